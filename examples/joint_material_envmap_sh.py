@@ -76,11 +76,12 @@ def deringing(coeffs, window):
 deringed_coeffs = deringing(coeffs, 6.0)
 res = (128, 128)
 # We call the utility function SH_reconstruct to rasterize the coefficients into an envmap
-envmap = pyredner.SH_reconstruct(deringed_coeffs, res)
-# Save the target envmap
-pyredner.imwrite(envmap.cpu(), 'results/joint_material_envmap_sh/target_envmap.exr')
-# Convert the PyTorch tensor into pyredner compatible envmap
-envmap = pyredner.EnvironmentMap(envmap)
+# for visualization
+pyredner.imwrite(pyredner.SH_reconstruct(deringed_coeffs, res).cpu(),
+                 'results/joint_material_envmap_sh/target_envmap.exr')
+# redner evaluates the coefficients directly, so we don't need to rasterize them
+# for rendering
+envmap = pyredner.SHEnvironmentMap(deringed_coeffs)
 # Setup the scene
 scene = pyredner.Scene(camera = cam,
                        shapes = shapes,
@@ -118,9 +119,9 @@ coeffs = torch.tensor([[ 0.5,
                        device = pyredner.get_device(),
                        requires_grad = True)
 deringed_coeffs = deringing(coeffs, 6.0)
-envmap = pyredner.SH_reconstruct(deringed_coeffs, res)
-pyredner.imwrite(envmap.cpu(), 'results/joint_material_envmap_sh/init_envmap.exr')
-envmap = pyredner.EnvironmentMap(envmap)
+pyredner.imwrite(pyredner.SH_reconstruct(deringed_coeffs, res).detach().cpu(),
+                 'results/joint_material_envmap_sh/init_envmap.exr')
+envmap = pyredner.SHEnvironmentMap(deringed_coeffs)
 # Also reset the material since we want to do joint estimation
 # We use an intermediate "param" variable and then take absolute value of it to avoid negative values
 # A better way to resolve this is to use projective SGD
@@ -158,9 +159,7 @@ for t in range(400):
     optimizer.zero_grad()
     # Repeat the envmap generation & material for the gradients
     deringed_coeffs = deringing(coeffs, 6.0)
-    envmap = pyredner.SH_reconstruct(deringed_coeffs, res)
-    pyredner.imwrite(envmap.cpu(), 'results/joint_material_envmap_sh/envmap_{}.exr'.format(t))
-    envmap = pyredner.EnvironmentMap(envmap)
+    envmap = pyredner.SHEnvironmentMap(deringed_coeffs)
     diffuse_reflectance = diffuse_reflectance_param.abs()
     specular_reflectance = specular_reflectance_param.abs()
     roughness = roughness_param.abs() # avoid going below zero
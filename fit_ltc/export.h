@@ -1,7 +1,8 @@
 #ifndef _EXPORT_
 #define _EXPORT_
 
-// export data in C
+// export data in C, in the format of redner's src/ltc.inc:
+// the tables are constexpr so that they need no runtime setup
 void writeTabC(mat3 * tab, vec2 * tabAmplitude, int N)
 {
 	ofstream file("results/ltc.inc");
@@ -9,41 +10,29 @@ void writeTabC(mat3 * tab, vec2 * tabAmplitude, int N)
 	file << std::fixed;
 	file << std::setprecision(6);
 
-	file << "namespace ltc {" << endl;
+	file << "#pragma once" << endl << endl;
+	file << "// Generated by fit_ltc/fitLTC.cpp" << endl << endl;
+	file << "#include \"redner.h\"" << endl << endl;
 
-	file << "static const int size = " << N  << ";" << endl << endl;
+	file << "namespace ltc {" << endl << endl;
 
-	file << "static const std::array<float, 9> tabM[size*size] = {" << endl;
-	for(int t = 0 ; t < N ; ++t)
-	for(int a = 0 ; a < N ; ++a)
-	{
-		file << "{";
-		file << tab[a + t*N][0][0] << ", " << tab[a + t*N][1][0] << ", " << tab[a + t*N][2][0] << ", ";
-		file << tab[a + t*N][0][1] << ", " << tab[a + t*N][1][1] << ", " << tab[a + t*N][2][1] << ", ";
-        file << tab[a + t*N][0][2] << ", " << tab[a + t*N][1][2] << ", " << tab[a + t*N][2][2] << "}";
-		if(a != N-1 || t != N-1)
-			file << ", ";
-		file << endl;
-	}
-	file << "};" << endl << endl;
+	file << "constexpr int size = " << N  << ";" << endl << endl;
 
-	file << "static const std::array<float, 9> tabMinv[size*size] = {" << endl;
+	// row-major 3x3 matrices
+	file << "constexpr float tabM_[size * size * 9] = {" << endl;
 	for(int t = 0 ; t < N ; ++t)
 	for(int a = 0 ; a < N ; ++a)
 	{
-		mat3 Minv = glm::inverse(tab[a + t*N]);
-
-		file << "{";
-		file << Minv[0][0] << ", " << Minv[1][0] << ", " << Minv[2][0] << ", ";
-		file << Minv[0][1] << ", " << Minv[1][1] << ", " << Minv[2][1] << ", ";
-        file << Minv[0][2] << ", " << Minv[1][2] << ", " << Minv[2][2] << "}";
+		file << tab[a + t*N][0][0] << "f, " << tab[a + t*N][1][0] << "f, " << tab[a + t*N][2][0] << "f, ";
+		file << tab[a + t*N][0][1] << "f, " << tab[a + t*N][1][1] << "f, " << tab[a + t*N][2][1] << "f, ";
+		file << tab[a + t*N][0][2] << "f, " << tab[a + t*N][1][2] << "f, " << tab[a + t*N][2][2] << "f";
 		if(a != N-1 || t != N-1)
 			file << ", ";
 		file << endl;
 	}
 	file << "};" << endl << endl;
 
-	file << "static const float tabAmplitude[size*size] = {" << endl;
+	file << "constexpr float tabAmplitude[size * size] = {" << endl;
 	for(int t = 0 ; t < N ; ++t)
 	for(int a = 0 ; a < N ; ++a)
 	{
@@ -52,7 +41,7 @@ void writeTabC(mat3 * tab, vec2 * tabAmplitude, int N)
 			file << ", ";
 		file << endl;
 	}
-	file << "};" << endl;
+	file << "};" << endl << endl;
 
 	file << "}" << endl;
 
@@ -4,8 +4,12 @@
 using namespace glm;
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "LTC.h"
 #include "brdf.h"
@@ -27,51 +31,63 @@ const int Nsample = 50;
 const float MIN_ALPHA = 0.0001f;
 
 
-// compute the norm (albedo) of the BRDF
-float computeNorm(const Brdf& brdf, const vec3& V, const float alpha)
+// BRDF samples of one (theta, alpha) cell, stored as arrays of floats.
+// They don't depend on the LTC, so they are computed once per cell
+// instead of once per Nelder-Mead iteration.
+struct BrdfSamples
 {
-	float norm = 0.0;
-
-	for(int j = 0 ; j < Nsample ; ++j)
-	for(int i = 0 ; i < Nsample ; ++i)
+	BrdfSamples(const Brdf& brdf, const vec3& V, const float alpha) :
+		x(Nsample*Nsample), y(Nsample*Nsample), z(Nsample*Nsample),
+		eval(Nsample*Nsample), pdf(Nsample*Nsample)
 	{
-		const float U1 = (i+0.5f)/(float)Nsample;
-		const float U2 = (j+0.5f)/(float)Nsample;
+		for(int j = 0 ; j < Nsample ; ++j)
+		for(int i = 0 ; i < Nsample ; ++i)
+		{
+			const float U1 = (i+0.5f)/(float)Nsample;
+			const float U2 = (j+0.5f)/(float)Nsample;
+			const int k = i + j*Nsample;
 
-		// sample
-		const vec3 L = brdf.sample(V, alpha, U1, U2);
+			// sample
+			const vec3 L = brdf.sample(V, alpha, U1, U2);
+			x[k] = L.x;
+			y[k] = L.y;
+			z[k] = L.z;
+
+			// eval
+			eval[k] = brdf.eval(V, L, alpha, pdf[k]);
+		}
+	}
 
-		// eval
-		float pdf;
-		float eval = brdf.eval(V, L, alpha, pdf);
+	int size() const { return (int)x.size(); }
 
-		// accumulate
-		norm += (pdf > 0) ? eval / pdf : 0.0f;
+	std::vector<float> x, y, z;
+	std::vector<float> eval, pdf;
+};
+
+// compute the norm (albedo) of the BRDF
+float computeNorm(const BrdfSamples& samples)
+{
+	float norm = 0.0;
+
+	for(int k = 0 ; k < samples.size() ; ++k)
+	{
+		const float pdf = samples.pdf[k];
+		norm += (pdf > 0) ? samples.eval[k] / pdf : 0.0f;
 	}
 
 	return norm / (float)(Nsample*Nsample);
 }
 
 // compute the average direction of the BRDF
-vec3 computeAverageDir(const Brdf& brdf, const vec3& V, const float alpha)
+vec3 computeAverageDir(const BrdfSamples& samples)
 {
 	vec3 averageDir = vec3(0,0,0);
 
-	for(int j = 0 ; j < Nsample ; ++j)
-	for(int i = 0 ; i < Nsample ; ++i)
+	for(int k = 0 ; k < samples.size() ; ++k)
 	{
-		const float U1 = (i+0.5f)/(float)Nsample;
-		const float U2 = (j+0.5f)/(float)Nsample;
-
-		// sample
-		const vec3 L = brdf.sample(V, alpha, U1, U2);
-
-		// eval
-		float pdf;
-		float eval = brdf.eval(V, L, alpha, pdf);
-
-		// accumulate
-		averageDir += (pdf > 0) ? eval / pdf * L : vec3(0,0,0);
+		const float pdf = samples.pdf[k];
+		const vec3 L(samples.x[k], samples.y[k], samples.z[k]);
+		averageDir += (pdf > 0) ? samples.eval[k] / pdf * L : vec3(0,0,0);
 	}
 
 	// clear y component, which should be zero with isotropic BRDFs
@@ -82,45 +98,47 @@ vec3 computeAverageDir(const Brdf& brdf, const vec3& V, const float alpha)
 
 // compute the error between the BRDF and the LTC
 // using Multiple Importance Sampling
-float computeError(const LTC& ltc, const Brdf& brdf, const vec3& V, const float alpha)
+float computeError(const LTC& ltc, const Brdf& brdf, const BrdfSamples& samples, const vec3& V, const float alpha)
 {
 	double error = 0.0;
 
+	// importance sample LTC
 	for(int j = 0 ; j < Nsample ; ++j)
 	for(int i = 0 ; i < Nsample ; ++i)
 	{
 		const float U1 = (i+0.5f)/(float)Nsample;
 		const float U2 = (j+0.5f)/(float)Nsample;
 
-		// importance sample LTC
-		{
-			// sample
-			const vec3 L = ltc.sample(U1, U2);
-				
-			// error with MIS weight
-			float pdf_brdf;
-			float eval_brdf = brdf.eval(V, L, alpha, pdf_brdf);
-			float eval_ltc = ltc.eval(L);
-			float pdf_ltc = eval_ltc / ltc.amplitude;
-			double error_ = fabsf(eval_brdf - eval_ltc);
-			error_ = error_*error_*error_;
-			error += error_ / (pdf_ltc + pdf_brdf);
-		}
-
-		// importance sample BRDF
-		{
-			// sample
-			const vec3 L = brdf.sample(V, alpha, U1, U2);
+		// sample
+		const vec3 L = ltc.sample(U1, U2);
+
+		// error with MIS weight
+		float pdf_brdf;
+		float eval_brdf = brdf.eval(V, L, alpha, pdf_brdf);
+		float eval_ltc = ltc.eval(L);
+		float pdf_ltc = eval_ltc / ltc.amplitude;
+		double error_ = fabsf(eval_brdf - eval_ltc);
+		error_ = error_*error_*error_;
+		error += error_ / (pdf_ltc + pdf_brdf);
+	}
 
-			// error with MIS weight
-			float pdf_brdf;
-			float eval_brdf = brdf.eval(V, L, alpha, pdf_brdf);			
-			float eval_ltc = ltc.eval(L);
-			float pdf_ltc = eval_ltc / ltc.amplitude;
-			double error_ = fabsf(eval_brdf - eval_ltc);
-			error_ = error_*error_*error_;
-			error += error_ / (pdf_ltc + pdf_brdf);
-		}
+	// importance sample BRDF: only the LTC changes between iterations,
+	// so this loop has no virtual call and vectorizes
+	const int n = samples.size();
+	const float * x = samples.x.data();
+	const float * y = samples.y.data();
+	const float * z = samples.z.data();
+	const float * eval = samples.eval.data();
+	const float * pdf = samples.pdf.data();
+#pragma omp simd reduction(+:error)
+	for(int k = 0 ; k < n ; ++k)
+	{
+		// error with MIS weight
+		float eval_ltc = ltc.eval(vec3(x[k], y[k], z[k]));
+		float pdf_ltc = eval_ltc / ltc.amplitude;
+		double error_ = fabsf(eval[k] - eval_ltc);
+		error_ = error_*error_*error_;
+		error += error_ / (pdf_ltc + pdf[k]);
 	}
 
 	return (float)error / (float)(Nsample*Nsample);
@@ -128,8 +146,8 @@ float computeError(const LTC& ltc, const Brdf& brdf, const vec3& V, const float
 
 struct FitLTC
 {
-	FitLTC(LTC& ltc_, const Brdf& brdf, bool isotropic_, const vec3& V_, float alpha_) :
-		ltc(ltc_), brdf(brdf), V(V_), alpha(alpha_), isotropic(isotropic_)
+	FitLTC(LTC& ltc_, const Brdf& brdf, const BrdfSamples& samples_, bool isotropic_, const vec3& V_, float alpha_) :
+		ltc(ltc_), brdf(brdf), samples(samples_), V(V_), alpha(alpha_), isotropic(isotropic_)
 	{
 	}
 
@@ -160,10 +178,11 @@ struct FitLTC
 	float operator()(const float * params)
 	{
 		update(params);
-		return computeError(ltc, brdf, V, alpha);
+		return computeError(ltc, brdf, samples, V, alpha);
 	}
 
 	const Brdf& brdf;
+	const BrdfSamples& samples;
 	LTC& ltc;
 	bool isotropic;
 
@@ -173,12 +192,12 @@ struct FitLTC
 
 // fit brute force
 // refine first guess by exploring parameter space
-void fit(LTC& ltc, const Brdf& brdf, const vec3& V, const float alpha, const float epsilon = 0.05f, const bool isotropic=false)
+void fit(LTC& ltc, const Brdf& brdf, const BrdfSamples& samples, const vec3& V, const float alpha, const float epsilon = 0.05f, const bool isotropic=false)
 {
 	float startFit[4] = { ltc.m11, ltc.m22, ltc.m13, ltc.m23 };
 	float resultFit[4];
 
-	FitLTC fitter(ltc, brdf, isotropic, V, alpha);
+	FitLTC fitter(ltc, brdf, samples, isotropic, V, alpha);
 
 	// Find best-fit LTC lobe (scale, alphax, alphay)
 	float error = NelderMead<4>(resultFit, startFit, epsilon, 1e-5f, 100, fitter);
@@ -187,92 +206,116 @@ void fit(LTC& ltc, const Brdf& brdf, const vec3& V, const float alpha, const flo
 	fitter.update(resultFit);
 }
 
-// fit data
-void fitTab(mat3 * tab, vec2 * tabAmplitude, const int N, const Brdf& brdf)
+// fit one (theta, alpha) cell
+// ltc holds the fit of the previous cell, used as first guess
+void fitCell(LTC& ltc, mat3 * tab, vec2 * tabAmplitude, const int N, const Brdf& brdf, const int a, const int t)
 {
-	LTC ltc;
+	float theta = std::min<float>(1.57f, t / float(N-1) * 1.57079f);
+	const vec3 V = vec3(sinf(theta),0,cosf(theta));
 
-	// loop over theta and alpha
-	for(int a = N-1 ; a >= 0   ; --a)
-	for(int t =   0 ; t <= N-1 ; ++t)
-	{
-		float theta = std::min<float>(1.57f, t / float(N-1) * 1.57079f);
-		const vec3 V = vec3(sinf(theta),0,cosf(theta));
+	// alpha = roughness^2
+	float roughness = a / float(N-1);
+	float alpha = std::max<float>(roughness*roughness, MIN_ALPHA);
 
-		// alpha = roughness^2
-		float roughness = a / float(N-1);
-		float alpha = std::max<float>(roughness*roughness, MIN_ALPHA);
-
-		cout << "a = " << a << "\t t = " << t  << endl;
-		cout << "alpha = " << alpha << "\t theta = " << theta << endl;
-		cout << endl;
+	const BrdfSamples samples(brdf, V, alpha);
+	ltc.amplitude = computeNorm(samples);
+	const vec3 averageDir = computeAverageDir(samples);
+	bool isotropic;
 
-		ltc.amplitude = computeNorm(brdf, V, alpha); 
-		const vec3 averageDir = computeAverageDir(brdf, V, alpha);		
-		bool isotropic;
+	// 1. first guess for the fit
+	// init the hemisphere in which the distribution is fitted
+	// if theta == 0 the lobe is rotationally symmetric and aligned with Z = (0 0 1)
+	if(t == 0)
+	{
+		ltc.X = vec3(1,0,0);
+		ltc.Y = vec3(0,1,0);
+		ltc.Z = vec3(0,0,1);
 
-		// 1. first guess for the fit
-		// init the hemisphere in which the distribution is fitted
-		// if theta == 0 the lobe is rotationally symmetric and aligned with Z = (0 0 1)
-		if(t == 0)
+		if(a == N-1) // roughness = 1
 		{
-			ltc.X = vec3(1,0,0);
-			ltc.Y = vec3(0,1,0);
-			ltc.Z = vec3(0,0,1);
-
-			if(a == N-1) // roughness = 1
-			{
-				ltc.m11 = 1.0f;
-				ltc.m22 = 1.0f;
-			}
-			else // init with roughness of previous fit
-			{
-				ltc.m11 = std::max<float>(tab[a+1+t*N][0][0], MIN_ALPHA);
-				ltc.m22 = std::max<float>(tab[a+1+t*N][1][1], MIN_ALPHA);
-			}
-			
-			ltc.m13 = 0;
-			ltc.m23 = 0;
-			ltc.update();
-
-			isotropic = true;
+			ltc.m11 = 1.0f;
+			ltc.m22 = 1.0f;
 		}
-		// otherwise use previous configuration as first guess
-		else
+		else // init with roughness of previous fit
 		{
-			vec3 L = normalize(averageDir);
-			vec3 T1(L.z,0,-L.x);
-			vec3 T2(0,1,0);
-			ltc.X = T1;
-			ltc.Y = T2;
-			ltc.Z = L;
+			ltc.m11 = std::max<float>(tab[a+1+t*N][0][0], MIN_ALPHA);
+			ltc.m22 = std::max<float>(tab[a+1+t*N][1][1], MIN_ALPHA);
+		}
 
-			ltc.update();
+		ltc.m13 = 0;
+		ltc.m23 = 0;
+		ltc.update();
 
-			isotropic = false;
-		}
+		isotropic = true;
+	}
+	// otherwise use previous configuration as first guess
+	else
+	{
+		vec3 L = normalize(averageDir);
+		vec3 T1(L.z,0,-L.x);
+		vec3 T2(0,1,0);
+		ltc.X = T1;
+		ltc.Y = T2;
+		ltc.Z = L;
+
+		ltc.update();
 
-		// 2. fit (explore parameter space and refine first guess)
-		float epsilon = 0.05f;
-		fit(ltc, brdf, V, alpha, epsilon, isotropic);
-
-		// copy data
-		tab[a + t*N] = ltc.M;
-		tabAmplitude[a + t*N][0] = ltc.amplitude;
-		tabAmplitude[a + t*N][1] = 0;
-
-		// kill useless coefs in matrix and normalize
-		tab[a+t*N][0][1] = 0;
-		tab[a+t*N][1][0] = 0;
-		tab[a+t*N][2][1] = 0;
-		tab[a+t*N][1][2] = 0;
-		tab[a+t*N] = 1.0f / tab[a+t*N][2][2] * tab[a+t*N];
-
-		cout << tab[a+t*N][0][0] << "\t " << tab[a+t*N][1][0] << "\t " << tab[a+t*N][2][0] << endl;
-		cout << tab[a+t*N][0][1] << "\t " << tab[a+t*N][1][1] << "\t " << tab[a+t*N][2][1] << endl;
-		cout << tab[a+t*N][0][2] << "\t " << tab[a+t*N][1][2] << "\t " << tab[a+t*N][2][2] << endl;
-		cout << endl;
+		isotropic = false;
 	}
+
+	// 2. fit (explore parameter space and refine first guess)
+	float epsilon = 0.05f;
+	fit(ltc, brdf, samples, V, alpha, epsilon, isotropic);
+
+	// copy data
+	tab[a + t*N] = ltc.M;
+	tabAmplitude[a + t*N][0] = ltc.amplitude;
+	tabAmplitude[a + t*N][1] = 0;
+
+	// kill useless coefs in matrix and normalize
+	tab[a+t*N][0][1] = 0;
+	tab[a+t*N][1][0] = 0;
+	tab[a+t*N][2][1] = 0;
+	tab[a+t*N][1][2] = 0;
+	tab[a+t*N] = 1.0f / tab[a+t*N][2][2] * tab[a+t*N];
+}
+
+// fit data
+void fitTab(mat3 * tab, vec2 * tabAmplitude, const int N, const Brdf& brdf)
+{
+	// Each cell starts from the fit of its neighbour: the next larger alpha
+	// for theta = 0, the previous theta otherwise. Fit theta = 0 first along
+	// alpha, then the rows of constant alpha are independent of each other.
+	std::vector<LTC> rowStart(N);
+	LTC ltc;
+	for(int a = N-1 ; a >= 0 ; --a)
+	{
+		fitCell(ltc, tab, tabAmplitude, N, brdf, a, 0);
+		rowStart[a] = ltc;
+	}
+	cout << "theta = 0 done" << endl;
+
+	std::atomic<int> nextRow(N-1);
+	std::mutex coutMutex;
+	auto fitRows = [&]()
+	{
+		for(int a = nextRow-- ; a >= 0 ; a = nextRow--)
+		{
+			LTC rowLtc = rowStart[a];
+			for(int t = 1 ; t <= N-1 ; ++t)
+				fitCell(rowLtc, tab, tabAmplitude, N, brdf, a, t);
+
+			std::lock_guard<std::mutex> lock(coutMutex);
+			cout << "a = " << a << " done" << endl;
+		}
+	};
+
+	const int numThreads = std::max<int>(1, std::thread::hardware_concurrency());
+	std::vector<std::thread> threads;
+	for(int i = 0 ; i < numThreads ; ++i)
+		threads.emplace_back(fitRows);
+	for(auto& thread : threads)
+		thread.join();
 }
 
 int main(int argc, char* argv[])
@@ -55,6 +55,11 @@ class Camera:
             the last two coefficients are for the tangential distortion (p1~p2).
             see https://docs.opencv.org/2.4/modules/calib3d/doc/camera_calibration_and_3d_reconstruction.html
             for more details.
+        distortion_lut_resolution: int
+            if > 0, bake the lens distortion (and its inverse) into lookup tables
+            with this resolution once per render, instead of evaluating the
+            distortion polynomial for every ray and projected point.
+            trades a small interpolation error for speed. 0 disables the tables.
         camera_type: render.camera_type
             the type of the camera (perspective, orthographic, fisheye, or panorama)
         fisheye: bool
@@ -73,7 +78,8 @@ class Camera:
                  intrinsic_mat: Optional[torch.Tensor] = None,
                  distortion_params: Optional[torch.Tensor] = None,
                  camera_type = pyredner.camera_type.perspective,
-                 fisheye: bool = False):
+                 fisheye: bool = False,
+                 distortion_lut_resolution: int = 0):
         if position is not None:
             assert(position.dtype == torch.float32)
             assert(len(position.shape) == 1 and position.shape[0] == 3)
@@ -117,6 +123,7 @@ class Camera:
             self._intrinsic_mat = intrinsic_mat
         self.intrinsic_mat_inv = torch.inverse(self.intrinsic_mat).contiguous()
         self.distortion_params = distortion_params
+        self.distortion_lut_resolution = distortion_lut_resolution
         self.clip_near = clip_near
         self.resolution = resolution
         self.viewport = viewport
@@ -173,7 +180,8 @@ class Camera:
             'intrinsic_mat': self._intrinsic_mat,
             'clip_near': self.clip_near,
             'resolution': self.resolution,
-            'camera_type': self.camera_type
+            'camera_type': self.camera_type,
+            'distortion_lut_resolution': self.distortion_lut_resolution
         }
 
     @classmethod
@@ -188,6 +196,7 @@ class Camera:
         out.clip_near = state_dict['clip_near']
         out.resolution = state_dict['resolution']
         out.camera_type = state_dict['camera_type']
+        out.distortion_lut_resolution = state_dict.get('distortion_lut_resolution', 0)
         return out
 
 def automatic_camera_placement(shapes: List,
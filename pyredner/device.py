@@ -1,4 +1,5 @@
 import torch
+import redner
 
 use_gpu = torch.cuda.is_available()
 device = torch.device('cuda') if use_gpu else torch.device('cpu')
@@ -39,3 +40,10 @@ def get_device():
     global device
     return device
 
+def set_pin_worker_threads(v: bool):
+    """
+        | Pin the CPU worker threads to the cores of one socket each, so that
+        | they don't migrate between memory nodes on multi-socket machines.
+        | Takes effect at the next render call. Only supported on Linux.
+    """
+    redner.set_pin_worker_threads(v)
@@ -35,28 +35,18 @@ class EnvironmentMap:
 
     def generate_envmap_pdf(self):
         values = self.values
-        # Build sampling table
+        # redner builds the alias tables for sampling, we only need the
+        # normalization of the luminance weighted by the solid angle of each row
         luminance = 0.212671 * values.texels[:, :, 0] + \
                     0.715160 * values.texels[:, :, 1] + \
                     0.072169 * values.texels[:, :, 2]
-        # For each y, compute CDF over x
-        sample_cdf_xs_ = torch.cumsum(luminance, dim = 1)
         y_weight = torch.sin(\
             math.pi * (torch.arange(luminance.shape[0],
                 dtype = torch.float32, device = luminance.device) + 0.5) \
              / float(luminance.shape[0]))
-        # Compute CDF for x
-        sample_cdf_ys_ = torch.cumsum(sample_cdf_xs_[:, -1] * y_weight, dim = 0)
+        total = torch.sum(torch.sum(luminance, dim = 1) * y_weight)
         pdf_norm = (luminance.shape[0] * luminance.shape[1]) / \
-            (sample_cdf_ys_[-1].item() * (2 * math.pi * math.pi))
-        # Normalize to [0, 1)
-        sample_cdf_xs = (sample_cdf_xs_ - sample_cdf_xs_[:, 0:1]) / \
-            torch.max(sample_cdf_xs_[:, (luminance.shape[1] - 1):luminance.shape[1]],
-                1e-8 * torch.ones(sample_cdf_xs_.shape[0], 1, device = sample_cdf_ys_.device))
-        sample_cdf_ys = (sample_cdf_ys_ - sample_cdf_ys_[0]) / \
-            torch.max(sample_cdf_ys_[-1], torch.tensor([1e-8], device = sample_cdf_ys_.device))
-        self.sample_cdf_ys = sample_cdf_ys.contiguous()
-        self.sample_cdf_xs = sample_cdf_xs.contiguous()
+            (total.item() * (2 * math.pi * math.pi))
         self.pdf_norm = pdf_norm
 
     @property
@@ -82,8 +72,6 @@ class EnvironmentMap:
             'values': self.values.state_dict(),
             'env_to_world': self.env_to_world,
             'world_to_env': self.world_to_env,
-            'sample_cdf_ys': self.sample_cdf_ys,
-            'sample_cdf_xs': self.sample_cdf_xs,
             'pdf_norm': self.pdf_norm,
             'directly_visible': self.directly_visible
         }
@@ -94,8 +82,70 @@ class EnvironmentMap:
         out.values = pyredner.Texture.load_state_dict(state_dict['values'])
         out.env_to_world = state_dict['env_to_world']
         out.world_to_env = state_dict['world_to_env']
-        out.sample_cdf_ys = state_dict['sample_cdf_ys']
-        out.sample_cdf_xs = state_dict['sample_cdf_xs']
         out.pdf_norm = state_dict['pdf_norm']
         out.directly_visible = state_dict['directly_visible']
         return out
+
+class SHEnvironmentMap:
+    """
+        A class representing light sources infinitely far away using spherical
+        harmonics coefficients. redner evaluates the coefficients directly,
+        so the cost does not depend on a texture resolution.
+        The radiance is clamped to be non-negative like pyredner.SH_reconstruct.
+
+        Args
+        ----------
+        coeffs: torch.Tensor
+            a float32 tensor with size [3, num_bands * num_bands],
+            same layout as the input of pyredner.SH_reconstruct
+        env_to_world: torch.Tensor
+            a float32 4x4 matrix that transforms the environment map
+        directly_visible: bool
+            can the camera sees the light source directly?
+    """
+
+    def __init__(self,
+                 coeffs: torch.Tensor,
+                 env_to_world: torch.Tensor = torch.eye(4, 4),
+                 directly_visible: bool = True):
+        assert(coeffs.dtype == torch.float32)
+        assert(len(coeffs.shape) == 2 and coeffs.shape[0] == 3)
+        num_bands = int(math.sqrt(coeffs.shape[1]))
+        assert(num_bands * num_bands == coeffs.shape[1])
+        assert(env_to_world.dtype == torch.float32)
+        assert(env_to_world.is_contiguous())
+
+        self.coeffs = coeffs
+        self._env_to_world = env_to_world
+        self.world_to_env = torch.inverse(env_to_world).contiguous()
+        self.directly_visible = directly_visible
+
+    @property
+    def num_bands(self):
+        return int(math.sqrt(self.coeffs.shape[1]))
+
+    @property
+    def env_to_world(self):
+        return self._env_to_world
+
+    @env_to_world.setter
+    def env_to_world(self, value):
+        self._env_to_world = value
+        self.world_to_env = torch.inverse(self._env_to_world).contiguous()
+
+    def state_dict(self):
+        return {
+            'coeffs': self.coeffs,
+            'env_to_world': self.env_to_world,
+            'world_to_env': self.world_to_env,
+            'directly_visible': self.directly_visible
+        }
+
+    @classmethod
+    def load_state_dict(cls, state_dict):
+        out = cls.__new__(SHEnvironmentMap)
+        out.coeffs = state_dict['coeffs']
+        out.env_to_world = state_dict['env_to_world']
+        out.world_to_env = state_dict['world_to_env']
+        out.directly_visible = state_dict['directly_visible']
+        return out
@@ -380,35 +380,17 @@ def parse_shape(node, material_dict, shape_id, device, shape_group_dict = None):
         if normals is not None:
             normals = normals.to(device)
         return pyredner.Shape(vertices, indices, uvs=uvs, normals=normals, material_id=mat_id), lgt
-    # Add instance support 
-    # TODO (simply transform & create a new shape now)
     elif node.attrib['type'] == 'instance':
         shape = None
+        to_world = torch.eye(4)
         for child in node:
             if 'name' in child.attrib:
                 if child.attrib['name'] == 'toWorld':
                     to_world = parse_transform(child)
             if child.tag == 'ref':
                 shape = shape_group_dict[child.attrib['id']]
-        # transform instance
-        vertices = shape.vertices
-        normals = shape.normals
-        vector1 = torch.ones(vertices.shape[0], 1, device = vertices.device)
-        to_world = to_world.to(vertices.device)
-        vertices = torch.cat((vertices, vector1), dim = 1)
-        vertices = vertices @ torch.transpose(to_world, 0, 1)
-        vertices = vertices / vertices[:, 3:4]
-        vertices = vertices[:, 0:3].contiguous()
-        if normals is not None:
-            normals = normals @ (torch.inverse(torch.transpose(to_world, 0, 1))[:3, :3])
-            normals = normals.contiguous()
-        # assert(vertices is not None)
-        # assert(indices is not None)
-        # lgt = None
-        # if light_intensity is not None:
-        #     lgt = pyredner.AreaLight(shape_id, light_intensity)
-
-        return pyredner.Shape(vertices, shape.indices, uvs=shape.uvs, normals=normals, material_ids=shape.material_id), None
+        # The instances of a shapegroup share its ray tracing structures and edges
+        return pyredner.instance_shape(shape, to_world), None
     else:
         print('Shape type {} is not supported!'.format(node.attrib['type']))
         assert(False)
@@ -435,7 +417,7 @@ def parse_scene(node, device):
         elif child.tag == 'shape' and child.attrib['type'] == 'shapegroup':
             for child_s in child:
                 if child_s.tag == 'shape':
-                    shape_group_dict[child.attrib['id']] = parse_shape(child_s, material_dict, None)[0]
+                    shape_group_dict[child.attrib['id']] = parse_shape(child_s, material_dict, None, device)[0]
         elif child.tag == 'shape':
             shape, light = parse_shape(child, material_dict, len(shapes), device, shape_group_dict if child.attrib['type'] == 'instance' else None)
             shapes.append(shape)
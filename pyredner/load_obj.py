@@ -130,7 +130,7 @@ def load_obj(filename: str,
             normal_indices = None
         else:
             normal_indices = torch.tensor(normal_indices, dtype = torch.int32, device = device)
-        vertices = torch.tensor(vertices, device = device)
+        vertices = pyredner.pad_vertices(torch.tensor(vertices, device = device))
         if len(uvs) == 0:
             uvs = None
         else:
@@ -1,5 +1,8 @@
 import torch
+import torch.utils.dlpack
 import numpy as np
+import math
+import numbers
 import redner
 import pyredner
 import time
@@ -28,6 +31,75 @@ def get_use_correlated_random_number():
     global use_correlated_random_number
     return use_correlated_random_number
 
+primary_hit_cache = None
+def set_use_primary_hit_cache(v: bool):
+    """
+        | Reuse primary rays and primary intersections across render calls.
+        | Useful when the camera and the geometry stay fixed over many iterations
+        | (e.g. texture, material or lighting optimization): after the first
+        | iteration, redner skips primary visibility entirely.
+        | The cache is keyed on the camera, the geometry and the sample sequence,
+        | so it only helps if the seeds are kept fixed across iterations.
+        | The cache memory is roughly 400 bytes per pixel per sample.
+    """
+    global primary_hit_cache
+    if v:
+        if primary_hit_cache is None:
+            primary_hit_cache = redner.PrimaryHitCache()
+    else:
+        primary_hit_cache = None
+
+def get_primary_hit_cache():
+    """
+        See set_use_primary_hit_cache
+    """
+    global primary_hit_cache
+    return primary_hit_cache
+
+def tensor_checksum(t: torch.Tensor):
+    """
+        Position dependent sum of the bit patterns of a tensor, computed on its device.
+        Returns a 0-dim int64 tensor so that the checksums of many tensors can be
+        fetched with a single synchronization.
+    """
+    x = t.detach().reshape(-1)
+    if x.dtype == torch.float32:
+        x = x.view(torch.int32)
+    elif x.dtype == torch.float64:
+        x = x.view(torch.int64)
+    x = x.to(torch.int64)
+    # Odd multipliers make the sum depend on where each value is stored,
+    # the products wrap around in 64 bits.
+    weights = torch.arange(x.shape[0], dtype = torch.int64, device = x.device) * 2 + 1
+    return torch.sum(x * (weights * 0x5bd1e995), dtype = torch.int64)
+
+def compute_geometry_version(shapes):
+    """
+        Fingerprint the geometry tensors by their shapes and their contents,
+        so that any modification invalidates the primary hit cache.
+        Storage addresses and version counters are not enough: a new tensor can
+        reuse the address of a freed one with the same version.
+        Runs only when the primary hit cache is on. It reads every geometry tensor
+        once per render, with int64 temporaries of the same length, and
+        synchronizes once per device to fetch the checksums.
+    """
+    h = 0
+    checksums = {}
+    for shape in shapes:
+        # The transforms of the instances are hashed by redner
+        if shape.prototype is not None:
+            shape = shape.prototype
+        for t in [shape.vertices, shape.indices, shape.uvs, shape.normals,
+                  shape.uv_indices, shape.normal_indices]:
+            if t is not None:
+                h = hash((h, tuple(t.shape), t.dtype))
+                checksums.setdefault(t.device, []).append(tensor_checksum(t))
+            else:
+                h = hash((h, 0))
+    for device in sorted(checksums.keys(), key = str):
+        h = hash((h, tuple(torch.stack(checksums[device]).tolist())))
+    return h & 0xffffffffffffffff
+
 print_timing = True
 def set_print_timing(v: bool):
     """
@@ -43,18 +115,78 @@ def get_print_timing():
     global print_timing
     return print_timing
 
-def serialize_texture(texture, args, device):
+check_finite = True
+def set_check_finite(v: bool):
+    """
+        | Set whether to check the scene tensors for NaN and infinity before rendering.
+        | The check scans all tensors of a device in one parallel pass,
+        | turn it off to save that pass once a scene is known to be valid.
+    """
+    global check_finite
+    check_finite = v
+
+def get_check_finite():
+    """
+        See set_check_finite
+    """
+    global check_finite
+    return check_finite
+
+def float_ptr(t: Optional[torch.Tensor]):
+    """
+        Pass a float32 tensor to redner through DLPack, so that redner
+        checks its dtype, layout and device. None becomes a null pointer.
+        The tensor has to outlive the pointer.
+    """
+    if t is None:
+        return redner.float_ptr(0)
+    return redner.float_ptr(torch.utils.dlpack.to_dlpack(t.detach()))
+
+def int_ptr(t: Optional[torch.Tensor]):
+    """
+        Same as float_ptr for int32 tensors.
+    """
+    if t is None:
+        return redner.int_ptr(0)
+    return redner.int_ptr(torch.utils.dlpack.to_dlpack(t.detach()))
+
+def assert_finite(tensors: List[Optional[torch.Tensor]]):
+    """
+        Check that all the tensors are free of NaN and infinity, with one native
+        parallel pass per device instead of one reduction per tensor.
+    """
+    tensors = [t.detach() for t in tensors if t is not None and t.numel() > 0]
+    groups = {}
+    for t in tensors:
+        if t.dtype != torch.float32:
+            # Doubles etc. are converted later, check them the slow way
+            assert(torch.isfinite(t).all())
+            continue
+        groups.setdefault(t.device, []).append(t.contiguous())
+    for device, group in groups.items():
+        ptrs = [float_ptr(t) for t in group]
+        sizes = [t.numel() for t in group]
+        if device.type == 'cuda':
+            with torch.cuda.device(device):
+                torch.cuda.synchronize()
+                bad = redner.find_non_finite(ptrs, sizes, True)
+        else:
+            bad = redner.find_non_finite(ptrs, sizes, False)
+        assert len(bad) == 0, \
+            'Found NaN or infinity in {} scene tensor(s) on {}'.format(len(bad), device)
+
+def serialize_texture(texture, args, device, finite_checks):
     if texture is None:
         args.append(0)
         return
     args.append(len(texture.mipmap))
     for mipmap in texture.mipmap:
-        assert(torch.isfinite(mipmap).all())
+        finite_checks.append(mipmap)
         assert(mipmap.is_contiguous())
         if mipmap.device != device:
             warnings.warn('Converting texture from {} to {}, this can be inefficient.'.format(mipmap.device, device))
         args.append(mipmap.to(device))
-    assert(torch.isfinite(texture.uv_scale).all())
+    finite_checks.append(texture.uv_scale)
     args.append(texture.uv_scale.to(device))
 
 class Context: pass
@@ -73,6 +205,11 @@ class RenderFunction(torch.autograd.Function):
                         use_primary_edge_sampling: bool = True,
                         use_secondary_edge_sampling: bool = True,
                         sample_pixel_center: bool = False,
+                        use_light_bvh: bool = False,
+                        use_rasterization: bool = False,
+                        primary_edge_samples: Optional[Union[int, float]] = None,
+                        secondary_edge_samples: Optional[Union[int, float]] = None,
+                        build_options: Optional[redner.SceneBuildOptions] = None,
                         device: Optional[torch.device] = None):
         """
             Given a pyredner scene & rendering options, convert them to a linear list of argument,
@@ -127,6 +264,40 @@ class RenderFunction(torch.autograd.Function):
                 (since there is no antialiasing integral),
                 and redner's edge sampling becomes an approximation to the gradients of the aliased rendering.
 
+            use_light_bvh: bool
+                Pick the area light triangles for next event estimation by traversing a bounding volume
+                hierarchy built over all emissive triangles, which accounts for the distance and orientation
+                of the lights to each shading point.
+                Greatly reduces noise in scenes with many emissive triangles, at the cost of
+                building the hierarchy for every render.
+
+            use_rasterization: bool
+                Find the surfaces visible from the camera by rasterizing the triangles
+                into screen tiles instead of tracing the primary rays one at a time.
+                The result is the same. Only for the perspective and orthographic cameras
+                without lens distortion, other cameras ignore this option.
+                Mostly useful when max_bounces is 0, where the primary rays are all we trace.
+
+            primary_edge_samples: Optional[Union[int, float]]
+                Number of primary (silhouette seen from the camera) edge samples per sample pass.
+                An integer is an absolute count, a float is a ratio to the number of pixels.
+                If set to None, use one sample per pixel.
+
+            secondary_edge_samples: Optional[Union[int, float]]
+                Number of secondary (shadow & reflection) edge samples per sample pass and bounce.
+                An integer is an absolute count, a float is a ratio to the number of paths still
+                alive at that bounce. If set to None, use one sample per path.
+                Together with primary_edge_samples this trades the variance of the
+                silhouette gradients against render time, independently of num_samples.
+
+            build_options: Optional[redner.SceneBuildOptions]
+                Build quality and flags of the CPU ray tracing structure (Embree BVH).
+                A higher quality build takes longer but makes tracing faster.
+                With redner.BuildQuality.auto the quality is picked from a rough estimate
+                of the number of rays we trace per triangle.
+                If set to None, use redner.BuildQuality.high with the robust flag.
+                Set pyredner.set_print_timing(True) to see the build and tracing times.
+
             device: Optional[torch.device]
                 Which device should we store the data in.
                 If set to None, use the device from pyredner.get_device().
@@ -154,11 +325,9 @@ class RenderFunction(torch.autograd.Function):
         args.append(num_shapes)
         args.append(num_materials)
         args.append(num_lights)
-        assert(cam.position is None or torch.isfinite(cam.position).all())
-        assert(cam.look_at is None or torch.isfinite(cam.look_at).all())
-        assert(cam.up is None or torch.isfinite(cam.up).all())
-        assert(torch.isfinite(cam.intrinsic_mat_inv).all())
-        assert(torch.isfinite(cam.intrinsic_mat).all())
+        # Tensors to check for NaN and infinity, all at once at the end
+        finite_checks = [cam.position, cam.look_at, cam.up,
+                         cam.intrinsic_mat_inv, cam.intrinsic_mat]
         if cam.position is not None and cam.position.requires_grad:
             requires_visibility_grad = True
         if cam.look_at is not None and cam.look_at.requires_grad:
@@ -190,6 +359,9 @@ class RenderFunction(torch.autograd.Function):
             args.append(cam.distortion_params.cpu().contiguous())
         else:
             args.append(None)
+        # Moving the camera moves every silhouette on screen,
+        # otherwise only the primary edges of shapes with varying vertices matter
+        camera_requires_grad = requires_visibility_grad
         args.append(cam.clip_near)
         args.append(cam.resolution)
         viewport = cam.viewport
@@ -202,33 +374,52 @@ class RenderFunction(torch.autograd.Function):
                     min(viewport[3], cam.resolution[1]))
         args.append(viewport)
         args.append(cam.camera_type)
-        for shape in scene.shapes:
-            assert(torch.isfinite(shape.vertices).all())
-            if (shape.uvs is not None):
-                assert(torch.isfinite(shape.uvs).all())
-            if (shape.normals is not None):
-                assert(torch.isfinite(shape.normals).all())
-            if (shape.vertices.requires_grad):
-                requires_visibility_grad = True
-            if shape.vertices.device != device:
-                warnings.warn('Converting shape vertices from {} to {}, this can be inefficient.'.format(shape.vertices.device, device))
-            if shape.indices.device != device:
-                warnings.warn('Converting shape indices from {} to {}, this can be inefficient.'.format(shape.indices.device, device))
-            args.append(shape.vertices.to(device))
-            args.append(shape.indices.to(device))
-            args.append(shape.uvs.to(device) if shape.uvs is not None else None)
-            args.append(shape.normals.to(device) if shape.normals is not None else None)
-            args.append(shape.uv_indices.to(device) if shape.uv_indices is not None else None)
-            args.append(shape.normal_indices.to(device) if shape.normal_indices is not None else None)
-            args.append(shape.colors.to(device) if shape.colors is not None else None)
+        args.append(cam.distortion_lut_resolution)
+        # The shapes sharing a prototype (see pyredner.instance_shape) share the
+        # buffers of the first of them, the others only pass their transforms
+        prototype_ids = {}
+        for shape_id, shape in enumerate(scene.shapes):
+            prototype = shape.prototype if shape.prototype is not None else shape
+            prototype_id = prototype_ids.setdefault(id(prototype), shape_id)
+            if prototype_id == shape_id:
+                prototype_id = -1
+                finite_checks += [prototype.vertices, prototype.uvs, prototype.normals]
+                if prototype.vertices.device != device:
+                    warnings.warn('Converting shape vertices from {} to {}, this can be inefficient.'.format(prototype.vertices.device, device))
+                if prototype.indices.device != device:
+                    warnings.warn('Converting shape indices from {} to {}, this can be inefficient.'.format(prototype.indices.device, device))
+                args.append(prototype.vertices.to(device))
+                args.append(prototype.indices.to(device))
+                args.append(prototype.uvs.to(device) if prototype.uvs is not None else None)
+                args.append(prototype.normals.to(device) if prototype.normals is not None else None)
+                args.append(prototype.uv_indices.to(device) if prototype.uv_indices is not None else None)
+                args.append(prototype.normal_indices.to(device) if prototype.normal_indices is not None else None)
+                args.append(prototype.colors.to(device) if prototype.colors is not None else None)
+            else:
+                args += [None] * 7
             args.append(shape.material_id)
             args.append(shape.light_id)
+            args.append(prototype_id)
+            requires_grad = prototype.vertices.requires_grad
+            if shape.to_world is not None:
+                # Row-major, on the CPU: redner keeps a copy in each shape.
+                # The normals are placed by the inverse transpose.
+                to_world = shape.to_world.cpu().float().contiguous()
+                finite_checks.append(to_world)
+                args.append(to_world)
+                args.append(torch.inverse(to_world[:3, :3]).t().contiguous())
+                requires_grad = requires_grad or to_world.requires_grad
+            else:
+                args += [None, None]
+            if requires_grad:
+                requires_visibility_grad = True
+            args.append(camera_requires_grad or requires_grad)
         for material in scene.materials:
-            serialize_texture(material.diffuse_reflectance, args, device)
-            serialize_texture(material.specular_reflectance, args, device)
-            serialize_texture(material.roughness, args, device)
-            serialize_texture(material.generic_texture, args, device)
-            serialize_texture(material.normal_map, args, device)
+            serialize_texture(material.diffuse_reflectance, args, device, finite_checks)
+            serialize_texture(material.specular_reflectance, args, device, finite_checks)
+            serialize_texture(material.roughness, args, device, finite_checks)
+            serialize_texture(material.generic_texture, args, device, finite_checks)
+            serialize_texture(material.normal_map, args, device, finite_checks)
             args.append(material.compute_specular_lighting)
             args.append(material.two_sided)
             args.append(material.use_vertex_color)
@@ -237,16 +428,21 @@ class RenderFunction(torch.autograd.Function):
             args.append(light.intensity.cpu())
             args.append(light.two_sided)
             args.append(light.directly_visible)
-        if scene.envmap is not None:
-            assert(torch.isfinite(scene.envmap.env_to_world).all())
-            assert(torch.isfinite(scene.envmap.world_to_env).all())
-            assert(torch.isfinite(scene.envmap.sample_cdf_ys).all())
-            assert(torch.isfinite(scene.envmap.sample_cdf_xs).all())
-            serialize_texture(scene.envmap.values, args, device)
+        if isinstance(scene.envmap, pyredner.SHEnvironmentMap):
+            finite_checks += [scene.envmap.coeffs,
+                              scene.envmap.env_to_world,
+                              scene.envmap.world_to_env]
+            args.append(-1) # num_levels, -1 marks spherical harmonics
+            args.append(scene.envmap.coeffs.contiguous().to(device))
+            args.append(scene.envmap.env_to_world.cpu())
+            args.append(scene.envmap.world_to_env.cpu())
+            args.append(scene.envmap.directly_visible)
+        elif scene.envmap is not None:
+            finite_checks += [scene.envmap.env_to_world,
+                              scene.envmap.world_to_env]
+            serialize_texture(scene.envmap.values, args, device, finite_checks)
             args.append(scene.envmap.env_to_world.cpu())
             args.append(scene.envmap.world_to_env.cpu())
-            args.append(scene.envmap.sample_cdf_ys.to(device))
-            args.append(scene.envmap.sample_cdf_xs.to(device))
             args.append(scene.envmap.pdf_norm)
             args.append(scene.envmap.directly_visible)
         else:
@@ -263,9 +459,24 @@ class RenderFunction(torch.autograd.Function):
             # Don't need to do edge sampling if we don't require spatial derivatives
             args.append(False)
             args.append(False)
+        # bool is an int, but True or False samples is most likely a mistake
+        assert(not isinstance(primary_edge_samples, bool))
+        assert(not isinstance(secondary_edge_samples, bool))
+        args.append(primary_edge_samples)
+        args.append(secondary_edge_samples)
         args.append(sample_pixel_center)
+        args.append(use_light_bvh)
+        args.append(use_rasterization)
+        if build_options is None:
+            build_options = redner.SceneBuildOptions()
+        args.append(build_options)
+        args.append(compute_geometry_version(scene.shapes) \
+            if get_primary_hit_cache() is not None else 0)
         args.append(device)
 
+        if get_check_finite():
+            assert_finite(finite_checks)
+
         return args
 
     @staticmethod
@@ -310,37 +521,42 @@ class RenderFunction(torch.autograd.Function):
         current_index += 1
         camera_type = args[current_index]
         current_index += 1
+        distortion_lut_resolution = args[current_index]
+        current_index += 1
         if cam_to_world is None:
             camera = redner.Camera(resolution[1],
                                    resolution[0],
-                                   redner.float_ptr(cam_position.data_ptr()),
-                                   redner.float_ptr(cam_look_at.data_ptr()),
-                                   redner.float_ptr(cam_up.data_ptr()),
+                                   float_ptr(cam_position),
+                                   float_ptr(cam_look_at),
+                                   float_ptr(cam_up),
                                    redner.float_ptr(0), # cam_to_world
                                    redner.float_ptr(0), # world_to_cam
-                                   redner.float_ptr(intrinsic_mat_inv.data_ptr()),
-                                   redner.float_ptr(intrinsic_mat.data_ptr()),
-                                   redner.float_ptr(distortion_params.data_ptr() if distortion_params is not None else 0),
+                                   float_ptr(intrinsic_mat_inv),
+                                   float_ptr(intrinsic_mat),
+                                   float_ptr(distortion_params),
                                    clip_near,
                                    camera_type,
                                    redner.Vector2i(viewport[1], viewport[0]),
-                                   redner.Vector2i(viewport[3], viewport[2]))
+                                   redner.Vector2i(viewport[3], viewport[2]),
+                                   distortion_lut_resolution)
         else:
             camera = redner.Camera(resolution[1],
                                    resolution[0],
                                    redner.float_ptr(0), # cam_position
                                    redner.float_ptr(0), # cam_look_at
                                    redner.float_ptr(0), # cam_up
-                                   redner.float_ptr(cam_to_world.data_ptr()),
-                                   redner.float_ptr(world_to_cam.data_ptr()),
-                                   redner.float_ptr(intrinsic_mat_inv.data_ptr()),
-                                   redner.float_ptr(intrinsic_mat.data_ptr()),
-                                   redner.float_ptr(distortion_params.data_ptr() if distortion_params is not None else 0),
+                                   float_ptr(cam_to_world),
+                                   float_ptr(world_to_cam),
+                                   float_ptr(intrinsic_mat_inv),
+                                   float_ptr(intrinsic_mat),
+                                   float_ptr(distortion_params),
                                    clip_near,
                                    camera_type,
                                    redner.Vector2i(viewport[1], viewport[0]),
-                                   redner.Vector2i(viewport[3], viewport[2]))
+                                   redner.Vector2i(viewport[3], viewport[2]),
+                                   distortion_lut_resolution)
         shapes = []
+        shape_buffers = []
         for i in range(num_shapes):
             vertices = args[current_index]
             current_index += 1
@@ -360,6 +576,20 @@ class RenderFunction(torch.autograd.Function):
             current_index += 1
             light_id = args[current_index]
             current_index += 1
+            prototype_id = args[current_index]
+            current_index += 1
+            to_world = args[current_index]
+            current_index += 1
+            normal_to_world = args[current_index]
+            current_index += 1
+            differentiable = args[current_index]
+            current_index += 1
+            if prototype_id >= 0:
+                # Same buffers as the prototype
+                vertices, indices, uvs, normals, uv_indices, normal_indices, colors = \
+                    shape_buffers[prototype_id]
+            shape_buffers.append((vertices, indices, uvs, normals,
+                                  uv_indices, normal_indices, colors))
             assert(vertices.is_contiguous())
             assert(indices.is_contiguous())
             if uvs is not None:
@@ -371,19 +601,25 @@ class RenderFunction(torch.autograd.Function):
             if normal_indices is not None:
                 assert(normal_indices.is_contiguous())
             shapes.append(redner.Shape(\
-                redner.float_ptr(vertices.data_ptr()),
-                redner.int_ptr(indices.data_ptr()),
-                redner.float_ptr(uvs.data_ptr() if uvs is not None else 0),
-                redner.float_ptr(normals.data_ptr() if normals is not None else 0),
-                redner.int_ptr(uv_indices.data_ptr() if uv_indices is not None else 0),
-                redner.int_ptr(normal_indices.data_ptr() if normal_indices is not None else 0),
-                redner.float_ptr(colors.data_ptr() if colors is not None else 0),
+                float_ptr(vertices),
+                int_ptr(indices),
+                float_ptr(uvs),
+                float_ptr(normals),
+                int_ptr(uv_indices),
+                int_ptr(normal_indices),
+                float_ptr(colors),
                 int(vertices.shape[0]),
                 int(uvs.shape[0]) if uvs is not None else 0,
                 int(normals.shape[0]) if normals is not None else 0,
                 int(indices.shape[0]),
                 material_id,
                 light_id))
+            shapes[-1].vertices_padded = pyredner.has_vertex_padding(vertices)
+            if prototype_id >= 0 or to_world is not None:
+                shapes[-1].set_instance(prototype_id,
+                                        float_ptr(to_world),
+                                        float_ptr(normal_to_world))
+            shapes[-1].differentiable = differentiable
 
         materials = []
         for i in range(num_materials):
@@ -448,56 +684,56 @@ class RenderFunction(torch.autograd.Function):
             if diffuse_reflectance[0].dim() == 1:
                 # Constant texture
                 diffuse_reflectance = redner.Texture3(\
-                    [redner.float_ptr(diffuse_reflectance[0].data_ptr())],
+                    [float_ptr(diffuse_reflectance[0])],
                     [0], [0], 3,
-                    redner.float_ptr(diffuse_uv_scale.data_ptr()))
+                    float_ptr(diffuse_uv_scale))
             else:
                 assert(diffuse_reflectance[0].dim() == 3)
                 diffuse_reflectance = redner.Texture3(\
-                    [redner.float_ptr(x.data_ptr()) for x in diffuse_reflectance],
+                    [float_ptr(x) for x in diffuse_reflectance],
                     [x.shape[1] for x in diffuse_reflectance],
                     [x.shape[0] for x in diffuse_reflectance],
                     3,
-                    redner.float_ptr(diffuse_uv_scale.data_ptr()))
+                    float_ptr(diffuse_uv_scale))
 
             if specular_reflectance[0].dim() == 1:
                 # Constant texture
                 specular_reflectance = redner.Texture3(\
-                    [redner.float_ptr(specular_reflectance[0].data_ptr())],
+                    [float_ptr(specular_reflectance[0])],
                     [0], [0], 3,
-                    redner.float_ptr(specular_uv_scale.data_ptr()))
+                    float_ptr(specular_uv_scale))
             else:
                 assert(specular_reflectance[0].dim() == 3)
                 specular_reflectance = redner.Texture3(\
-                    [redner.float_ptr(x.data_ptr()) for x in specular_reflectance],
+                    [float_ptr(x) for x in specular_reflectance],
                     [x.shape[1] for x in specular_reflectance],
                     [x.shape[0] for x in specular_reflectance],
                     3,
-                    redner.float_ptr(specular_uv_scale.data_ptr()))
+                    float_ptr(specular_uv_scale))
 
             if roughness[0].dim() == 1:
                 # Constant texture
                 roughness = redner.Texture1(\
-                    [redner.float_ptr(roughness[0].data_ptr())],
+                    [float_ptr(roughness[0])],
                     [0], [0], 1,
-                    redner.float_ptr(roughness_uv_scale.data_ptr()))
+                    float_ptr(roughness_uv_scale))
             else:
                 assert(roughness[0].dim() == 3)
                 roughness = redner.Texture1(\
-                    [redner.float_ptr(x.data_ptr()) for x in roughness],
+                    [float_ptr(x) for x in roughness],
                     [x.shape[1] for x in roughness],
                     [x.shape[0] for x in roughness],
                     1,
-                    redner.float_ptr(roughness_uv_scale.data_ptr()))
+                    float_ptr(roughness_uv_scale))
 
             if len(generic_texture) > 0:
                 assert(generic_texture[0].dim() == 3)
                 generic_texture = redner.TextureN(\
-                    [redner.float_ptr(x.data_ptr()) for x in generic_texture],
+                    [float_ptr(x) for x in generic_texture],
                     [x.shape[1] for x in generic_texture],
                     [x.shape[0] for x in generic_texture],
                     generic_texture[0].shape[2],
-                    redner.float_ptr(generic_uv_scale.data_ptr()))
+                    float_ptr(generic_uv_scale))
             else:
                 generic_texture = redner.TextureN(\
                     [], [], [], 0, redner.float_ptr(0))
@@ -505,11 +741,11 @@ class RenderFunction(torch.autograd.Function):
             if len(normal_map) > 0:
                 assert(normal_map[0].dim() == 3)
                 normal_map = redner.Texture3(\
-                    [redner.float_ptr(x.data_ptr()) for x in normal_map],
+                    [float_ptr(x) for x in normal_map],
                     [x.shape[1] for x in normal_map],
                     [x.shape[0] for x in normal_map],
                     3,
-                    redner.float_ptr(normal_map_uv_scale.data_ptr()))
+                    float_ptr(normal_map_uv_scale))
             else:
                 normal_map = redner.Texture3(\
                     [], [], [], 0, redner.float_ptr(0))
@@ -536,12 +772,28 @@ class RenderFunction(torch.autograd.Function):
 
             area_lights.append(redner.AreaLight(\
                 shape_id,
-                redner.float_ptr(intensity.data_ptr()),
+                float_ptr(intensity),
                 two_sided,
                 directly_visible))
 
         envmap = None
-        if args[current_index] is not None:
+        if args[current_index] == -1:
+            current_index += 1
+            sh_coeffs = args[current_index]
+            current_index += 1
+            env_to_world = args[current_index]
+            current_index += 1
+            world_to_env = args[current_index]
+            current_index += 1
+            directly_visible = args[current_index]
+            current_index += 1
+            envmap = redner.EnvironmentMap(\
+                float_ptr(sh_coeffs),
+                int(math.sqrt(sh_coeffs.shape[1])),
+                float_ptr(env_to_world),
+                float_ptr(world_to_env),
+                directly_visible)
+        elif args[current_index] is not None:
             num_levels = args[current_index]
             current_index += 1
             values = []
@@ -554,26 +806,20 @@ class RenderFunction(torch.autograd.Function):
             current_index += 1
             world_to_env = args[current_index]
             current_index += 1
-            sample_cdf_ys = args[current_index]
-            current_index += 1
-            sample_cdf_xs = args[current_index]
-            current_index += 1
             pdf_norm = args[current_index]
             current_index += 1
             directly_visible = args[current_index]
             current_index += 1
             values = redner.Texture3(\
-                [redner.float_ptr(x.data_ptr()) for x in values],
+                [float_ptr(x) for x in values],
                 [x.shape[1] for x in values], # width
                 [x.shape[0] for x in values], # height
                 3, # channels
-                redner.float_ptr(envmap_uv_scale.data_ptr()))
+                float_ptr(envmap_uv_scale))
             envmap = redner.EnvironmentMap(\
                 values,
-                redner.float_ptr(env_to_world.data_ptr()),
-                redner.float_ptr(world_to_env.data_ptr()),
-                redner.float_ptr(sample_cdf_ys.data_ptr()),
-                redner.float_ptr(sample_cdf_xs.data_ptr()),
+                float_ptr(env_to_world),
+                float_ptr(world_to_env),
                 pdf_norm,
                 directly_visible)
         else:
@@ -592,8 +838,20 @@ class RenderFunction(torch.autograd.Function):
         current_index += 1
         use_secondary_edge_sampling_ = args[current_index]
         current_index += 1
+        primary_edge_samples = args[current_index]
+        current_index += 1
+        secondary_edge_samples = args[current_index]
+        current_index += 1
         sample_pixel_center = args[current_index]
         current_index += 1
+        use_light_bvh = args[current_index]
+        current_index += 1
+        use_rasterization = args[current_index]
+        current_index += 1
+        build_options = args[current_index]
+        current_index += 1
+        geometry_version = args[current_index]
+        current_index += 1
         device = args[current_index]
         current_index += 1
 
@@ -605,6 +863,19 @@ class RenderFunction(torch.autograd.Function):
         device_index = device.index
         if device.index is None:
             device_index = torch.cuda.current_device() if torch.cuda.is_available() else 0
+        if build_options.quality == redner.BuildQuality.auto:
+            # Don't write into the caller's options, they can be shared by renders
+            # with different resolutions and sample counts
+            options = redner.SceneBuildOptions()
+            options.quality = build_options.quality
+            options.dynamic = build_options.dynamic
+            options.compact = build_options.compact
+            options.robust = build_options.robust
+            # The scene is traced by the forward and the backward passes
+            total_samples = sum(num_samples) if isinstance(num_samples, tuple) else 2 * num_samples
+            options.expected_num_rays = (viewport[2] - viewport[0]) * \
+                (viewport[3] - viewport[1]) * total_samples * (max_bounces + 1)
+            build_options = options
         start = time.time()
         scene = redner.Scene(camera,
                              shapes,
@@ -614,10 +885,13 @@ class RenderFunction(torch.autograd.Function):
                              device.type == 'cuda',
                              device_index,
                              use_primary_edge_sampling,
-                             use_secondary_edge_sampling)
+                             use_secondary_edge_sampling,
+                             use_light_bvh,
+                             build_options)
         time_elapsed = time.time() - start
         if get_print_timing():
-            print('Scene construction, time: %.5f s' % time_elapsed)
+            print('Scene construction, time: %.5f s (ray tracing structures: %.5f s)' % \
+                (time_elapsed, scene.build_time))
 
         # check that num_samples is a tuple
         if isinstance(num_samples, int):
@@ -629,6 +903,20 @@ class RenderFunction(torch.autograd.Function):
                                        channels,
                                        sampler_type,
                                        sample_pixel_center)
+        options.use_rasterization = use_rasterization
+        # Any integer type (e.g. numpy's) is a count
+        if isinstance(primary_edge_samples, numbers.Integral):
+            options.num_primary_edge_samples = int(primary_edge_samples)
+        elif primary_edge_samples is not None:
+            options.primary_edge_sample_ratio = float(primary_edge_samples)
+        if isinstance(secondary_edge_samples, numbers.Integral):
+            options.num_secondary_edge_samples = int(secondary_edge_samples)
+        elif secondary_edge_samples is not None:
+            options.secondary_edge_sample_ratio = float(secondary_edge_samples)
+        cache = get_primary_hit_cache()
+        if cache is not None:
+            cache.geometry_version = geometry_version
+            options.primary_hit_cache = cache
 
         ctx = Context()
         ctx.channels = channels
@@ -682,16 +970,18 @@ class RenderFunction(torch.autograd.Function):
         img_width = viewport[3] - viewport[1]
         rendered_image = torch.zeros(img_height, img_width, num_channels, device = device)
         start = time.time()
+        trace_start = scene.trace_time
         redner.render(scene,
                       options,
-                      redner.float_ptr(rendered_image.data_ptr()),
+                      float_ptr(rendered_image),
                       redner.float_ptr(0), # d_rendered_image
                       None, # d_scene
                       redner.float_ptr(0), # translational_gradient_image
                       redner.float_ptr(0)) # debug_image
         time_elapsed = time.time() - start
         if get_print_timing():
-            print('Forward pass, time: %.5f s' % time_elapsed)
+            print('Forward pass, time: %.5f s (ray tracing: %.5f s)' % \
+                (time_elapsed, scene.trace_time - trace_start))
 
         ctx.seed = seed
         ctx.camera = camera
@@ -734,49 +1024,69 @@ class RenderFunction(torch.autograd.Function):
             buffers.d_distortion_params = torch.zeros(8, device = device)
         if camera.use_look_at:
             buffers.d_camera = redner.DCamera(\
-                redner.float_ptr(buffers.d_cam_position.data_ptr()),
-                redner.float_ptr(buffers.d_cam_look.data_ptr()),
-                redner.float_ptr(buffers.d_cam_up.data_ptr()),
+                float_ptr(buffers.d_cam_position),
+                float_ptr(buffers.d_cam_look),
+                float_ptr(buffers.d_cam_up),
                 redner.float_ptr(0), # cam_to_world
                 redner.float_ptr(0), # world_to_cam
-                redner.float_ptr(buffers.d_intrinsic_mat_inv.data_ptr()),
-                redner.float_ptr(buffers.d_intrinsic_mat.data_ptr()),
-                redner.float_ptr(buffers.d_distortion_params.data_ptr() if buffers.d_distortion_params is not None else 0))
+                float_ptr(buffers.d_intrinsic_mat_inv),
+                float_ptr(buffers.d_intrinsic_mat),
+                float_ptr(buffers.d_distortion_params))
         else:
             buffers.d_camera = redner.DCamera(\
                 redner.float_ptr(0), # pos
                 redner.float_ptr(0), # look
                 redner.float_ptr(0), # up
-                redner.float_ptr(buffers.d_cam_to_world.data_ptr()),
-                redner.float_ptr(buffers.d_world_to_cam.data_ptr()),
-                redner.float_ptr(buffers.d_intrinsic_mat_inv.data_ptr()),
-                redner.float_ptr(buffers.d_intrinsic_mat.data_ptr()),
-                redner.float_ptr(buffers.d_distortion_params.data_ptr() if buffers.d_distortion_params is not None else 0))
+                float_ptr(buffers.d_cam_to_world),
+                float_ptr(buffers.d_world_to_cam),
+                float_ptr(buffers.d_intrinsic_mat_inv),
+                float_ptr(buffers.d_intrinsic_mat),
+                float_ptr(buffers.d_distortion_params))
         buffers.d_vertices_list = []
         buffers.d_uvs_list = []
         buffers.d_normals_list = []
         buffers.d_colors_list = []
+        buffers.d_to_world_list = []
+        buffers.d_normal_to_world_list = []
         buffers.d_shapes = []
         for shape in ctx.shapes:
-            num_vertices = shape.num_vertices
-            num_uv_vertices = shape.num_uv_vertices
-            num_normal_vertices = shape.num_normal_vertices
-            d_vertices = torch.zeros(num_vertices, 3, device = device)
-            d_uvs = torch.zeros(num_uv_vertices, 2,
-                device = device) if shape.has_uvs() else None
-            d_normals = torch.zeros(num_normal_vertices, 3,
-                device = device) if shape.has_normals() else None
-            d_colors = torch.zeros(num_vertices, 3,
-                device = device) if shape.has_colors() else None
+            if shape.prototype_id >= 0:
+                # Accumulate into the buffers of the prototype
+                prototype_id = shape.prototype_id
+                d_vertices = buffers.d_vertices_list[prototype_id]
+                d_uvs = buffers.d_uvs_list[prototype_id]
+                d_normals = buffers.d_normals_list[prototype_id]
+                d_colors = buffers.d_colors_list[prototype_id]
+            else:
+                num_vertices = shape.num_vertices
+                num_uv_vertices = shape.num_uv_vertices
+                num_normal_vertices = shape.num_normal_vertices
+                d_vertices = torch.zeros(num_vertices, 3, device = device)
+                d_uvs = torch.zeros(num_uv_vertices, 2,
+                    device = device) if shape.has_uvs() else None
+                d_normals = torch.zeros(num_normal_vertices, 3,
+                    device = device) if shape.has_normals() else None
+                d_colors = torch.zeros(num_vertices, 3,
+                    device = device) if shape.has_colors() else None
+            buffers.d_shapes.append(redner.DShape(\
+                float_ptr(d_vertices),
+                float_ptr(d_uvs),
+                float_ptr(d_normals),
+                float_ptr(d_colors)))
+            if shape.prototype_id >= 0:
+                d_vertices = d_uvs = d_normals = d_colors = None
             buffers.d_vertices_list.append(d_vertices)
             buffers.d_uvs_list.append(d_uvs)
             buffers.d_normals_list.append(d_normals)
             buffers.d_colors_list.append(d_colors)
-            buffers.d_shapes.append(redner.DShape(\
-                redner.float_ptr(d_vertices.data_ptr()),
-                redner.float_ptr(d_uvs.data_ptr() if d_uvs is not None else 0),
-                redner.float_ptr(d_normals.data_ptr() if d_normals is not None else 0),
-                redner.float_ptr(d_colors.data_ptr() if d_colors is not None else 0)))
+            d_to_world = torch.zeros(4, 4, device = device) \
+                if shape.has_transform else None
+            d_normal_to_world = torch.zeros(3, 3, device = device) \
+                if shape.has_transform else None
+            buffers.d_shapes[-1].set_instance(float_ptr(d_to_world),
+                                              float_ptr(d_normal_to_world))
+            buffers.d_to_world_list.append(d_to_world)
+            buffers.d_normal_to_world_list.append(d_normal_to_world)
 
         buffers.d_diffuse_list = []
         buffers.d_diffuse_uv_scale_list = []
@@ -869,70 +1179,70 @@ class RenderFunction(torch.autograd.Function):
             buffers.d_normal_map_uv_scale_list.append(d_normal_map_uv_scale)
             if d_diffuse[0].dim() == 1:
                 d_diffuse_tex = redner.Texture3(\
-                    [redner.float_ptr(d_diffuse[0].data_ptr())],
+                    [float_ptr(d_diffuse[0])],
                     [0],
                     [0],
                     3,
-                    redner.float_ptr(d_diffuse_uv_scale.data_ptr()))
+                    float_ptr(d_diffuse_uv_scale))
             else:
                 d_diffuse_tex = redner.Texture3(\
-                    [redner.float_ptr(x.data_ptr()) for x in d_diffuse],
+                    [float_ptr(x) for x in d_diffuse],
                     [x.shape[1] for x in d_diffuse],
                     [x.shape[0] for x in d_diffuse],
                     3,
-                    redner.float_ptr(d_diffuse_uv_scale.data_ptr()))
+                    float_ptr(d_diffuse_uv_scale))
 
             if d_specular[0].dim() == 1:
                 d_specular_tex = redner.Texture3(\
-                    [redner.float_ptr(d_specular[0].data_ptr())],
+                    [float_ptr(d_specular[0])],
                     [0],
                     [0],
                     3,
-                    redner.float_ptr(d_specular_uv_scale.data_ptr()))
+                    float_ptr(d_specular_uv_scale))
             else:
                 d_specular_tex = redner.Texture3(\
-                    [redner.float_ptr(x.data_ptr()) for x in d_specular],
+                    [float_ptr(x) for x in d_specular],
                     [x.shape[1] for x in d_specular],
                     [x.shape[0] for x in d_specular],
                     3,
-                    redner.float_ptr(d_specular_uv_scale.data_ptr()))
+                    float_ptr(d_specular_uv_scale))
 
             if d_roughness[0].dim() == 1:
                 d_roughness_tex = redner.Texture1(\
-                    [redner.float_ptr(d_roughness[0].data_ptr())],
+                    [float_ptr(d_roughness[0])],
                     [0],
                     [0],
                     1,
-                    redner.float_ptr(d_roughness_uv_scale.data_ptr()))
+                    float_ptr(d_roughness_uv_scale))
             else:
                 d_roughness_tex = redner.Texture1(\
-                    [redner.float_ptr(x.data_ptr()) for x in d_roughness],
+                    [float_ptr(x) for x in d_roughness],
                     [x.shape[1] for x in d_roughness],
                     [x.shape[0] for x in d_roughness],
                     1,
-                    redner.float_ptr(d_roughness_uv_scale.data_ptr()))
+                    float_ptr(d_roughness_uv_scale))
 
             if d_generic is None:
                 d_generic_tex = redner.TextureN(\
                     [], [], [], 0, redner.float_ptr(0))
             else:
                 d_generic_tex = redner.TextureN(\
-                    [redner.float_ptr(x.data_ptr()) for x in d_generic],
+                    [float_ptr(x) for x in d_generic],
                     [x.shape[1] for x in d_generic],
                     [x.shape[0] for x in d_generic],
                     d_generic[0].shape[2],
-                    redner.float_ptr(d_generic_uv_scale.data_ptr()))
+                    float_ptr(d_generic_uv_scale))
 
             if d_normal_map is None:
                 d_normal_map = redner.Texture3(\
                     [], [], [], 0, redner.float_ptr(0))
             else:
                 d_normal_map = redner.Texture3(\
-                    [redner.float_ptr(x.data_ptr()) for x in d_normal_map],
+                    [float_ptr(x) for x in d_normal_map],
                     [x.shape[1] for x in d_normal_map],
                     [x.shape[0] for x in d_normal_map],
                     3,
-                    redner.float_ptr(d_normal_map_uv_scale.data_ptr()))
+                    float_ptr(d_normal_map_uv_scale))
             buffers.d_materials.append(redner.DMaterial(\
                 d_diffuse_tex, d_specular_tex, d_roughness_tex,
                 d_generic_tex, d_normal_map))
@@ -943,10 +1253,17 @@ class RenderFunction(torch.autograd.Function):
             d_intensity = torch.zeros(3, device = device)
             buffers.d_intensity_list.append(d_intensity)
             buffers.d_area_lights.append(\
-                redner.DAreaLight(redner.float_ptr(d_intensity.data_ptr())))
+                redner.DAreaLight(float_ptr(d_intensity)))
 
         buffers.d_envmap = None
-        if ctx.envmap is not None:
+        if ctx.envmap is not None and ctx.envmap.sh_num_bands > 0:
+            num_bands = ctx.envmap.sh_num_bands
+            buffers.d_envmap_sh_coeffs = torch.zeros(3, num_bands * num_bands, device = device)
+            buffers.d_world_to_env = torch.zeros(4, 4, device = device)
+            buffers.d_envmap = redner.DEnvironmentMap(\
+                float_ptr(buffers.d_envmap_sh_coeffs),
+                float_ptr(buffers.d_world_to_env))
+        elif ctx.envmap is not None:
             envmap = ctx.envmap
             buffers.d_envmap_values = []
             for l in range(envmap.get_levels()):
@@ -957,15 +1274,15 @@ class RenderFunction(torch.autograd.Function):
                                 3, device = device))
             buffers.d_envmap_uv_scale = torch.zeros(2, device = device)
             d_envmap_tex = redner.Texture3(\
-                [redner.float_ptr(x.data_ptr()) for x in buffers.d_envmap_values],
+                [float_ptr(x) for x in buffers.d_envmap_values],
                 [x.shape[1] for x in buffers.d_envmap_values],
                 [x.shape[0] for x in buffers.d_envmap_values],
                 3,
-                redner.float_ptr(buffers.d_envmap_uv_scale.data_ptr()))
+                float_ptr(buffers.d_envmap_uv_scale))
             buffers.d_world_to_env = torch.zeros(4, 4, device = device)
             buffers.d_envmap = redner.DEnvironmentMap(\
                 d_envmap_tex,
-                redner.float_ptr(buffers.d_world_to_env.data_ptr()))
+                float_ptr(buffers.d_world_to_env))
 
         device_index = device.index
         if device.index is None:
@@ -1037,9 +1354,9 @@ class RenderFunction(torch.autograd.Function):
         redner.render(scene,
                       options,
                       redner.float_ptr(0), # rendered_image
-                      redner.float_ptr(grad_img.data_ptr()), # d_rendered_image
+                      float_ptr(grad_img), # d_rendered_image
                       buffers.d_scene,
-                      redner.float_ptr(screen_gradient_image.data_ptr()),
+                      float_ptr(screen_gradient_image),
                       redner.float_ptr(0)) # debug_image
         time_elapsed = time.time() - start
         if get_print_timing():
@@ -1062,15 +1379,17 @@ class RenderFunction(torch.autograd.Function):
         options.seed = ctx.seed[1]
         options.num_samples = ctx.num_samples[1]
         start = time.time()
+        trace_start = scene.trace_time
         redner.render(scene, options,
                       redner.float_ptr(0), # rendered_image
-                      redner.float_ptr(grad_img.data_ptr()),
+                      float_ptr(grad_img),
                       buffers.d_scene,
                       redner.float_ptr(0), # translational_gradient_image
                       redner.float_ptr(0)) # debug_image
         time_elapsed = time.time() - start
         if get_print_timing():
-            print('Backward pass, time: %.5f s' % time_elapsed)
+            print('Backward pass, time: %.5f s (ray tracing: %.5f s)' % \
+                (time_elapsed, scene.trace_time - trace_start))
 
         ret_list = []
         ret_list.append(None) # seed
@@ -1099,6 +1418,7 @@ class RenderFunction(torch.autograd.Function):
         ret_list.append(None) # resolution
         ret_list.append(None) # viewport
         ret_list.append(None) # camera_type
+        ret_list.append(None) # distortion_lut_resolution
 
         num_shapes = len(ctx.shapes)
         for i in range(num_shapes):
@@ -1111,6 +1431,13 @@ class RenderFunction(torch.autograd.Function):
             ret_list.append(buffers.d_colors_list[i])
             ret_list.append(None) # material id
             ret_list.append(None) # light id
+            ret_list.append(None) # prototype id
+            d_to_world = buffers.d_to_world_list[i]
+            d_normal_to_world = buffers.d_normal_to_world_list[i]
+            ret_list.append(d_to_world.cpu() if d_to_world is not None else None)
+            ret_list.append(d_normal_to_world.cpu() \
+                if d_normal_to_world is not None else None)
+            ret_list.append(None) # differentiable
 
         num_materials = len(ctx.materials)
         for i in range(num_materials):
@@ -1151,15 +1478,19 @@ class RenderFunction(torch.autograd.Function):
             ret_list.append(None) # two_sided
             ret_list.append(None) # directly_visible
 
-        if ctx.envmap is not None:
+        if ctx.envmap is not None and ctx.envmap.sh_num_bands > 0:
+            ret_list.append(None) # num_levels
+            ret_list.append(buffers.d_envmap_sh_coeffs)
+            ret_list.append(None) # env_to_world
+            ret_list.append(buffers.d_world_to_env.cpu())
+            ret_list.append(None) # directly_visible
+        elif ctx.envmap is not None:
             ret_list.append(None) # num_levels
             for d_values in buffers.d_envmap_values:
                 ret_list.append(d_values)
             ret_list.append(buffers.d_envmap_uv_scale)
             ret_list.append(None) # env_to_world
             ret_list.append(buffers.d_world_to_env.cpu())
-            ret_list.append(None) # sample_cdf_ys
-            ret_list.append(None) # sample_cdf_xs
             ret_list.append(None) # pdf_norm
             ret_list.append(None) # directly_visible
         else:
@@ -1171,7 +1502,13 @@ class RenderFunction(torch.autograd.Function):
         ret_list.append(None) # sampler type
         ret_list.append(None) # use_primary_edge_sampling
         ret_list.append(None) # use_secondary_edge_sampling
+        ret_list.append(None) # primary_edge_samples
+        ret_list.append(None) # secondary_edge_samples
         ret_list.append(None) # sample_pixel_center
+        ret_list.append(None) # use_light_bvh
+        ret_list.append(None) # use_rasterization
+        ret_list.append(None) # build_options
+        ret_list.append(None) # geometry_version
         ret_list.append(None) # device
 
         return tuple(ret_list)
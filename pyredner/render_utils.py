@@ -4,6 +4,7 @@ import redner
 import torch
 import math
 from typing import Union, Tuple, Optional, List
+from .render_pytorch import float_ptr
 
 class DeferredLight:
     pass
@@ -101,6 +102,193 @@ class SpotLight(DeferredLight):
         dot_l_n = torch.max(dot_l_n, torch.zeros_like(dot_l_n))
         return self.intensity.to(spot_factor.device) * spot_factor * dot_l_n * (albedo / math.pi)
 
+class SHLight(DeferredLight):
+    """
+        Spherical harmonics environment lighting for deferred rendering.
+        The irradiance is computed analytically by convolving the coefficients with
+        the clamped cosine lobe, following "An Efficient Representation for
+        Irradiance Environment Maps", Ramamoorthi and Hanrahan 2001.
+        Visibility is ignored. The coefficients and env_to_world follow the same
+        convention as pyredner.SHEnvironmentMap.
+    """
+    def __init__(self,
+                 coeffs: torch.Tensor,
+                 env_to_world: torch.Tensor = torch.eye(4, 4)):
+        self.coeffs = coeffs
+        self.env_to_world = env_to_world
+
+    @staticmethod
+    def cosine_lobe_coeff(l):
+        # Spherical harmonics coefficients of max(cos(theta), 0) times sqrt(4pi / (2l + 1))
+        if l == 0:
+            return math.pi
+        if l == 1:
+            return 2 * math.pi / 3
+        if l % 2 == 1:
+            return 0.0
+        return 2 * math.pi * math.pow(-1, l // 2 - 1) / ((l + 2) * (l - 1)) * \
+            math.factorial(l) / (math.pow(2, l) * math.factorial(l // 2) ** 2)
+
+    def render(self,
+               position: torch.Tensor,
+               normal: torch.Tensor,
+               albedo: torch.Tensor):
+        world_to_env = torch.inverse(self.env_to_world)[:3, :3].to(normal.device)
+        local_normal = torch.matmul(normal, world_to_env.t())
+        local_normal = local_normal / \
+            torch.max(torch.norm(local_normal, dim = -1, keepdim = True),
+                      torch.tensor(1e-8, device = normal.device))
+        theta = torch.acos(torch.clamp(local_normal[..., 1], -1 + 1e-6, 1 - 1e-6))
+        phi = torch.atan2(local_normal[..., 0], -local_normal[..., 2])
+        coeffs = self.coeffs.to(normal.device)
+        num_bands = int(math.sqrt(coeffs.shape[1]))
+        irradiance = torch.zeros(*normal.shape[:-1], 3, device = normal.device)
+        i = 0
+        for l in range(num_bands):
+            a_l = SHLight.cosine_lobe_coeff(l)
+            for m in range(-l, l + 1):
+                if a_l != 0:
+                    sh_factor = pyredner.SH(l, m, theta, phi).unsqueeze(-1)
+                    irradiance = irradiance + a_l * sh_factor * coeffs[:, i]
+                i += 1
+        irradiance = torch.max(irradiance, torch.zeros_like(irradiance))
+        return irradiance * (albedo / math.pi)
+
+class DeferredShading(torch.autograd.Function):
+    """
+        Shade a G-buffer with the native kernel. The lights of each kind are
+        stacked into tensors, and the G-buffer stores position, shading normal
+        and albedo in its first 9 channels.
+    """
+    @staticmethod
+    def forward(ctx,
+                g_buffer,
+                ambient_intensities,
+                point_positions,
+                point_intensities,
+                directional_directions,
+                directional_intensities,
+                spot_positions,
+                spot_directions,
+                spot_exponents,
+                spot_intensities):
+        g_buffer = g_buffer.contiguous()
+        lights = [ambient_intensities,
+                  point_positions,
+                  point_intensities,
+                  directional_directions,
+                  directional_intensities,
+                  spot_positions,
+                  spot_directions,
+                  spot_exponents,
+                  spot_intensities]
+        lights = [l.to(g_buffer.device, torch.float32).contiguous() for l in lights]
+        width = g_buffer.shape[-2]
+        num_channels = g_buffer.shape[-1]
+        # Batched G-buffers are shaded as one tall image
+        height = g_buffer.numel() // (width * num_channels)
+        device = g_buffer.device
+        use_gpu = device.type == 'cuda'
+        device_index = device.index
+        if device.index is None:
+            device_index = torch.cuda.current_device() if use_gpu else 0
+        img = torch.zeros(*g_buffer.shape[:-1], 3, device = device)
+        redner.shade_deferred(DeferredShading.native_lights(lights),
+                              float_ptr(g_buffer),
+                              width,
+                              height,
+                              num_channels,
+                              float_ptr(img),
+                              use_gpu,
+                              device_index)
+        ctx.g_buffer = g_buffer
+        ctx.lights = lights
+        ctx.width = width
+        ctx.height = height
+        ctx.num_channels = num_channels
+        ctx.use_gpu = use_gpu
+        ctx.device_index = device_index
+        return img
+
+    @staticmethod
+    def native_lights(lights):
+        ambient_intensities, point_positions, point_intensities, \
+            directional_directions, directional_intensities, \
+            spot_positions, spot_directions, spot_exponents, spot_intensities = lights
+        return redner.DeferredLights(\
+            float_ptr(ambient_intensities),
+            ambient_intensities.shape[0],
+            float_ptr(point_positions),
+            float_ptr(point_intensities),
+            point_positions.shape[0],
+            float_ptr(directional_directions),
+            float_ptr(directional_intensities),
+            directional_directions.shape[0],
+            float_ptr(spot_positions),
+            float_ptr(spot_directions),
+            float_ptr(spot_exponents),
+            float_ptr(spot_intensities),
+            spot_positions.shape[0])
+
+    @staticmethod
+    def backward(ctx, grad_img):
+        grad_img = grad_img.to(torch.float32).contiguous()
+        d_g_buffer = torch.zeros_like(ctx.g_buffer)
+        d_lights = [torch.zeros_like(l) for l in ctx.lights]
+        redner.d_shade_deferred(DeferredShading.native_lights(ctx.lights),
+                                float_ptr(ctx.g_buffer),
+                                ctx.width,
+                                ctx.height,
+                                ctx.num_channels,
+                                float_ptr(grad_img),
+                                float_ptr(d_g_buffer),
+                                DeferredShading.native_lights(d_lights),
+                                ctx.use_gpu,
+                                ctx.device_index)
+        return tuple([d_g_buffer] + d_lights)
+
+def shade_g_buffer(g_buffer: torch.Tensor,
+                   lights: List[DeferredLight]):
+    """
+        Sum the contributions of the lights on a G-buffer of shape [..., H, W, C]
+        with position, shading normal and albedo in its first 9 channels.
+        Ambient, point, directional and spot lights are evaluated together by
+        a native kernel that culls the point and spot lights per screen tile,
+        other lights use their render method.
+
+        Returns
+        =======
+        torch.Tensor
+            [..., H, W, 3] radiance
+    """
+    device = g_buffer.device
+    def stack(tensors, size):
+        if len(tensors) == 0:
+            return torch.zeros(0, size, device = device)
+        return torch.stack([t.to(device).reshape(size) for t in tensors])
+    ambient_lights = [l for l in lights if isinstance(l, AmbientLight)]
+    point_lights = [l for l in lights if isinstance(l, PointLight)]
+    directional_lights = [l for l in lights if isinstance(l, DirectionalLight)]
+    spot_lights = [l for l in lights if isinstance(l, SpotLight)]
+    img = DeferredShading.apply(\
+        g_buffer,
+        stack([l.intensity for l in ambient_lights], 3),
+        stack([l.position for l in point_lights], 3),
+        stack([l.intensity for l in point_lights], 3),
+        stack([l.direction for l in directional_lights], 3),
+        stack([l.intensity for l in directional_lights], 3),
+        stack([l.position for l in spot_lights], 3),
+        stack([l.spot_direction for l in spot_lights], 3),
+        stack([l.spot_exponent for l in spot_lights], 1).reshape(-1),
+        stack([l.intensity for l in spot_lights], 3))
+    pos = g_buffer[..., :3]
+    normal = g_buffer[..., 3:6]
+    albedo = g_buffer[..., 6:9]
+    for light in lights:
+        if not isinstance(light, (AmbientLight, PointLight, DirectionalLight, SpotLight)):
+            img = img + light.render(pos, normal, albedo)
+    return img
+
 def render_deferred(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                     lights: Union[List[DeferredLight], List[List[DeferredLight]]],
                     alpha: bool = False,
@@ -108,13 +296,15 @@ def render_deferred(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                     seed: Optional[Union[int, List[int], Tuple[int, int], List[Tuple[int, int]]]] = None,
                     sample_pixel_center: bool = False,
                     use_primary_edge_sampling: bool = True,
+                    use_rasterization: bool = False,
                     device: Optional[torch.device] = None):
     """
         Render the scenes using `deferred rendering <https://en.wikipedia.org/wiki/Deferred_shading>`_.
         We generate G-buffer images containing world-space position,
         normal, and albedo using redner, then shade the G-buffer
-        using PyTorch code. Assuming Lambertian shading and does not
-        compute shadow.
+        with a native kernel (lights other than the ambient, point, directional
+        and spot lights use their PyTorch code). Assuming Lambertian shading
+        and does not compute shadow.
 
         Args
         ====
@@ -146,6 +336,12 @@ def render_deferred(scene: Union[pyredner.Scene, List[pyredner.Scene]],
             and redner's edge sampling becomes an approximation to the gradients of the aliased rendering.
         use_primary_edge_sampling: bool
             debug option
+        use_rasterization: bool
+            Find the surfaces visible from the camera by rasterizing the triangles
+            instead of tracing the primary rays. Same result. Only for perspective and
+            orthographic cameras without lens distortion, other cameras ignore this option.
+            Pays off when many triangles are hidden behind others,
+            tests/test_rasterization.py times both on a given scene.
         device: Optional[torch.device]
             Which device should we store the data in.
             If set to None, use the device from pyredner.get_device().
@@ -186,17 +382,13 @@ def render_deferred(scene: Union[pyredner.Scene, List[pyredner.Scene]],
             use_primary_edge_sampling = use_primary_edge_sampling,
             use_secondary_edge_sampling = False,
             sample_pixel_center = sample_pixel_center,
+            use_rasterization = use_rasterization,
             device = device)
         # Need to revert the resolution back
         scene.camera.resolution = org_res
         scene.camera.viewport = org_viewport
         g_buffer = pyredner.RenderFunction.apply(seed, *scene_args)
-        pos = g_buffer[:, :, :3]
-        normal = g_buffer[:, :, 3:6]
-        albedo = g_buffer[:, :, 6:9]
-        img = torch.zeros(g_buffer.shape[0], g_buffer.shape[1], 3, device = device)
-        for light in lights:
-            img = img + light.render(pos, normal, albedo)
+        img = shade_g_buffer(g_buffer, lights)
         if alpha:
             # alpha is in the last channel
             img = torch.cat((img, g_buffer[:, :, 9:10]), dim = -1)
@@ -242,22 +434,14 @@ def render_deferred(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                     use_primary_edge_sampling = use_primary_edge_sampling,
                     use_secondary_edge_sampling = False,
                     sample_pixel_center = sample_pixel_center,
+                    use_rasterization = use_rasterization,
                     device = device)
                 # Need to revert the resolution back
                 sc.camera.resolution = org_res
                 sc.camera.viewport = org_viewport
                 g_buffers.append(pyredner.RenderFunction.apply(se, *scene_args))
             g_buffers = torch.stack(g_buffers)
-            pos = g_buffers[:, :, :, :3]
-            normal = g_buffers[:, :, :, 3:6]
-            albedo = g_buffers[:, :, :, 6:9]
-            imgs = torch.zeros(g_buffers.shape[0],
-                               g_buffers.shape[1],
-                               g_buffers.shape[2],
-                               3,
-                               device = device)
-            for light in lights:
-                imgs = imgs + light.render(pos, normal, albedo)
+            imgs = shade_g_buffer(g_buffers, lights)
             if alpha:
                 imgs = torch.cat((imgs, g_buffers[:, :, :, 9:10]), dim = -1)
         else:
@@ -282,20 +466,13 @@ def render_deferred(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                     use_primary_edge_sampling = use_primary_edge_sampling,
                     use_secondary_edge_sampling = False,
                     sample_pixel_center = sample_pixel_center,
+                    use_rasterization = use_rasterization,
                     device = device)
                 # Need to revert the resolution back
                 sc.camera.resolution = org_res
                 sc.camera.viewport = org_viewport
                 g_buffer = pyredner.RenderFunction.apply(se, *scene_args)
-                pos = g_buffer[:, :, :3]
-                normal = g_buffer[:, :, 3:6]
-                albedo = g_buffer[:, :, 6:9]
-                img = torch.zeros(g_buffer.shape[0],
-                                  g_buffer.shape[1],
-                                  3,
-                                  device = device)
-                for light in lgts:
-                    img = img + light.render(pos, normal, albedo)
+                img = shade_g_buffer(g_buffer, lgts)
                 if alpha:
                     # alpha is in the last channel
                     img = torch.cat((img, g_buffer[:, :, 9:10]), dim = -1)
@@ -321,6 +498,10 @@ def render_generic(scene: pyredner.Scene,
                    sample_pixel_center: bool = False,
                    use_primary_edge_sampling: bool = True,
                    use_secondary_edge_sampling: bool = True,
+                   use_light_bvh: bool = False,
+                   use_rasterization: bool = False,
+                   primary_edge_samples: Optional[Union[int, float]] = None,
+                   secondary_edge_samples: Optional[Union[int, float]] = None,
                    device: Optional[torch.device] = None):
     """
         A generic rendering function that can be either pathtracing or
@@ -376,6 +557,22 @@ def render_generic(scene: pyredner.Scene,
             debug option
         use_secondary_edge_sampling: bool
             debug option
+        use_light_bvh: bool
+            Sample the area lights with a bounding volume hierarchy that accounts for
+            the position and orientation of the emissive triangles.
+            Recommended for scenes with many emissive triangles.
+        use_rasterization: bool
+            Find the surfaces visible from the camera by rasterizing the triangles
+            instead of tracing the primary rays. Same result. Only for perspective and
+            orthographic cameras without lens distortion, other cameras ignore this option.
+            Pays off when many triangles are hidden behind others,
+            tests/test_rasterization.py times both on a given scene.
+        primary_edge_samples: Optional[Union[int, float]]
+            Primary edge samples per sample pass: an int is a count,
+            a float is a ratio to the number of pixels. None means one per pixel.
+        secondary_edge_samples: Optional[Union[int, float]]
+            Secondary edge samples per sample pass and bounce: an int is a count,
+            a float is a ratio to the number of active paths. None means one per path.
         device: Optional[torch.device]
             Which device should we store the data in.
             If set to None, use the device from pyredner.get_device().
@@ -401,6 +598,10 @@ def render_generic(scene: pyredner.Scene,
             sample_pixel_center = sample_pixel_center,
             use_primary_edge_sampling = use_primary_edge_sampling,
             use_secondary_edge_sampling = use_secondary_edge_sampling,
+            use_light_bvh = use_light_bvh,
+            use_rasterization = use_rasterization,
+            primary_edge_samples = primary_edge_samples,
+            secondary_edge_samples = secondary_edge_samples,
             device = device)
         return pyredner.RenderFunction.apply(seed, *scene_args)
     else:
@@ -423,6 +624,10 @@ def render_generic(scene: pyredner.Scene,
                 sample_pixel_center = sample_pixel_center,
                 use_primary_edge_sampling = use_primary_edge_sampling,
                 use_secondary_edge_sampling = use_secondary_edge_sampling,
+                use_light_bvh = use_light_bvh,
+                use_rasterization = use_rasterization,
+                primary_edge_samples = primary_edge_samples,
+                secondary_edge_samples = secondary_edge_samples,
                 device = device)
             imgs.append(pyredner.RenderFunction.apply(se, *scene_args))
         imgs = torch.stack(imgs)
@@ -435,6 +640,7 @@ def render_g_buffer(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                     sample_pixel_center: bool = False,
                     use_primary_edge_sampling: bool = True,
                     use_secondary_edge_sampling: bool = True,
+                    use_rasterization: bool = False,
                     device: Optional[torch.device] = None):
     """
         Render G buffers from the scene.
@@ -481,6 +687,12 @@ def render_g_buffer(scene: Union[pyredner.Scene, List[pyredner.Scene]],
             debug option
         use_secondary_edge_sampling: bool
             debug option
+        use_rasterization: bool
+            Find the surfaces visible from the camera by rasterizing the triangles
+            instead of tracing the primary rays. Same result. Only for perspective and
+            orthographic cameras without lens distortion, other cameras ignore this option.
+            Pays off when many triangles are hidden behind others,
+            tests/test_rasterization.py times both on a given scene.
         device: Optional[torch.device]
             Which device should we store the data in.
             If set to None, use the device from pyredner.get_device().
@@ -500,6 +712,7 @@ def render_g_buffer(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                           sample_pixel_center = sample_pixel_center,
                           use_primary_edge_sampling = use_primary_edge_sampling,
                           use_secondary_edge_sampling = use_secondary_edge_sampling,
+                          use_rasterization = use_rasterization,
                           device = device)
 
 def render_pathtracing(scene: Union[pyredner.Scene, List[pyredner.Scene]],
@@ -511,6 +724,9 @@ def render_pathtracing(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                        sample_pixel_center: bool = False,
                        use_primary_edge_sampling: bool = True,
                        use_secondary_edge_sampling: bool = True,
+                       use_light_bvh: bool = False,
+                       primary_edge_samples: Optional[Union[int, float]] = None,
+                       secondary_edge_samples: Optional[Union[int, float]] = None,
                        device: Optional[torch.device] = None):
     """
         Render a pyredner scene using pathtracing.
@@ -547,6 +763,16 @@ def render_pathtracing(scene: Union[pyredner.Scene, List[pyredner.Scene]],
             debug option
         use_secondary_edge_sampling: bool
             debug option
+        use_light_bvh: bool
+            Sample the area lights with a bounding volume hierarchy that accounts for
+            the position and orientation of the emissive triangles.
+            Recommended for scenes with many emissive triangles.
+        primary_edge_samples: Optional[Union[int, float]]
+            Primary edge samples per sample pass: an int is a count,
+            a float is a ratio to the number of pixels. None means one per pixel.
+        secondary_edge_samples: Optional[Union[int, float]]
+            Secondary edge samples per sample pass and bounce: an int is a count,
+            a float is a ratio to the number of active paths. None means one per path.
         device: Optional[torch.device]
             Which device should we store the data in.
             If set to None, use the device from pyredner.get_device().
@@ -571,6 +797,9 @@ def render_pathtracing(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                           sample_pixel_center = sample_pixel_center,
                           use_primary_edge_sampling = use_primary_edge_sampling,
                           use_secondary_edge_sampling = use_secondary_edge_sampling,
+                          use_light_bvh = use_light_bvh,
+                          primary_edge_samples = primary_edge_samples,
+                          secondary_edge_samples = secondary_edge_samples,
                           device = device)
 
 def render_albedo(scene: Union[pyredner.Scene, List[pyredner.Scene]],
@@ -579,6 +808,7 @@ def render_albedo(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                   seed: Optional[Union[int, List[int], Tuple[int, int], List[Tuple[int, int]]]] = None,
                   sample_pixel_center: bool = False,
                   use_primary_edge_sampling: bool = True,
+                  use_rasterization: bool = False,
                   device: Optional[torch.device] = None):
     """
         Render the diffuse albedo colors of the scenes.
@@ -607,6 +837,12 @@ def render_albedo(scene: Union[pyredner.Scene, List[pyredner.Scene]],
             If this option is activated, the rendering becomes non-differentiable
             (since there is no antialiasing integral),
             and redner's edge sampling becomes an approximation to the gradients of the aliased rendering.
+        use_rasterization: bool
+            Find the surfaces visible from the camera by rasterizing the triangles
+            instead of tracing the primary rays. Same result. Only for perspective and
+            orthographic cameras without lens distortion, other cameras ignore this option.
+            Pays off when many triangles are hidden behind others,
+            tests/test_rasterization.py times both on a given scene.
         device: Optional[torch.device]
             Which device should we store the data in.
             If set to None, use the device from pyredner.get_device().
@@ -628,4 +864,5 @@ def render_albedo(scene: Union[pyredner.Scene, List[pyredner.Scene]],
                            seed = seed,
                            sample_pixel_center = sample_pixel_center,
                            use_primary_edge_sampling = use_primary_edge_sampling,
+                           use_rasterization = use_rasterization,
                            device = device)
@@ -1,6 +1,6 @@
 import pyredner
 import torch
-from typing import Optional, List
+from typing import Optional, List, Union
 
 class Scene:
     """
@@ -16,7 +16,7 @@ class Scene:
             materials: List[pyredner.Material] = [],
             area_lights: List[pyredner.AreaLight] = [],
             objects: Optional[List[pyredner.Object]] = None,
-            envmap: Optional[pyredner.EnvironmentMap] = None
+            envmap: Optional[Union[pyredner.EnvironmentMap, pyredner.SHEnvironmentMap]] = None
     """
     def __init__(self,
                  camera: pyredner.Camera,
@@ -24,7 +24,7 @@ class Scene:
                  materials: List[pyredner.Material] = [],
                  area_lights: List[pyredner.AreaLight] = [],
                  objects: Optional[List[pyredner.Object]] = None,
-                 envmap: Optional[pyredner.EnvironmentMap] = None):
+                 envmap: Optional[Union[pyredner.EnvironmentMap, pyredner.SHEnvironmentMap]] = None):
         self.camera = camera
         self.envmap = envmap
         if objects is None:
@@ -79,9 +79,15 @@ class Scene:
     @classmethod
     def load_state_dict(cls, state_dict):
         envmap_dict = state_dict['envmap']
+        if envmap_dict is None:
+            envmap = None
+        elif 'coeffs' in envmap_dict:
+            envmap = pyredner.SHEnvironmentMap.load_state_dict(envmap_dict)
+        else:
+            envmap = pyredner.EnvironmentMap.load_state_dict(envmap_dict)
         return cls(
             pyredner.Camera.load_state_dict(state_dict['camera']),
             [pyredner.Shape.load_state_dict(s) for s in state_dict['shapes']],
             [pyredner.Material.load_state_dict(m) for m in state_dict['materials']],
             [pyredner.AreaLight.load_state_dict(l) for l in state_dict['area_lights']],
-            pyredner.EnvironmentMap.load_state_dict(envmap_dict) if envmap_dict is not None else None)
+            envmap = envmap)
@@ -285,6 +285,8 @@ def compute_uvs(vertices, indices, print_progress = True):
         vertices: torch.Tensor
             3D position of vertices
             float32 tensor with size num_vertices x 3
+            On the CPU, vertices from pad_vertices are not copied
+            when building the scene.
         indices: torch.Tensor
             vertex indices of triangle faces.
             int32 tensor with size num_triangles x 3
@@ -324,6 +326,42 @@ def compute_uvs(vertices, indices, print_progress = True):
     uv_indices = uv_indices.to(device)
     return uvs, uv_indices
 
+def has_vertex_padding(vertices: torch.Tensor):
+    """
+        Whether the storage of the vertices has room for at least
+        one more float after the last vertex.
+        The CPU ray tracer (Embree) can then use the vertices in place,
+        instead of copying them into its own padded buffer.
+    """
+    return vertices.is_contiguous() and \
+        vertices.storage_offset() + vertices.numel() < \
+        vertices.untyped_storage().nbytes() // vertices.element_size()
+
+def pad_vertices(vertices: torch.Tensor):
+    """
+        Copy the vertices into a buffer with one more float after
+        the last vertex, see has_vertex_padding.
+        Returns the vertices unchanged if they already have the padding.
+
+        Args
+        ====
+        vertices: torch.Tensor
+            float32 tensor with size num_vertices x 3
+
+        Returns
+        =======
+        torch.Tensor
+            float32 tensor with size num_vertices x 3
+    """
+    if has_vertex_padding(vertices):
+        return vertices
+    padded = torch.empty(vertices.numel() + 1,
+                         dtype = vertices.dtype,
+                         device = vertices.device)
+    padded = padded[:-1].view(vertices.shape)
+    padded.copy_(vertices)
+    return padded
+
 class Shape:
     """
         redner supports only triangle meshes for now. It stores a pool of
@@ -400,6 +438,9 @@ class Shape:
         self.normal_indices = normal_indices
         self.colors = colors
         self.light_id = -1
+        # Set by instance_shape
+        self.prototype = None
+        self.to_world = None
 
     def state_dict(self):
         return {
@@ -427,3 +468,42 @@ class Shape:
             state_dict['colors'])
         out.light_id = state_dict['light_id']
         return out
+
+def instance_shape(shape: Shape,
+                   to_world: torch.Tensor,
+                   material_id: Optional[int] = None):
+    """
+        Create an instance of a shape placed by an affine transform.
+        The instance has no geometry of its own: it shares the tensors of the
+        shape, and redner applies to_world to the vertices (and its inverse
+        transpose to the normals) while rendering. The vertices of the instance
+        are therefore in the shape space. The derivatives go to to_world and to
+        the shape tensors.
+        When a scene has several instances of the same shape (with the shape
+        itself or not), redner builds the ray tracing structures and collects
+        the edges of the shape once for all of them.
+
+        Args
+        ====
+        shape: Shape
+            the shape to instance
+        to_world: torch.Tensor
+            4x4 affine transformation matrix from the shape space to the world space
+        material_id: Optional[int]
+            material of the instance, defaults to the material of the shape
+
+        Returns
+        =======
+        Shape
+    """
+    out = Shape(shape.vertices,
+                shape.indices,
+                material_id if material_id is not None else shape.material_id,
+                uvs = shape.uvs,
+                normals = shape.normals,
+                uv_indices = shape.uv_indices,
+                normal_indices = shape.normal_indices,
+                colors = shape.colors)
+    out.prototype = shape
+    out.to_world = to_world
+    return out
@@ -34,6 +34,17 @@ else:
     assert(tf.__cxx11_abi_flag__ == 1)
     __data_ptr_module = tf.load_op_library(os.path.join(os.path.dirname(redner.__file__), 'libredner_tf_data_ptr_cxx11_abi.so'))
 
+# The native render op is optional: without it pyredner_tensorflow.render
+# falls back to the eager implementation.
+if tf.__cxx11_abi_flag__ == 0:
+    __render_op_library = 'libredner_tf_render_no_cxx11_abi.so'
+else:
+    __render_op_library = 'libredner_tf_render_cxx11_abi.so'
+try:
+    render_op_module = tf.load_op_library(os.path.join(os.path.dirname(redner.__file__), __render_op_library))
+except (tf.errors.NotFoundError, OSError):
+    render_op_module = None
+
 def data_ptr(tensor):    
     addr_as_uint64 = __data_ptr_module.data_ptr(tensor)
     return int(addr_as_uint64)
@@ -0,0 +1,605 @@
+/* Native TensorFlow ops that run the redner path tracer.
+
+   RednerRender and RednerRenderGrad take the flat argument list produced by
+   pyredner_tensorflow.serialize_scene and call the C++ render() directly,
+   so that rendering can be traced into tf.function graphs without going
+   back to Python for every call.
+==============================================================================*/
+
+#pragma warning(disable : 4003 4061 4100 4127 4242 4244 4267 4355 4365 4388 4464 4514 4574 4623 4625 4626 4647 4668 4710 4820 4946 5026 5027 5031 5039)
+
+// For windows
+#define NOMINMAX
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/op_kernel.h"
+
+#include "area_light.h"
+#include "camera.h"
+#include "channels.h"
+#include "envmap.h"
+#include "material.h"
+#include "pathtracer.h"
+#include "scene.h"
+#include "shape.h"
+
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace tensorflow;
+
+/* The argument list contains tensors of different types, which we pass as
+   a list(type) input. The order of the arguments is defined by
+   serialize_scene in render_tensorflow.py and must be kept in sync with it.
+*/
+
+REGISTER_OP("RednerRender")
+    .Attr("Targs: list(type)")
+    .Input("seed: int64")  // scalar
+    .Input("args: Targs")  // serialized scene
+    .Output("image: float")  // [height, width, num_channels]
+    .SetIsStateful()  // render() is stochastic
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+      // The number of channels depends on the materials of the scene
+      c->set_output(0, c->UnknownShapeOfRank(3));
+      return Status::OK();
+    });
+
+REGISTER_OP("RednerRenderGrad")
+    .Attr("Targs: list(type)")
+    .Input("seed: int64")  // scalar
+    .Input("grad_image: float")  // [height, width, num_channels]
+    .Input("args: Targs")  // serialized scene
+    .Output("grad_args: Targs")  // one gradient per argument, zero if not differentiable
+    .SetIsStateful()
+    .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+      for (int i = 2; i < c->num_inputs(); i++) {
+        c->set_output(i - 2, c->input(i));
+      }
+      return Status::OK();
+    });
+
+namespace {
+
+// Same order as the tables in redner_enum_wrapper.py
+const CameraType camera_types[] = {
+  CameraType::Perspective,
+  CameraType::Orthographic,
+  CameraType::Fisheye,
+  CameraType::Panorama
+};
+
+const Channels channel_types[] = {
+  Channels::radiance,
+  Channels::alpha,
+  Channels::depth,
+  Channels::position,
+  Channels::geometry_normal,
+  Channels::shading_normal,
+  Channels::uv,
+  Channels::barycentric_coordinates,
+  Channels::diffuse_reflectance,
+  Channels::specular_reflectance,
+  Channels::vertex_color,
+  Channels::roughness,
+  Channels::generic_texture,
+  Channels::vertex_color,
+  Channels::shape_id,
+  Channels::triangle_id,
+  Channels::material_id
+};
+
+const SamplerType sampler_types[] = {
+  SamplerType::independent,
+  SamplerType::sobol
+};
+
+template <typename T, int N>
+T lookup(const T (&table)[N], int index, const char *name) {
+  if (index < 0 || index >= N) {
+    throw std::runtime_error(std::string("Invalid ") + name + " index " +
+                             std::to_string(index));
+  }
+  return table[index];
+}
+
+// The render() entry point uses a global thread pool, so two render ops
+// scheduled concurrently by TensorFlow must not overlap.
+std::mutex render_mutex;
+
+// Argument indices of a texture: one per mipmap level, plus the uv scale.
+struct TextureArgs {
+  std::vector<int> levels;
+  int uv_scale = -1;
+};
+
+/* Walks the serialized scene and builds the redner scene on top of the
+   input tensors (nothing is copied). The indices of the differentiable
+   arguments are recorded, so that the gradient op can point the
+   derivative scene at its outputs.
+*/
+class SceneArgs {
+ public:
+  SceneArgs(const OpInputList &args, uint64 seed, bool backward) : args(args) {
+    auto device_name = std::string(next().scalar<tstring>()());
+    use_gpu = device_name.find("gpu") != std::string::npos ||
+              device_name.find("GPU") != std::string::npos;
+    if (use_gpu) {
+      throw std::runtime_error(
+        "The native render op only supports CPU devices, got " + device_name);
+    }
+    auto num_shapes = next_int();
+    auto num_materials = next_int();
+    auto num_lights = next_int();
+
+    // Camera
+    position = next_index();
+    look_at = next_index();
+    up = next_index();
+    cam_to_world = next_index();
+    world_to_cam = next_index();
+    intrinsic_mat_inv = next_index();
+    intrinsic_mat = next_index();
+    distortion_params = next_index();
+    auto clip_near = next_float();
+    const auto &resolution = next();
+    const auto &viewport = next();
+    auto camera_type = lookup(camera_types, next_int(), "camera type");
+    auto height = int_value(resolution, 0);
+    auto width = int_value(resolution, 1);
+    viewport_beg = Vector2i{int_value(viewport, 1), int_value(viewport, 0)};
+    viewport_end = Vector2i{int_value(viewport, 3), int_value(viewport, 2)};
+    if (is_empty(cam_to_world)) {
+      cam_to_world = world_to_cam = -1;
+    } else {
+      position = look_at = up = -1;
+    }
+    if (is_empty(distortion_params)) {
+      distortion_params = -1;
+    }
+    camera.reset(new Camera(width,
+                            height,
+                            float_ptr(position),
+                            float_ptr(look_at),
+                            float_ptr(up),
+                            float_ptr(cam_to_world),
+                            float_ptr(world_to_cam),
+                            float_ptr(intrinsic_mat_inv),
+                            float_ptr(intrinsic_mat),
+                            float_ptr(distortion_params),
+                            clip_near,
+                            camera_type,
+                            viewport_beg,
+                            viewport_end,
+                            0)); // distortion_lut_resolution
+
+    // Shapes
+    for (int i = 0; i < num_shapes; i++) {
+      auto vertices = next_index();
+      auto indices = next_index();
+      auto uvs = optional_index(next_index());
+      auto normals = optional_index(next_index());
+      auto uv_indices = optional_index(next_index());
+      auto normal_indices = optional_index(next_index());
+      auto colors = optional_index(next_index());
+      auto material_id = next_int();
+      auto light_id = next_int();
+      shapes.push_back(Shape(float_ptr(vertices),
+                             int_ptr(indices),
+                             float_ptr(uvs),
+                             float_ptr(normals),
+                             int_ptr(uv_indices),
+                             int_ptr(normal_indices),
+                             float_ptr(colors),
+                             (int)args[vertices].dim_size(0),
+                             uvs != -1 ? (int)args[uvs].dim_size(0) : 0,
+                             normals != -1 ? (int)args[normals].dim_size(0) : 0,
+                             (int)args[indices].dim_size(0),
+                             material_id,
+                             light_id));
+      shape_args.push_back({vertices, uvs, normals, colors});
+    }
+
+    // Materials
+    for (int i = 0; i < num_materials; i++) {
+      auto diffuse = next_texture(true);
+      auto specular = next_texture(true);
+      auto roughness = next_texture(true);
+      auto generic = next_texture(false);
+      auto normal_map = next_texture(false);
+      auto compute_specular_lighting = next_bool();
+      auto two_sided = next_bool();
+      auto use_vertex_color = next_bool();
+      materials.push_back(Material(texture<3>(diffuse, 3),
+                                   texture<3>(specular, 3),
+                                   texture<1>(roughness, 1),
+                                   texture<-1>(generic, -1),
+                                   texture<3>(normal_map, 3),
+                                   compute_specular_lighting,
+                                   two_sided,
+                                   use_vertex_color));
+      material_args.push_back({diffuse, specular, roughness, generic, normal_map});
+    }
+
+    // Area lights
+    for (int i = 0; i < num_lights; i++) {
+      auto shape_id = next_int();
+      auto intensity = next_index();
+      auto two_sided = next_bool();
+      auto directly_visible = next_bool();
+      area_lights.push_back(
+        AreaLight(shape_id, float_ptr(intensity), two_sided, directly_visible));
+      light_args.push_back(intensity);
+    }
+
+    // Environment map
+    auto num_envmap_levels = next_index();
+    if (!is_empty(num_envmap_levels)) {
+      auto num_levels = int_value(args[num_envmap_levels], 0);
+      for (int i = 0; i < num_levels; i++) {
+        envmap_args.levels.push_back(next_index());
+      }
+      envmap_args.uv_scale = next_index();
+      auto env_to_world = next_index();
+      world_to_env = next_index();
+      auto pdf_norm = next_float();
+      auto directly_visible = next_bool();
+      envmap = std::make_shared<EnvironmentMap>(texture<3>(envmap_args, 3),
+                                                float_ptr(env_to_world),
+                                                float_ptr(world_to_env),
+                                                pdf_norm,
+                                                directly_visible);
+    }
+
+    // Options
+    const auto &num_samples = next();
+    auto num_forward_samples = int_value(num_samples, 0);
+    auto num_backward_samples = num_samples.NumElements() > 1 ?
+      int_value(num_samples, 1) : num_forward_samples;
+    auto max_bounces = next_int();
+    auto num_channels = next_int();
+    std::vector<Channels> channels;
+    for (int i = 0; i < num_channels; i++) {
+      channels.push_back(lookup(channel_types, next_int(), "channel"));
+    }
+    auto sampler_type = lookup(sampler_types, next_int(), "sampler type");
+    auto use_primary_edge_sampling = next_bool();
+    auto use_secondary_edge_sampling = next_bool();
+    auto sample_pixel_center = next_bool();
+    if (current != args.size()) {
+      throw std::runtime_error("Unexpected number of scene arguments: expected " +
+                               std::to_string(current) + ", got " +
+                               std::to_string(args.size()));
+    }
+
+    std::vector<const Shape*> shape_ptrs;
+    for (const auto &shape : shapes) {
+      shape_ptrs.push_back(&shape);
+    }
+    std::vector<const Material*> material_ptrs;
+    for (const auto &material : materials) {
+      material_ptrs.push_back(&material);
+    }
+    std::vector<const AreaLight*> light_ptrs;
+    for (const auto &light : area_lights) {
+      light_ptrs.push_back(&light);
+    }
+    scene.reset(new Scene(*camera,
+                          shape_ptrs,
+                          material_ptrs,
+                          light_ptrs,
+                          envmap,
+                          use_gpu,
+                          -1, // gpu_index
+                          use_primary_edge_sampling,
+                          use_secondary_edge_sampling,
+                          false)); // use_light_bvh
+    options = RenderOptions{seed,
+                            backward ? num_backward_samples : num_forward_samples,
+                            max_bounces,
+                            channels,
+                            sampler_type,
+                            sample_pixel_center};
+  }
+
+  int image_height() const {
+    return viewport_end.y - viewport_beg.y;
+  }
+
+  int image_width() const {
+    return viewport_end.x - viewport_beg.x;
+  }
+
+  // Build the derivative scene on top of the gradient outputs,
+  // which have the same shapes as the arguments.
+  std::shared_ptr<DScene> d_scene(OpOutputList &grads) {
+    auto d_ptr = [&](int index) {
+      return index != -1 ? ptr<float>(grads[index]->flat<float>().data()) : ptr<float>();
+    };
+    auto d_camera = DCamera(d_ptr(position),
+                            d_ptr(look_at),
+                            d_ptr(up),
+                            d_ptr(cam_to_world),
+                            d_ptr(world_to_cam),
+                            d_ptr(intrinsic_mat_inv),
+                            d_ptr(intrinsic_mat),
+                            d_ptr(distortion_params));
+    for (const auto &shape : shape_args) {
+      d_shapes.push_back(DShape(d_ptr(shape.vertices),
+                                d_ptr(shape.uvs),
+                                d_ptr(shape.normals),
+                                d_ptr(shape.colors)));
+    }
+    for (const auto &material : material_args) {
+      d_materials.push_back(DMaterial{
+        make_texture<3>(material.diffuse, 3, d_ptr),
+        make_texture<3>(material.specular, 3, d_ptr),
+        make_texture<1>(material.roughness, 1, d_ptr),
+        make_texture<-1>(material.generic, -1, d_ptr),
+        make_texture<3>(material.normal_map, 3, d_ptr)});
+    }
+    for (auto intensity : light_args) {
+      d_area_lights.push_back(DAreaLight(d_ptr(intensity)));
+    }
+    std::shared_ptr<DEnvironmentMap> d_envmap;
+    if (envmap != nullptr) {
+      d_envmap = std::make_shared<DEnvironmentMap>(
+        make_texture<3>(envmap_args, 3, d_ptr), d_ptr(world_to_env));
+    }
+
+    std::vector<DShape*> d_shape_ptrs;
+    for (auto &d_shape : d_shapes) {
+      d_shape_ptrs.push_back(&d_shape);
+    }
+    std::vector<DMaterial*> d_material_ptrs;
+    for (auto &d_material : d_materials) {
+      d_material_ptrs.push_back(&d_material);
+    }
+    std::vector<DAreaLight*> d_light_ptrs;
+    for (auto &d_light : d_area_lights) {
+      d_light_ptrs.push_back(&d_light);
+    }
+    return std::make_shared<DScene>(d_camera,
+                                    d_shape_ptrs,
+                                    d_material_ptrs,
+                                    d_light_ptrs,
+                                    d_envmap,
+                                    use_gpu,
+                                    -1); // gpu_index
+  }
+
+  std::unique_ptr<Scene> scene;
+  RenderOptions options;
+
+ private:
+  struct ShapeArgs {
+    int vertices, uvs, normals, colors;
+  };
+  struct MaterialArgs {
+    TextureArgs diffuse, specular, roughness, generic, normal_map;
+  };
+
+  const Tensor &next() {
+    if (current >= args.size()) {
+      throw std::runtime_error("Not enough scene arguments");
+    }
+    return args[current++];
+  }
+
+  int next_index() {
+    next();
+    return current - 1;
+  }
+
+  int next_int() {
+    return int_value(next(), 0);
+  }
+
+  float next_float() {
+    const auto &t = next();
+    switch (t.dtype()) {
+      case DT_FLOAT: return t.flat<float>()(0);
+      case DT_DOUBLE: return (float)t.flat<double>()(0);
+      default: throw std::runtime_error("Expected a float scene argument");
+    }
+  }
+
+  bool next_bool() {
+    const auto &t = next();
+    if (t.dtype() != DT_BOOL) {
+      throw std::runtime_error("Expected a bool scene argument");
+    }
+    return t.flat<bool>()(0);
+  }
+
+  // Mipmap levels followed by the uv scale. Optional textures (generic
+  // texture and normal map) have no uv scale when they have no levels.
+  TextureArgs next_texture(bool required) {
+    TextureArgs tex;
+    auto num_levels = next_int();
+    for (int i = 0; i < num_levels; i++) {
+      tex.levels.push_back(next_index());
+    }
+    if (required || num_levels > 0) {
+      tex.uv_scale = next_index();
+    }
+    return tex;
+  }
+
+  static int int_value(const Tensor &t, int i) {
+    switch (t.dtype()) {
+      case DT_INT32: return t.flat<int32>()(i);
+      case DT_INT64: return (int)t.flat<int64>()(i);
+      default: throw std::runtime_error("Expected an integer scene argument");
+    }
+  }
+
+  bool is_empty(int index) const {
+    return args[index].NumElements() == 0;
+  }
+
+  int optional_index(int index) const {
+    return is_empty(index) ? -1 : index;
+  }
+
+  ptr<float> float_ptr(int index) const {
+    if (index == -1) {
+      return ptr<float>();
+    }
+    return ptr<float>(const_cast<float*>(args[index].flat<float>().data()));
+  }
+
+  ptr<int> int_ptr(int index) const {
+    if (index == -1) {
+      return ptr<int>();
+    }
+    return ptr<int>(const_cast<int*>(args[index].flat<int32>().data()));
+  }
+
+  template <int N>
+  Texture<N> texture(const TextureArgs &tex, int channels) const {
+    return make_texture<N>(tex, channels,
+      [&](int index) { return float_ptr(index); });
+  }
+
+  // A rank 1 first level is a constant, otherwise the levels are
+  // [height, width, channels] images.
+  template <int N, typename PtrFunc>
+  Texture<N> make_texture(const TextureArgs &tex,
+                          int channels,
+                          PtrFunc get_ptr) const {
+    if (tex.levels.size() == 0) {
+      return Texture<N>({}, {}, {}, 0, ptr<float>());
+    }
+    std::vector<ptr<float>> texels;
+    std::vector<int> width, height;
+    const auto &level0 = args[tex.levels[0]];
+    if (level0.dims() == 1) {
+      texels.push_back(get_ptr(tex.levels[0]));
+      width.push_back(0);
+      height.push_back(0);
+    } else {
+      for (auto level : tex.levels) {
+        texels.push_back(get_ptr(level));
+        width.push_back((int)args[level].dim_size(1));
+        height.push_back((int)args[level].dim_size(0));
+      }
+      if (channels == -1) {
+        channels = (int)level0.dim_size(2);
+      }
+    }
+    return Texture<N>(texels, width, height, channels, get_ptr(tex.uv_scale));
+  }
+
+  const OpInputList &args;
+  int current = 0;
+  bool use_gpu = false;
+  int position, look_at, up, cam_to_world, world_to_cam;
+  int intrinsic_mat_inv, intrinsic_mat, distortion_params;
+  int world_to_env = -1;
+  Vector2i viewport_beg, viewport_end;
+  std::vector<ShapeArgs> shape_args;
+  std::vector<MaterialArgs> material_args;
+  std::vector<int> light_args;
+  TextureArgs envmap_args;
+
+  std::unique_ptr<Camera> camera;
+  std::vector<Shape> shapes;
+  std::vector<Material> materials;
+  std::vector<AreaLight> area_lights;
+  std::shared_ptr<EnvironmentMap> envmap;
+  std::vector<DShape> d_shapes;
+  std::vector<DMaterial> d_materials;
+  std::vector<DAreaLight> d_area_lights;
+};
+
+}  // namespace
+
+class RednerRenderOp : public OpKernel {
+ public:
+  explicit RednerRenderOp(OpKernelConstruction* context) : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    auto seed = context->input(0).scalar<int64>()();
+    OpInputList args;
+    OP_REQUIRES_OK(context, context->input_list("args", &args));
+
+    std::lock_guard<std::mutex> guard(render_mutex);
+    try {
+      SceneArgs scene_args(args, (uint64)seed, false);
+      auto num_channels = compute_num_channels(
+        scene_args.options.channels,
+        scene_args.scene->max_generic_texture_dimension);
+      Tensor* image = NULL;
+      OP_REQUIRES_OK(context,
+        context->allocate_output(0,
+          {scene_args.image_height(), scene_args.image_width(), num_channels},
+          &image));
+      image->flat<float>().setZero();
+      render(*scene_args.scene,
+             scene_args.options,
+             ptr<float>(image->flat<float>().data()),
+             ptr<float>(), // d_rendered_image
+             nullptr, // d_scene
+             ptr<float>(), // screen_gradient_image
+             ptr<float>()); // debug_image
+    } catch (const std::exception &e) {
+      context->SetStatus(errors::InvalidArgument(e.what()));
+    }
+  }
+};
+
+class RednerRenderGradOp : public OpKernel {
+ public:
+  explicit RednerRenderGradOp(OpKernelConstruction* context) : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    auto seed = context->input(0).scalar<int64>()();
+    const Tensor& grad_image = context->input(1);
+    OpInputList args;
+    OP_REQUIRES_OK(context, context->input_list("args", &args));
+    OpOutputList grads;
+    OP_REQUIRES_OK(context, context->output_list("grad_args", &grads));
+    // Non-differentiable arguments get zero gradients of their own type
+    for (int i = 0; i < args.size(); i++) {
+      Tensor* grad = NULL;
+      OP_REQUIRES_OK(context, grads.allocate(i, args[i].shape(), &grad));
+      switch (grad->dtype()) {
+        case DT_FLOAT: grad->flat<float>().setZero(); break;
+        case DT_DOUBLE: grad->flat<double>().setZero(); break;
+        case DT_INT32: grad->flat<int32>().setZero(); break;
+        case DT_INT64: grad->flat<int64>().setZero(); break;
+        case DT_BOOL: grad->flat<bool>().setConstant(false); break;
+        default: break; // strings are already empty
+      }
+    }
+
+    std::lock_guard<std::mutex> guard(render_mutex);
+    try {
+      SceneArgs scene_args(args, (uint64)seed, true);
+      auto d_scene = scene_args.d_scene(grads);
+      render(*scene_args.scene,
+             scene_args.options,
+             ptr<float>(), // rendered_image
+             ptr<float>(const_cast<float*>(grad_image.flat<float>().data())),
+             d_scene,
+             ptr<float>(), // screen_gradient_image
+             ptr<float>()); // debug_image
+    } catch (const std::exception &e) {
+      context->SetStatus(errors::InvalidArgument(e.what()));
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+  Name("RednerRender")
+  .Device(DEVICE_CPU),
+  RednerRenderOp);
+REGISTER_KERNEL_BUILDER(
+  Name("RednerRenderGrad")
+  .Device(DEVICE_CPU),
+  RednerRenderGradOp);
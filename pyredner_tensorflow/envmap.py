@@ -40,31 +40,16 @@ class EnvironmentMap:
             luminance = 0.212671 * values.texels[:, :, 0] + \
                         0.715160 * values.texels[:, :, 1] + \
                         0.072169 * values.texels[:, :, 2]
-            # For each y, compute CDF over x
-            sample_cdf_xs_ = tf.cumsum(luminance, axis=1)
-
+            # redner builds the alias tables for sampling, we only need the
+            # normalization of the luminance weighted by the solid angle of each row
             y_weight = tf.sin(
                 math.pi * (tf.cast(
                     tf.range(luminance.shape[0]),
                     tf.float32) + 0.5) / float(luminance.shape[0]))
 
-            # Compute CDF for x
-            sample_cdf_ys_ = tf.cumsum(sample_cdf_xs_[:, -1] * y_weight, axis=0)
+            total = tf.reduce_sum(tf.reduce_sum(luminance, axis=1) * y_weight)
             pdf_norm = (luminance.shape[0] * luminance.shape[1]) / \
-                    (sample_cdf_ys_[-1] * (2 * math.pi * math.pi))
-            # Normalize to [0, 1)
-            sample_cdf_xs = (sample_cdf_xs_ - sample_cdf_xs_[:, 0:1]) / \
-                tf.math.maximum(
-                    sample_cdf_xs_[
-                        :, 
-                        (luminance.shape[1] - 1):luminance.shape[1]],
-                        1e-8 * tf.convert_to_tensor(np.ones((sample_cdf_xs_.shape[0], 1)), dtype=tf.float32)
-                    )
-            sample_cdf_ys = (sample_cdf_ys_ - sample_cdf_ys_[0]) / \
-                tf.math.maximum(sample_cdf_ys_[-1], tf.constant([1e-8]))
-
-            self.sample_cdf_ys = sample_cdf_ys
-            self.sample_cdf_xs = sample_cdf_xs
+                    (total * (2 * math.pi * math.pi))
             self.pdf_norm = pdf_norm
 
     @property
@@ -91,8 +76,6 @@ class EnvironmentMap:
             'values': self.values.state_dict(),
             'env_to_world': self.env_to_world,
             'world_to_env': self.world_to_env,
-            'sample_cdf_ys': self.sample_cdf_ys,
-            'sample_cdf_xs': self.sample_cdf_xs,
             'pdf_norm': self.pdf_norm,
             'directly_visible': self.directly_visible
         }
@@ -103,8 +86,6 @@ class EnvironmentMap:
         out.values = pyredner.Texture.load_state_dict(state_dict['values'])
         out.env_to_world = state_dict['env_to_world']
         out.world_to_env = state_dict['world_to_env']
-        out.sample_cdf_ys = state_dict['sample_cdf_ys']
-        out.sample_cdf_xs = state_dict['sample_cdf_xs']
         out.pdf_norm = state_dict['pdf_norm']
         out.directly_visible = state_dict['directly_visible']
         return out
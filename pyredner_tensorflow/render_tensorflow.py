@@ -239,9 +239,6 @@ def serialize_scene(scene: pyredner.Scene,
         with tf.device('/device:cpu:' + str(pyredner.get_cpu_device_id())):
             args.append(tf.identity(scene.envmap.env_to_world))
             args.append(tf.identity(scene.envmap.world_to_env))
-        with tf.device(device_name):
-            args.append(tf.identity(scene.envmap.sample_cdf_ys))
-            args.append(tf.identity(scene.envmap.sample_cdf_xs))
         args.append(scene.envmap.pdf_norm)
         args.append(scene.envmap.directly_visible)
     else:
@@ -319,7 +316,8 @@ def unpack_args(seed,
                                    clip_near,
                                    camera_type,
                                    redner.Vector2i(viewport[1], viewport[0]),
-                                   redner.Vector2i(viewport[3], viewport[2]))
+                                   redner.Vector2i(viewport[3], viewport[2]),
+                                   0) # distortion_lut_resolution
         else:
             camera = redner.Camera(resolution[1],
                                    resolution[0],
@@ -334,7 +332,8 @@ def unpack_args(seed,
                                    clip_near,
                                    camera_type,
                                    redner.Vector2i(viewport[1], viewport[0]),
-                                   redner.Vector2i(viewport[3], viewport[2]))
+                                   redner.Vector2i(viewport[3], viewport[2]),
+                                   0) # distortion_lut_resolution
 
     with tf.device(device_name):
         shapes = []
@@ -543,19 +542,12 @@ def unpack_args(seed,
         current_index += 1
         world_to_env = args[current_index]
         current_index += 1
-        sample_cdf_ys = args[current_index]
-        current_index += 1
-        sample_cdf_xs = args[current_index]
-        current_index += 1
         pdf_norm = float(args[current_index])
         current_index += 1
         directly_visible = bool(args[current_index])
         current_index += 1
 
         assert isinstance(pdf_norm, float)
-        with tf.device(device_name):
-            sample_cdf_ys = redner.float_ptr(pyredner.data_ptr(sample_cdf_ys))
-            sample_cdf_xs = redner.float_ptr(pyredner.data_ptr(sample_cdf_xs))
         with tf.device('/device:cpu:' + str(pyredner.get_cpu_device_id())):
             env_to_world = redner.float_ptr(pyredner.data_ptr(env_to_world))
             world_to_env = redner.float_ptr(pyredner.data_ptr(world_to_env))
@@ -570,8 +562,6 @@ def unpack_args(seed,
             values,
             env_to_world,
             world_to_env,
-            sample_cdf_ys,
-            sample_cdf_xs,
             pdf_norm,
             directly_visible)
     else:
@@ -622,7 +612,8 @@ def unpack_args(seed,
                          use_gpu,
                          gpu_index,
                          use_primary_edge_sampling,
-                         use_secondary_edge_sampling)
+                         use_secondary_edge_sampling,
+                         False) # use_light_bvh
     time_elapsed = time.time() - start
     if get_print_timing():
         print('Scene construction, time: %.5f s' % time_elapsed)
@@ -995,10 +986,42 @@ def create_gradient_buffers(ctx):
                                     gpu_index)
     return buffers
 
-@tf.custom_gradient
 def render(*x):
     """
         The main TensorFlow interface of C++ redner.
+        x is the seed followed by the output of serialize_scene.
+
+        When the native render op is available (CPU only for now), rendering
+        runs as a TensorFlow op, so it can be traced into tf.function graphs.
+        Otherwise we fall back to the eager implementation.
+    """
+    if pyredner.render_op_module is not None and not pyredner.get_use_gpu():
+        seed = tf.cast(x[0], tf.int64)
+        return pyredner.render_op_module.redner_render(seed = seed, args = list(x[1:]))
+    return render_eager(*x)
+
+@tf.RegisterGradient('RednerRender')
+def render_op_grad(op, grad_img):
+    """
+        Gradient of the native render op, computed by the native gradient op.
+    """
+    seed = op.inputs[0]
+    if not get_use_correlated_random_number():
+        # Decouple the forward/backward random numbers by adding a big prime number
+        seed = seed + 1000003
+    args = list(op.inputs[1:])
+    grads = pyredner.render_op_module.redner_render_grad(\
+        seed = seed, grad_image = grad_img, args = args)
+    ret_list = [None] # seed
+    for arg, grad in zip(args, grads):
+        # Only float arguments are differentiable
+        ret_list.append(grad if arg.dtype == tf.float32 else None)
+    return ret_list
+
+@tf.custom_gradient
+def render_eager(*x):
+    """
+        Eager implementation of render, see render.
     """
     assert(tf.executing_eagerly())
     if pyredner.get_use_gpu() and os.environ['TF_FORCE_GPU_ALLOW_GROWTH'] != 'true':
@@ -1129,8 +1152,6 @@ def render(*x):
             ret_list.append(None) # env_to_world
             with tf.device('/device:cpu:' + str(pyredner.get_cpu_device_id())):
                 ret_list.append(tf.identity(buffers.d_world_to_env))
-            ret_list.append(None) # sample_cdf_ys
-            ret_list.append(None) # sample_cdf_xs
             ret_list.append(None) # pdf_norm
             ret_list.append(None) # directly_visible
         else:
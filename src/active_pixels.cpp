@@ -48,6 +48,27 @@ void update_active_pixels(const BufferView<int> &active_pixels,
     new_active_pixels.count = int(new_end - new_active_pixels.begin());
 }
 
+struct is_valid_path {
+    DEVICE bool operator()(int pixel_id) {
+        return isects[pixel_id].valid() && !is_zero(throughputs[pixel_id]);
+    }
+
+    const Intersection *isects;
+    const Vector3 *throughputs;
+};
+
+void update_active_pixels(const BufferView<int> &active_pixels,
+                          const BufferView<Intersection> &isects,
+                          const BufferView<Vector3> &throughputs,
+                          BufferView<int> &new_active_pixels,
+                          bool use_gpu) {
+    auto op = is_valid_path{isects.begin(), throughputs.begin()};
+    auto new_end = DISPATCH(use_gpu, thrust::copy_if,
+        active_pixels.begin(), active_pixels.end(),
+        new_active_pixels.begin(), op);
+    new_active_pixels.count = int(new_end - new_active_pixels.begin());
+}
+
 void test_active_pixels(bool use_gpu) {
     auto num_pixels = 1024;
     auto rays_buffer = Buffer<Ray>(use_gpu, num_pixels);
@@ -74,4 +95,19 @@ void test_active_pixels(bool use_gpu) {
                          active_pixels,
                          use_gpu);
     equal_or_error(__FILE__, __LINE__, num_pixels / 2, active_pixels.size());
+    auto throughputs_buffer = Buffer<Vector3>(use_gpu, num_pixels);
+    auto throughputs = throughputs_buffer.view(0, num_pixels);
+    for (int i = 0; i < num_pixels; i++) {
+        if (i % 4 == 0) {
+            throughputs[i] = Vector3{0, 0, 0};
+        } else {
+            throughputs[i] = Vector3{0.0, 0.5, 0.0};
+        }
+    }
+    update_active_pixels(active_pixels,
+                         isects,
+                         throughputs,
+                         active_pixels,
+                         use_gpu);
+    equal_or_error(__FILE__, __LINE__, num_pixels / 4, active_pixels.size());
 }
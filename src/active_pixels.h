@@ -14,5 +14,12 @@ void update_active_pixels(const BufferView<int> &active_pixels,
                           const BufferView<Intersection> &isects,
                           BufferView<int> &new_active,
                           bool use_gpu);
+/// Also removes the paths whose throughput is zero:
+/// they can't contribute to the image anymore.
+void update_active_pixels(const BufferView<int> &active_pixels,
+                          const BufferView<Intersection> &isects,
+                          const BufferView<Vector3> &throughputs,
+                          BufferView<int> &new_active,
+                          bool use_gpu);
 
 void test_active_pixels(bool use_gpu);
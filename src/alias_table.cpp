@@ -0,0 +1,37 @@
+#include "alias_table.h"
+#include "test_utils.h"
+
+#include <vector>
+
+void test_alias_table() {
+    std::vector<Real> weights{Real(1), Real(0.5), Real(0), Real(3), Real(0.25), Real(1.25)};
+    auto n = (int)weights.size();
+    auto total = Real(0);
+    for (auto w : weights) {
+        total += w;
+    }
+    std::vector<AliasEntry> table(n);
+    std::vector<int> scratch(n);
+    build_alias_table(weights.data(), n, total, table.data(), scratch.data());
+    // The probability of each index implied by the table matches the weights
+    std::vector<Real> implied(n, Real(0));
+    for (int i = 0; i < n; i++) {
+        implied[i] += table[i].prob / n;
+        implied[table[i].alias] += (1 - table[i].prob) / n;
+    }
+    for (int i = 0; i < n; i++) {
+        equal_or_error(__FILE__, __LINE__, weights[i] / total, implied[i]);
+    }
+    // So does sampling
+    constexpr int num_samples = 100000;
+    std::vector<Real> freq(n, Real(0));
+    for (int s = 0; s < num_samples; s++) {
+        auto id = sample_alias_table(table.data(), n, (s + Real(0.5)) / num_samples);
+        freq[id] += Real(1) / num_samples;
+    }
+    for (int i = 0; i < n; i++) {
+        equal_or_error(__FILE__, __LINE__, weights[i] / total, freq[i]);
+    }
+    // Zero weights are never sampled
+    equal_or_error(__FILE__, __LINE__, Real(0), freq[2]);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "redner.h"
+
+/**
+ * Walker's alias method for O(1) sampling of a discrete distribution.
+ * Bucket i is picked uniformly; it returns i with probability prob,
+ * otherwise it returns alias.
+ */
+struct AliasEntry {
+    Real prob;
+    int alias;
+};
+
+/// Vose's construction of the alias table of n weights summing to total.
+/// scratch holds n integers. Each table is built sequentially, build tables
+/// of different distributions in parallel.
+DEVICE
+inline void build_alias_table(const Real *weights,
+                              int n,
+                              Real total,
+                              AliasEntry *table,
+                              int *scratch) {
+    if (n <= 0) {
+        return;
+    }
+    if (total <= 0) {
+        // Degenerate distribution, fall back to uniform
+        for (int i = 0; i < n; i++) {
+            table[i] = AliasEntry{Real(1), i};
+        }
+        return;
+    }
+    // Small buckets grow from the front of scratch, large ones from the back
+    auto num_small = 0;
+    auto large_begin = n;
+    for (int i = 0; i < n; i++) {
+        auto p = weights[i] * n / total;
+        table[i] = AliasEntry{p, i};
+        if (p < 1) {
+            scratch[num_small++] = i;
+        } else {
+            scratch[--large_begin] = i;
+        }
+    }
+    while (num_small > 0 && large_begin < n) {
+        auto small = scratch[--num_small];
+        auto large = scratch[large_begin];
+        // Fill the rest of the small bucket with the large one
+        table[small].alias = large;
+        table[large].prob -= (1 - table[small].prob);
+        if (table[large].prob < 1) {
+            large_begin++;
+            scratch[num_small++] = large;
+        }
+    }
+    // Leftovers are full up to rounding errors
+    for (int i = 0; i < num_small; i++) {
+        table[scratch[i]] = AliasEntry{Real(1), scratch[i]};
+    }
+    for (int i = large_begin; i < n; i++) {
+        table[scratch[i]] = AliasEntry{Real(1), scratch[i]};
+    }
+}
+
+/// Map sample in [0, 1) to an index of the table of size n
+DEVICE
+inline int sample_alias_table(const AliasEntry *table, int n, Real sample) {
+    auto x = sample * n;
+    auto i = clamp((int)x, 0, n - 1);
+    return (x - i) < table[i].prob ? i : table[i].alias;
+}
+
+/// Same as above, also returns sample rescaled to [0, 1) for reuse
+/// in the selected bucket.
+DEVICE
+inline int sample_alias_table(const AliasEntry *table, int n, Real sample, Real &remapped) {
+    auto x = sample * n;
+    auto i = clamp((int)x, 0, n - 1);
+    auto u = x - i;
+    const auto &entry = table[i];
+    if (u < entry.prob) {
+        remapped = min(u / entry.prob, Real(1 - 1e-10));
+        return i;
+    }
+    remapped = min((u - entry.prob) / (1 - entry.prob), Real(1 - 1e-10));
+    return entry.alias;
+}
+
+void test_alias_table();
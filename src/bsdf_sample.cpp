@@ -4,6 +4,12 @@
 
 struct bsdf_sampler {
     DEVICE void operator()(int idx) {
+        const auto &shape = scene.shapes[shading_isects[active_pixels[idx]].shape_id];
+        dispatch_material_features(scene.materials[shape.material_id].features, *this, idx);
+    }
+
+    template <int Features>
+    DEVICE void shade(int idx) {
         auto pixel_id = active_pixels[idx];
         const auto &isect = shading_isects[pixel_id];
         const auto &shape = scene.shapes[isect.shape_id];
@@ -13,7 +19,7 @@ struct bsdf_sampler {
 
         next_rays[pixel_id] = Ray{
             shading_points[pixel_id].position,
-            bsdf_sample(
+            bsdf_sample<Features>(
                 material,
                 shading_point,
                 -incoming_ray.dir,
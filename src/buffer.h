@@ -2,17 +2,19 @@
 
 #include "redner.h"
 #include "cuda_utils.h"
+#include "parallel.h"
 
 #include <vector>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 
 template <typename T>
 struct BufferView {
-    BufferView(T *data = nullptr, int count = 0) :
+    BufferView(T *data = nullptr, int64_t count = 0) :
         data(data), count(count) {}
 
-    int size() const {
+    int64_t size() const {
         return count;
     }
 
@@ -28,15 +30,15 @@ struct BufferView {
     const T* end() const {
         return data + count;
     }
-    const T& operator[](int i) const {
+    const T& operator[](int64_t i) const {
         return data[i];
     }
-    T& operator[](int i) {
+    T& operator[](int64_t i) {
         return data[i];
     }
 
     T *data;
-    int count;
+    int64_t count;
 };
 
 /**
@@ -57,7 +59,7 @@ public:
                 assert(false);
 #endif
             } else {
-                data = (T*)malloc(count * sizeof(T));
+                data = (T*)allocate_host(count * sizeof(T));
             }
         }
     }
@@ -88,13 +90,13 @@ public:
                 assert(false);
 #endif
             } else {
-                free(data);
+                free_host(data);
             }
         }
     }
 
-    int size() const { return (int)count; }
-    int bytes() const { return (int)count * sizeof(T); }
+    int64_t size() const { return (int64_t)count; }
+    size_t bytes() const { return count * sizeof(T); }
 
     T* begin() {
         return data;
@@ -108,13 +110,13 @@ public:
     const T* end() const {
         return data + count;
     }
-    T& operator[](int idx) {
+    T& operator[](int64_t idx) {
         return data[idx];
     }
-    const T& operator[](int idx) const {
+    const T& operator[](int64_t idx) const {
         return data[idx];
     }
-    BufferView<T> view(int offset, int size) const {
+    BufferView<T> view(int64_t offset, int64_t size) const {
         return BufferView<T>{data + offset, size};
     }
     
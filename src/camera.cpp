@@ -5,6 +5,7 @@
 
 #include <cmath>
 
+template <CameraType camera_type, bool has_distortion>
 struct primary_ray_sampler {
     DEVICE void operator()(int idx) {
         // Compute pixel coordinate based on index and camera viewport
@@ -19,21 +20,19 @@ struct primary_ray_sampler {
             (pixel_y + sample[1]) / Real(camera.height)
         };
 
-        auto ray = sample_primary(camera, screen_pos);
-        rays[idx] = ray;
-        // Ray differential computation
-        auto delta = Real(1e-3);
-        auto screen_pos_dx = screen_pos + Vector2{delta, Real(0)};
-        auto ray_dx = sample_primary(camera, screen_pos_dx);
-        auto screen_pos_dy = screen_pos + Vector2{Real(0), delta};
-        auto ray_dy = sample_primary(camera, screen_pos_dy);
+        // Ray differential computation: analytic derivatives w.r.t. screen position
+        auto screen_differential = RayDifferential{
+            Vector3{0, 0, 0}, Vector3{0, 0, 0},
+            Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+        rays[idx] = sample_primary<camera_type, has_distortion>(
+            camera, screen_pos, &screen_differential);
         auto pixel_size_x = Real(0.5) / camera.width;
         auto pixel_size_y = Real(0.5) / camera.height;
-        auto org_dx = pixel_size_x * (ray_dx.org - ray.org) / delta;
-        auto org_dy = pixel_size_y * (ray_dy.org - ray.org) / delta;
-        auto dir_dx = pixel_size_x * (ray_dx.dir - ray.dir) / delta;
-        auto dir_dy = pixel_size_y * (ray_dy.dir - ray.dir) / delta;
-        ray_differentials[idx] = RayDifferential{org_dx, org_dy, dir_dx, dir_dy};
+        ray_differentials[idx] = RayDifferential{
+            pixel_size_x * screen_differential.org_dx,
+            pixel_size_y * screen_differential.org_dy,
+            pixel_size_x * screen_differential.dir_dx,
+            pixel_size_y * screen_differential.dir_dy};
     }
 
     const Camera camera;
@@ -42,14 +41,71 @@ struct primary_ray_sampler {
     RayDifferential *ray_differentials;
 };
 
+template <CameraType camera_type>
 void sample_primary_rays(const Camera &camera,
                          const BufferView<CameraSample> &samples,
                          BufferView<Ray> rays,
                          BufferView<RayDifferential> ray_differentials,
                          bool use_gpu) {
-    parallel_for(primary_ray_sampler{
-        camera, samples.begin(), rays.begin(), ray_differentials.begin()},
-        samples.size(), use_gpu);
+    if (camera.has_distortion_params()) {
+        parallel_for(primary_ray_sampler<camera_type, true>{
+            camera, samples.begin(), rays.begin(), ray_differentials.begin()},
+            samples.size(), use_gpu);
+    } else {
+        parallel_for(primary_ray_sampler<camera_type, false>{
+            camera, samples.begin(), rays.begin(), ray_differentials.begin()},
+            samples.size(), use_gpu);
+    }
+}
+
+void sample_primary_rays(const Camera &camera,
+                         const BufferView<CameraSample> &samples,
+                         BufferView<Ray> rays,
+                         BufferView<RayDifferential> ray_differentials,
+                         bool use_gpu) {
+    // Resolve the camera model once, outside of the per-pixel kernel
+    switch (camera.camera_type) {
+        case CameraType::Perspective: {
+            sample_primary_rays<CameraType::Perspective>(
+                camera, samples, rays, ray_differentials, use_gpu);
+        } break;
+        case CameraType::Orthographic: {
+            sample_primary_rays<CameraType::Orthographic>(
+                camera, samples, rays, ray_differentials, use_gpu);
+        } break;
+        case CameraType::Fisheye: {
+            sample_primary_rays<CameraType::Fisheye>(
+                camera, samples, rays, ray_differentials, use_gpu);
+        } break;
+        case CameraType::Panorama: {
+            sample_primary_rays<CameraType::Panorama>(
+                camera, samples, rays, ray_differentials, use_gpu);
+        } break;
+        default: {
+            assert(false);
+        }
+    }
+}
+
+template <CameraType camera_type>
+void test_primary_ray_differential(const Camera &camera,
+                                   const Vector2 &screen_pos) {
+    auto screen_differential = RayDifferential{};
+    sample_primary<camera_type, true>(camera, screen_pos, &screen_differential);
+    // Compare with central difference
+    auto finite_delta = Real(1e-5);
+    auto pos_x = sample_primary(camera, screen_pos + Vector2{finite_delta, Real(0)});
+    auto neg_x = sample_primary(camera, screen_pos - Vector2{finite_delta, Real(0)});
+    auto pos_y = sample_primary(camera, screen_pos + Vector2{Real(0), finite_delta});
+    auto neg_y = sample_primary(camera, screen_pos - Vector2{Real(0), finite_delta});
+    equal_or_error<Real>(__FILE__, __LINE__,
+        (pos_x.org - neg_x.org) / (2 * finite_delta), screen_differential.org_dx);
+    equal_or_error<Real>(__FILE__, __LINE__,
+        (pos_y.org - neg_y.org) / (2 * finite_delta), screen_differential.org_dy);
+    equal_or_error<Real>(__FILE__, __LINE__,
+        (pos_x.dir - neg_x.dir) / (2 * finite_delta), screen_differential.dir_dx);
+    equal_or_error<Real>(__FILE__, __LINE__,
+        (pos_y.dir - neg_y.dir) / (2 * finite_delta), screen_differential.dir_dy);
 }
 
 void test_sample_primary_rays(bool use_gpu) {
@@ -90,7 +146,52 @@ void test_sample_primary_rays(bool use_gpu) {
 
     equal_or_error<Real>(__FILE__, __LINE__, rays[0].org, Vector3{0, 0, 0});
     equal_or_error<Real>(__FILE__, __LINE__, rays[0].dir, Vector3{0, 0, 1});
-    // TODO: test ray differentials
+    // At the center of a 1x1 pixel with identity intrinsics,
+    // the direction moves by half a pixel along x and y
+    equal_or_error<Real>(__FILE__, __LINE__,
+        ray_differentials[0].dir_dx, Vector3{-1, 0, 0});
+    equal_or_error<Real>(__FILE__, __LINE__,
+        ray_differentials[0].dir_dy, Vector3{0, -1, 0});
+
+    // Analytic ray differentials of every camera model,
+    // with and without distortion
+    float distortion_params[8] = {0.1f, -0.05f, 0.02f, 0.01f, 0.f, 0.f, 0.01f, -0.02f};
+    for (int distorted = 0; distorted < 2; distorted++) {
+        for (int type = 0; type < 4; type++) {
+            auto test_camera = Camera{4, 3,
+                &pos[0],
+                &look[0],
+                &up[0],
+                nullptr, // cam_to_world
+                nullptr, // world_to_cam
+                &n2c.data[0][0],
+                &c2n.data[0][0],
+                distorted ? &distortion_params[0] : nullptr,
+                1e-2f,
+                CameraType(type),
+                Vector2i{0, 0},
+                Vector2i{4, 3}};
+            auto screen_pos = Vector2{0.3, 0.6};
+            switch (test_camera.camera_type) {
+                case CameraType::Perspective:
+                    test_primary_ray_differential<CameraType::Perspective>(
+                        test_camera, screen_pos);
+                    break;
+                case CameraType::Orthographic:
+                    test_primary_ray_differential<CameraType::Orthographic>(
+                        test_camera, screen_pos);
+                    break;
+                case CameraType::Fisheye:
+                    test_primary_ray_differential<CameraType::Fisheye>(
+                        test_camera, screen_pos);
+                    break;
+                case CameraType::Panorama:
+                    test_primary_ray_differential<CameraType::Panorama>(
+                        test_camera, screen_pos);
+                    break;
+            }
+        }
+    }
 
     parallel_cleanup();
 }
@@ -32,7 +32,8 @@ struct Camera {
            float clip_near,
            CameraType camera_type,
            Vector2i viewport_beg,
-           Vector2i viewport_end)
+           Vector2i viewport_end,
+           int distortion_lut_resolution = 0)
         : width(width),
           height(height),
           intrinsic_mat_inv(intrinsic_mat_inv.get()),
@@ -40,7 +41,8 @@ struct Camera {
           clip_near(clip_near),
           camera_type(camera_type),
           viewport_beg(viewport_beg),
-          viewport_end(viewport_end) {
+          viewport_end(viewport_end),
+          distortion_lut_resolution(distortion_lut_resolution) {
         if (cam_to_world_.get() != nullptr) {
             cam_to_world = Matrix4x4(cam_to_world_.get());
             world_to_cam = Matrix4x4(world_to_cam_.get());
@@ -80,6 +82,9 @@ struct Camera {
     float clip_near;
     CameraType camera_type;
     Vector2i viewport_beg, viewport_end;
+    // If > 0 and the camera has distortion, Scene bakes the distortion
+    // into lookup tables with this resolution (see build_distortion_lut)
+    int distortion_lut_resolution;
 };
 
 struct DCamera {
@@ -118,13 +123,67 @@ struct TCameraSample {
 
 using CameraSample = TCameraSample<Real>;
 
+// Forward-mode derivative of normalize(v) along the direction dv
+template <typename T>
+DEVICE
+inline TVector3<T> normalize_differential(const TVector3<T> &v,
+                                          const TVector3<T> &dv) {
+    auto l = length(v);
+    if (l <= 0) {
+        return TVector3<T>{0, 0, 0};
+    }
+    auto n = v / l;
+    return (dv - n * dot(n, dv)) / l;
+}
+
+// Forward-mode derivative of xfm_point(xform, pt) along the direction dpt
+template <typename T>
+DEVICE
+inline TVector3<T> xfm_point_differential(const TMatrix4x4<T> &xform,
+                                          const TVector3<T> &pt,
+                                          const TVector3<T> &dpt) {
+    auto tpt = TVector4<T>{
+        xform(0, 0) * pt[0] + xform(0, 1) * pt[1] + xform(0, 2) * pt[2] + xform(0, 3),
+        xform(1, 0) * pt[0] + xform(1, 1) * pt[1] + xform(1, 2) * pt[2] + xform(1, 3),
+        xform(2, 0) * pt[0] + xform(2, 1) * pt[1] + xform(2, 2) * pt[2] + xform(2, 3),
+        xform(3, 0) * pt[0] + xform(3, 1) * pt[1] + xform(3, 2) * pt[2] + xform(3, 3)};
+    auto dw = xform(3, 0) * dpt[0] + xform(3, 1) * dpt[1] + xform(3, 2) * dpt[2];
+    auto inv_w = 1.f / tpt[3];
+    // out = tpt.xyz / w -> dout = (dtpt.xyz - out * dw) / w
+    auto out = TVector3<T>{tpt[0], tpt[1], tpt[2]} * inv_w;
+    return (xfm_vector(xform, dpt) - out * dw) * inv_w;
+}
+
+/**
+ * Generate a primary ray for a specific camera model. The camera type and
+ * whether the camera has distortion parameters are compile-time constants,
+ * so the per-pixel kernels do not branch on them.
+ * If screen_differential is not null, we also output the analytic derivatives
+ * of the ray origin and direction with respect to the screen position
+ * (org_dx = d org / d screen_pos.x, etc).
+ */
+template <CameraType camera_type, bool has_distortion>
 DEVICE
 inline
 Ray sample_primary(const Camera &camera,
-                   const Vector2 &screen_pos) {
-    auto distorted_screen_pos =
-        inverse_distort(camera.distortion_params, screen_pos);
-    switch(camera.camera_type) {
+                   const Vector2 &screen_pos,
+                   RayDifferential *screen_differential) {
+    auto distorted_screen_pos = screen_pos;
+    // Jacobian of the undistortion: du_dpos[i] = d distorted_screen_pos[i] / d screen_pos
+    Vector2 du_dpos[2] = {Vector2{1, 0}, Vector2{0, 1}};
+    if (has_distortion) {
+        if (screen_differential != nullptr) {
+            distorted_screen_pos = inverse_distort(
+                camera.distortion_params, screen_pos, &du_dpos[0], &du_dpos[1]);
+        } else {
+            distorted_screen_pos = inverse_distort(camera.distortion_params, screen_pos);
+        }
+    }
+    // Derivatives with respect to distorted_screen_pos
+    Vector3 org_du[2] = {Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+    Vector3 dir_du[2] = {Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+    auto ray = Ray{};
+    switch(camera_type) {
         case CameraType::Perspective: {
             // Linear projection
             auto org = xfm_point(camera.cam_to_world, Vector3{0, 0, 0});
@@ -137,8 +196,18 @@ Ray sample_primary(const Camera &camera,
             auto n_dir = normalize(dir);
             auto world_dir = xfm_vector(camera.cam_to_world, n_dir);
             auto n_world_dir = normalize(world_dir);
-            return Ray{org, n_world_dir};
-        }
+            ray = Ray{org, n_world_dir};
+            if (screen_differential != nullptr) {
+                Vector3 dpt_du[2] = {Vector3{Real(2), Real(0), Real(0)},
+                                     Vector3{Real(0), Real(-2) / aspect_ratio, Real(0)}};
+                for (int i = 0; i < 2; i++) {
+                    auto d_dir = camera.intrinsic_mat_inv * dpt_du[i];
+                    auto d_n_dir = normalize_differential(dir, d_dir);
+                    auto d_world_dir = xfm_vector(camera.cam_to_world, d_n_dir);
+                    dir_du[i] = normalize_differential(world_dir, d_world_dir);
+                }
+            }
+        } break;
         case CameraType::Orthographic: {
             // Linear projection
             // [0, 1] x [0, 1] -> [-1, 1/aspect_ratio] x [1, -1/aspect_ratio]
@@ -146,11 +215,20 @@ Ray sample_primary(const Camera &camera,
             auto pt = Vector3{(distorted_screen_pos[0] - 0.5f) * 2.f,
                               (distorted_screen_pos[1] - 0.5f) * (-2.f) / aspect_ratio,
                               Real(0)};
-            auto org = xfm_point(camera.cam_to_world, camera.intrinsic_mat_inv * pt);
+            auto local_org = camera.intrinsic_mat_inv * pt;
+            auto org = xfm_point(camera.cam_to_world, local_org);
             auto dir = xfm_vector(camera.cam_to_world, Vector3{0, 0, 1});
             auto n_dir = normalize(dir);
-            return Ray{org, n_dir};
-        }
+            ray = Ray{org, n_dir};
+            if (screen_differential != nullptr) {
+                Vector3 dpt_du[2] = {Vector3{Real(2), Real(0), Real(0)},
+                                     Vector3{Real(0), Real(-2) / aspect_ratio, Real(0)}};
+                for (int i = 0; i < 2; i++) {
+                    org_du[i] = xfm_point_differential(camera.cam_to_world,
+                        local_org, camera.intrinsic_mat_inv * dpt_du[i]);
+                }
+            }
+        } break;
         case CameraType::Fisheye: {
             // Equi-angular projection
             auto org = xfm_point(camera.cam_to_world, Vector3{0, 0, 0});
@@ -158,7 +236,8 @@ Ray sample_primary(const Camera &camera,
             auto x = 2.f * (distorted_screen_pos.x - 0.5f);
             auto y = 2.f * (distorted_screen_pos.y - 0.5f);
             if (x * x + y * y > 1.f) {
-                return Ray{Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+                ray = Ray{Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+                break;
             }
             auto r = sqrt(x*x + y*y);
             auto phi = atan2(y, x);
@@ -171,8 +250,33 @@ Ray sample_primary(const Camera &camera,
             auto dir = Vector3{-cos_phi * sin_theta, -sin_phi * sin_theta, cos_theta};
             auto world_dir = xfm_vector(camera.cam_to_world, dir);
             auto n_world_dir = normalize(world_dir);
-            return Ray{org, n_world_dir};
-        }
+            ray = Ray{org, n_world_dir};
+            if (screen_differential != nullptr) {
+                // dir = {-x * s, -y * s, cos(theta)}, s = sin(theta) / r
+                auto s = Real(M_PI / 2);
+                auto ds_dr = Real(0);
+                auto dcos_theta_dr_over_r = -Real(M_PI / 2) * Real(M_PI / 2);
+                if (r > Real(1e-6)) {
+                    s = sin_theta / r;
+                    ds_dr = (cos_theta * Real(M_PI / 2) * r - sin_theta) / (r * r);
+                    dcos_theta_dr_over_r = -sin_theta * Real(M_PI / 2) / r;
+                }
+                // dr/dx = x / r, dr/dy = y / r
+                auto ds_dx = r > Real(1e-6) ? ds_dr * x / r : Real(0);
+                auto ds_dy = r > Real(1e-6) ? ds_dr * y / r : Real(0);
+                auto ddir_dx = Vector3{-s - x * ds_dx,
+                                       -y * ds_dx,
+                                       dcos_theta_dr_over_r * x};
+                auto ddir_dy = Vector3{-x * ds_dy,
+                                       -s - y * ds_dy,
+                                       dcos_theta_dr_over_r * y};
+                // x = 2 * (u0 - 0.5), y = 2 * (u1 - 0.5)
+                dir_du[0] = normalize_differential(world_dir,
+                    xfm_vector(camera.cam_to_world, 2 * ddir_dx));
+                dir_du[1] = normalize_differential(world_dir,
+                    xfm_vector(camera.cam_to_world, 2 * ddir_dy));
+            }
+        } break;
         case CameraType::Panorama: {
             auto org = xfm_point(camera.cam_to_world, Vector3{0, 0, 0});
             // x, y to spherical coordinate
@@ -187,8 +291,50 @@ Ray sample_primary(const Camera &camera,
                                sin_phi * sin_theta};
             auto world_dir = xfm_vector(camera.cam_to_world, dir);
             auto n_world_dir = normalize(world_dir);
-            return Ray{org, n_world_dir};
+            ray = Ray{org, n_world_dir};
+            if (screen_differential != nullptr) {
+                // phi = 2pi * u0, theta = pi * u1
+                auto ddir_du0 = Real(2 * M_PI) *
+                    Vector3{-sin_phi * sin_theta, Real(0), cos_phi * sin_theta};
+                auto ddir_du1 = Real(M_PI) *
+                    Vector3{cos_phi * cos_theta, -sin_theta, sin_phi * cos_theta};
+                dir_du[0] = normalize_differential(world_dir,
+                    xfm_vector(camera.cam_to_world, ddir_du0));
+                dir_du[1] = normalize_differential(world_dir,
+                    xfm_vector(camera.cam_to_world, ddir_du1));
+            }
+        } break;
+        default: {
+            assert(false);
         }
+    }
+    if (screen_differential != nullptr) {
+        // Chain rule through the undistortion
+        screen_differential->org_dx = org_du[0] * du_dpos[0].x + org_du[1] * du_dpos[1].x;
+        screen_differential->org_dy = org_du[0] * du_dpos[0].y + org_du[1] * du_dpos[1].y;
+        screen_differential->dir_dx = dir_du[0] * du_dpos[0].x + dir_du[1] * du_dpos[1].x;
+        screen_differential->dir_dy = dir_du[0] * du_dpos[0].y + dir_du[1] * du_dpos[1].y;
+    }
+    return ray;
+}
+
+DEVICE
+inline
+Ray sample_primary(const Camera &camera,
+                   const Vector2 &screen_pos) {
+    switch(camera.camera_type) {
+        case CameraType::Perspective:
+            return sample_primary<CameraType::Perspective, true>(
+                camera, screen_pos, nullptr);
+        case CameraType::Orthographic:
+            return sample_primary<CameraType::Orthographic, true>(
+                camera, screen_pos, nullptr);
+        case CameraType::Fisheye:
+            return sample_primary<CameraType::Fisheye, true>(
+                camera, screen_pos, nullptr);
+        case CameraType::Panorama:
+            return sample_primary<CameraType::Panorama, true>(
+                camera, screen_pos, nullptr);
         default: {
             assert(false);
             return Ray{};
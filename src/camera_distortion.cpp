@@ -1,6 +1,58 @@
 #include "camera_distortion.h"
+#include "parallel.h"
 #include "test_utils.h"
 
+struct distortion_lut_builder {
+    DEVICE void operator()(int idx) {
+        auto xi = idx % param.lut_resolution;
+        auto yi = idx / param.lut_resolution;
+        auto step = (param.lut_max - param.lut_min) / (param.lut_resolution - 1);
+        auto pos = Vector2{param.lut_min + xi * step, param.lut_min + yi * step};
+
+        auto &f = forward_lut[idx];
+        f.value = distort_exact(param, pos, &f.dx_dpos, &f.dy_dpos);
+        f.valid = isfinite(f.value) && isfinite(f.dx_dpos) && isfinite(f.dy_dpos);
+
+        // The polynomial is not invertible everywhere: only keep the nodes
+        // where Gauss-Newton converged to a solution that doesn't fold over
+        auto &i = inverse_lut[idx];
+        i.value = inverse_distort_exact(param, pos, &i.dx_dpos, &i.dy_dpos);
+        auto residual = distort_exact(param, i.value) - pos;
+        auto det = i.dx_dpos.x * i.dy_dpos.y - i.dx_dpos.y * i.dy_dpos.x;
+        i.valid = isfinite(i.value) && isfinite(i.dx_dpos) && isfinite(i.dy_dpos) &&
+            fabs(residual[0]) + fabs(residual[1]) <= Real(1e-3) && det > 0;
+    }
+
+    const DistortionParameters param;
+    DistortionLUTEntry *forward_lut;
+    DistortionLUTEntry *inverse_lut;
+};
+
+void build_distortion_lut(DistortionParameters &param,
+                          int resolution,
+                          BufferView<DistortionLUTEntry> lut,
+                          bool use_gpu) {
+    assert(resolution >= 2);
+    assert(lut.size() >= 2 * resolution * resolution);
+    // Evaluate the exact mappings at the nodes
+    auto exact_param = param;
+    exact_param.lut_resolution = resolution;
+    exact_param.lut_min = Real(-0.5);
+    exact_param.lut_max = Real(1.5);
+    exact_param.forward_lut = nullptr;
+    exact_param.inverse_lut = nullptr;
+    auto forward_lut = lut.begin();
+    auto inverse_lut = lut.begin() + resolution * resolution;
+    parallel_for(distortion_lut_builder{exact_param, forward_lut, inverse_lut},
+        resolution * resolution, use_gpu);
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    param = exact_param;
+    param.forward_lut = forward_lut;
+    param.inverse_lut = inverse_lut;
+}
+
 void test_inverse_distort() {
     // Check if inverse_distort(distort(x)) = x
     DistortionParameters param;
@@ -127,8 +179,52 @@ void test_d_inverse_distort() {
     }
 }
 
+void test_distortion_lut() {
+    // A mild, invertible lens (the tables only store one branch of the inverse)
+    DistortionParameters param;
+    param.defined = true;
+    param.k[0] = 0.1f;
+    param.k[1] = -0.05f;
+    param.k[2] = 0.01f;
+    param.k[3] = 0.02f;
+    param.k[4] = 0.f;
+    param.k[5] = 0.f;
+    param.p[0] = 0.001f;
+    param.p[1] = -0.002f;
+    auto resolution = 257;
+    Buffer<DistortionLUTEntry> lut(false, 2 * resolution * resolution);
+    auto lut_param = param;
+    build_distortion_lut(lut_param, resolution, lut.view(0, lut.size()), false);
+
+    // Compare the interpolated tables against the exact polynomial
+    for (int i = 0; i < 4; i++) {
+        auto pos = Vector2{Real(0.1) + Real(0.27) * i, Real(0.83) - Real(0.21) * i};
+        auto dx_exact = Vector2{0, 0};
+        auto dy_exact = Vector2{0, 0};
+        auto dx_lut = Vector2{0, 0};
+        auto dy_lut = Vector2{0, 0};
+        auto distorted_exact = distort_exact(param, pos, &dx_exact, &dy_exact);
+        auto distorted_lut = distort(lut_param, pos, &dx_lut, &dy_lut);
+        equal_or_error(__FILE__, __LINE__, distorted_exact, distorted_lut);
+        equal_or_error(__FILE__, __LINE__, dx_exact, dx_lut);
+        equal_or_error(__FILE__, __LINE__, dy_exact, dy_lut);
+
+        auto undistorted_exact = inverse_distort_exact(param, pos, &dx_exact, &dy_exact);
+        auto undistorted_lut = inverse_distort(lut_param, pos, &dx_lut, &dy_lut);
+        equal_or_error(__FILE__, __LINE__, undistorted_exact, undistorted_lut);
+        equal_or_error(__FILE__, __LINE__, dx_exact, dx_lut);
+        equal_or_error(__FILE__, __LINE__, dy_exact, dy_lut);
+    }
+
+    // Outside of the tables we fall back to the polynomial
+    auto far_pos = Vector2{2.0, -1.0};
+    equal_or_error(__FILE__, __LINE__,
+        distort_exact(param, far_pos), distort(lut_param, far_pos));
+}
+
 void test_camera_distortion() {
     test_inverse_distort();
     test_d_distort();
     test_d_inverse_distort();
+    test_distortion_lut();
 }
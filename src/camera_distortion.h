@@ -3,22 +3,92 @@
 #include "redner.h"
 #include "atomic.h"
 #include "vector.h"
+#include "buffer.h"
+
+/// A node of a baked distortion table: the mapping and its Jacobian.
+struct DistortionLUTEntry {
+    Vector2 value;
+    // Rows of the Jacobian: d value.x / d pos, d value.y / d pos
+    Vector2 dx_dpos, dy_dpos;
+    bool valid;
+};
 
 struct DistortionParameters {
     bool defined;
     Real k[6]; // Radial distortion
     Real p[2]; // Tangential distortion
+
+    // Optional tables baked by build_distortion_lut, with lut_resolution^2 nodes
+    // covering [lut_min, lut_max]^2 in screen space. When present, distort and
+    // inverse_distort interpolate them instead of evaluating the polynomial.
+    int lut_resolution = 0;
+    Real lut_min = 0, lut_max = 0;
+    const DistortionLUTEntry *forward_lut = nullptr;
+    const DistortionLUTEntry *inverse_lut = nullptr;
 };
 
 struct DDistortionParameters {
     float *params;
 };
 
+/// Bilinearly interpolate a baked distortion table at pos.
+/// Returns false if pos is outside of the table or next to a node
+/// where the mapping is undefined, in which case output is untouched.
 inline
 DEVICE
-Vector2 distort(const DistortionParameters &param, const Vector2 &pos,
-                Vector2 *dx_dpos = nullptr, Vector2 *dy_dpos = nullptr) {
+bool lookup_distortion_lut(const DistortionParameters &param,
+                           const DistortionLUTEntry *lut,
+                           const Vector2 &pos,
+                           Vector2 &output,
+                           Vector2 *dx_dpos = nullptr,
+                           Vector2 *dy_dpos = nullptr) {
+    if (lut == nullptr) {
+        return false;
+    }
+    auto res = param.lut_resolution;
+    auto scale = (res - 1) / (param.lut_max - param.lut_min);
+    auto u = (pos.x - param.lut_min) * scale;
+    auto v = (pos.y - param.lut_min) * scale;
+    // Written in the negated form so that NaNs are rejected as well
+    if (!(u >= 0 && v >= 0 && u < res - 1 && v < res - 1)) {
+        return false;
+    }
+    auto xi = int(u);
+    auto yi = int(v);
+    const auto &e00 = lut[yi * res + xi];
+    const auto &e10 = lut[yi * res + xi + 1];
+    const auto &e01 = lut[(yi + 1) * res + xi];
+    const auto &e11 = lut[(yi + 1) * res + xi + 1];
+    if (!e00.valid || !e10.valid || !e01.valid || !e11.valid) {
+        return false;
+    }
+    auto fu = u - xi;
+    auto fv = v - yi;
+    auto w00 = (1 - fu) * (1 - fv);
+    auto w10 = fu * (1 - fv);
+    auto w01 = (1 - fu) * fv;
+    auto w11 = fu * fv;
+    output = w00 * e00.value + w10 * e10.value + w01 * e01.value + w11 * e11.value;
+    if (dx_dpos != nullptr && dy_dpos != nullptr) {
+        // Interpolate the Jacobians evaluated at the nodes
+        *dx_dpos = w00 * e00.dx_dpos + w10 * e10.dx_dpos +
+                   w01 * e01.dx_dpos + w11 * e11.dx_dpos;
+        *dy_dpos = w00 * e00.dy_dpos + w10 * e10.dy_dpos +
+                   w01 * e01.dy_dpos + w11 * e11.dy_dpos;
+    }
+    return true;
+}
+
+/// Evaluate the distortion polynomial, ignoring the baked tables.
+inline
+DEVICE
+Vector2 distort_exact(const DistortionParameters &param, const Vector2 &pos,
+                      Vector2 *dx_dpos = nullptr, Vector2 *dy_dpos = nullptr) {
     if (!param.defined) {
+        if (dx_dpos != nullptr && dy_dpos != nullptr) {
+            *dx_dpos = Vector2{1, 0};
+            *dy_dpos = Vector2{0, 1};
+        }
         return pos;
     }
     // Brown–Conrady model
@@ -48,10 +118,9 @@ Vector2 distort(const DistortionParameters &param, const Vector2 &pos,
         auto dx = 2 * dpos_x;
         // y = 2.f * (pos.y - 0.5f)
         auto dy = 2 * dpos_y;
-        // r = sqrt(x*x + y*y)
-        auto dr = (dx * x + dy * y) / r;
-        // r2 = r * r
-        auto dr2 = 2 * r * dr;
+        // r2 = x*x + y*y
+        // (differentiate r2 directly, r can be zero at the center)
+        auto dr2 = 2 * (dx * x + dy * y);
         // r4 = r2 * r2;
         auto dr4 = 2 * r2 * dr2;
         // r6 = r4 * r2;
@@ -81,6 +150,20 @@ Vector2 distort(const DistortionParameters &param, const Vector2 &pos,
     return Vector2{xx_, yy_};
 }
 
+inline
+DEVICE
+Vector2 distort(const DistortionParameters &param, const Vector2 &pos,
+                Vector2 *dx_dpos = nullptr, Vector2 *dy_dpos = nullptr) {
+    if (!param.defined) {
+        return pos;
+    }
+    auto result = Vector2{0, 0};
+    if (lookup_distortion_lut(param, param.forward_lut, pos, result, dx_dpos, dy_dpos)) {
+        return result;
+    }
+    return distort_exact(param, pos, dx_dpos, dy_dpos);
+}
+
 inline
 DEVICE
 void d_distort(const DistortionParameters &param, const Vector2 &pos,
@@ -168,10 +251,16 @@ void d_distort(const DistortionParameters &param, const Vector2 &pos,
     }
 }
 
+/// Invert the distortion polynomial with Gauss-Newton, ignoring the baked tables.
 inline
 DEVICE
-Vector2 inverse_distort(const DistortionParameters &param, const Vector2 &pos) {
+Vector2 inverse_distort_exact(const DistortionParameters &param, const Vector2 &pos,
+                              Vector2 *dx_dpos = nullptr, Vector2 *dy_dpos = nullptr) {
     if (!param.defined) {
+        if (dx_dpos != nullptr && dy_dpos != nullptr) {
+            *dx_dpos = Vector2{1, 0};
+            *dy_dpos = Vector2{0, 1};
+        }
         return pos;
     }
     auto result = pos;
@@ -181,7 +270,7 @@ Vector2 inverse_distort(const DistortionParameters &param, const Vector2 &pos) {
     do {
         auto drxdp = Vector2{0, 0};
         auto drydp = Vector2{0, 0};
-        auto next = distort(param, result, &drxdp, &drydp);
+        auto next = distort_exact(param, result, &drxdp, &drydp);
         auto residual = next - pos;
         err = fabs(residual[0]) + fabs(residual[1]);
         // J = {drx/dpx, drx/dpy,
@@ -194,9 +283,39 @@ Vector2 inverse_distort(const DistortionParameters &param, const Vector2 &pos) {
         auto invJ1 = inv_det * Vector2{-drydp.x, drxdp.x};
         result = result - Vector2{dot(invJ0, residual), dot(invJ1, residual)};
     } while (err > Real(1e-3) && iter++ < 1000);
+
+    if (dx_dpos != nullptr && dy_dpos != nullptr) {
+        // Forward mode: the Jacobian of the inverse map is
+        // the inverse of the Jacobian of distort at the solution
+        auto drxdp = Vector2{0, 0};
+        auto drydp = Vector2{0, 0};
+        distort_exact(param, result, &drxdp, &drydp);
+        auto det = drxdp.x * drydp.y - drxdp.y * drydp.x;
+        auto inv_det = 1 / det;
+        *dx_dpos = inv_det * Vector2{drydp.y, -drxdp.y};
+        *dy_dpos = inv_det * Vector2{-drydp.x, drxdp.x};
+    }
     return result;
 }
 
+inline
+DEVICE
+Vector2 inverse_distort(const DistortionParameters &param, const Vector2 &pos,
+                        Vector2 *dx_dpos = nullptr, Vector2 *dy_dpos = nullptr) {
+    if (!param.defined) {
+        if (dx_dpos != nullptr && dy_dpos != nullptr) {
+            *dx_dpos = Vector2{1, 0};
+            *dy_dpos = Vector2{0, 1};
+        }
+        return pos;
+    }
+    auto result = Vector2{0, 0};
+    if (lookup_distortion_lut(param, param.inverse_lut, pos, result, dx_dpos, dy_dpos)) {
+        return result;
+    }
+    return inverse_distort_exact(param, pos, dx_dpos, dy_dpos);
+}
+
 inline
 DEVICE
 void d_inverse_distort(const DistortionParameters &param, const Vector2 &pos,
@@ -207,13 +326,16 @@ void d_inverse_distort(const DistortionParameters &param, const Vector2 &pos,
         return;
     }
     auto result = pos;
+    // Start from the baked inverse if we have one, Gauss-Newton then
+    // usually converges in a single step
+    lookup_distortion_lut(param, param.inverse_lut, pos, result);
     // Gauss-Newton iteration
     auto iter = 0;
     auto err = Real(0);
     do {
         auto drxdp = Vector2{0, 0};
         auto drydp = Vector2{0, 0};
-        auto next = distort(param, result, &drxdp, &drydp);
+        auto next = distort_exact(param, result, &drxdp, &drydp);
         auto residual = next - pos;
         err = fabs(residual[0]) + fabs(residual[1]);
         // J = {drx/dpx, drx/dpy,
@@ -237,7 +359,7 @@ void d_inverse_distort(const DistortionParameters &param, const Vector2 &pos,
     //  the adjoint with J^{-1}^T)
     auto dfxdp = Vector2{0, 0};
     auto dfydp = Vector2{0, 0};
-    distort(param, result, &dfxdp, &dfydp);
+    distort_exact(param, result, &dfxdp, &dfydp);
     // J = {dfx/dpx, dfx/dpy,
     //      dfy/dpx, dfy/dpy}
     // invJ = 1/det * {dfy/dpy, -dfx/dpy,
@@ -258,4 +380,11 @@ void d_inverse_distort(const DistortionParameters &param, const Vector2 &pos,
     d_pos -= d_result;
 }
 
+/// Bake distort & inverse_distort over [-0.5, 1.5]^2 into lut, which needs
+/// 2 * resolution^2 entries, and make param interpolate the tables.
+void build_distortion_lut(DistortionParameters &param,
+                          int resolution,
+                          BufferView<DistortionLUTEntry> lut,
+                          bool use_gpu);
+
 void test_camera_distortion();
@@ -1,5 +1,6 @@
 #include "channels.h"
 #include "cuda_utils.h"
+#include "test_utils.h"
 #include <iostream>
 #include <stdexcept>
 
@@ -9,6 +10,7 @@ ChannelInfo::ChannelInfo(const std::vector<Channels> &channels,
     num_channels = (int)channels.size();
     radiance_dimension = -1;
     num_total_dimensions = compute_num_channels(channels, max_generic_texture_dimension);
+    channel_set = find_channel_set(channels);
     this->max_generic_texture_dimension = max_generic_texture_dimension;
     if (use_gpu) {
 #ifdef __CUDACC__
@@ -111,3 +113,61 @@ int compute_num_channels(const std::vector<Channels> &channels,
     }
     return num_total_dimensions;
 }
+
+ChannelSet find_channel_set(const std::vector<Channels> &channels) {
+    if (channels == std::vector<Channels>{Channels::radiance}) {
+        return ChannelSet::radiance;
+    }
+    auto gbuffer = std::vector<Channels>{Channels::position,
+                                         Channels::shading_normal,
+                                         Channels::diffuse_reflectance};
+    if (channels == gbuffer) {
+        return ChannelSet::gbuffer;
+    }
+    gbuffer.push_back(Channels::alpha);
+    if (channels == gbuffer) {
+        return ChannelSet::gbuffer_alpha;
+    }
+    return ChannelSet::generic;
+}
+
+struct channel_recorder {
+    int operator()(Channels channel, int d) {
+        visited.push_back(channel);
+        offsets.push_back(d);
+        return d + compute_num_channels({channel}, 0);
+    }
+
+    std::vector<Channels> visited;
+    std::vector<int> offsets;
+};
+
+void test_channel_sets() {
+    auto gbuffer = std::vector<Channels>{Channels::position,
+                                         Channels::shading_normal,
+                                         Channels::diffuse_reflectance,
+                                         Channels::alpha};
+    equal_or_error(__FILE__, __LINE__,
+        int(ChannelSet::gbuffer_alpha), int(find_channel_set(gbuffer)));
+    equal_or_error(__FILE__, __LINE__,
+        int(ChannelSet::radiance), int(find_channel_set({Channels::radiance})));
+    equal_or_error(__FILE__, __LINE__,
+        int(ChannelSet::generic), int(find_channel_set({Channels::alpha, Channels::radiance})));
+
+    // The specialized channel list visits the same channels as the generic loop
+    ChannelInfo channel_info(gbuffer, false, 0);
+    channel_recorder specialized;
+    for_each_channel(channel_info, specialized);
+    channel_info.channel_set = ChannelSet::generic;
+    channel_recorder generic;
+    for_each_channel(channel_info, generic);
+    channel_info.free();
+    equal_or_error(__FILE__, __LINE__, (int)gbuffer.size(), (int)specialized.visited.size());
+    equal_or_error(__FILE__, __LINE__, (int)gbuffer.size(), (int)generic.visited.size());
+    for (int i = 0; i < (int)gbuffer.size(); i++) {
+        equal_or_error(__FILE__, __LINE__, int(gbuffer[i]), int(specialized.visited[i]));
+        equal_or_error(__FILE__, __LINE__, int(gbuffer[i]), int(generic.visited[i]));
+        equal_or_error(__FILE__, __LINE__, 3 * i, specialized.offsets[i]);
+        equal_or_error(__FILE__, __LINE__, 3 * i, generic.offsets[i]);
+    }
+}
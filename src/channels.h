@@ -22,6 +22,14 @@ enum class Channels {
     material_id
 };
 
+/// Channel lists with specialized accumulation kernels, see for_each_channel
+enum class ChannelSet {
+    generic,
+    radiance, // radiance
+    gbuffer, // position, shading_normal, diffuse_reflectance
+    gbuffer_alpha // position, shading_normal, diffuse_reflectance, alpha
+};
+
 struct ChannelInfo {
     ChannelInfo(const std::vector<Channels> &channels,
                 bool use_gpu,
@@ -33,8 +41,56 @@ struct ChannelInfo {
     int num_total_dimensions;
     int radiance_dimension;
     int max_generic_texture_dimension;
+    ChannelSet channel_set;
     bool use_gpu;
 };
 
 int compute_num_channels(const std::vector<Channels> &channels,
                          int max_generic_texture_dimension);
+ChannelSet find_channel_set(const std::vector<Channels> &channels);
+
+template <Channels... channels>
+struct ChannelList {};
+
+template <typename F>
+DEVICE
+inline void for_each_channel(ChannelList<>, F &, int) {}
+
+template <typename F, Channels channel, Channels... rest>
+DEVICE
+inline void for_each_channel(ChannelList<channel, rest...>, F &f, int d) {
+    for_each_channel(ChannelList<rest...>{}, f, f(channel, d));
+}
+
+/// Call d_next = f(channel, d) for each channel in order, where d is the first
+/// dimension of the channel and d_next the one of the next channel.
+/// For the specialized channel sets the channels are compile time constants,
+/// so the switch over them in f folds away once inlined.
+template <typename F>
+DEVICE
+inline void for_each_channel(const ChannelInfo &channel_info, F &f) {
+    switch (channel_info.channel_set) {
+        case ChannelSet::radiance: {
+            for_each_channel(ChannelList<Channels::radiance>{}, f, 0);
+        } break;
+        case ChannelSet::gbuffer: {
+            for_each_channel(ChannelList<Channels::position,
+                                         Channels::shading_normal,
+                                         Channels::diffuse_reflectance>{}, f, 0);
+        } break;
+        case ChannelSet::gbuffer_alpha: {
+            for_each_channel(ChannelList<Channels::position,
+                                         Channels::shading_normal,
+                                         Channels::diffuse_reflectance,
+                                         Channels::alpha>{}, f, 0);
+        } break;
+        default: {
+            auto d = 0;
+            for (int c = 0; c < channel_info.num_channels; c++) {
+                d = f(channel_info.channels[c], d);
+            }
+        }
+    }
+}
+
+void test_channel_sets();
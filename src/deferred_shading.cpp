@@ -0,0 +1,603 @@
+#include "deferred_shading.h"
+#include "buffer.h"
+#include "parallel.h"
+#include "atomic.h"
+#include "cuda_utils.h"
+#include "test_utils.h"
+
+#include <vector>
+
+DEVICE
+inline Vector3 load_vector3(const float *data) {
+    return Vector3{data[0], data[1], data[2]};
+}
+
+DEVICE
+inline Vector3 point_light_radiance(const Vector3 &light_pos,
+                                    const Vector3 &intensity,
+                                    const Vector3 &position,
+                                    const Vector3 &normal,
+                                    const Vector3 &albedo) {
+    auto v = light_pos - position;
+    auto dist_sq = length_squared(v);
+    auto cos_n = dot(normalize(v), normal);
+    if (cos_n <= 0) {
+        return Vector3{0, 0, 0};
+    }
+    return intensity * cos_n * albedo / (Real(M_PI) * dist_sq);
+}
+
+DEVICE
+inline void d_point_light_radiance(const Vector3 &light_pos,
+                                   const Vector3 &intensity,
+                                   const Vector3 &position,
+                                   const Vector3 &normal,
+                                   const Vector3 &albedo,
+                                   const Vector3 &d_output,
+                                   Vector3 &d_light_pos,
+                                   Vector3 &d_intensity,
+                                   Vector3 &d_position,
+                                   Vector3 &d_normal,
+                                   Vector3 &d_albedo) {
+    auto v = light_pos - position;
+    auto dist_sq = length_squared(v);
+    auto l = normalize(v);
+    auto cos_n = dot(l, normal);
+    if (cos_n <= 0) {
+        return;
+    }
+    // output = intensity * cos_n * albedo / (pi * dist_sq)
+    auto inv_denom = 1 / (Real(M_PI) * dist_sq);
+    d_intensity += d_output * cos_n * albedo * inv_denom;
+    d_albedo += d_output * intensity * cos_n * inv_denom;
+    auto d_scalar = sum(d_output * intensity * albedo);
+    auto d_cos_n = d_scalar * inv_denom;
+    auto d_dist_sq = -d_scalar * cos_n * inv_denom / dist_sq;
+    // cos_n = dot(l, normal)
+    d_normal += d_cos_n * l;
+    // l = normalize(v), dist_sq = length_squared(v)
+    auto d_v = d_normalize(v, d_cos_n * normal) + d_length_squared(v, d_dist_sq);
+    // v = light_pos - position
+    d_light_pos += d_v;
+    d_position -= d_v;
+}
+
+DEVICE
+inline Vector3 directional_light_radiance(const Vector3 &light_dir,
+                                          const Vector3 &intensity,
+                                          const Vector3 &normal,
+                                          const Vector3 &albedo) {
+    auto cos_n = dot(-normalize(light_dir), normal);
+    if (cos_n <= 0) {
+        return Vector3{0, 0, 0};
+    }
+    return intensity * cos_n * albedo / Real(M_PI);
+}
+
+DEVICE
+inline void d_directional_light_radiance(const Vector3 &light_dir,
+                                         const Vector3 &intensity,
+                                         const Vector3 &normal,
+                                         const Vector3 &albedo,
+                                         const Vector3 &d_output,
+                                         Vector3 &d_light_dir,
+                                         Vector3 &d_intensity,
+                                         Vector3 &d_normal,
+                                         Vector3 &d_albedo) {
+    auto l = -normalize(light_dir);
+    auto cos_n = dot(l, normal);
+    if (cos_n <= 0) {
+        return;
+    }
+    // output = intensity * cos_n * albedo / pi
+    d_intensity += d_output * cos_n * albedo / Real(M_PI);
+    d_albedo += d_output * intensity * cos_n / Real(M_PI);
+    auto d_cos_n = sum(d_output * intensity * albedo) / Real(M_PI);
+    // cos_n = dot(l, normal)
+    d_normal += d_cos_n * l;
+    // l = -normalize(light_dir)
+    d_light_dir -= d_normalize(light_dir, d_cos_n * normal);
+}
+
+DEVICE
+inline Vector3 spot_light_radiance(const Vector3 &light_pos,
+                                   const Vector3 &spot_dir,
+                                   Real spot_exponent,
+                                   const Vector3 &intensity,
+                                   const Vector3 &position,
+                                   const Vector3 &normal,
+                                   const Vector3 &albedo) {
+    auto l = normalize(light_pos - position);
+    auto spot_cos = max(dot(l, -normalize(spot_dir)), Real(0));
+    auto cos_n = max(dot(l, normal), Real(0));
+    return intensity * pow(spot_cos, spot_exponent) * cos_n * albedo / Real(M_PI);
+}
+
+DEVICE
+inline void d_spot_light_radiance(const Vector3 &light_pos,
+                                  const Vector3 &spot_dir,
+                                  Real spot_exponent,
+                                  const Vector3 &intensity,
+                                  const Vector3 &position,
+                                  const Vector3 &normal,
+                                  const Vector3 &albedo,
+                                  const Vector3 &d_output,
+                                  Vector3 &d_light_pos,
+                                  Vector3 &d_spot_dir,
+                                  Real &d_spot_exponent,
+                                  Vector3 &d_intensity,
+                                  Vector3 &d_position,
+                                  Vector3 &d_normal,
+                                  Vector3 &d_albedo) {
+    auto v = light_pos - position;
+    auto l = normalize(v);
+    auto s = -normalize(spot_dir);
+    auto spot_cos = max(dot(l, s), Real(0));
+    auto spot_factor = pow(spot_cos, spot_exponent);
+    auto cos_n = max(dot(l, normal), Real(0));
+    // output = intensity * spot_factor * cos_n * albedo / pi
+    d_intensity += d_output * spot_factor * cos_n * albedo / Real(M_PI);
+    d_albedo += d_output * intensity * spot_factor * cos_n / Real(M_PI);
+    auto d_scalar = sum(d_output * intensity * albedo) / Real(M_PI);
+    auto d_spot_factor = d_scalar * cos_n;
+    auto d_cos_n = d_scalar * spot_factor;
+    auto d_l = Vector3{0, 0, 0};
+    if (cos_n > 0) {
+        // cos_n = dot(l, normal)
+        d_l += d_cos_n * normal;
+        d_normal += d_cos_n * l;
+    }
+    if (spot_cos > 0) {
+        // spot_factor = pow(spot_cos, spot_exponent)
+        auto d_spot_cos = d_spot_factor * spot_exponent * pow(spot_cos, spot_exponent - 1);
+        d_spot_exponent += d_spot_factor * spot_factor * log(spot_cos);
+        // spot_cos = dot(l, s)
+        d_l += d_spot_cos * s;
+        // s = -normalize(spot_dir)
+        d_spot_dir -= d_normalize(spot_dir, d_spot_cos * l);
+    }
+    // l = normalize(v)
+    auto d_v = d_normalize(v, d_l);
+    // v = light_pos - position
+    d_light_pos += d_v;
+    d_position -= d_v;
+}
+
+/// Upper bound of dot(q - p, n) for p in [p_min, p_max] and n in [n_min, n_max]
+DEVICE
+inline Real max_dot(const Vector3 &q,
+                    const Vector3 &p_min, const Vector3 &p_max,
+                    const Vector3 &n_min, const Vector3 &n_max) {
+    auto ret = Real(0);
+    for (int i = 0; i < 3; i++) {
+        // The bound of each term is at a corner
+        ret += max(max((q[i] - p_min[i]) * n_min[i], (q[i] - p_min[i]) * n_max[i]),
+                   max((q[i] - p_max[i]) * n_min[i], (q[i] - p_max[i]) * n_max[i]));
+    }
+    return ret;
+}
+
+struct deferred_light_culler {
+    DEVICE void operator()(int tile_id) {
+        auto tile_x = tile_id % num_tiles_x;
+        auto tile_y = tile_id / num_tiles_x;
+        auto inf = infinity<Real>();
+        auto p_min = Vector3{inf, inf, inf};
+        auto p_max = -p_min;
+        auto n_min = p_min;
+        auto n_max = p_max;
+        auto x_end = min((tile_x + 1) * deferred_tile_size, width);
+        auto y_end = min((tile_y + 1) * deferred_tile_size, height);
+        for (int y = tile_y * deferred_tile_size; y < y_end; y++) {
+            for (int x = tile_x * deferred_tile_size; x < x_end; x++) {
+                const auto *pixel = g_buffer + num_channels * (y * width + x);
+                auto p = load_vector3(pixel);
+                auto n = load_vector3(pixel + 3);
+                p_min = min(p_min, p);
+                p_max = max(p_max, p);
+                n_min = min(n_min, n);
+                n_max = max(n_max, n);
+            }
+        }
+        auto *light_ids = tile_light_ids + tile_id * (lights.num_point_lights + lights.num_spot_lights);
+        auto count = 0;
+        for (int i = 0; i < lights.num_point_lights; i++) {
+            // Lights behind all surfaces of the tile contribute nothing
+            auto q = load_vector3(lights.point_positions + 3 * i);
+            if (max_dot(q, p_min, p_max, n_min, n_max) > 0) {
+                light_ids[count++] = i;
+            }
+        }
+        for (int i = 0; i < lights.num_spot_lights; i++) {
+            auto q = load_vector3(lights.spot_positions + 3 * i);
+            if (max_dot(q, p_min, p_max, n_min, n_max) <= 0) {
+                continue;
+            }
+            // Also skip the tiles behind the spot light, pow(0, 0) = 1 though
+            auto s = load_vector3(lights.spot_directions + 3 * i);
+            if (lights.spot_exponents[i] > 0 &&
+                    max_dot(q, p_min, p_max, -s, -s) <= 0) {
+                continue;
+            }
+            light_ids[count++] = lights.num_point_lights + i;
+        }
+        tile_num_lights[tile_id] = count;
+    }
+
+    const DeferredLights lights;
+    const float *g_buffer;
+    const int width;
+    const int height;
+    const int num_channels;
+    const int num_tiles_x;
+    int *tile_light_ids;
+    int *tile_num_lights;
+};
+
+struct deferred_shader {
+    DEVICE void operator()(int pixel_id) {
+        const auto *pixel = g_buffer + num_channels * pixel_id;
+        auto position = load_vector3(pixel);
+        auto normal = load_vector3(pixel + 3);
+        auto albedo = load_vector3(pixel + 6);
+        auto radiance = Vector3{0, 0, 0};
+        for (int i = 0; i < lights.num_ambient_lights; i++) {
+            radiance += load_vector3(lights.ambient_intensities + 3 * i) * albedo;
+        }
+        for (int i = 0; i < lights.num_directional_lights; i++) {
+            radiance += directional_light_radiance(
+                load_vector3(lights.directional_directions + 3 * i),
+                load_vector3(lights.directional_intensities + 3 * i),
+                normal, albedo);
+        }
+        auto x = pixel_id % width;
+        auto y = pixel_id / width;
+        auto tile_id = (y / deferred_tile_size) * num_tiles_x + x / deferred_tile_size;
+        const auto *light_ids =
+            tile_light_ids + tile_id * (lights.num_point_lights + lights.num_spot_lights);
+        for (int j = 0; j < tile_num_lights[tile_id]; j++) {
+            auto i = light_ids[j];
+            if (i < lights.num_point_lights) {
+                radiance += point_light_radiance(
+                    load_vector3(lights.point_positions + 3 * i),
+                    load_vector3(lights.point_intensities + 3 * i),
+                    position, normal, albedo);
+            } else {
+                i -= lights.num_point_lights;
+                radiance += spot_light_radiance(
+                    load_vector3(lights.spot_positions + 3 * i),
+                    load_vector3(lights.spot_directions + 3 * i),
+                    lights.spot_exponents[i],
+                    load_vector3(lights.spot_intensities + 3 * i),
+                    position, normal, albedo);
+            }
+        }
+        output[3 * pixel_id + 0] = float(radiance[0]);
+        output[3 * pixel_id + 1] = float(radiance[1]);
+        output[3 * pixel_id + 2] = float(radiance[2]);
+    }
+
+    const DeferredLights lights;
+    const float *g_buffer;
+    const int width;
+    const int num_channels;
+    const int num_tiles_x;
+    const int *tile_light_ids;
+    const int *tile_num_lights;
+    float *output;
+};
+
+struct d_deferred_shader {
+    DEVICE void operator()(int pixel_id) {
+        const auto *pixel = g_buffer + num_channels * pixel_id;
+        auto position = load_vector3(pixel);
+        auto normal = load_vector3(pixel + 3);
+        auto albedo = load_vector3(pixel + 6);
+        auto d_radiance = load_vector3(d_output + 3 * pixel_id);
+        auto d_position = Vector3{0, 0, 0};
+        auto d_normal = Vector3{0, 0, 0};
+        auto d_albedo = Vector3{0, 0, 0};
+        for (int i = 0; i < lights.num_ambient_lights; i++) {
+            // radiance += intensity * albedo
+            auto intensity = load_vector3(lights.ambient_intensities + 3 * i);
+            d_albedo += d_radiance * intensity;
+            atomic_add(d_lights.ambient_intensities + 3 * i, d_radiance * albedo);
+        }
+        for (int i = 0; i < lights.num_directional_lights; i++) {
+            auto d_dir = Vector3{0, 0, 0};
+            auto d_intensity = Vector3{0, 0, 0};
+            d_directional_light_radiance(
+                load_vector3(lights.directional_directions + 3 * i),
+                load_vector3(lights.directional_intensities + 3 * i),
+                normal, albedo, d_radiance,
+                d_dir, d_intensity, d_normal, d_albedo);
+            atomic_add(d_lights.directional_directions + 3 * i, d_dir);
+            atomic_add(d_lights.directional_intensities + 3 * i, d_intensity);
+        }
+        auto x = pixel_id % width;
+        auto y = pixel_id / width;
+        auto tile_id = (y / deferred_tile_size) * num_tiles_x + x / deferred_tile_size;
+        const auto *light_ids =
+            tile_light_ids + tile_id * (lights.num_point_lights + lights.num_spot_lights);
+        for (int j = 0; j < tile_num_lights[tile_id]; j++) {
+            auto i = light_ids[j];
+            auto d_light_pos = Vector3{0, 0, 0};
+            auto d_intensity = Vector3{0, 0, 0};
+            if (i < lights.num_point_lights) {
+                d_point_light_radiance(
+                    load_vector3(lights.point_positions + 3 * i),
+                    load_vector3(lights.point_intensities + 3 * i),
+                    position, normal, albedo, d_radiance,
+                    d_light_pos, d_intensity, d_position, d_normal, d_albedo);
+                atomic_add(d_lights.point_positions + 3 * i, d_light_pos);
+                atomic_add(d_lights.point_intensities + 3 * i, d_intensity);
+            } else {
+                i -= lights.num_point_lights;
+                auto d_spot_dir = Vector3{0, 0, 0};
+                auto d_spot_exponent = Real(0);
+                d_spot_light_radiance(
+                    load_vector3(lights.spot_positions + 3 * i),
+                    load_vector3(lights.spot_directions + 3 * i),
+                    lights.spot_exponents[i],
+                    load_vector3(lights.spot_intensities + 3 * i),
+                    position, normal, albedo, d_radiance,
+                    d_light_pos, d_spot_dir, d_spot_exponent, d_intensity,
+                    d_position, d_normal, d_albedo);
+                atomic_add(d_lights.spot_positions + 3 * i, d_light_pos);
+                atomic_add(d_lights.spot_directions + 3 * i, d_spot_dir);
+                atomic_add(d_lights.spot_exponents + i, d_spot_exponent);
+                atomic_add(d_lights.spot_intensities + 3 * i, d_intensity);
+            }
+        }
+        auto *d_pixel = d_g_buffer + num_channels * pixel_id;
+        for (int i = 0; i < 3; i++) {
+            d_pixel[i] = float(d_position[i]);
+            d_pixel[3 + i] = float(d_normal[i]);
+            d_pixel[6 + i] = float(d_albedo[i]);
+        }
+        for (int i = 9; i < num_channels; i++) {
+            d_pixel[i] = 0;
+        }
+    }
+
+    const DeferredLights lights;
+    const float *g_buffer;
+    const int width;
+    const int num_channels;
+    const int num_tiles_x;
+    const int *tile_light_ids;
+    const int *tile_num_lights;
+    const float *d_output;
+    float *d_g_buffer;
+    DeferredLights d_lights;
+};
+
+void cull_deferred_lights(const DeferredLights &lights,
+                          const float *g_buffer,
+                          int width,
+                          int height,
+                          int num_channels,
+                          Buffer<int> &tile_light_ids,
+                          Buffer<int> &tile_num_lights,
+                          bool use_gpu) {
+    auto num_tiles_x = idiv_ceil(width, deferred_tile_size);
+    auto num_tiles = num_tiles_x * idiv_ceil(height, deferred_tile_size);
+    tile_light_ids = Buffer<int>(use_gpu,
+        num_tiles * (lights.num_point_lights + lights.num_spot_lights));
+    tile_num_lights = Buffer<int>(use_gpu, num_tiles);
+    parallel_for(deferred_light_culler{
+        lights, g_buffer, width, height, num_channels, num_tiles_x,
+        tile_light_ids.begin(), tile_num_lights.begin()}, num_tiles, use_gpu);
+}
+
+void shade_deferred(const DeferredLights &lights,
+                    ptr<float> g_buffer,
+                    int width,
+                    int height,
+                    int num_channels,
+                    ptr<float> output,
+                    bool use_gpu,
+                    int gpu_index) {
+#ifdef __NVCC__
+    int old_device_id = -1;
+    if (use_gpu) {
+        checkCuda(cudaGetDevice(&old_device_id));
+        if (gpu_index != -1) {
+            checkCuda(cudaSetDevice(gpu_index));
+        }
+    }
+#endif
+    parallel_init();
+    Buffer<int> tile_light_ids, tile_num_lights;
+    cull_deferred_lights(lights, g_buffer.get(), width, height, num_channels,
+                         tile_light_ids, tile_num_lights, use_gpu);
+    parallel_for(deferred_shader{
+        lights, g_buffer.get(), width, num_channels,
+        idiv_ceil(width, deferred_tile_size),
+        tile_light_ids.begin(), tile_num_lights.begin(),
+        output.get()}, width * height, use_gpu);
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    parallel_cleanup();
+#ifdef __NVCC__
+    if (old_device_id != -1) {
+        checkCuda(cudaSetDevice(old_device_id));
+    }
+#endif
+}
+
+void d_shade_deferred(const DeferredLights &lights,
+                      ptr<float> g_buffer,
+                      int width,
+                      int height,
+                      int num_channels,
+                      ptr<float> d_output,
+                      ptr<float> d_g_buffer,
+                      const DeferredLights &d_lights,
+                      bool use_gpu,
+                      int gpu_index) {
+#ifdef __NVCC__
+    int old_device_id = -1;
+    if (use_gpu) {
+        checkCuda(cudaGetDevice(&old_device_id));
+        if (gpu_index != -1) {
+            checkCuda(cudaSetDevice(gpu_index));
+        }
+    }
+#endif
+    parallel_init();
+    Buffer<int> tile_light_ids, tile_num_lights;
+    cull_deferred_lights(lights, g_buffer.get(), width, height, num_channels,
+                         tile_light_ids, tile_num_lights, use_gpu);
+    parallel_for(d_deferred_shader{
+        lights, g_buffer.get(), width, num_channels,
+        idiv_ceil(width, deferred_tile_size),
+        tile_light_ids.begin(), tile_num_lights.begin(),
+        d_output.get(), d_g_buffer.get(), d_lights}, width * height, use_gpu);
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    parallel_cleanup();
+#ifdef __NVCC__
+    if (old_device_id != -1) {
+        checkCuda(cudaSetDevice(old_device_id));
+    }
+#endif
+}
+
+void test_deferred_shading() {
+    // A 20x18 G-buffer of two tiles facing away from each other,
+    // so that the culling removes lights in both
+    constexpr int w = 20;
+    constexpr int h = 18;
+    constexpr int nc = 10;
+    std::vector<float> g_buffer(w * h * nc);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            auto *pixel = &g_buffer[nc * (y * w + x)];
+            auto facing_up = x < deferred_tile_size;
+            pixel[0] = 0.1f * x;
+            pixel[1] = facing_up ? 0.f : 1.f;
+            pixel[2] = 0.1f * y;
+            auto n = normalize(Vector3f{0.05f * x - 0.5f, facing_up ? 1.f : -1.f, 0.1f});
+            pixel[3] = n[0];
+            pixel[4] = n[1];
+            pixel[5] = n[2];
+            pixel[6] = 0.5f + 0.02f * x;
+            pixel[7] = 0.3f;
+            pixel[8] = 0.7f - 0.02f * y;
+            pixel[9] = 1.f;
+        }
+    }
+    std::vector<float> ambient = {0.1f, 0.2f, 0.3f};
+    std::vector<float> point_positions = {1.f, 3.f, 1.f,
+                                          1.f, -3.f, 1.f};
+    std::vector<float> point_intensities = {5.f, 4.f, 3.f,
+                                            2.f, 3.f, 4.f};
+    std::vector<float> directional_directions = {0.3f, -1.f, 0.2f};
+    std::vector<float> directional_intensities = {1.f, 1.5f, 2.f};
+    std::vector<float> spot_positions = {0.5f, 2.f, 0.5f,
+                                         1.5f, -2.f, 1.f};
+    std::vector<float> spot_directions = {0.1f, -1.f, 0.2f,
+                                          -0.2f, 1.f, 0.1f};
+    std::vector<float> spot_exponents = {3.f, 0.f};
+    std::vector<float> spot_intensities = {3.f, 2.f, 1.f,
+                                           1.f, 1.f, 1.f};
+    DeferredLights lights(&ambient[0], 1,
+                          &point_positions[0], &point_intensities[0], 2,
+                          &directional_directions[0], &directional_intensities[0], 1,
+                          &spot_positions[0], &spot_directions[0], &spot_exponents[0],
+                          &spot_intensities[0], 2);
+    std::vector<float> output(w * h * 3);
+    shade_deferred(lights, &g_buffer[0], w, h, nc, &output[0], false, -1);
+
+    // Compare against shading each pixel with all lights
+    for (int pixel_id = 0; pixel_id < w * h; pixel_id++) {
+        const auto *pixel = &g_buffer[nc * pixel_id];
+        auto p = load_vector3(pixel);
+        auto n = load_vector3(pixel + 3);
+        auto a = load_vector3(pixel + 6);
+        auto expected = load_vector3(&ambient[0]) * a +
+            directional_light_radiance(load_vector3(&directional_directions[0]),
+                                       load_vector3(&directional_intensities[0]), n, a);
+        for (int i = 0; i < 2; i++) {
+            expected += point_light_radiance(load_vector3(&point_positions[3 * i]),
+                                             load_vector3(&point_intensities[3 * i]), p, n, a);
+            expected += spot_light_radiance(load_vector3(&spot_positions[3 * i]),
+                                            load_vector3(&spot_directions[3 * i]),
+                                            spot_exponents[i],
+                                            load_vector3(&spot_intensities[3 * i]), p, n, a);
+        }
+        equal_or_error(__FILE__, __LINE__, expected, load_vector3(&output[3 * pixel_id]));
+    }
+
+    // Finite difference check of the derivatives of the sum of the outputs
+    // weighted by d_output
+    std::vector<float> d_output(w * h * 3);
+    for (int i = 0; i < (int)d_output.size(); i++) {
+        d_output[i] = 0.5f + 0.25f * (i % 3);
+    }
+    auto weighted_sum = [&](const DeferredLights &lights, std::vector<float> &g_buffer) {
+        std::vector<float> output(w * h * 3);
+        shade_deferred(lights, &g_buffer[0], w, h, nc, &output[0], false, -1);
+        auto ret = Real(0);
+        for (int i = 0; i < (int)output.size(); i++) {
+            ret += Real(output[i]) * d_output[i];
+        }
+        return ret;
+    };
+    std::vector<float> d_ambient(3, 0.f);
+    std::vector<float> d_point_positions(6, 0.f), d_point_intensities(6, 0.f);
+    std::vector<float> d_directional_directions(3, 0.f), d_directional_intensities(3, 0.f);
+    std::vector<float> d_spot_positions(6, 0.f), d_spot_directions(6, 0.f);
+    std::vector<float> d_spot_exponents(2, 0.f), d_spot_intensities(6, 0.f);
+    DeferredLights d_lights(&d_ambient[0], 1,
+                            &d_point_positions[0], &d_point_intensities[0], 2,
+                            &d_directional_directions[0], &d_directional_intensities[0], 1,
+                            &d_spot_positions[0], &d_spot_directions[0], &d_spot_exponents[0],
+                            &d_spot_intensities[0], 2);
+    std::vector<float> d_g_buffer(w * h * nc);
+    d_shade_deferred(lights, &g_buffer[0], w, h, nc, &d_output[0], &d_g_buffer[0],
+                     d_lights, false, -1);
+    auto finite_delta = 1e-3f;
+    auto check = [&](std::vector<float> &param, const std::vector<float> &d_param) {
+        for (int i = 0; i < (int)param.size(); i++) {
+            auto v = param[i];
+            param[i] = v + finite_delta;
+            auto positive = weighted_sum(lights, g_buffer);
+            param[i] = v - finite_delta;
+            auto negative = weighted_sum(lights, g_buffer);
+            param[i] = v;
+            auto diff = (positive - negative) / (2 * finite_delta);
+            // The sums are over many pixels
+            equal_or_error(__FILE__, __LINE__, diff, Real(d_param[i]),
+                           Real(5e-3) * max(fabs(diff), Real(1)));
+        }
+    };
+    check(ambient, d_ambient);
+    check(point_positions, d_point_positions);
+    check(point_intensities, d_point_intensities);
+    check(directional_directions, d_directional_directions);
+    check(directional_intensities, d_directional_intensities);
+    check(spot_positions, d_spot_positions);
+    check(spot_directions, d_spot_directions);
+    check(spot_exponents, d_spot_exponents);
+    check(spot_intensities, d_spot_intensities);
+    // A few G-buffer entries
+    for (int pixel_id : {0, 7 * w + 5, 11 * w + 17}) {
+        std::vector<float> pixel(g_buffer.begin() + nc * pixel_id,
+                                 g_buffer.begin() + nc * pixel_id + 9);
+        for (int i = 0; i < 9; i++) {
+            auto v = g_buffer[nc * pixel_id + i];
+            g_buffer[nc * pixel_id + i] = v + finite_delta;
+            auto positive = weighted_sum(lights, g_buffer);
+            g_buffer[nc * pixel_id + i] = v - finite_delta;
+            auto negative = weighted_sum(lights, g_buffer);
+            g_buffer[nc * pixel_id + i] = v;
+            equal_or_error(__FILE__, __LINE__, (positive - negative) / (2 * finite_delta),
+                           Real(d_g_buffer[nc * pixel_id + i]), Real(5e-3));
+        }
+        equal_or_error(__FILE__, __LINE__, 0.f, d_g_buffer[nc * pixel_id + 9]);
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "redner.h"
+#include "vector.h"
+#include "ptr.h"
+
+/**
+ * Lights of pyredner.render_deferred, stored as arrays of each kind.
+ * The same struct holds the derivatives of the parameters.
+ * Diffuse shading of a G-buffer pixel with position p, normal n and albedo a:
+ * ambient:     I * a
+ * point:       I * max(dot(l, n), 0) * a / (pi * |q - p|^2), l = normalize(q - p)
+ * directional: I * max(dot(-normalize(d), n), 0) * a / pi
+ * spot:        I * max(dot(l, -normalize(s)), 0)^e * max(dot(l, n), 0) * a / pi,
+ *              l = normalize(q - p)
+ */
+struct DeferredLights {
+    DeferredLights() {}
+
+    DeferredLights(ptr<float> ambient_intensities,
+                   int num_ambient_lights,
+                   ptr<float> point_positions,
+                   ptr<float> point_intensities,
+                   int num_point_lights,
+                   ptr<float> directional_directions,
+                   ptr<float> directional_intensities,
+                   int num_directional_lights,
+                   ptr<float> spot_positions,
+                   ptr<float> spot_directions,
+                   ptr<float> spot_exponents,
+                   ptr<float> spot_intensities,
+                   int num_spot_lights)
+        : ambient_intensities(ambient_intensities.get()),
+          num_ambient_lights(num_ambient_lights),
+          point_positions(point_positions.get()),
+          point_intensities(point_intensities.get()),
+          num_point_lights(num_point_lights),
+          directional_directions(directional_directions.get()),
+          directional_intensities(directional_intensities.get()),
+          num_directional_lights(num_directional_lights),
+          spot_positions(spot_positions.get()),
+          spot_directions(spot_directions.get()),
+          spot_exponents(spot_exponents.get()),
+          spot_intensities(spot_intensities.get()),
+          num_spot_lights(num_spot_lights) {}
+
+    float *ambient_intensities;
+    int num_ambient_lights;
+    float *point_positions;
+    float *point_intensities;
+    int num_point_lights;
+    float *directional_directions;
+    float *directional_intensities;
+    int num_directional_lights;
+    float *spot_positions;
+    float *spot_directions;
+    float *spot_exponents;
+    float *spot_intensities;
+    int num_spot_lights;
+};
+
+/// Size of the square screen tiles we cull the point and spot lights for
+constexpr auto deferred_tile_size = 16;
+
+/// Shade a G-buffer of width x height pixels with num_channels floats per pixel,
+/// starting with position, shading normal and albedo. Writes 3 floats per pixel
+/// into output. Tiles of pixels skip the point and spot lights that are behind
+/// all of their surfaces.
+void shade_deferred(const DeferredLights &lights,
+                    ptr<float> g_buffer,
+                    int width,
+                    int height,
+                    int num_channels,
+                    ptr<float> output,
+                    bool use_gpu,
+                    int gpu_index);
+
+/// Backpropagate d_output to the G-buffer and the light parameters.
+/// d_g_buffer has the layout of g_buffer and is overwritten,
+/// the derivatives of the lights are accumulated into d_lights.
+void d_shade_deferred(const DeferredLights &lights,
+                      ptr<float> g_buffer,
+                      int width,
+                      int height,
+                      int num_channels,
+                      ptr<float> d_output,
+                      ptr<float> d_g_buffer,
+                      const DeferredLights &d_lights,
+                      bool use_gpu,
+                      int gpu_index);
+
+void test_deferred_shading();
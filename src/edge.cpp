@@ -103,13 +103,13 @@ DEVICE inline bool less_than(const Vector3f &v0, const Vector3f &v1) {
 struct edge_vertex_comparer {
     DEVICE inline bool operator()(const Edge &e0, const Edge &e1) {
         // First, locally sort v0 & v1 within e0 & e1
-        auto v00 = get_vertex(*shape_ptr, e0.v0);
-        auto v01 = get_vertex(*shape_ptr, e0.v1);
+        auto v00 = get_local_vertex(*shape_ptr, e0.v0);
+        auto v01 = get_local_vertex(*shape_ptr, e0.v1);
         if (less_than(v01, v00)) {
             swap_(v00, v01);
         }
-        auto v10 = get_vertex(*shape_ptr, e1.v0);
-        auto v11 = get_vertex(*shape_ptr, e1.v1);
+        auto v10 = get_local_vertex(*shape_ptr, e1.v0);
+        auto v11 = get_local_vertex(*shape_ptr, e1.v1);
         if (less_than(v11, v10)) {
             swap_(v10, v11);
         }
@@ -131,15 +131,15 @@ struct edge_face_assigner {
         if (edge.f1 != -1) {
             return;
         }
-        auto v0 = get_vertex(*shape_ptr, edge.v0);
-        auto v1 = get_vertex(*shape_ptr, edge.v1);
+        auto v0 = get_local_vertex(*shape_ptr, edge.v0);
+        auto v1 = get_local_vertex(*shape_ptr, edge.v1);
         if (less_than(v1, v0)) {
             swap_(v0, v1);
         }
         if (idx > 0) {
             const auto &cmp_edge = edges[idx - 1];
-            auto cmp_v0 = get_vertex(*shape_ptr, cmp_edge.v0);
-            auto cmp_v1 = get_vertex(*shape_ptr, cmp_edge.v1);
+            auto cmp_v0 = get_local_vertex(*shape_ptr, cmp_edge.v0);
+            auto cmp_v1 = get_local_vertex(*shape_ptr, cmp_edge.v1);
             if (less_than(cmp_v1, cmp_v0)) {
                 swap_(cmp_v0, cmp_v1);
             }
@@ -149,8 +149,8 @@ struct edge_face_assigner {
         }
         if (idx < num_edges - 1) {
             const auto &cmp_edge = edges[idx + 1];
-            auto cmp_v0 = get_vertex(*shape_ptr, cmp_edge.v0);
-            auto cmp_v1 = get_vertex(*shape_ptr, cmp_edge.v1);
+            auto cmp_v0 = get_local_vertex(*shape_ptr, cmp_edge.v0);
+            auto cmp_v1 = get_local_vertex(*shape_ptr, cmp_edge.v1);
             if (less_than(cmp_v1, cmp_v0)) {
                 swap_(cmp_v0, cmp_v1);
             }
@@ -184,14 +184,16 @@ struct edge_remover {
 };
 
 struct primary_edge_weighter {
-    DEVICE void operator()(int idx) {
-        const auto &edge = edges[idx];
-        auto &primary_edge_weight = primary_edge_weights[idx];
+    DEVICE Real screen_length(const Edge &edge) {
+        if (!shapes[edge.shape_id].differentiable) {
+            // Neither the camera nor the shape moves, so this silhouette
+            // has no derivative
+            return 0;
+        }
         auto v0 = get_v0(shapes, edge);
         auto v1 = get_v1(shapes, edge);
         auto v0p = Vector2{};
         auto v1p = Vector2{};
-        primary_edge_weight = 0;
         // Project to screen space
         if (project(camera, Vector3(v0), Vector3(v1), v0p, v1p)) {
             auto v0c = v0p;
@@ -201,16 +203,39 @@ struct primary_edge_weighter {
                 // Reject non-silhouette edges
                 auto org = xfm_point(camera.cam_to_world, Vector3{0, 0, 0});
                 if (is_silhouette(shapes, org, edge)) {
-                    primary_edge_weight = distance(v0c, v1c);
+                    return distance(v0c, v1c);
                 }
             }
         }
+        return 0;
+    }
+
+    DEVICE void operator()(int idx) {
+        // The edge weight sums the screen space lengths over the shapes
+        // using the edge, the shapes sharing the edges also sum their lengths
+        auto edge = edges[idx];
+        auto base_id = edge.shape_id;
+        auto num_users = shape_num_users[base_id];
+        auto &primary_edge_weight = primary_edge_weights[idx];
+        primary_edge_weight = 0;
+        for (int i = 0; i < num_users; i++) {
+            edge.shape_id = shape_users[shape_user_offsets[base_id] + i];
+            auto length = screen_length(edge);
+            primary_edge_weight += length;
+            if (num_users > 1 && length > 0) {
+                atomic_add(&shape_weights[edge.shape_id], length);
+            }
+        }
     }
 
     Camera camera;
     const Shape *shapes;
     const Edge *edges;
+    const int *shape_user_offsets;
+    const int *shape_num_users;
+    const int *shape_users;
     Real *primary_edge_weights;
+    Real *shape_weights;
 };
 
 struct secondary_edge_weighter {
@@ -222,11 +247,14 @@ struct secondary_edge_weighter {
         auto exterior_dihedral = compute_exterior_dihedral_angle(shapes, edge);
         auto v0 = get_v0(shapes, edge);
         auto v1 = get_v1(shapes, edge);
-        secondary_edge_weight = distance(v0, v1) * exterior_dihedral;
+        // Once for each shape using the edge
+        secondary_edge_weight = distance(v0, v1) * exterior_dihedral *
+            shape_num_users[edge.shape_id];
     }
 
     const Shape *shapes;
     const Edge *edges;
+    const int *shape_num_users;
     Real *secondary_edge_weights;
 };
 
@@ -236,11 +264,40 @@ EdgeSampler::EdgeSampler(const std::vector<const Shape*> &shapes,
         // No need to collect edges
         return;
     }
-    auto shapes_buffer = scene.shapes.view(0, (int)shapes.size());
+    auto num_shapes = (int)shapes.size();
+    auto shapes_buffer = scene.shapes.view(0, num_shapes);
+    // Static shapes have no primary edge derivatives, but their edges still
+    // occlude the moving shapes seen from the shading points, so the secondary
+    // edges need all of them. Without any moving shape there is no derivative.
+    auto any_differentiable = false;
+    for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+        any_differentiable = any_differentiable || shapes[shape_id]->differentiable;
+    }
+    // The shapes using the edges of each shape: the shape and its instances
+    std::vector<std::vector<int>> users(num_shapes);
+    for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+        auto prototype_id = shapes[shape_id]->prototype_id;
+        users[prototype_id >= 0 ? prototype_id : shape_id].push_back(shape_id);
+    }
+    shape_user_offsets = Buffer<int>(scene.use_gpu, num_shapes);
+    shape_num_users = Buffer<int>(scene.use_gpu, num_shapes);
+    shape_users = Buffer<int>(scene.use_gpu, num_shapes);
+    auto current_num_users = 0;
+    for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+        shape_user_offsets[shape_id] = current_num_users;
+        shape_num_users[shape_id] = (int)users[shape_id].size();
+        for (auto user_id : users[shape_id]) {
+            shape_users[current_num_users++] = user_id;
+        }
+    }
     // Conservatively allocate a big buffer for all edges
     auto num_total_triangles = 0;
-    for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
-        num_total_triangles += shapes[shape_id]->num_triangles;
+    if (any_differentiable) {
+        for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+            if (shapes[shape_id]->prototype_id < 0) {
+                num_total_triangles += shapes[shape_id]->num_triangles;
+            }
+        }
     }
     // Collect the edges
     // TODO: this assumes each edge is only associated with two triangles
@@ -250,84 +307,133 @@ EdgeSampler::EdgeSampler(const std::vector<const Shape*> &shapes,
     edges = Buffer<Edge>(scene.use_gpu, 3 * num_total_triangles);
     auto edges_buffer = Buffer<Edge>(scene.use_gpu, 3 * num_total_triangles);
     auto current_num_edges = 0;
-    for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
-        parallel_for(edge_collector{
-            shape_id,
-            shapes_buffer.begin() + shape_id,
-            edges.data + current_num_edges
-        }, 3 * shapes[shape_id]->num_triangles, scene.use_gpu);
-        // Merge the edges
-        auto edges_begin = edges.data + current_num_edges;
-        DISPATCH(scene.use_gpu, thrust::sort,
-                 edges_begin,
-                 edges_begin + 3 * shapes[shape_id]->num_triangles,
-                 edge_less_comparer{});
-        auto edges_buffer_begin = edges_buffer.data;
-        auto new_end = DISPATCH(scene.use_gpu, thrust::reduce_by_key,
-            edges_begin, // input keys
-            edges_begin + 3 * shapes[shape_id]->num_triangles,
-            edges_begin, // input values
-            edges_buffer_begin, // output keys
-            edges_buffer_begin, // output values
-            edge_equal_comparer{},
-            edge_merger{}).first;
-        auto num_edges = new_end - edges_buffer_begin;
-        // Sometimes there are duplicated edges that don't get merged 
-        // in the procedure above (e.g. UV seams), here we make sure these edges
-        // are associated with two faces.
-        // We do this by sorting the edges again based on vertex positions,
-        // look at nearby edges and assign faces.
-        DISPATCH(scene.use_gpu, thrust::sort,
-                 edges_buffer_begin,
-                 edges_buffer_begin + num_edges,
-                 edge_vertex_comparer{shapes_buffer.begin() + shape_id});
-        parallel_for(edge_face_assigner{
-            shapes_buffer.begin() + shape_id,
-            edges_buffer_begin,
-            (int)num_edges
-        }, num_edges, scene.use_gpu);
-
-        DISPATCH(scene.use_gpu, thrust::copy, edges_buffer_begin, new_end, edges_begin);
-        current_num_edges += (int)num_edges;
+    auto num_unshared_edges = 0;
+    // Where the merged edges of each shape start in edges, and how many there are
+    std::vector<int> edge_offsets(num_shapes, 0);
+    std::vector<int> num_edges_of(num_shapes, 0);
+    // First the shapes without instances, then the shapes with instances
+    for (int shared = 0; shared < 2; shared++) {
+        for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+            if (shapes[shape_id]->prototype_id >= 0 ||
+                    (users[shape_id].size() > 1) != (shared == 1)) {
+                continue;
+            }
+            edge_offsets[shape_id] = current_num_edges;
+            if (!any_differentiable) {
+                continue;
+            }
+            parallel_for(edge_collector{
+                shape_id,
+                shapes_buffer.begin() + shape_id,
+                edges.data + current_num_edges
+            }, 3 * shapes[shape_id]->num_triangles, scene.use_gpu);
+            // Merge the edges
+            auto edges_begin = edges.data + current_num_edges;
+            DISPATCH(scene.use_gpu, thrust::sort,
+                     edges_begin,
+                     edges_begin + 3 * shapes[shape_id]->num_triangles,
+                     edge_less_comparer{});
+            auto edges_buffer_begin = edges_buffer.data;
+            auto new_end = DISPATCH(scene.use_gpu, thrust::reduce_by_key,
+                edges_begin, // input keys
+                edges_begin + 3 * shapes[shape_id]->num_triangles,
+                edges_begin, // input values
+                edges_buffer_begin, // output keys
+                edges_buffer_begin, // output values
+                edge_equal_comparer{},
+                edge_merger{}).first;
+            auto num_edges = new_end - edges_buffer_begin;
+            // Sometimes there are duplicated edges that don't get merged 
+            // in the procedure above (e.g. UV seams), here we make sure these edges
+            // are associated with two faces.
+            // We do this by sorting the edges again based on vertex positions,
+            // look at nearby edges and assign faces.
+            DISPATCH(scene.use_gpu, thrust::sort,
+                     edges_buffer_begin,
+                     edges_buffer_begin + num_edges,
+                     edge_vertex_comparer{shapes_buffer.begin() + shape_id});
+            parallel_for(edge_face_assigner{
+                shapes_buffer.begin() + shape_id,
+                edges_buffer_begin,
+                (int)num_edges
+            }, num_edges, scene.use_gpu);
+
+            DISPATCH(scene.use_gpu, thrust::copy, edges_buffer_begin, new_end, edges_begin);
+            // Remove edges with 180 degree dihedral angles
+            auto edges_end = DISPATCH(scene.use_gpu, thrust::remove_if, edges_begin,
+                edges_begin + num_edges, edge_remover{shapes_buffer.begin()});
+            num_edges_of[shape_id] = (int)(edges_end - edges_begin);
+            current_num_edges += num_edges_of[shape_id];
+        }
+        if (shared == 0) {
+            num_unshared_edges = current_num_edges;
+        }
+    }
+    edges.count = current_num_edges;
+    shape_edge_offsets = Buffer<int>(scene.use_gpu, num_shapes);
+    shape_num_edges = Buffer<int>(scene.use_gpu, num_shapes);
+    for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+        shape_edge_offsets[shape_id] = edge_offsets[shape_id];
+        shape_num_edges[shape_id] = num_edges_of[shape_id];
     }
-    // Remove edges with 180 degree dihedral angles
-    auto edges_end = DISPATCH(scene.use_gpu, thrust::remove_if, edges.begin(),
-        edges.begin() + current_num_edges, edge_remover{shapes_buffer.begin()});
-    edges.count = edges_end - edges.begin();
 
     if (scene.use_primary_edge_sampling) {
         // Primary edge sampler:
         primary_edges_pmf = Buffer<Real>(scene.use_gpu, edges.count);
         primary_edges_cdf = Buffer<Real>(scene.use_gpu, edges.count);
+        primary_edges_total = Buffer<Real>(scene.use_gpu, num_shapes);
+        primary_shapes_pmf = Buffer<Real>(scene.use_gpu, num_shapes);
+        primary_shapes_cdf = Buffer<Real>(scene.use_gpu, num_shapes);
         // For each edge, if it is a silhouette, we project them on screen
         // and compute the screen-space length. We store the length in
-        // primary_edges_pmf
+        // primary_edges_pmf, and the lengths of the edges of each shape
+        // with instances in primary_shapes_pmf.
         {
+            DISPATCH(scene.use_gpu, thrust::fill,
+                primary_shapes_pmf.begin(), primary_shapes_pmf.end(), Real(0));
             parallel_for(primary_edge_weighter{
                 scene.camera,
                 scene.shapes.data,
                 edges.begin(),
-                primary_edges_pmf.begin()
-            }, edges.size(), scene.use_gpu);
-            // Compute PMF & CDF
-            // First normalize primary_edges_pmf.
-            auto total_length = DISPATCH(scene.use_gpu, thrust::reduce,
-                primary_edges_pmf.begin(),
-                primary_edges_pmf.end(),
-                Real(0),
-                thrust::plus<Real>());
-            DISPATCH(scene.use_gpu, thrust::transform,
-                primary_edges_pmf.begin(),
-                primary_edges_pmf.end(),
-                thrust::make_constant_iterator(total_length),
+                shape_user_offsets.begin(),
+                shape_num_users.begin(),
+                shape_users.begin(),
                 primary_edges_pmf.begin(),
-                thrust::divides<Real>());
+                primary_shapes_pmf.begin()
+            }, edges.size(), scene.use_gpu);
             // Next we compute a prefix sum
             DISPATCH(scene.use_gpu, thrust::transform_exclusive_scan,
                 primary_edges_pmf.begin(),
                 primary_edges_pmf.end(),
                 primary_edges_cdf.begin(),
                 thrust::identity<Real>(), Real(0), thrust::plus<Real>());
+            if (scene.use_gpu) {
+                cuda_synchronize();
+            }
+            // The number of shapes is small, so the rest is done here
+            auto total_length = Real(0);
+            for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+                auto offset = edge_offsets[shape_id];
+                auto num_edges = num_edges_of[shape_id];
+                primary_edges_total[shape_id] = num_edges > 0 ?
+                    primary_edges_cdf[offset + num_edges - 1] +
+                    primary_edges_pmf[offset + num_edges - 1] -
+                    primary_edges_cdf[offset] : Real(0);
+                if (shapes[shape_id]->prototype_id < 0 && users[shape_id].size() == 1) {
+                    primary_shapes_pmf[shape_id] = primary_edges_total[shape_id];
+                }
+                total_length += primary_shapes_pmf[shape_id];
+            }
+            // Zero when no moving silhouette is on screen,
+            // the sampler then rejects every edge
+            auto cdf = Real(0);
+            for (int shape_id = 0; shape_id < num_shapes; shape_id++) {
+                if (total_length > 0) {
+                    primary_shapes_pmf[shape_id] /= total_length;
+                }
+                primary_shapes_cdf[shape_id] = cdf;
+                cdf += primary_shapes_pmf[shape_id];
+            }
         }
     }
 
@@ -342,6 +448,7 @@ EdgeSampler::EdgeSampler(const std::vector<const Shape*> &shapes,
             parallel_for(secondary_edge_weighter{
                 scene.shapes.data,
                 edges.begin(),
+                shape_num_users.begin(),
                 secondary_edges_pmf.begin()
             }, edges.size(), scene.use_gpu);
             {
@@ -370,14 +477,22 @@ EdgeSampler::EdgeSampler(const std::vector<const Shape*> &shapes,
                 new EdgeTree(scene.use_gpu,
                              scene.camera,
                              shapes_buffer,
-                             edges.view(0, edges.size())));
+                             edges.view(0, edges.size()),
+                             num_unshared_edges,
+                             shape_edge_offsets.view(0, num_shapes),
+                             shape_num_edges.view(0, num_shapes),
+                             shape_num_users.view(0, num_shapes)));
         } else {
             // Build a hierarchical data structure for edge sampling
             edge_tree = std::unique_ptr<EdgeTree>(
                 new EdgeTree(scene.use_gpu,
                              scene.camera,
                              shapes_buffer,
-                             edges.view(0, edges.size())));
+                             edges.view(0, edges.size()),
+                             num_unshared_edges,
+                             shape_edge_offsets.view(0, num_shapes),
+                             shape_num_edges.view(0, num_shapes),
+                             shape_num_users.view(0, num_shapes)));
         }
     }
 }
@@ -388,22 +503,47 @@ struct primary_edge_sampler {
         edge_records[idx] = PrimaryEdgeRecord{};
         throughputs[2 * idx + 0] = Vector3{0, 0, 0};
         throughputs[2 * idx + 1] = Vector3{0, 0, 0};
-        auto nd = channel_info.num_total_dimensions;
+        auto nd = int64_t(channel_info.num_total_dimensions);
         for (int d = 0; d < nd; d++) {
             channel_multipliers[2 * nd * idx + d] = 0;
             channel_multipliers[2 * nd * idx + d + nd] = 0;
         }
         rays[2 * idx + 0] = Ray(Vector3{0, 0, 0}, Vector3{0, 0, 0});
         rays[2 * idx + 1] = Ray(Vector3{0, 0, 0}, Vector3{0, 0, 0});
+        if (num_edges == 0) {
+            // Nothing moves
+            return;
+        }
 
-        // Sample an edge by binary search on cdf
+        // Sample a shape, then an edge of the shape by binary search on cdf
         auto sample = samples[idx];
-        const Real *edge_ptr = thrust::upper_bound(thrust::seq,
-                edges_cdf, edges_cdf + num_edges,
+        const Real *shape_ptr = thrust::upper_bound(thrust::seq,
+                shapes_cdf, shapes_cdf + num_shapes,
                 sample.edge_sel);
+        auto shape_id = clamp((int)(shape_ptr - shapes_cdf - 1),
+                                    0, num_shapes - 1);
+        if (shapes_pmf[shape_id] <= 0.f) {
+            return;
+        }
+        // Instances use the edges of their prototypes
+        auto prototype_id = shapes[shape_id].prototype_id;
+        auto base_id = prototype_id >= 0 ? prototype_id : shape_id;
+        auto edges_begin = shape_edge_offsets[base_id];
+        auto edges_count = shape_num_edges[base_id];
+        auto edges_total = edges_total_by_shape[base_id];
+        if (edges_count == 0 || edges_total <= 0.f) {
+            return;
+        }
+        // Reuse the sample for selecting the edge
+        auto edge_sel = (sample.edge_sel - shapes_cdf[shape_id]) / shapes_pmf[shape_id];
+        const Real *edge_ptr = thrust::upper_bound(thrust::seq,
+                edges_cdf + edges_begin, edges_cdf + edges_begin + edges_count,
+                edges_cdf[edges_begin] + edge_sel * edges_total);
         auto edge_id = clamp((int)(edge_ptr - edges_cdf - 1),
-                                   0, num_edges - 1);
-        const auto &edge = edges[edge_id];
+                             edges_begin, edges_begin + edges_count - 1);
+        auto edge = edges[edge_id];
+        edge.shape_id = shape_id;
+        auto edge_pmf = shapes_pmf[shape_id] * edges_pmf[edge_id] / edges_total;
         // Sample a point on the edge
         auto v0 = Vector3{get_v0(shapes, edge)};
         auto v1 = Vector3{get_v1(shapes, edge)};
@@ -413,7 +553,7 @@ struct primary_edge_sampler {
         if (!project(camera, v0, v1, v0_ss, v1_ss)) {
             return;
         }
-        if (edges_pmf[edge_id] <= 0.f) {
+        if (edge_pmf <= 0.f) {
             return;
         }
 
@@ -464,8 +604,8 @@ struct primary_edge_sampler {
             // For perspective projection the length of edge and gradients
             // cancel each other out.
             // For fisheye & panorama we need to compute the Jacobians
-            auto upper_weight = d_color / edges_pmf[edge_id];
-            auto lower_weight = -d_color / edges_pmf[edge_id];
+            auto upper_weight = d_color / edge_pmf;
+            auto lower_weight = -d_color / edge_pmf;
 
             assert(isfinite(d_color));
             assert(isfinite(upper_weight));
@@ -476,8 +616,8 @@ struct primary_edge_sampler {
             for (int d = 0; d < nd; d++) {
                 auto viewport_width = camera.viewport_end.x - camera.viewport_beg.x;
                 auto d_channel = d_rendered_image[nd * (yi * viewport_width + xi) + d];
-                channel_multipliers[2 * nd * idx + d] = d_channel / edges_pmf[edge_id];
-                channel_multipliers[2 * nd * idx + d + nd] = -d_channel / edges_pmf[edge_id];
+                channel_multipliers[2 * nd * idx + d] = d_channel / edge_pmf;
+                channel_multipliers[2 * nd * idx + d + nd] = -d_channel / edge_pmf;
             }
         } else {
             assert(camera.camera_type == CameraType::Fisheye ||
@@ -558,8 +698,8 @@ struct primary_edge_sampler {
             // For perspective projection the length of edge and gradients
             // cancel each other out.
             // For fisheye & Panorama we need to compute the Jacobians
-            auto upper_weight = d_color / edges_pmf[edge_id];
-            auto lower_weight = -d_color / edges_pmf[edge_id];
+            auto upper_weight = d_color / edge_pmf;
+            auto lower_weight = -d_color / edge_pmf;
 
             // alpha(p(x, y)) = dot(p(x, y), cross(v0_dir, v1_dir))
             // p = screen_to_camera(x, y)
@@ -585,9 +725,9 @@ struct primary_edge_sampler {
                 auto viewport_width = camera.viewport_end.x - camera.viewport_beg.x;
                 auto d_channel = d_rendered_image[nd * (yi * viewport_width + xi) + d];
                 channel_multipliers[2 * nd * idx + d] =
-                    d_channel * jacobian / edges_pmf[edge_id];
+                    d_channel * jacobian / edge_pmf;
                 channel_multipliers[2 * nd * idx + d + nd] =
-                    -d_channel * jacobian / edges_pmf[edge_id];
+                    -d_channel * jacobian / edge_pmf;
             }
         }
 
@@ -612,6 +752,12 @@ struct primary_edge_sampler {
     const Shape *shapes;
     const Edge *edges;
     int num_edges;
+    int num_shapes;
+    const Real *shapes_pmf;
+    const Real *shapes_cdf;
+    const int *shape_edge_offsets;
+    const int *shape_num_edges;
+    const Real *edges_total_by_shape;
     const Real *edges_pmf;
     const Real *edges_cdf;
     const PrimaryEdgeSample *samples;
@@ -638,6 +784,12 @@ void sample_primary_edges(const Scene &scene,
         scene.shapes.data,
         scene.edge_sampler.edges.begin(),
         (int)scene.edge_sampler.edges.size(),
+        (int)scene.edge_sampler.primary_shapes_pmf.size(),
+        scene.edge_sampler.primary_shapes_pmf.begin(),
+        scene.edge_sampler.primary_shapes_cdf.begin(),
+        scene.edge_sampler.shape_edge_offsets.begin(),
+        scene.edge_sampler.shape_num_edges.begin(),
+        scene.edge_sampler.primary_edges_total.begin(),
         scene.edge_sampler.primary_edges_pmf.begin(),
         scene.edge_sampler.primary_edges_cdf.begin(),
         samples.begin(),
@@ -666,7 +818,7 @@ struct primary_edge_weights_updater {
         if (!upper_connected && !lower_connected) {
             throughputs_upper = Vector3{0, 0, 0};
             throughputs_lower = Vector3{0, 0, 0};
-            auto nd = channel_info.num_total_dimensions;
+            auto nd = int64_t(channel_info.num_total_dimensions);
             for (int d = 0; d < nd; d++) {
                 channel_multipliers[2 * nd * idx + d] = 0;
                 channel_multipliers[2 * nd * idx + d + nd] = 0;
@@ -760,8 +912,10 @@ struct primary_edge_derivatives_computer {
             d_v0_ss.x, d_v0_ss.y,
             d_v1_ss.x, d_v1_ss.y,
             d_camera, d_v0, d_v1);
-        atomic_add(&d_shapes[edge_record.edge.shape_id].vertices[3 * edge_record.edge.v0], d_v0);
-        atomic_add(&d_shapes[edge_record.edge.shape_id].vertices[3 * edge_record.edge.v1], d_v1);
+        const auto &shape = shapes[edge_record.edge.shape_id];
+        auto &d_shape = d_shapes[edge_record.edge.shape_id];
+        atomic_add_vertex_derivative(shape, d_shape, edge_record.edge.v0, d_v0);
+        atomic_add_vertex_derivative(shape, d_shape, edge_record.edge.v1, d_v1);
         if (screen_gradient_image != nullptr) {
             auto xi = clamp(int(edge_pt[0] * camera.width - camera.viewport_beg.x),
                             0, camera.viewport_end.x - camera.viewport_beg.x);
@@ -813,14 +967,21 @@ inline Matrix3x3 get_ltc_matrix(const SurfacePoint &surface_point,
     return Matrix3x3(&tabM[9 * (rid + tid * ltc::size)]);
 }
 
+// The trees the stack items belong to, besides the local trees
+// (identified by the shape placing them)
+constexpr int c_world_tree = -1;
+constexpr int c_instance_tree = -2;
+
 struct BVHStackItemH {
     BVHNodePtr node_ptr;
     int num_samples;
     Real pmf;
+    int tree;
 };
 
 struct BVHStackItemL {
     BVHNodePtr node_ptr;
+    int tree;
 };
 
 struct secondary_edge_sampler {
@@ -882,15 +1043,16 @@ struct secondary_edge_sampler {
         return ltc_bound(p_bounds, p, m, m_inv);
     }
 
-    DEVICE Real importance(const BVHNode3 &node,
+    DEVICE Real importance(const AABB3 &bounds,
+                           Real weighted_total_length,
                            const SurfacePoint &p,
                            const Matrix3x3 &m,
                            const Matrix3x3 &m_inv) {
         // importance = BRDF * weighted length / dist
         // For BRDF we estimate the bound using linearly transformed cosine distribution
-        auto brdf_term = ltc_bound(node.bounds, p, m, m_inv);
-        auto center = 0.5f * (node.bounds.p_min + node.bounds.p_max);
-        return brdf_term * node.weighted_total_length
+        auto brdf_term = ltc_bound(bounds, p, m, m_inv);
+        auto center = 0.5f * (bounds.p_min + bounds.p_max);
+        return brdf_term * weighted_total_length
             / max(distance(center, p.position), Real(1e-3));
     }
 
@@ -916,17 +1078,52 @@ struct secondary_edge_sampler {
             / max(distance(center, p.position), Real(1e-3));
     }
 
+    /// The world space bounds of a node, the local trees are moved
+    /// by the transform of the shape placing them
+    DEVICE AABB3 node_bounds(const BVHNodePtr &node_ptr, int tree) {
+        if (node_ptr.is_bvh_node3) {
+            if (tree >= 0) {
+                return get_instance_bounds(scene.shapes[tree], node_ptr.ptr3->bounds);
+            }
+            return node_ptr.ptr3->bounds;
+        } else {
+            return convert_aabb<AABB3>(node_ptr.ptr6->bounds);
+        }
+    }
+
     DEVICE Real importance(const BVHNodePtr &node_ptr,
+                           int tree,
                            const SurfacePoint &p,
                            const Matrix3x3 &m,
                            const Matrix3x3 &m_inv) {
         if (node_ptr.is_bvh_node3) {
-            return importance(*node_ptr.ptr3, p, m, m_inv);
+            auto weighted_total_length = node_ptr.ptr3->weighted_total_length;
+            if (tree >= 0) {
+                weighted_total_length *= get_instance_scale(scene.shapes[tree]);
+            }
+            return importance(node_bounds(node_ptr, tree),
+                weighted_total_length, p, m, m_inv);
         } else {
             return importance(*node_ptr.ptr6, p, m, m_inv);
         }
     }
 
+    /// The edge of a leaf, placed by the shape of the tree for the local trees
+    DEVICE Edge leaf_edge(const BVHNodePtr &node_ptr, int tree) {
+        auto edge = edges[get_edge_id(node_ptr)];
+        if (tree >= 0) {
+            edge.shape_id = tree;
+        }
+        return edge;
+    }
+
+    /// The local tree with the edges of the shape with the id
+    DEVICE const BVHNode3 *local_root(int shape_id) {
+        auto prototype_id = scene.shapes[shape_id].prototype_id;
+        return edge_tree_roots.local_bvh_roots[
+            prototype_id >= 0 ? prototype_id : shape_id];
+    }
+
     DEVICE bool contains_silhouette(const BVHNodePtr &node_ptr,
                                     const Vector3 &p) {
         if (node_ptr.is_bvh_node3) {
@@ -939,12 +1136,10 @@ struct secondary_edge_sampler {
         }
     }
 
-    template <typename BVHNodeType>
-    DEVICE Real leaf_importance(const BVHNodeType &node,
+    DEVICE Real leaf_importance(const Edge &edge,
                                 const SurfacePoint &p,
                                 const Matrix3x3 &m,
                                 const Matrix3x3 &m_inv) {
-        const auto &edge = edges[node.edge_id];
         if (!is_silhouette(scene.shapes, p.position, edge)) {
             return 0;
         }
@@ -983,26 +1178,13 @@ struct secondary_edge_sampler {
         return 0;
     }
 
-    DEVICE Real leaf_importance(const BVHNodePtr &node_ptr,
-                                const SurfacePoint &p,
-                                const Matrix3x3 &m,
-                                const Matrix3x3 &m_inv) {
-        if (node_ptr.is_bvh_node3) {
-            return leaf_importance(*node_ptr.ptr3, p, m, m_inv);
-        } else {
-            return leaf_importance(*node_ptr.ptr6, p, m, m_inv);
-        }
-    }
-
-    template <typename BVHNodeType>
-    DEVICE Real leaf_importance(const BVHNodeType &node,
+    DEVICE Real leaf_importance(const Edge &edge,
                                 const SurfacePoint &p,
                                 const Matrix3x3 &m,
                                 const Matrix3x3 &m_inv,
                                 const Ray &nee_ray,
                                 const Intersection &nee_isect,
                                 Real edge_billboard_size) {
-        const auto &edge = edges[node.edge_id];
         if (!is_silhouette(scene.shapes, p.position, edge)) {
             return 0;
         }
@@ -1066,28 +1248,12 @@ struct secondary_edge_sampler {
         return 0;
     }
 
-    DEVICE Real leaf_importance(const BVHNodePtr &node_ptr,
-                                const SurfacePoint &p,
-                                const Matrix3x3 &m,
-                                const Matrix3x3 &m_inv,
-                                const Ray &nee_ray,
-                                const Intersection &nee_isect,
-                                Real edge_bounds_expand) {
-        if (node_ptr.is_bvh_node3) {
-            return leaf_importance(*node_ptr.ptr3,
-                p, m, m_inv, nee_ray, nee_isect, edge_bounds_expand);
-        } else {
-            return leaf_importance(*node_ptr.ptr6,
-                p, m, m_inv, nee_ray, nee_isect, edge_bounds_expand);
-        }
+    DEVICE bool inside(const BVHNodePtr &node_ptr, int tree, const SurfacePoint &p) {
+        return ::inside(node_bounds(node_ptr, tree), p.position);
     }
 
-    DEVICE bool inside(const BVHNodePtr &node_ptr, const SurfacePoint &p) {
-        if (node_ptr.is_bvh_node3) {
-            return ::inside(node_ptr.ptr3->bounds, p.position);
-        } else {
-            return ::inside(node_ptr.ptr6->bounds, p.position);
-        }
+    DEVICE bool intersect_node(const BVHNodePtr &node_ptr, int tree, const Ray &ray) {
+        return intersect(node_bounds(node_ptr, tree), ray, edge_bounds_expand);
     }
 
     static constexpr auto num_h_samples = 16;
@@ -1112,74 +1278,78 @@ struct secondary_edge_sampler {
         return distance_squared(edge_pt, isect_pt) < square(edge_bounds_expand);
     }
 
-    DEVICE int sample_edge_h(const EdgeTreeRoots &edge_tree_roots,
-                             const SurfacePoint &p,
-                             const Matrix3x3 &m,
-                             const Matrix3x3 &m_inv,
-                             const Ray &nee_ray,
-                             Real sample,
-                             Real resample_sample,
-                             Real &sample_weight) {
+    DEVICE Edge sample_edge_h(const EdgeTreeRoots &edge_tree_roots,
+                              const SurfacePoint &p,
+                              const Matrix3x3 &m,
+                              const Matrix3x3 &m_inv,
+                              const Ray &nee_ray,
+                              Real sample,
+                              Real resample_sample,
+                              Real &sample_weight) {
         constexpr auto buffer_size = 128;
         BVHStackItemH buffer[buffer_size];
-        auto selected_edge = -1;
+        auto selected_edge = Edge{};
         auto edge_weight = Real(0);
         auto wsum = Real(0);
 
         auto stack_ptr = &buffer[0];
 
         // randomly sample an edge using edge hierarchy
-        // push both nodes into stack
-        auto imp_cs = Real(0);
-        auto imp_ncs = Real(0);
+        // push the roots into stack, with the samples split evenly
+        BVHStackItemH roots[3];
+        auto num_roots = 0;
         if (edge_tree_roots.cs_bvh_root != nullptr) {
-            imp_cs = 1;
+            roots[num_roots++] = BVHStackItemH{
+                BVHNodePtr{edge_tree_roots.cs_bvh_root}, 0, 0, c_world_tree};
         }
         if (edge_tree_roots.ncs_bvh_root != nullptr) {
-            imp_ncs = 1;
-        }
-        if (imp_cs <= 0 && imp_ncs <= 0) {
-            return -1;
-        }
-        auto prob_cs = imp_cs / (imp_cs + imp_ncs);
-        auto prob_ncs = 1 - prob_cs;
-        auto expected_cs = num_h_samples * prob_cs;
-        auto expected_ncs = num_h_samples * prob_ncs;
-        auto samples_cs = int(floor(expected_cs));
-        auto samples_ncs = int(floor(expected_ncs));
-        if (samples_cs + samples_ncs < num_h_samples) {
-            auto prob = expected_cs - samples_cs;
-            if (sample < prob) {
-                samples_cs++;
-                sample /= prob;
-            } else {
-                samples_ncs++;
-                sample = (sample - prob) / (1 - prob);
+            roots[num_roots++] = BVHStackItemH{
+                BVHNodePtr{edge_tree_roots.ncs_bvh_root}, 0, 0, c_world_tree};
+        }
+        if (edge_tree_roots.instance_bvh_root != nullptr) {
+            roots[num_roots++] = BVHStackItemH{
+                BVHNodePtr{edge_tree_roots.instance_bvh_root}, 0, 0, c_instance_tree};
+        }
+        if (num_roots == 0) {
+            return selected_edge;
+        }
+        // The remaining samples go to the roots following a random one
+        auto num_extra_samples = num_h_samples % num_roots;
+        auto first_extra = 0;
+        if (num_extra_samples > 0) {
+            first_extra = min(int(sample * num_roots), num_roots - 1);
+            sample = sample * num_roots - first_extra;
+        }
+        for (int i = 0; i < num_roots; i++) {
+            roots[i].num_samples = num_h_samples / num_roots;
+            if ((i - first_extra + num_roots) % num_roots < num_extra_samples) {
+                roots[i].num_samples++;
+            }
+            roots[i].pmf = Real(1) / num_roots;
+            if (roots[i].num_samples > 0) {
+                *stack_ptr++ = roots[i];
             }
-        }
-
-        if (samples_cs > 0) {
-            *stack_ptr++ = BVHStackItemH{
-                BVHNodePtr{edge_tree_roots.cs_bvh_root}, samples_cs, prob_cs};
-        }
-        if (samples_ncs > 0) {
-            *stack_ptr++ = BVHStackItemH{
-                BVHNodePtr{edge_tree_roots.ncs_bvh_root}, samples_ncs, prob_ncs};
         }
         while (stack_ptr != &buffer[0]) {
             assert(stack_ptr > &buffer[0] && stack_ptr < &buffer[buffer_size]);
             // pop from stack
-            const auto &stack_item = *--stack_ptr;
-            if (is_leaf(stack_item.node_ptr)) {
+            auto stack_item = *--stack_ptr;
+            if (stack_item.tree == c_instance_tree && is_leaf(stack_item.node_ptr)) {
+                // Continue in the local tree placed by the shape of the leaf
+                auto shape_id = get_edge_id(stack_item.node_ptr);
+                *stack_ptr++ = BVHStackItemH{BVHNodePtr{local_root(shape_id)},
+                    stack_item.num_samples, stack_item.pmf, shape_id};
+            } else if (is_leaf(stack_item.node_ptr)) {
+                auto edge = leaf_edge(stack_item.node_ptr, stack_item.tree);
                 auto w = stack_item.num_samples *
-                    leaf_importance(stack_item.node_ptr, p, m, m_inv) /
+                    leaf_importance(edge, p, m, m_inv) /
                     stack_item.pmf;
                 if (w > 0) {
                     auto prev_wsum = wsum;
                     wsum += w;
                     auto normalized_w = w / wsum;
                     if (resample_sample <= normalized_w || prev_wsum == 0) {
-                        selected_edge = get_edge_id(stack_item.node_ptr);
+                        selected_edge = edge;
                         edge_weight = w * stack_item.pmf;
                         // rescale sample to [0, 1]
                         resample_sample /= normalized_w;
@@ -1192,11 +1362,11 @@ struct secondary_edge_sampler {
                 BVHNodePtr children[2];
                 get_children(stack_item.node_ptr, children);
                 auto imp0 = Real(0), imp1 = Real(0);
-                if (inside(stack_item.node_ptr, p)) {
+                if (inside(stack_item.node_ptr, stack_item.tree, p)) {
                     imp0 = imp1 = Real(1);
                 } else {
-                    imp0 = importance(children[0], p, m, m_inv);
-                    imp1 = importance(children[1], p, m, m_inv);
+                    imp0 = importance(children[0], stack_item.tree, p, m, m_inv);
+                    imp1 = importance(children[1], stack_item.tree, p, m, m_inv);
                 }
                 if (imp0 > 0 || imp1 > 0) {
                     auto prob0 = imp0 / (imp0 + imp1);
@@ -1217,18 +1387,18 @@ struct secondary_edge_sampler {
                     }
                     auto current_pmf = stack_item.pmf;
                     if (samples0 > 0) {
-                        *stack_ptr++ = BVHStackItemH{
-                            BVHNodePtr(children[0]), samples0, current_pmf * prob0};
+                        *stack_ptr++ = BVHStackItemH{BVHNodePtr(children[0]),
+                            samples0, current_pmf * prob0, stack_item.tree};
                     }
                     if (samples1 > 0) {
-                        *stack_ptr++ = BVHStackItemH{
-                            BVHNodePtr(children[1]), samples1, current_pmf * prob1};
+                        *stack_ptr++ = BVHStackItemH{BVHNodePtr(children[1]),
+                            samples1, current_pmf * prob1, stack_item.tree};
                     }
                 }
             }
         }
         if (edge_weight <= 0 || wsum <= 0) {
-            return -1;
+            return Edge{};
         }
 
         auto pmf_h = edge_weight * num_h_samples / wsum;
@@ -1236,20 +1406,20 @@ struct secondary_edge_sampler {
         return selected_edge;
     }
 
-    DEVICE int sample_edge_l(const EdgeTreeRoots &edge_tree_roots,
-                             const SurfacePoint &p,
-                             const Matrix3x3 &m,
-                             const Matrix3x3 &m_inv,
-                             const Ray &nee_ray,
-                             const Intersection &nee_isect,
-                             const SurfacePoint &nee_point,
-                             Real resample_sample,
-                             Real &sample_weight,
-                             Vector3 &edge_pt,
-                             Vector3 &mwt) {
+    DEVICE Edge sample_edge_l(const EdgeTreeRoots &edge_tree_roots,
+                              const SurfacePoint &p,
+                              const Matrix3x3 &m,
+                              const Matrix3x3 &m_inv,
+                              const Ray &nee_ray,
+                              const Intersection &nee_isect,
+                              const SurfacePoint &nee_point,
+                              Real resample_sample,
+                              Real &sample_weight,
+                              Vector3 &edge_pt,
+                              Vector3 &mwt) {
         constexpr auto buffer_size = 128;
         BVHStackItemL buffer[buffer_size];
-        auto selected_edge = -1;
+        auto selected_edge = Edge{};
         auto edge_weight = Real(0);
         auto wsum = Real(0);
 
@@ -1259,25 +1429,35 @@ struct secondary_edge_sampler {
         // push both nodes into stack
         if (edge_tree_roots.cs_bvh_root != nullptr) {
             *stack_ptr++ = BVHStackItemL{
-                BVHNodePtr{edge_tree_roots.cs_bvh_root}};
+                BVHNodePtr{edge_tree_roots.cs_bvh_root}, c_world_tree};
         }
         if (edge_tree_roots.ncs_bvh_root != nullptr) {
             *stack_ptr++ = BVHStackItemL{
-                BVHNodePtr{edge_tree_roots.ncs_bvh_root}};
+                BVHNodePtr{edge_tree_roots.ncs_bvh_root}, c_world_tree};
+        }
+        if (edge_tree_roots.instance_bvh_root != nullptr) {
+            *stack_ptr++ = BVHStackItemL{
+                BVHNodePtr{edge_tree_roots.instance_bvh_root}, c_instance_tree};
         }
         while (stack_ptr != &buffer[0]) {
             assert(stack_ptr > &buffer[0] && stack_ptr < &buffer[buffer_size]);
             // pop from stack
-            const auto &stack_item = *--stack_ptr;
-            if (is_leaf(stack_item.node_ptr)) {
-                auto w = leaf_importance(stack_item.node_ptr, p, m, m_inv,
+            auto stack_item = *--stack_ptr;
+            if (stack_item.tree == c_instance_tree && is_leaf(stack_item.node_ptr)) {
+                // Continue in the local tree placed by the shape of the leaf,
+                // the bounds of the leaf are the bounds of the moved tree
+                auto shape_id = get_edge_id(stack_item.node_ptr);
+                *stack_ptr++ = BVHStackItemL{BVHNodePtr{local_root(shape_id)}, shape_id};
+            } else if (is_leaf(stack_item.node_ptr)) {
+                auto edge = leaf_edge(stack_item.node_ptr, stack_item.tree);
+                auto w = leaf_importance(edge, p, m, m_inv,
                     nee_ray, nee_isect, edge_bounds_expand);
                 if (w > 0) {
                     auto prev_wsum = wsum;
                     wsum += w;
                     auto normalized_w = w / wsum;
                     if (resample_sample <= normalized_w || prev_wsum == 0) {
-                        selected_edge = get_edge_id(stack_item.node_ptr);
+                        selected_edge = edge;
                         edge_weight = w;
                         // rescale sample to [0, 1]
                         resample_sample /= normalized_w;
@@ -1289,47 +1469,47 @@ struct secondary_edge_sampler {
             } else {
                 BVHNodePtr children[2];
                 get_children(stack_item.node_ptr, children);
+                auto tree = stack_item.tree;
                 if (nee_isect.valid()) {
                     auto nee_pt = nee_point.position;
                     if (contains_silhouette(children[0], p.position) &&
                             contains_silhouette(children[0], nee_pt) &&
-                            intersect(children[0], nee_ray, edge_bounds_expand)) {
-                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[0])};
+                            intersect_node(children[0], tree, nee_ray)) {
+                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[0]), tree};
                     }
                     if (contains_silhouette(children[1], p.position) &&
                             contains_silhouette(children[1], nee_pt) &&
-                            intersect(children[1], nee_ray, edge_bounds_expand)) {
-                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[1])};
+                            intersect_node(children[1], tree, nee_ray)) {
+                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[1]), tree};
                     }
                 } else {
                     // Infinitely far nee rays
                     // TODO: silhouette detection for infinitely far positions
                     if (contains_silhouette(children[0], p.position) &&
-                            intersect(children[0], nee_ray, edge_bounds_expand)) {
-                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[0])};
+                            intersect_node(children[0], tree, nee_ray)) {
+                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[0]), tree};
                     }
                     if (contains_silhouette(children[1], p.position) &&
-                            intersect(children[1], nee_ray, edge_bounds_expand)) {
-                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[1])};
+                            intersect_node(children[1], tree, nee_ray)) {
+                        *stack_ptr++ = BVHStackItemL{BVHNodePtr(children[1]), tree};
                     }
                 }
             }
         }
-        if (selected_edge == -1) {
-            return -1;
+        if (selected_edge.shape_id == -1) {
+            return selected_edge;
         }
 
         auto pmf = edge_weight / wsum;
         // Intersect nee_ray with the edge billboard
-        const auto &edge = edges[selected_edge];
-        auto v0 = Vector3{get_v0(scene.shapes, edge)};
-        auto v1 = Vector3{get_v1(scene.shapes, edge)};
+        auto v0 = Vector3{get_v0(scene.shapes, selected_edge)};
+        auto v1 = Vector3{get_v1(scene.shapes, selected_edge)};
         auto plane_pt = v0;
         auto plane_normal = nee_ray.dir;
         auto t = -(dot(nee_ray.org, plane_normal) - dot(plane_pt, plane_normal)) /
             dot(nee_ray.dir, plane_normal);
         if (t < nee_ray.tmin || t > nee_ray.tmax) {
-            return -1;
+            return Edge{};
         }
         auto isect_pt = nee_ray.org + nee_ray.dir * t;
         auto isect_jac = Real(0);
@@ -1343,16 +1523,14 @@ struct secondary_edge_sampler {
             isect_jac = length(tau * ((v1 - v0) -
                         omega * (dot(v1 - v0, nee_normal) / dot(omega, nee_normal))));
             const auto &light_shape = scene.shapes[nee_isect.shape_id];
-            auto light_pmf = scene.light_pmf[light_shape.light_id];
-            auto light_area = scene.light_areas[light_shape.light_id];
-            pdf_nee = light_pmf / light_area;
+            pdf_nee = light_pdf(scene, p, light_shape.light_id, nee_isect.tri_id);
         } else {
             // Environment map sampling
             isect_jac = 1 / distance_squared(isect_pt, nee_ray.org);
             pdf_nee = envmap_pdf(*scene.envmap, nee_ray.dir);
         }
         if (pmf <= 0 || isect_jac <= 0 || pdf_nee <= 0) {
-            return -1;
+            return Edge{};
         }
         sample_weight = 1 / (2 * edge_bounds_expand * pmf * isect_jac * pdf_nee);
         // Project isect_pt to corresponding point on the edge
@@ -1363,6 +1541,24 @@ struct secondary_edge_sampler {
         return selected_edge;
     }
     
+    /// Samples an edge from the global distribution, and one of the shapes using
+    /// it uniformly. The pmf is for the pair.
+    DEVICE Edge sample_edge_cdf(Real sel, Real &pmf) {
+        const Real *edge_ptr = thrust::upper_bound(thrust::seq,
+                edges_cdf, edges_cdf + num_edges, sel);
+        auto edge_id = clamp((int)(edge_ptr - edges_cdf - 1), 0, num_edges - 1);
+        auto edge = edges[edge_id];
+        auto num_users = shape_num_users[edge.shape_id];
+        pmf = edges_pmf[edge_id] / num_users;
+        if (num_users > 1 && edges_pmf[edge_id] > 0) {
+            // Reuse the sample for picking the shape
+            auto user_sel = (sel - edges_cdf[edge_id]) / edges_pmf[edge_id];
+            auto user = clamp(int(user_sel * num_users), 0, num_users - 1);
+            edge.shape_id = shape_users[shape_user_offsets[edge.shape_id] + user];
+        }
+        return edge;
+    }
+
     DEVICE void operator()(int idx) {
         auto pixel_id = active_pixels[idx];
         const auto &edge_sample = edge_samples[idx];
@@ -1447,7 +1643,7 @@ struct secondary_edge_sampler {
             m_pmf = specular_pmf;
         }
 
-        auto edge_id = -1;
+        auto edge = Edge{};
         auto edge_weight = Real(0);
         auto sample_p = Vector3{};
         auto mwt = Vector3{};
@@ -1472,16 +1668,16 @@ struct secondary_edge_sampler {
             }
             if (edges_pmf != nullptr) {
                 if (c_uniform_sampling) {
-                    const Real *edge_ptr = thrust::upper_bound(thrust::seq,
-                            edges_cdf, edges_cdf + num_edges, edge_sel);
-                    edge_id = clamp((int)(edge_ptr - edges_cdf - 1), 0, num_edges - 1);
-                    edge_weight = 1 / edges_pmf[edge_id];
+                    auto edge_pmf = Real(0);
+                    edge = sample_edge_cdf(edge_sel, edge_pmf);
+                    edge_weight = 1 / edge_pmf;
                 } else {
                     // Sample an edge by importance resampling:
                     // We randomly sample M edges, estimate contribution based on LTC, 
                     // then sample based on the estimated contribution.
                     constexpr int M = 64;
-                    int edge_ids[M];
+                    Edge sampled_edges[M];
+                    Real sampled_edges_pmf[M];
                     Real edge_weights[M];
                     Real resample_cdf[M];
                     for (int sample_id = 0; sample_id < M; sample_id++) {
@@ -1489,18 +1685,15 @@ struct secondary_edge_sampler {
                         // We use some form of stratification over the M samples here: 
                         // the random number we use is mod(edge_sample.edge_sel + i / M, 1)
                         // It enables us to choose M edges with a single random number
-                        const Real *edge_ptr = thrust::upper_bound(thrust::seq,
-                                edges_cdf, edges_cdf + num_edges,
-                                modulo(edge_sel + Real(sample_id) / M, Real(1)));
-                        auto edge_id = clamp((int)(edge_ptr - edges_cdf - 1), 0, num_edges - 1);
-                        edge_ids[sample_id] = edge_id;
+                        auto &edge_pmf = sampled_edges_pmf[sample_id];
+                        const auto &edge = sampled_edges[sample_id] = sample_edge_cdf(
+                            modulo(edge_sel + Real(sample_id) / M, Real(1)), edge_pmf);
                         edge_weights[sample_id] = 0;
-                        const auto &edge = edges[edge_id];
                         // If the edge lies on the same triangle of shading isects, the weight is 0
                         // If not a silhouette edge, the weight is 0
                         bool same_tri = edge.shape_id == shading_isect.shape_id &&
                             (edge.v0 == shading_isect.tri_id || edge.v1 == shading_isect.tri_id);
-                        if (edges_pmf[edge_id] > 0 &&
+                        if (edge_pmf > 0 &&
                                 is_silhouette(scene.shapes, shading_point.position, edge) &&
                                 !same_tri) {
                             auto v0 = Vector3{get_v0(scene.shapes, edge)};
@@ -1532,7 +1725,7 @@ struct secondary_edge_sampler {
                                     };
                                     auto Il0 = I(l0);
                                     auto Il1 = I(l1);
-                                    edge_weights[sample_id] = max((Il1 - Il0) / edges_pmf[edge_id], Real(0));
+                                    edge_weights[sample_id] = max((Il1 - Il0) / edge_pmf, Real(0));
                                 }
                             }
                         }
@@ -1560,20 +1753,19 @@ struct secondary_edge_sampler {
                         return;
                     }
                     edge_weight = (resample_cdf[M - 1] / M) /
-                        (edge_weights[resample_id] * edges_pmf[edge_ids[resample_id]]);
-                    edge_id = edge_ids[resample_id];
+                        (edge_weights[resample_id] * sampled_edges_pmf[resample_id]);
+                    edge = sampled_edges[resample_id];
                 }
             } else {
                 // sample using a tree traversal
-                edge_id = sample_edge_h(edge_tree_roots,
+                edge = sample_edge_h(edge_tree_roots,
                     shading_point, m, m_inv, nee_ray,
                     edge_sel, edge_sample.resample_sel, edge_weight);
-                if (edge_id == -1 || edge_weight <= 0) {
+                if (edge.shape_id == -1 || edge_weight <= 0) {
                     return;
                 }
             }
 
-            const auto &edge = edges[edge_id];
             if (!is_silhouette(scene.shapes, shading_point.position, edge)) {
                 return;
             }
@@ -1653,16 +1845,15 @@ struct secondary_edge_sampler {
             mwt = m * wt;
         } else {
             // edge_sel *= 2;
-            edge_id = sample_edge_l(edge_tree_roots,
+            edge = sample_edge_l(edge_tree_roots,
                  shading_point, m, m_inv, nee_ray, nee_isect, nee_point,
                  edge_sample.resample_sel, edge_weight, sample_p,
                  mwt);
-            if (edge_id == -1 || edge_weight <= 0) {
+            if (edge.shape_id == -1 || edge_weight <= 0) {
                 return;
             }
         }
 
-        const auto &edge = edges[edge_id];
         auto v0 = Vector3{get_v0(scene.shapes, edge)};
         auto v1 = Vector3{get_v1(scene.shapes, edge)};
         // shading_point.position, v0 and v1 forms a half-plane
@@ -1683,7 +1874,7 @@ struct secondary_edge_sampler {
         }
 
         // Setup output
-        auto nd = channel_info.num_total_dimensions;
+        auto nd = int64_t(channel_info.num_total_dimensions);
         auto rd = channel_info.radiance_dimension;
         auto d_color = Vector3{0, 0, 0};
         if (rd != -1) {
@@ -1749,6 +1940,9 @@ struct secondary_edge_sampler {
     const Vector3 cam_org;
     const Real *edges_pmf;
     const Real *edges_cdf;
+    const int *shape_user_offsets;
+    const int *shape_num_users;
+    const int *shape_users;
     const EdgeTreeRoots edge_tree_roots;
     const Real edge_bounds_expand;
     const int *active_pixels;
@@ -1800,6 +1994,9 @@ void sample_secondary_edges(const Scene &scene,
         cam_org,
         scene.edge_sampler.secondary_edges_pmf.begin(),
         scene.edge_sampler.secondary_edges_cdf.begin(),
+        scene.edge_sampler.shape_user_offsets.begin(),
+        scene.edge_sampler.shape_num_users.begin(),
+        scene.edge_sampler.shape_users.begin(),
         get_edge_tree_roots(edge_tree),
         edge_tree != nullptr ? edge_tree->edge_bounds_expand : Real(0),
         active_pixels.begin(),
@@ -2038,8 +2235,10 @@ struct secondary_edge_derivatives_accumulator {
         assert(isfinite(dcolor_dp));
 
         d_points[pixel_id].position += dcolor_dp;
-        atomic_add(&(d_shapes[edge_record.edge.shape_id].vertices[3 * edge_record.edge.v0]), dcolor_dv0);
-        atomic_add(&(d_shapes[edge_record.edge.shape_id].vertices[3 * edge_record.edge.v1]), dcolor_dv1);
+        const auto &shape = shapes[edge_record.edge.shape_id];
+        auto &d_shape = d_shapes[edge_record.edge.shape_id];
+        atomic_add_vertex_derivative(shape, d_shape, edge_record.edge.v0, dcolor_dv0);
+        atomic_add_vertex_derivative(shape, d_shape, edge_record.edge.v1, dcolor_dv1);
     }
 
     const Shape *shapes;
@@ -62,9 +62,26 @@ struct EdgeSampler {
     EdgeSampler(const std::vector<const Shape*> &shapes,
                 const Scene &scene);
 
+    // The edges of the shapes that are not instances. The instances use the
+    // edges of their prototype: the sampled edges are relabelled with the
+    // shape id of the instance, so that its transform is applied.
+    // The edges of the shapes without instances come first.
     Buffer<Edge> edges;
+    // By shape id: the edges of the shape ([offset, offset + count) in edges),
+    // and the shapes using them ([offset, offset + count) in shape_users)
+    Buffer<int> shape_edge_offsets;
+    Buffer<int> shape_num_edges;
+    Buffer<int> shape_user_offsets;
+    Buffer<int> shape_num_users;
+    Buffer<int> shape_users;
+    // Primary edges are sampled by first picking a shape (primary_shapes_pmf/cdf),
+    // then an edge of the shape (the unnormalized primary_edges_pmf/cdf
+    // of the range of the shape, primary_edges_total by shape id).
+    Buffer<Real> primary_shapes_pmf;
+    Buffer<Real> primary_shapes_cdf;
     Buffer<Real> primary_edges_pmf;
     Buffer<Real> primary_edges_cdf;
+    Buffer<Real> primary_edges_total;
     Buffer<Real> secondary_edges_pmf;
     Buffer<Real> secondary_edges_cdf;
     // For secondary edges
@@ -240,6 +257,34 @@ inline Real compute_exterior_dihedral_angle(const Shape *shapes, const Edge &edg
     return exterior_dihedral;
 }
 
+/// Bounds in the coordinates of the vertex buffer of the shape to world space
+DEVICE
+inline AABB3 get_instance_bounds(const Shape &shape, const AABB3 &bounds) {
+    if (!shape.has_transform) {
+        return bounds;
+    }
+    auto to_world = Matrix4x4(shape.to_world);
+    auto ret = AABB3();
+    for (int i = 0; i < 8; i++) {
+        ret = merge(ret, xfm_point(to_world, corner(bounds, i)));
+    }
+    return ret;
+}
+
+/// How much the transform of the shape scales the edge lengths
+/// (exact for a uniform scale)
+DEVICE
+inline Real get_instance_scale(const Shape &shape) {
+    if (!shape.has_transform) {
+        return Real(1);
+    }
+    const auto &m = shape.to_world;
+    auto det = m(0, 0) * (m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1)) -
+               m(0, 1) * (m(1, 0) * m(2, 2) - m(1, 2) * m(2, 0)) +
+               m(0, 2) * (m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0));
+    return cbrt(fabs(Real(det)));
+}
+
 void initialize_ltc_table(bool use_gpu);
 
 void sample_primary_edges(const Scene &scene,
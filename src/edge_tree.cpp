@@ -5,6 +5,7 @@
 #include "edge.h"
 #include "parallel.h"
 #include "thrust_utils.h"
+#include "radix_tree.h"
 
 #include <thrust/transform_reduce.h>
 #include <thrust/sequence.h>
@@ -73,14 +74,17 @@ struct edge_6d_bounds_computer {
     AABB6 *edge_aabbs;
 };
 
+/// Bounds of edges[begin, end) into edge_aabbs[begin, end)
 void compute_edge_bounds(const Shape *shapes,
                          const BufferView<Edge> &edges,
+                         int64_t begin,
+                         int64_t end,
                          const Vector3 cam_org,
                          BufferView<AABB6> edge_aabbs,
                          bool use_gpu) {
     parallel_for(edge_6d_bounds_computer{
-                     shapes, edges.begin(), cam_org, edge_aabbs.begin()},
-                 edges.size(),
+                     shapes, edges.begin() + begin, cam_org, edge_aabbs.begin() + begin},
+                 end - begin,
                  use_gpu);
 }
 
@@ -112,18 +116,10 @@ struct id_to_edge_pt_abs {
     Vector3 mean;
 };
 
-struct id_to_aabb3 {
-    DEVICE AABB3 operator()(int id) const {
-        auto b = bounds[id];
-        return AABB3{b.p_min, b.p_max};
-    }
-
-    const AABB6 *bounds;
-};
-
-struct id_to_aabb6 {
-    DEVICE AABB6 operator()(int id) const {
-        return bounds[id];
+template <typename AABBType>
+struct id_to_aabb {
+    DEVICE AABBType operator()(int id) const {
+        return convert_aabb<AABBType>(bounds[id]);
     }
 
     const AABB6 *bounds;
@@ -163,38 +159,39 @@ struct sum_vec3 {
     }
 };
 
-struct morton_code_3d_computer {
-    DEVICE uint64_t expand_bits(uint64_t x) {
-        // Insert two zero after every bit given a 21-bit integer
-        // https://github.com/leonardo-domingues/atrbvh/blob/master/BVHRT-Core/src/Commons.cuh#L599
-        uint64_t expanded = x;
-        expanded &= 0x1fffff;
-        expanded = (expanded | expanded << 32) & 0x1f00000000ffff;
-        expanded = (expanded | expanded << 16) & 0x1f0000ff0000ff;
-        expanded = (expanded | expanded << 8) & 0x100f00f00f00f00f;
-        expanded = (expanded | expanded << 4) & 0x10c30c30c30c30c3;
-        expanded = (expanded | expanded << 2) & 0x1249249249249249;
-        return expanded;
-    }
-
-    DEVICE uint64_t morton3D(const Vector3 &p) {
-        auto pp = (p - scene_bounds.p_min) / (scene_bounds.p_max - scene_bounds.p_min);
-        for (int i = 0; i < 3; i++) {
-            if (scene_bounds.p_max[i] - scene_bounds.p_min[i] <= 0.f) {
-                pp[i] = 0.5f;
-            }
-        }
-        auto scale = (1 << 21) - 1;
-        TVector3<uint64_t> pp_i{pp.x * scale, pp.y * scale, pp.z * scale};
-        return (expand_bits(pp_i.x) << 2u) |
-               (expand_bits(pp_i.y) << 1u) |
-               (expand_bits(pp_i.z) << 0u);
+struct edge_weight_computer {
+    DEVICE void operator()(int idx) {
+        // length * (pi - dihedral angle)
+        const auto &edge = edges[idx];
+        auto v0 = get_v0(shapes, edge);
+        auto v1 = get_v1(shapes, edge);
+        auto exterior_dihedral = compute_exterior_dihedral_angle(shapes, edge);
+        weights[idx] = distance(v0, v1) * exterior_dihedral;
     }
 
+    const Shape *shapes;
+    const Edge *edges;
+    Real *weights;
+};
+
+/// Weights of edges[begin, end) into weights[begin, end)
+void compute_edge_weights(const Shape *shapes,
+                          const BufferView<Edge> &edges,
+                          int64_t begin,
+                          int64_t end,
+                          BufferView<Real> weights,
+                          bool use_gpu) {
+    parallel_for(edge_weight_computer{
+                     shapes, edges.begin() + begin, weights.begin() + begin},
+                 end - begin,
+                 use_gpu);
+}
+
+struct morton_code_3d_computer {
     DEVICE void operator()(int idx) {
         // This might be suboptimal -- should probably use raw edge information directly
         auto box = convert_aabb<AABB3>(edge_aabbs[edge_ids[idx]]);
-        morton_codes[idx] = morton3D(0.5f * (box.p_min + box.p_max));
+        morton_codes[idx] = morton_code_3d(scene_bounds, 0.5f * (box.p_min + box.p_max));
     }
 
     const AABB3 scene_bounds;
@@ -279,129 +276,14 @@ void compute_morton_codes(const AABB6 &scene_bounds,
                  use_gpu);
 }
 
-template <typename BVHNodeType>
-struct radix_tree_builder {
-    // https://github.com/henrikdahlberg/GPUPathTracer/blob/master/Source/Core/BVHConstruction.cu#L62
-    DEVICE int longest_common_prefix(int idx0, int idx1) {
-        if (idx0 < 0 || idx0 >= num_primitives || idx1 < 0 || idx1 >= num_primitives) {
-            return -1;
-        }
-        auto mc0 = morton_codes[idx0];
-        auto mc1 = morton_codes[idx1];
-        if (mc0 == mc1) {
-            // Break even when the Morton codes are the same
-            auto id0 = (uint64_t)edge_ids[idx0];
-            auto id1 = (uint64_t)edge_ids[idx1];
-            return clz(mc0 ^ mc1) + clz(id0 ^ id1);
-        }
-        else {
-            return clz(mc0 ^ mc1);
-        }
-    }
-
-    DEVICE void operator()(int idx) {
-        // Mostly adapted from 
-        // https://github.com/henrikdahlberg/GPUPathTracer/blob/master/Source/Core/BVHConstruction.cu#L161
-        // Also see Figure 4 in
-        // https://devblogs.nvidia.com/wp-content/uploads/2012/11/karras2012hpg_paper.pdf
-
-        if (idx >= num_primitives - 1) {
-            if (num_primitives == 1) {
-                // Special case: if there is only one primitive, set it as the root
-                nodes[0] = leaves[0];
-            }
-            return;
-        }
-
-        // Compute upper bound for the length of the range
-        auto d = longest_common_prefix(idx, idx + 1) -
-                 longest_common_prefix(idx, idx - 1) >= 0 ? 1 : -1;
-        auto delta_min = longest_common_prefix(idx, idx - d);
-        auto lmax = 2;
-        while (longest_common_prefix(idx, idx + lmax * d) > delta_min) {
-            lmax *= 2;
-        }
-        // Find the other end using binary search
-        auto l = 0;
-        auto divider = 2;
-        for (int t = lmax / divider; t >= 1;) {
-            if (longest_common_prefix(idx, idx + (l + t) * d) > delta_min) {
-                l += t;
-            }
-            if (t == 1) {
-                break;
-            }
-            divider *= 2;
-            t = lmax / divider;
-        }
-        auto j = idx + l * d;
-        // Find the split position using binary search
-        auto delta_node = longest_common_prefix(idx, j);
-        auto s = 0;
-        divider = 2;
-        for (int t = (l + (divider - 1)) / divider; t >= 1;) {
-            if (longest_common_prefix(idx, idx + (s + t) * d) > delta_node) {
-                s += t;
-            }
-            if (t == 1) {
-                break;
-            }
-            divider *= 2;
-            t = (l + (divider - 1)) / divider;
-        }
-        auto gamma = idx + s * d + min(d, 0);
-        assert(gamma >= 0 && gamma + 1 < num_primitives);
-        auto &node = nodes[idx];
-        if (min(idx, j) == gamma) {
-            node.children[0] = &leaves[gamma];
-            leaves[gamma].parent = &node;
-        } else {
-            node.children[0] = &nodes[gamma];
-            nodes[gamma].parent = &node;
-        }
-        if (max(idx, j) == gamma + 1) {
-            node.children[1] = &leaves[gamma + 1];
-            leaves[gamma + 1].parent = &node;
-        } else {
-            node.children[1] = &nodes[gamma + 1];
-            nodes[gamma + 1].parent = &node;
-        }
-    }
-
-    const uint64_t *morton_codes;
-    const int *edge_ids;
-    const int num_primitives;
-    BVHNodeType *nodes;
-    BVHNodeType *leaves;
-};
-
-template <typename BVHNodeType>
-void build_radix_tree(const BufferView<uint64_t> &morton_codes,
-                      const BufferView<int> &edge_ids,
-                      BufferView<BVHNodeType> nodes,
-                      BufferView<BVHNodeType> leaves,
-                      bool use_gpu) {
-    parallel_for(radix_tree_builder<BVHNodeType>{
-        morton_codes.begin(), edge_ids.begin(),
-            morton_codes.size(), nodes.begin(), leaves.begin()},
-        morton_codes.size(),
-        use_gpu);
-}
-
 template <typename BVHNodeType>
 struct bvh_computer {
     DEVICE void operator()(int idx) {
-        auto edge_id = edge_ids[idx];
-        assert(edge_id >= 0 && edge_id < num_edges);
-        const auto &edge = edges[edge_id];
+        auto id = ids[idx];
         auto leaf = &leaves[idx];
-        leaf->bounds = convert_aabb<decltype(BVHNodeType::bounds)>(bounds[edge_id]);
-        // length * (pi - dihedral angle)
-        auto v0 = get_v0(shapes, edge);
-        auto v1 = get_v1(shapes, edge);
-        auto exterior_dihedral = compute_exterior_dihedral_angle(shapes, edge);
-        leaf->weighted_total_length = distance(v0, v1) * exterior_dihedral;
-        leaf->edge_id = edge_ids[idx];
+        leaf->bounds = convert_aabb<decltype(BVHNodeType::bounds)>(bounds[id]);
+        leaf->weighted_total_length = weights[id];
+        leaf->edge_id = id;
 
         // Trace from leaf to root and merge bounding boxes & length
         auto current = leaf->parent;
@@ -433,29 +315,27 @@ struct bvh_computer {
         }
     }
 
-    const Shape *shapes;
-    const Edge *edges;
-    const int num_edges;
-    const int *edge_ids;
+    const int *ids;
     const AABB6 *bounds;
+    const Real *weights;
     const int num_leaves;
     int *node_counters;
     BVHNodeType *nodes;
     BVHNodeType *leaves;
 };
 
+/// ids index bounds and weights, the leaves get the weights as their lengths
 template <typename BVHNodeType>
-void compute_bvh(const BufferView<Shape> &shapes,
-                 const BufferView<Edge> &edges,
-                 const BufferView<int> &edge_ids,
+void compute_bvh(const BufferView<int> &ids,
                  const BufferView<AABB6> &bounds,
+                 const BufferView<Real> &weights,
                  BufferView<int> node_counters,
                  BufferView<BVHNodeType> nodes,
                  BufferView<BVHNodeType> leaves,
                  bool use_gpu) {
-    assert(leaves.size() == edge_ids.size());
+    assert(leaves.size() == ids.size());
     parallel_for(bvh_computer<BVHNodeType>{
-            shapes.begin(), edges.begin(), edges.size(), edge_ids.begin(), bounds.begin(), leaves.size(),
+            ids.begin(), bounds.begin(), weights.begin(), (int)leaves.size(),
             node_counters.begin(), nodes.begin(), leaves.begin()},
         leaves.size(),
         use_gpu);
@@ -721,10 +601,63 @@ void optimize_bvh(BufferView<int> node_counters,
         use_gpu);
 }
 
+/// Builds a LBVH over bounds[ids] with weights[ids] as the lengths of the leaves.
+/// ids is sorted by Morton code in place.
+template <typename BVHNodeType>
+void build_bvh(BufferView<int> ids,
+               const BufferView<AABB6> &bounds,
+               const BufferView<Real> &weights,
+               BufferView<int> node_counters,
+               BufferView<BVHNodeType> nodes,
+               BufferView<BVHNodeType> leaves,
+               bool use_gpu) {
+    using AABBType = decltype(BVHNodeType::bounds);
+    assert(ids.size() > 0 && leaves.size() == ids.size());
+    // Compute scene bounding box for BVH
+    AABBType scene_bounds = DISPATCH(use_gpu,
+        thrust::transform_reduce, ids.begin(), ids.end(),
+        id_to_aabb<AABBType>{bounds.begin()}, AABBType(), union_bounding_box{});
+    assert(scene_bounds.p_max.x - scene_bounds.p_min.x >= 0.f &&
+           scene_bounds.p_max.y - scene_bounds.p_min.y >= 0.f &&
+           scene_bounds.p_max.z - scene_bounds.p_min.z >= 0.f);
+    // Compute Morton code for LBVH
+    Buffer<uint64_t> morton_codes(use_gpu, ids.size());
+    compute_morton_codes(scene_bounds,
+                         bounds,
+                         ids,
+                         morton_codes.view(0, ids.size()),
+                         use_gpu);
+    // Sort by Morton code
+    DISPATCH(use_gpu, thrust::stable_sort_by_key,
+        morton_codes.begin(), morton_codes.end(), ids.begin());
+    // Initialize nodes
+    BVHNodeType init_node{AABBType(), Real(0), nullptr, {nullptr, nullptr}, -1};
+    DISPATCH(use_gpu, thrust::fill, nodes.begin(), nodes.end(), init_node);
+    DISPATCH(use_gpu, thrust::fill, leaves.begin(), leaves.end(), init_node);
+    // Build tree (see
+    // "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees")
+    build_radix_tree(morton_codes.view(0, morton_codes.size()),
+                     ids,
+                     nodes,
+                     leaves,
+                     use_gpu);
+    // Compute BVH node information (bounding box, length of edges, etc)
+    DISPATCH(use_gpu, thrust::fill,
+        node_counters.begin(), node_counters.begin() + leaves.size(), 0);
+    compute_bvh(ids, bounds, weights, node_counters, nodes, leaves, use_gpu);
+    DISPATCH(use_gpu, thrust::fill,
+        node_counters.begin(), node_counters.begin() + leaves.size(), 0);
+    optimize_bvh(node_counters, nodes, leaves, use_gpu);
+}
+
 EdgeTree::EdgeTree(bool use_gpu,
                    const Camera &camera,
                    const BufferView<Shape> &shapes,
-                   const BufferView<Edge> &edges) {
+                   const BufferView<Edge> &edges,
+                   int num_unshared_edges,
+                   const BufferView<int> &shape_edge_offsets,
+                   const BufferView<int> &shape_num_edges,
+                   const BufferView<int> &shape_num_users) {
     if (edges.size() == 0) {
         return;
     }
@@ -744,22 +677,62 @@ EdgeTree::EdgeTree(bool use_gpu,
     // in Hough space.
     // This means we can build a BVH over set 2 and discard edges whose two endpoints
     // are both not inside the v-sphere during traversal.
+    //
+    // The edges of the shapes with instances are placed differently by each instance,
+    // so they can't be classified against the camera. They go in 3D trees in the
+    // coordinates of their vertex buffers instead, below a 3D tree over the instances.
     Buffer<int> edge_ids(use_gpu, edges.size());
     DISPATCH(use_gpu, thrust::sequence, edge_ids.begin(), edge_ids.end());
     auto cam_org = xfm_point(camera.cam_to_world, Vector3{0, 0, 0});
     auto partition_result = DISPATCH(use_gpu,
-        thrust::stable_partition, edge_ids.begin(), edge_ids.end(),
+        thrust::stable_partition, edge_ids.begin(), edge_ids.begin() + num_unshared_edges,
         edge_partitioner{shapes.begin(), cam_org, edges.begin()});
     // We call the set of edges in 1) "cs_edges" and the set 2) "ncs_edges"
     BufferView<int> cs_edge_ids(edge_ids.begin(), partition_result - edge_ids.begin());
-    BufferView<int> ncs_edge_ids(partition_result, edge_ids.end() - partition_result);
-    Buffer<int> node_counters(use_gpu, edges.size());
+    BufferView<int> ncs_edge_ids(partition_result,
+        edge_ids.begin() + num_unshared_edges - partition_result);
+    Buffer<int> node_counters(use_gpu, max(edges.size(), shapes.size()));
     Buffer<AABB6> edge_bounds(use_gpu, edges.size());
+    Buffer<Real> edge_weights(use_gpu, edges.size());
     compute_edge_bounds(shapes.begin(),
                         edges,
+                        0,
+                        num_unshared_edges,
                         cam_org,
-                        edge_bounds.view(0, edge_ids.size()),
+                        edge_bounds.view(0, edge_bounds.size()),
                         use_gpu);
+    compute_edge_weights(shapes.begin(),
+                         edges,
+                         0,
+                         num_unshared_edges,
+                         edge_weights.view(0, edge_weights.size()),
+                         use_gpu);
+    if (num_unshared_edges < edges.size()) {
+        // Ignore the transforms: the shared edges are bounded in the coordinates of
+        // the vertex buffers (the Hough space bounds are unused by the 3D trees)
+        if (use_gpu) {
+            cuda_synchronize();
+        }
+        Buffer<Shape> local_shapes(use_gpu, shapes.size());
+        for (int shape_id = 0; shape_id < shapes.size(); shape_id++) {
+            local_shapes[shape_id] = shapes[shape_id];
+            local_shapes[shape_id].has_transform = false;
+        }
+        compute_edge_bounds(local_shapes.begin(),
+                            edges,
+                            num_unshared_edges,
+                            edges.size(),
+                            cam_org,
+                            edge_bounds.view(0, edge_bounds.size()),
+                            use_gpu);
+        compute_edge_weights(local_shapes.begin(),
+                             edges,
+                             num_unshared_edges,
+                             edges.size(),
+                             edge_weights.view(0, edge_weights.size()),
+                             use_gpu);
+    }
+    // Only the scale of the scene matters here, so the shared edges are counted once
     auto edge_pt_mean = DISPATCH(use_gpu,
         thrust::transform_reduce, edge_ids.begin(), edge_ids.end(),
         id_to_edge_pt_sum{shapes.begin(), edges.begin()},
@@ -776,107 +749,98 @@ EdgeTree::EdgeTree(bool use_gpu,
     // a 6D BVH over the non camera silhouette edges
     // camera silhouette edges
     if (cs_edge_ids.size() > 0) {
-        // Compute scene bounding box for BVH
-        AABB3 cs_scene_bounds = DISPATCH(use_gpu,
-            thrust::transform_reduce, cs_edge_ids.begin(), cs_edge_ids.end(),
-            id_to_aabb3{edge_bounds.begin()}, AABB3(), union_bounding_box{});
-        assert(cs_scene_bounds.p_max.x - cs_scene_bounds.p_min.x >= 0.f &&
-               cs_scene_bounds.p_max.y - cs_scene_bounds.p_min.y >= 0.f &&
-               cs_scene_bounds.p_max.z - cs_scene_bounds.p_min.z >= 0.f);
-        // Compute Morton code for LBVH
-        Buffer<uint64_t> cs_morton_codes(use_gpu, cs_edge_ids.size());
-        compute_morton_codes(cs_scene_bounds,
-                             edge_bounds.view(0, edge_bounds.size()),
-                             cs_edge_ids,
-                             cs_morton_codes.view(0, cs_edge_ids.size()),
-                             use_gpu);
-        // Sort by Morton code
-        DISPATCH(use_gpu, thrust::stable_sort_by_key,
-            cs_morton_codes.begin(), cs_morton_codes.end(), cs_edge_ids.begin());
-
-        cs_bvh_nodes = Buffer<BVHNode3>(use_gpu, max(cs_morton_codes.size() - 1, 1));
-        cs_bvh_leaves = Buffer<BVHNode3>(use_gpu, cs_morton_codes.size());
-        // Initialize nodes
-        BVHNode3 init_node{AABB3(), Real(0), nullptr, {nullptr, nullptr}, -1};
-        DISPATCH(use_gpu, thrust::fill, cs_bvh_nodes.begin(), cs_bvh_nodes.end(), init_node);
-        DISPATCH(use_gpu, thrust::fill, cs_bvh_leaves.begin(), cs_bvh_leaves.end(), init_node);
-        // Build tree (see
-        // "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees")
-        build_radix_tree(cs_morton_codes.view(0, cs_morton_codes.size()),
-                         cs_edge_ids,
-                         cs_bvh_nodes.view(0, cs_bvh_nodes.size()),
-                         cs_bvh_leaves.view(0, cs_bvh_leaves.size()),
-                         use_gpu);
-        // Compute BVH node information (bounding box, length of edges, etc)
-        DISPATCH(use_gpu, thrust::fill,
-            node_counters.begin(), node_counters.begin() + cs_bvh_leaves.size(), 0);
-        compute_bvh(shapes,
-                    edges,
-                    cs_edge_ids,
-                    edge_bounds.view(0, edge_bounds.size()),
-                    node_counters.view(0, cs_bvh_leaves.size()),
-                    cs_bvh_nodes.view(0, cs_bvh_nodes.size()),
-                    cs_bvh_leaves.view(0, cs_bvh_leaves.size()),
-                    use_gpu);
-        DISPATCH(use_gpu, thrust::fill,
-            node_counters.begin(), node_counters.begin() + cs_bvh_leaves.size(), 0);
-        optimize_bvh(node_counters.view(0, cs_bvh_leaves.size()),
-                     cs_bvh_nodes.view(0, cs_bvh_nodes.size()),
-                     cs_bvh_leaves.view(0, cs_bvh_leaves.size()),
-                     use_gpu);
+        cs_bvh_nodes = Buffer<BVHNode3>(use_gpu, max(cs_edge_ids.size() - 1, int64_t(1)));
+        cs_bvh_leaves = Buffer<BVHNode3>(use_gpu, cs_edge_ids.size());
+        build_bvh(cs_edge_ids,
+                  edge_bounds.view(0, edge_bounds.size()),
+                  edge_weights.view(0, edge_weights.size()),
+                  node_counters.view(0, cs_bvh_leaves.size()),
+                  cs_bvh_nodes.view(0, cs_bvh_nodes.size()),
+                  cs_bvh_leaves.view(0, cs_bvh_leaves.size()),
+                  use_gpu);
     }
 
     // Do the same thing for non camera silhouette edges
     if (ncs_edge_ids.size() > 0) {
-        // Compute scene bounding box for BVH
-        AABB6 ncs_scene_bounds = DISPATCH(use_gpu,
-            thrust::transform_reduce, ncs_edge_ids.begin(), ncs_edge_ids.end(),
-            id_to_aabb6{edge_bounds.begin()}, AABB6(), union_bounding_box{});
-        assert(ncs_scene_bounds.p_max.x - ncs_scene_bounds.p_min.x >= 0.f &&
-               ncs_scene_bounds.p_max.y - ncs_scene_bounds.p_min.y >= 0.f &&
-               ncs_scene_bounds.p_max.z - ncs_scene_bounds.p_min.z >= 0.f);
-        assert(ncs_scene_bounds.d_max.x - ncs_scene_bounds.d_min.x >= 0.f &&
-               ncs_scene_bounds.d_max.y - ncs_scene_bounds.d_min.y >= 0.f &&
-               ncs_scene_bounds.d_max.z - ncs_scene_bounds.d_min.z >= 0.f);
-        // Compute Morton code for LBVH
-        Buffer<uint64_t> ncs_morton_codes(use_gpu, ncs_edge_ids.size());
-        compute_morton_codes(ncs_scene_bounds,
-                             edge_bounds.view(0, edge_bounds.size()),
-                             ncs_edge_ids,
-                             ncs_morton_codes.view(0, ncs_edge_ids.size()),
-                             use_gpu);
-        // Sort by Morton code
-        DISPATCH(use_gpu, thrust::stable_sort_by_key,
-            ncs_morton_codes.begin(), ncs_morton_codes.end(), ncs_edge_ids.begin());
-        ncs_bvh_nodes = Buffer<BVHNode6>(use_gpu, max(ncs_morton_codes.size() - 1, 1));
-        ncs_bvh_leaves = Buffer<BVHNode6>(use_gpu, ncs_morton_codes.size());
-        // Initialize nodes
-        BVHNode6 init_node{AABB6(), Real(0), nullptr, {nullptr, nullptr}, -1};
-        DISPATCH(use_gpu, thrust::fill, ncs_bvh_nodes.begin(), ncs_bvh_nodes.end(), init_node);
-        DISPATCH(use_gpu, thrust::fill, ncs_bvh_leaves.begin(), ncs_bvh_leaves.end(), init_node);
-        // Build tree (see
-        // "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees")
-        build_radix_tree(ncs_morton_codes.view(0, ncs_morton_codes.size()),
-                         ncs_edge_ids,
-                         ncs_bvh_nodes.view(0, ncs_bvh_nodes.size()),
-                         ncs_bvh_leaves.view(0, ncs_bvh_leaves.size()),
-                         use_gpu);
-        // Compute BVH node information (bounding box, length of edges, etc)
-        DISPATCH(use_gpu, thrust::fill,
-            node_counters.begin(), node_counters.begin() + ncs_bvh_leaves.size(), 0);
-        compute_bvh(shapes,
-                    edges,
-                    ncs_edge_ids,
-                    edge_bounds.view(0, edge_bounds.size()),
-                    node_counters.view(0, ncs_bvh_leaves.size()),
-                    ncs_bvh_nodes.view(0, ncs_bvh_nodes.size()),
-                    ncs_bvh_leaves.view(0, ncs_bvh_leaves.size()),
-                    use_gpu);
-        DISPATCH(use_gpu, thrust::fill,
-            node_counters.begin(), node_counters.begin() + ncs_bvh_leaves.size(), 0);
-        optimize_bvh(node_counters.view(0, ncs_bvh_leaves.size()),
-                     ncs_bvh_nodes.view(0, ncs_bvh_nodes.size()),
-                     ncs_bvh_leaves.view(0, ncs_bvh_leaves.size()),
-                     use_gpu);
+        ncs_bvh_nodes = Buffer<BVHNode6>(use_gpu, max(ncs_edge_ids.size() - 1, int64_t(1)));
+        ncs_bvh_leaves = Buffer<BVHNode6>(use_gpu, ncs_edge_ids.size());
+        build_bvh(ncs_edge_ids,
+                  edge_bounds.view(0, edge_bounds.size()),
+                  edge_weights.view(0, edge_weights.size()),
+                  node_counters.view(0, ncs_bvh_leaves.size()),
+                  ncs_bvh_nodes.view(0, ncs_bvh_nodes.size()),
+                  ncs_bvh_leaves.view(0, ncs_bvh_leaves.size()),
+                  use_gpu);
+    }
+
+    if (num_unshared_edges == edges.size()) {
+        return;
+    }
+
+    // A local tree for each shape with instances
+    local_bvh_roots = Buffer<const BVHNode3*>(use_gpu, shapes.size());
+    auto num_local_nodes = int64_t(0);
+    for (int shape_id = 0; shape_id < shapes.size(); shape_id++) {
+        local_bvh_roots[shape_id] = nullptr;
+        if (shape_num_users[shape_id] > 1 && shape_num_edges[shape_id] > 0) {
+            num_local_nodes += max(shape_num_edges[shape_id] - 1, 1);
+        }
+    }
+    local_bvh_nodes = Buffer<BVHNode3>(use_gpu, max(num_local_nodes, int64_t(1)));
+    local_bvh_leaves = Buffer<BVHNode3>(use_gpu, edges.size() - num_unshared_edges);
+    auto node_offset = int64_t(0);
+    for (int shape_id = 0; shape_id < shapes.size(); shape_id++) {
+        auto num_edges = shape_num_edges[shape_id];
+        if (shape_num_users[shape_id] <= 1 || num_edges == 0) {
+            continue;
+        }
+        auto num_nodes = max(num_edges - 1, 1);
+        auto edge_offset = shape_edge_offsets[shape_id];
+        auto leaf_offset = edge_offset - num_unshared_edges;
+        build_bvh(edge_ids.view(edge_offset, num_edges),
+                  edge_bounds.view(0, edge_bounds.size()),
+                  edge_weights.view(0, edge_weights.size()),
+                  node_counters.view(0, num_edges),
+                  local_bvh_nodes.view(node_offset, num_nodes),
+                  local_bvh_leaves.view(leaf_offset, num_edges),
+                  use_gpu);
+        local_bvh_roots[shape_id] = get_bvh_root(&local_bvh_nodes[node_offset],
+                                                 &local_bvh_leaves[leaf_offset],
+                                                 num_edges);
+        node_offset += num_nodes;
+    }
+
+    // The instance tree, with the local trees moved by the transforms of the shapes as leaves
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    Buffer<int> instance_ids(use_gpu, shapes.size());
+    Buffer<AABB6> instance_bounds(use_gpu, shapes.size());
+    Buffer<Real> instance_weights(use_gpu, shapes.size());
+    auto num_instances = 0;
+    for (int shape_id = 0; shape_id < shapes.size(); shape_id++) {
+        const auto &shape = shapes[shape_id];
+        auto base_id = shape.prototype_id >= 0 ? shape.prototype_id : shape_id;
+        const auto *root = local_bvh_roots[base_id];
+        if (root == nullptr) {
+            continue;
+        }
+        auto bounds = get_instance_bounds(shape, root->bounds);
+        instance_bounds[shape_id] =
+            AABB6{bounds.p_min, Vector3{0, 0, 0}, bounds.p_max, Vector3{0, 0, 0}};
+        instance_weights[shape_id] =
+            root->weighted_total_length * get_instance_scale(shape);
+        instance_ids[num_instances++] = shape_id;
+    }
+    if (num_instances > 0) {
+        instance_bvh_nodes = Buffer<BVHNode3>(use_gpu, max(num_instances - 1, 1));
+        instance_bvh_leaves = Buffer<BVHNode3>(use_gpu, num_instances);
+        build_bvh(instance_ids.view(0, num_instances),
+                  instance_bounds.view(0, instance_bounds.size()),
+                  instance_weights.view(0, instance_weights.size()),
+                  node_counters.view(0, num_instances),
+                  instance_bvh_nodes.view(0, instance_bvh_nodes.size()),
+                  instance_bvh_leaves.view(0, instance_bvh_leaves.size()),
+                  use_gpu);
     }
 }
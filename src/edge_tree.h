@@ -95,30 +95,67 @@ inline bool intersect(const BVHNodePtr &node_ptr, const Ray &ray,
     }
 }
 
+/// The edges [0, num_unshared_edges) are in world space and go in the cs/ncs trees.
+/// The rest belong to the shapes with instances (shape_num_users > 1): each of these
+/// shapes gets a local 3D tree over its edges in the coordinates of its vertex buffer,
+/// and the instance tree has a leaf (edge_id is the shape id) for each shape using it,
+/// bounding the local tree moved by the transform of that shape.
 struct EdgeTree {
     EdgeTree(bool use_gpu,
              const Camera &camera,
              const BufferView<Shape> &shapes,
-             const BufferView<Edge> &edges);
+             const BufferView<Edge> &edges,
+             int num_unshared_edges,
+             const BufferView<int> &shape_edge_offsets,
+             const BufferView<int> &shape_num_edges,
+             const BufferView<int> &shape_num_users);
 
     Buffer<BVHNode3> cs_bvh_nodes;
     Buffer<BVHNode3> cs_bvh_leaves;
     Buffer<BVHNode6> ncs_bvh_nodes;
     Buffer<BVHNode6> ncs_bvh_leaves;
+    Buffer<BVHNode3> instance_bvh_nodes;
+    Buffer<BVHNode3> instance_bvh_leaves;
+    Buffer<BVHNode3> local_bvh_nodes;
+    Buffer<BVHNode3> local_bvh_leaves;
+    // By shape id, nullptr for the shapes without instances
+    Buffer<const BVHNode3*> local_bvh_roots;
     Real edge_bounds_expand;
 };
 
 struct EdgeTreeRoots {
     const BVHNode3 *cs_bvh_root;
     const BVHNode6 *ncs_bvh_root;
+    const BVHNode3 *instance_bvh_root;
+    const BVHNode3 * const *local_bvh_roots;
 };
 
+/// The root of a tree built from num_leaves leaves, nullptr if there is none.
+/// A single leaf has no internal node above it.
+template <typename BVHNodeType>
+inline const BVHNodeType *get_bvh_root(const BVHNodeType *nodes,
+                                       const BVHNodeType *leaves,
+                                       int64_t num_leaves) {
+    if (num_leaves == 0) {
+        return nullptr;
+    }
+    return num_leaves == 1 ? leaves : nodes;
+}
+
 inline EdgeTreeRoots get_edge_tree_roots(const EdgeTree *edge_tree) {
     if (edge_tree == nullptr) {
-        return EdgeTreeRoots{nullptr, nullptr};
+        return EdgeTreeRoots{nullptr, nullptr, nullptr, nullptr};
     } else {
         return EdgeTreeRoots{
-            edge_tree->cs_bvh_nodes.begin(),
-            edge_tree->ncs_bvh_nodes.begin()};
+            get_bvh_root(edge_tree->cs_bvh_nodes.begin(),
+                         edge_tree->cs_bvh_leaves.begin(),
+                         edge_tree->cs_bvh_leaves.size()),
+            get_bvh_root(edge_tree->ncs_bvh_nodes.begin(),
+                         edge_tree->ncs_bvh_leaves.begin(),
+                         edge_tree->ncs_bvh_leaves.size()),
+            get_bvh_root(edge_tree->instance_bvh_nodes.begin(),
+                         edge_tree->instance_bvh_leaves.begin(),
+                         edge_tree->instance_bvh_leaves.size()),
+            edge_tree->local_bvh_roots.begin()};
     }
 }
@@ -0,0 +1,251 @@
+#include "envmap.h"
+#include "parallel.h"
+#include "test_utils.h"
+#include "thrust_utils.h"
+
+#include <thrust/reduce.h>
+#include <vector>
+
+struct envmap_row_alias_builder {
+    DEVICE void operator()(int y) {
+        const auto *texels = envmap.values.texels[0] + 3 * y * width;
+        auto *weights = row_weights + y * width;
+        auto total = Real(0);
+        for (int x = 0; x < width; x++) {
+            weights[x] = fabs(luminance(
+                Vector3f{texels[3 * x + 0], texels[3 * x + 1], texels[3 * x + 2]}));
+            total += weights[x];
+        }
+        build_alias_table(weights, width, total,
+                          alias_xs + y * width, scratch + y * width);
+        // Rows near the poles cover less solid angle
+        row_sums[y] = total * sin(Real(M_PI) * (y + Real(0.5)) / height);
+    }
+
+    const EnvironmentMap envmap;
+    const int width;
+    const int height;
+    Real *row_weights;
+    int *scratch;
+    Real *row_sums;
+    AliasEntry *alias_xs;
+};
+
+struct envmap_marginal_alias_builder {
+    DEVICE void operator()(int) {
+        auto total = Real(0);
+        for (int y = 0; y < height; y++) {
+            total += row_sums[y];
+        }
+        build_alias_table(row_sums, height, total, alias_ys, scratch);
+    }
+
+    const Real *row_sums;
+    const int height;
+    int *scratch;
+    AliasEntry *alias_ys;
+};
+
+Real build_envmap_alias_tables(const EnvironmentMap &envmap,
+                               Buffer<AliasEntry> &alias_ys,
+                               Buffer<AliasEntry> &alias_xs,
+                               bool use_gpu) {
+    auto w = envmap.values.width[0];
+    auto h = envmap.values.height[0];
+    alias_ys = Buffer<AliasEntry>(use_gpu, h);
+    alias_xs = Buffer<AliasEntry>(use_gpu, w * h);
+    Buffer<Real> row_weights(use_gpu, w * h);
+    Buffer<int> scratch(use_gpu, w * h);
+    Buffer<Real> row_sums(use_gpu, h);
+    // Each row is independent
+    parallel_for(envmap_row_alias_builder{
+        envmap, w, h,
+        row_weights.begin(),
+        scratch.begin(),
+        row_sums.begin(),
+        alias_xs.begin()}, h, use_gpu);
+    parallel_for(envmap_marginal_alias_builder{
+        row_sums.begin(), h, scratch.begin(), alias_ys.begin()}, 1, use_gpu);
+    auto total = DISPATCH(use_gpu, thrust::reduce,
+        row_sums.begin(), row_sums.end(), Real(0), thrust::plus<Real>());
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    return total;
+}
+
+struct envmap_sh_tabulator {
+    DEVICE void operator()(int idx) {
+        auto x = idx % width;
+        auto y = idx / width;
+        // Same mapping as envmap_sample
+        auto phi = (2 * Real(M_PI) / width) * (x + Real(0.5));
+        auto theta = (Real(M_PI) / height) * (y + Real(0.5));
+        auto local_dir = Vector3{sin(phi) * sin(theta), cos(theta), -cos(phi) * sin(theta)};
+        auto radiance = envmap_sh_eval(envmap, local_dir);
+        // The tabulation can miss small lobes between the texel centers,
+        // so we add a fraction of the average radiance everywhere
+        auto num_coeffs = square(envmap.sh_num_bands);
+        for (int c = 0; c < 3; c++) {
+            auto average = envmap.sh_coeffs[c * num_coeffs] * Real(0.282095);
+            texels[3 * idx + c] = float(radiance[c] + Real(0.1) * max(average, Real(1e-3)));
+        }
+    }
+
+    const EnvironmentMap envmap;
+    const int width;
+    const int height;
+    float *texels;
+};
+
+void tabulate_envmap_sh(const EnvironmentMap &envmap,
+                        int width,
+                        int height,
+                        Buffer<float> &texels,
+                        bool use_gpu) {
+    texels = Buffer<float>(use_gpu, 3 * width * height);
+    parallel_for(envmap_sh_tabulator{envmap, width, height, texels.begin()},
+        width * height, use_gpu);
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+}
+
+void test_envmap_sample() {
+    constexpr int w = 8;
+    constexpr int h = 4;
+    std::vector<float> texels(3 * w * h);
+    std::vector<Real> expected(w * h);
+    auto total = Real(0);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            // A bright spot, a dim row and a smooth gradient elsewhere
+            auto v = y == 2 ? 0.05f : 0.1f + 0.05f * x + 0.2f * y;
+            if (x == 5 && y == 1) {
+                v = 4.f;
+            }
+            auto *texel = &texels[3 * (y * w + x)];
+            texel[0] = v;
+            texel[1] = 0.5f * v;
+            texel[2] = 2.f * v;
+            expected[y * w + x] = luminance(Vector3f{texel[0], texel[1], texel[2]}) *
+                sin(Real(M_PI) * (y + Real(0.5)) / h);
+            total += expected[y * w + x];
+        }
+    }
+    float uv_scale[2] = {1.f, 1.f};
+    float identity[16] = {1.f, 0.f, 0.f, 0.f,
+                          0.f, 1.f, 0.f, 0.f,
+                          0.f, 0.f, 1.f, 0.f,
+                          0.f, 0.f, 0.f, 1.f};
+    // Same normalization as the frontends
+    auto pdf_norm = (w * h) / (total * 2 * square(Real(M_PI)));
+    EnvironmentMap envmap{Texture3{{&texels[0]}, {w}, {h}, 3, &uv_scale[0]},
+                          &identity[0],
+                          &identity[0],
+                          (float)pdf_norm,
+                          true};
+    Buffer<AliasEntry> alias_ys, alias_xs;
+    build_envmap_alias_tables(envmap, alias_ys, alias_xs, false);
+    envmap.sample_alias_ys = alias_ys.begin();
+    envmap.sample_alias_xs = alias_xs.begin();
+
+    // The probability of each texel implied by the tables
+    std::vector<Real> row_probs(h, Real(0));
+    for (int y = 0; y < h; y++) {
+        row_probs[y] += alias_ys[y].prob / h;
+        row_probs[alias_ys[y].alias] += (1 - alias_ys[y].prob) / h;
+    }
+    for (int y = 0; y < h; y++) {
+        std::vector<Real> texel_probs(w, Real(0));
+        for (int x = 0; x < w; x++) {
+            const auto &entry = alias_xs[y * w + x];
+            texel_probs[x] += entry.prob / w;
+            texel_probs[entry.alias] += (1 - entry.prob) / w;
+        }
+        for (int x = 0; x < w; x++) {
+            equal_or_error(__FILE__, __LINE__,
+                expected[y * w + x] / total, row_probs[y] * texel_probs[x]);
+        }
+    }
+
+    // The sampled directions follow envmap_pdf: estimate the solid angle
+    // between the centers of the first and the last rows using them.
+    // (the bilinear pdf wraps around the poles, while the samples cross them)
+    constexpr int n = 512;
+    auto theta_min = Real(M_PI) * Real(0.5) / h;
+    auto theta_max = Real(M_PI) * (h - Real(0.5)) / h;
+    auto solid_angle = Real(0);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            auto sample = Vector2{(i + Real(0.5)) / n, (j + Real(0.5)) / n};
+            auto dir = envmap_sample(envmap, sample);
+            auto theta = safe_acos(dir.y);
+            if (theta > theta_min && theta < theta_max) {
+                solid_angle += 1 / (envmap_pdf(envmap, dir) * n * n);
+            }
+        }
+    }
+    // ~1% of the solid angle: the samples are deterministic, but the dim row has
+    // low density
+    equal_or_error(__FILE__, __LINE__,
+        2 * Real(M_PI) * (cos(theta_min) - cos(theta_max)), solid_angle, Real(0.1));
+}
+
+void test_envmap_sh() {
+    constexpr int num_bands = 3;
+    float coeffs[3 * num_bands * num_bands] = {
+        0.79f, 0.39f, -0.35f, -0.34f, -0.11f, -0.26f, -0.16f, 0.56f, 0.21f,
+        0.44f, 0.35f, -0.18f, -0.06f, -0.05f, -0.22f, -0.09f, 0.21f, -0.05f,
+        0.54f, 0.60f, -0.27f, 0.01f, -0.12f, -0.47f, -0.15f, 0.14f, -0.30f};
+    // Rotate the envmap by 90 degrees around x
+    float env_to_world[16] = {1.f, 0.f, 0.f, 0.f,
+                              0.f, 0.f, -1.f, 0.f,
+                              0.f, 1.f, 0.f, 0.f,
+                              0.f, 0.f, 0.f, 1.f};
+    float world_to_env[16] = {1.f, 0.f, 0.f, 0.f,
+                              0.f, 0.f, 1.f, 0.f,
+                              0.f, -1.f, 0.f, 0.f,
+                              0.f, 0.f, 0.f, 1.f};
+    EnvironmentMap envmap{&coeffs[0], num_bands, &env_to_world[0], &world_to_env[0], true};
+    RayDifferential ray_diff{Vector3{0, 0, 0}, Vector3{0, 0, 0},
+                             Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+    auto dir = normalize(Vector3{0.3, 0.6, -0.5});
+    auto local_dir = Vector3{dir.x, dir.z, -dir.y};
+    Real basis[max_sh_num_coeffs];
+    sh_basis(num_bands, local_dir, basis, nullptr);
+    auto radiance = envmap_eval(envmap, dir, ray_diff);
+    for (int c = 0; c < 3; c++) {
+        auto expected = Real(0);
+        for (int i = 0; i < num_bands * num_bands; i++) {
+            expected += coeffs[c * num_bands * num_bands + i] * basis[i];
+        }
+        equal_or_error(__FILE__, __LINE__, max(expected, Real(0)), radiance[c]);
+    }
+
+    // Derivatives
+    float d_coeffs[3 * num_bands * num_bands] = {};
+    float d_world_to_env[16] = {};
+    DEnvironmentMap d_envmap{&d_coeffs[0], &d_world_to_env[0]};
+    auto d_output = Vector3{1, 2, 3};
+    auto d_dir = Vector3{0, 0, 0};
+    auto d_ray_diff = ray_diff;
+    d_envmap_eval(envmap, dir, ray_diff, d_output, d_envmap, d_dir, d_ray_diff);
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < num_bands * num_bands; i++) {
+            equal_or_error(__FILE__, __LINE__,
+                radiance[c] > 0 ? d_output[c] * basis[i] : Real(0),
+                Real(d_coeffs[c * num_bands * num_bands + i]));
+        }
+    }
+    auto finite_delta = Real(1e-6);
+    for (int axis = 0; axis < 3; axis++) {
+        auto dir_pos = dir;
+        auto dir_neg = dir;
+        dir_pos[axis] += finite_delta;
+        dir_neg[axis] -= finite_delta;
+        auto diff = dot(d_output, envmap_eval(envmap, dir_pos, ray_diff) -
+                                  envmap_eval(envmap, dir_neg, ray_diff));
+        equal_or_error(__FILE__, __LINE__, diff / (2 * finite_delta), d_dir[axis]);
+    }
+}
@@ -7,31 +7,54 @@
 #include "ray.h"
 #include "transform.h"
 #include "buffer.h"
+#include "alias_table.h"
+#include "spherical_harmonics.h"
 
-#pragma warning(push)
-#pragma warning(disable : 4324 4668)
-#include <thrust/execution_policy.h>
-#include <thrust/binary_search.h>
-#pragma warning(pop)
+#include <stdexcept>
+#include <string>
+#include <tuple>
 
 struct Scene;
 
 struct EnvironmentMap {
-    EnvironmentMap() {}
+    EnvironmentMap() : sh_coeffs(nullptr), sh_num_bands(0),
+        sample_alias_ys(nullptr), sample_alias_xs(nullptr) {}
     EnvironmentMap(const Texture3 &values,
                    ptr<float> env_to_world,
                    ptr<float> world_to_env,
-                   ptr<float> sample_cdf_ys,
-                   ptr<float> sample_cdf_xs,
                    float pdf_norm,
                    bool directly_visible)
         : values(values),
           env_to_world(env_to_world.get()),
           world_to_env(world_to_env.get()),
-          sample_cdf_ys(sample_cdf_ys.get()),
-          sample_cdf_xs(sample_cdf_xs.get()),
           pdf_norm((Real)pdf_norm),
-          directly_visible(directly_visible) {}
+          directly_visible(directly_visible),
+          sh_coeffs(nullptr),
+          sh_num_bands(0),
+          sample_alias_ys(nullptr),
+          sample_alias_xs(nullptr) {}
+    // Radiance from the spherical harmonics coefficients of the first
+    // sh_num_bands bands, a 3 x sh_num_bands^2 array.
+    // The scene tabulates it into values for importance sampling.
+    EnvironmentMap(ptr<float> sh_coeffs,
+                   int sh_num_bands,
+                   ptr<float> env_to_world,
+                   ptr<float> world_to_env,
+                   bool directly_visible)
+        : values({}, {}, {}, 3, nullptr),
+          env_to_world(env_to_world.get()),
+          world_to_env(world_to_env.get()),
+          pdf_norm(0),
+          directly_visible(directly_visible),
+          sh_coeffs(sh_coeffs.get()),
+          sh_num_bands(sh_num_bands),
+          sample_alias_ys(nullptr),
+          sample_alias_xs(nullptr) {
+        if (sh_num_bands <= 0 || sh_num_bands > max_sh_num_bands) {
+            throw std::runtime_error("Spherical harmonics environment maps support 1 to " +
+                std::to_string(max_sh_num_bands) + " bands");
+        }
+    }
 
     inline int get_levels() const {
         return values.num_levels;
@@ -44,27 +67,113 @@ struct EnvironmentMap {
     Texture3 values;
     Matrix4x4 env_to_world;
     Matrix4x4 world_to_env;
-    float *sample_cdf_ys;
-    float *sample_cdf_xs;
     Real pdf_norm;
     bool directly_visible;
+    // Spherical harmonics mode if sh_num_bands > 0
+    float *sh_coeffs;
+    int sh_num_bands;
+    // Alias tables of the rows (height) and of the texels in each row
+    // (width * height), built by the scene from the texels.
+    const AliasEntry *sample_alias_ys;
+    const AliasEntry *sample_alias_xs;
 };
 
+/// Build the alias tables used by envmap_sample. The texels are weighted by
+/// luminance * sin(theta), the same distribution envmap_pdf evaluates.
+/// Returns the sum of the weights.
+Real build_envmap_alias_tables(const EnvironmentMap &envmap,
+                               Buffer<AliasEntry> &alias_ys,
+                               Buffer<AliasEntry> &alias_xs,
+                               bool use_gpu);
+
+/// Tabulate the radiance of a spherical harmonics envmap at the texel centers
+/// of a width x height latitude-longitude map, for importance sampling.
+void tabulate_envmap_sh(const EnvironmentMap &envmap,
+                        int width,
+                        int height,
+                        Buffer<float> &texels,
+                        bool use_gpu);
+
 struct DEnvironmentMap {
     DEnvironmentMap() {}
     DEnvironmentMap(const Texture3 &values,
                     ptr<float> world_to_env)
         : values(values),
-          world_to_env(world_to_env.get()) {}
+          world_to_env(world_to_env.get()),
+          sh_coeffs(nullptr) {}
+    DEnvironmentMap(ptr<float> sh_coeffs,
+                    ptr<float> world_to_env)
+        : values({}, {}, {}, 3, nullptr),
+          world_to_env(world_to_env.get()),
+          sh_coeffs(sh_coeffs.get()) {}
     Texture3 values;
     float *world_to_env;
+    float *sh_coeffs;
 };
 
+/// Radiance of a spherical harmonics envmap towards local_dir (a unit vector),
+/// clamped to be non-negative like pyredner.SH_reconstruct
+DEVICE
+inline Vector3 envmap_sh_eval(const EnvironmentMap &envmap, const Vector3 &local_dir) {
+    Real basis[max_sh_num_coeffs];
+    sh_basis(envmap.sh_num_bands, local_dir, basis, nullptr);
+    auto num_coeffs = square(envmap.sh_num_bands);
+    auto ret = Vector3{0, 0, 0};
+    for (int c = 0; c < 3; c++) {
+        const auto *coeffs = envmap.sh_coeffs + c * num_coeffs;
+        for (int i = 0; i < num_coeffs; i++) {
+            ret[c] += coeffs[i] * basis[i];
+        }
+        ret[c] = max(ret[c], Real(0));
+    }
+    return ret;
+}
+
+DEVICE
+inline void d_envmap_sh_eval(const EnvironmentMap &envmap,
+                             const Vector3 &dir,
+                             const Vector3 &d_output,
+                             DEnvironmentMap &d_envmap,
+                             Vector3 &d_dir) {
+    auto n_local_dir = xfm_vector(envmap.world_to_env, dir);
+    auto local_dir = normalize(n_local_dir);
+    Real basis[max_sh_num_coeffs];
+    Vector3 d_basis[max_sh_num_coeffs];
+    sh_basis(envmap.sh_num_bands, local_dir, basis, d_basis);
+    auto num_coeffs = square(envmap.sh_num_bands);
+    auto d_local_dir = Vector3{0, 0, 0};
+    for (int c = 0; c < 3; c++) {
+        const auto *coeffs = envmap.sh_coeffs + c * num_coeffs;
+        auto val = Real(0);
+        for (int i = 0; i < num_coeffs; i++) {
+            val += coeffs[i] * basis[i];
+        }
+        if (val <= 0 || d_output[c] == 0) {
+            // Clamped
+            continue;
+        }
+        // val = sum(coeffs[i] * basis[i])
+        for (int i = 0; i < num_coeffs; i++) {
+            atomic_add(&d_envmap.sh_coeffs[c * num_coeffs + i], d_output[c] * basis[i]);
+            d_local_dir += d_output[c] * coeffs[i] * d_basis[i];
+        }
+    }
+    // local_dir = normalize(n_local_dir)
+    auto d_n_local_dir = d_normalize(n_local_dir, d_local_dir);
+    // n_local_dir = xfm_vector(envmap.world_to_env, dir)
+    auto d_world_to_env = Matrix4x4{};
+    d_xfm_vector(envmap.world_to_env, dir, d_n_local_dir, d_world_to_env, d_dir);
+    atomic_add(d_envmap.world_to_env, d_world_to_env);
+}
+
 DEVICE
 inline Vector3 envmap_eval(const EnvironmentMap &envmap,
                            const Vector3 &dir,
                            const RayDifferential &ray_diff) {
     auto local_dir = normalize(xfm_vector(envmap.world_to_env, dir));
+    if (envmap.sh_num_bands > 0) {
+        return envmap_sh_eval(envmap, local_dir);
+    }
     // Project to spherical coordinate, y is up vector
     auto uv = Vector2{
         atan2(local_dir.x, -local_dir.z) / Real(2 * M_PI),
@@ -107,6 +216,11 @@ inline void d_envmap_eval(const EnvironmentMap &envmap,
                           DEnvironmentMap &d_envmap,
                           Vector3 &d_dir,
                           RayDifferential &d_ray_diff) {
+    if (envmap.sh_num_bands > 0) {
+        // No ray differentials: spherical harmonics are band limited already
+        d_envmap_sh_eval(envmap, dir, d_output, d_envmap, d_dir);
+        return;
+    }
     auto n_local_dir = xfm_vector(envmap.world_to_env, dir);
     auto local_dir = normalize(n_local_dir);
     // Project to spherical coordinate, y is up vector
@@ -198,44 +312,21 @@ inline void d_envmap_eval(const EnvironmentMap &envmap,
 
 DEVICE
 inline Real tent_inv_cdf(Real x) {
+    // Inverse CDF of the tent filter on [-1, 1]
     if (x < Real(0.5)) {
-        return 1 - sqrt(2 * x);
+        return sqrt(2 * x) - 1;
     } else {
-        return sqrt(2 * x - 0.5f) - 1;
+        return 1 - sqrt(2 - 2 * x);
     }
 }
 
 DEVICE
 inline Vector3 envmap_sample(const EnvironmentMap &envmap, Vector2 sample) {
-    const float *y_ptr =
-        thrust::upper_bound(thrust::seq,
-            envmap.sample_cdf_ys,
-            envmap.sample_cdf_ys + envmap.values.height[0],
-            sample.y);
-    auto y_pos = clamp((int)(y_ptr - envmap.sample_cdf_ys - 1),
-                       0, envmap.values.height[0] - 1);
-    if (y_pos < envmap.values.height[0] - 1) {
-        sample.y = (sample.y - envmap.sample_cdf_ys[y_pos]) /
-            (envmap.sample_cdf_ys[y_pos + 1] - envmap.sample_cdf_ys[y_pos]);
-    } else {
-        sample.y = (sample.y - envmap.sample_cdf_ys[y_pos]) /
-            (1 - envmap.sample_cdf_ys[y_pos]);
-    }
-    auto sample_cdf_xs = envmap.sample_cdf_xs + y_pos * envmap.values.width[0];
-    const float *x_ptr =
-        thrust::upper_bound(thrust::seq,
-            sample_cdf_xs,
-            sample_cdf_xs + envmap.values.width[0],
-            sample.x);
-    auto x_pos = clamp((int)(x_ptr - sample_cdf_xs - 1),
-                       0, envmap.values.width[0] - 1);
-    if (x_pos < envmap.values.width[0] - 1) {
-        sample.x = (sample.x - sample_cdf_xs[x_pos]) /
-            (sample_cdf_xs[x_pos + 1] - sample_cdf_xs[x_pos]);
-    } else {
-        sample.x = (sample.x - sample_cdf_xs[x_pos]) /
-            (1 - sample_cdf_xs[x_pos]);
-    }
+    // Pick a row, then a texel in the row, in constant time
+    auto w = envmap.values.width[0];
+    auto h = envmap.values.height[0];
+    auto y_pos = sample_alias_table(envmap.sample_alias_ys, h, sample.y, sample.y);
+    auto x_pos = sample_alias_table(envmap.sample_alias_xs + y_pos * w, w, sample.x, sample.x);
 
     // Importance sample bilinear sampling
     auto uv = Vector2{x_pos + tent_inv_cdf(sample.x), y_pos + tent_inv_cdf(sample.y)};
@@ -304,3 +395,6 @@ inline Real envmap_pdf(const EnvironmentMap &envmap, const Vector3 &dir) {
     auto sin_theta_cy = fabs(sin(Real(M_PI) * (yci + 0.5f) / h));
     return envmap.pdf_norm * fabs(lum_fy * sin_theta_fy + lum_cy * sin_theta_cy) / sin_theta;
 }
+
+void test_envmap_sample();
+void test_envmap_sh();
@@ -0,0 +1,290 @@
+#include "light_bvh.h"
+#include "shape.h"
+#include "area_light.h"
+#include "atomic.h"
+#include "parallel.h"
+#include "radix_tree.h"
+#include "test_utils.h"
+#include "thrust_utils.h"
+
+#include <thrust/transform_reduce.h>
+#include <thrust/sequence.h>
+#include <thrust/sort.h>
+#include <thrust/fill.h>
+
+struct light_primitive_computer {
+    DEVICE void operator()(int idx) {
+        auto ind = get_indices(shape, idx);
+        auto v0 = Vector3{get_vertex(shape, ind[0])};
+        auto v1 = Vector3{get_vertex(shape, ind[1])};
+        auto v2 = Vector3{get_vertex(shape, ind[2])};
+        auto n = cross(v1 - v0, v2 - v0);
+        auto area = 0.5f * length(n);
+        auto &prim = primitives[idx];
+        prim.bounds = merge(merge(AABB3{v0, v0}, v1), v2);
+        if (area > 0) {
+            // Same orientation as the normal of sample_shape
+            prim.axis = n / (2 * area);
+        } else {
+            prim.axis = Vector3{0, 0, 1};
+        }
+        // A triangle only emits along its normal (or its flipped normal if two-sided),
+        // over the whole hemisphere.
+        prim.cos_theta_o = 1;
+        prim.cos_theta_e = 0;
+        prim.power = area * luminance(light.intensity) * Real(M_PI) *
+            (light.two_sided ? 2 : 1);
+        prim.two_sided = light.two_sided;
+        prim.parent = nullptr;
+        prim.children[0] = nullptr;
+        prim.children[1] = nullptr;
+        prim.light_id = light_id;
+        prim.tri_id = idx;
+    }
+
+    const Shape shape;
+    const AreaLight light;
+    const int light_id;
+    LightBVHNode *primitives;
+};
+
+struct light_centroid_bounds {
+    DEVICE AABB3 operator()(const LightBVHNode &node) const {
+        auto c = 0.5f * (node.bounds.p_min + node.bounds.p_max);
+        return AABB3{c, c};
+    }
+};
+
+struct light_bounds_union {
+    DEVICE AABB3 operator()(const AABB3 &b0, const AABB3 &b1) const {
+        return merge(b0, b1);
+    }
+};
+
+struct light_morton_code_computer {
+    DEVICE void operator()(int idx) {
+        const auto &bounds = primitives[idx].bounds;
+        morton_codes[idx] = morton_code_3d(scene_bounds, 0.5f * (bounds.p_min + bounds.p_max));
+    }
+
+    const AABB3 scene_bounds;
+    const LightBVHNode *primitives;
+    uint64_t *morton_codes;
+};
+
+/// Merge the bounds of two sibling nodes into their parent
+DEVICE
+inline void merge_light_bounds(const LightBVHNode &n0,
+                               const LightBVHNode &n1,
+                               LightBVHNode &parent) {
+    parent.bounds = merge(n0.bounds, n1.bounds);
+    parent.power = n0.power + n1.power;
+    parent.two_sided = n0.two_sided || n1.two_sided;
+    // Lights with zero power never contribute, don't let them widen the cone
+    if (n1.power <= 0) {
+        parent.axis = n0.axis;
+        parent.cos_theta_o = n0.cos_theta_o;
+        parent.cos_theta_e = n0.cos_theta_e;
+    } else if (n0.power <= 0) {
+        parent.axis = n1.axis;
+        parent.cos_theta_o = n1.cos_theta_o;
+        parent.cos_theta_e = n1.cos_theta_e;
+    } else {
+        merge_cones(n0.axis, n0.cos_theta_o, n1.axis, n1.cos_theta_o,
+                    parent.axis, parent.cos_theta_o);
+        parent.cos_theta_e = min(n0.cos_theta_e, n1.cos_theta_e);
+    }
+}
+
+struct light_bvh_computer {
+    DEVICE void operator()(int idx) {
+        auto prim_id = prim_ids[idx];
+        const auto &prim = primitives[prim_id];
+        auto leaf = &leaves[idx];
+        // parent is set by the radix tree builder
+        leaf->bounds = prim.bounds;
+        leaf->axis = prim.axis;
+        leaf->cos_theta_o = prim.cos_theta_o;
+        leaf->cos_theta_e = prim.cos_theta_e;
+        leaf->power = prim.power;
+        leaf->two_sided = prim.two_sided;
+        leaf->children[0] = nullptr;
+        leaf->children[1] = nullptr;
+        leaf->light_id = prim.light_id;
+        leaf->tri_id = prim.tri_id;
+        leaf_ids[prim_id] = idx;
+
+        // Trace from leaf to root and merge bounds, cones & power
+        auto current = leaf->parent;
+        while (current != nullptr) {
+            auto node_idx = current - nodes;
+            assert(node_idx >= 0 && node_idx < num_nodes);
+            auto res = atomic_increment(node_counters + node_idx);
+            if (res == 1) {
+                // Terminate the first thread entering this node, the second one
+                // sees both children
+                return;
+            }
+            merge_light_bounds(*current->children[0], *current->children[1], *current);
+            current = current->parent;
+        }
+    }
+
+    const LightBVHNode *primitives;
+    const int *prim_ids;
+    const int num_nodes;
+    int *node_counters;
+    int *leaf_ids;
+    LightBVHNode *nodes;
+    LightBVHNode *leaves;
+};
+
+LightBVH::LightBVH(const std::vector<const Shape*> &shapes,
+                   const std::vector<const AreaLight*> &area_lights,
+                   bool use_gpu) {
+    tri_offsets = Buffer<int>(use_gpu, area_lights.size());
+    auto num_primitives = 0;
+    for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
+        tri_offsets[light_id] = num_primitives;
+        num_primitives += shapes[area_lights[light_id]->shape_id]->num_triangles;
+    }
+    if (num_primitives == 0) {
+        return;
+    }
+    // Like the edge tree, we build a LBVH over the triangle centroids (see
+    // "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees")
+    Buffer<LightBVHNode> primitives(use_gpu, num_primitives);
+    for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
+        const auto &light = *area_lights[light_id];
+        const auto &shape = *shapes[light.shape_id];
+        parallel_for(light_primitive_computer{
+            shape, light, light_id, primitives.begin() + tri_offsets[light_id]},
+            shape.num_triangles, use_gpu);
+    }
+    auto scene_bounds = DISPATCH(use_gpu,
+        thrust::transform_reduce, primitives.begin(), primitives.end(),
+        light_centroid_bounds{}, AABB3(), light_bounds_union{});
+    Buffer<uint64_t> morton_codes(use_gpu, num_primitives);
+    parallel_for(light_morton_code_computer{
+        scene_bounds, primitives.begin(), morton_codes.begin()},
+        num_primitives, use_gpu);
+    Buffer<int> prim_ids(use_gpu, num_primitives);
+    DISPATCH(use_gpu, thrust::sequence, prim_ids.begin(), prim_ids.end());
+    DISPATCH(use_gpu, thrust::stable_sort_by_key,
+        morton_codes.begin(), morton_codes.end(), prim_ids.begin());
+
+    nodes = Buffer<LightBVHNode>(use_gpu, max(num_primitives - 1, 1));
+    leaves = Buffer<LightBVHNode>(use_gpu, num_primitives);
+    leaf_ids = Buffer<int>(use_gpu, num_primitives);
+    LightBVHNode init_node{AABB3(), Vector3{0, 0, 1}, Real(1), Real(0), Real(0), false,
+                           nullptr, {nullptr, nullptr}, -1, -1};
+    DISPATCH(use_gpu, thrust::fill, nodes.begin(), nodes.end(), init_node);
+    DISPATCH(use_gpu, thrust::fill, leaves.begin(), leaves.end(), init_node);
+    build_radix_tree(morton_codes.view(0, num_primitives),
+                     prim_ids.view(0, num_primitives),
+                     nodes.view(0, nodes.size()),
+                     leaves.view(0, leaves.size()),
+                     use_gpu);
+    Buffer<int> node_counters(use_gpu, nodes.size());
+    DISPATCH(use_gpu, thrust::fill, node_counters.begin(), node_counters.end(), 0);
+    parallel_for(light_bvh_computer{
+        primitives.begin(), prim_ids.begin(), (int)nodes.size(),
+        node_counters.begin(), leaf_ids.begin(), nodes.begin(), leaves.begin()},
+        num_primitives, use_gpu);
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+}
+
+void test_light_bvh() {
+    // Two quads above and below the origin and a two-sided quad far away,
+    // each made of two triangles.
+    Buffer<Vector3f> vertices(false, 12);
+    // Quad 0 at z = 3, facing -z
+    vertices[0] = Vector3f{-1.f, -1.f, 3.f};
+    vertices[1] = Vector3f{-1.f,  1.f, 3.f};
+    vertices[2] = Vector3f{ 1.f,  1.f, 3.f};
+    vertices[3] = Vector3f{ 1.f, -1.f, 3.f};
+    // Quad 1 at z = -3, facing -z (away from the origin)
+    vertices[4] = Vector3f{-1.f, -1.f, -3.f};
+    vertices[5] = Vector3f{-1.f,  1.f, -3.f};
+    vertices[6] = Vector3f{ 1.f,  1.f, -3.f};
+    vertices[7] = Vector3f{ 1.f, -1.f, -3.f};
+    // Quad 2 at x = 10, two-sided
+    vertices[8] = Vector3f{10.f, -1.f, -1.f};
+    vertices[9] = Vector3f{10.f,  1.f, -1.f};
+    vertices[10] = Vector3f{10.f,  1.f, 1.f};
+    vertices[11] = Vector3f{10.f, -1.f, 1.f};
+    Buffer<Vector3i> indices(false, 6);
+    for (int i = 0; i < 3; i++) {
+        indices[2 * i + 0] = Vector3i{4 * i + 0, 4 * i + 1, 4 * i + 2};
+        indices[2 * i + 1] = Vector3i{4 * i + 0, 4 * i + 2, 4 * i + 3};
+    }
+    std::vector<Shape> shape_storage;
+    for (int i = 0; i < 3; i++) {
+        shape_storage.push_back(Shape{(float*)vertices.data,
+                                      (int*)indices.data + 6 * i,
+                                      nullptr, // uvs
+                                      nullptr, // normals
+                                      nullptr, // uv_indices
+                                      nullptr, // normal_indices
+                                      nullptr, // colors
+                                      12, // num_vertices
+                                      0, // num_uv_vertices
+                                      0, // num_normal_vertices
+                                      2, // num_triangles
+                                      0, // material_id
+                                      i}); // light_id
+    }
+    std::vector<AreaLight> light_storage{
+        AreaLight{0, Vector3f{1.f, 1.f, 1.f}, false, true},
+        AreaLight{1, Vector3f{1.f, 1.f, 1.f}, false, true},
+        AreaLight{2, Vector3f{5.f, 5.f, 5.f}, true, true}};
+    std::vector<const Shape*> shapes;
+    std::vector<const AreaLight*> area_lights;
+    for (int i = 0; i < 3; i++) {
+        shapes.push_back(&shape_storage[i]);
+        area_lights.push_back(&light_storage[i]);
+    }
+    LightBVH light_bvh(shapes, area_lights, false);
+    auto flatten_light_bvh = get_flatten_light_bvh(&light_bvh);
+    equal_or_error(__FILE__, __LINE__, 6, (int)light_bvh.leaves.size());
+
+    Vector3 shading_pos[2] = {Vector3{0, 0, 0}, Vector3{3.0, 0.5, 0.2}};
+    Vector3 shading_normal[2] = {Vector3{0, 0, 1}, Vector3{0, 0, 0}};
+    for (int i = 0; i < 2; i++) {
+        const auto &p = shading_pos[i];
+        const auto &n = shading_normal[i];
+        // The pmfs of all triangles sum to one
+        auto pmf_sum = Real(0);
+        for (int light_id = 0; light_id < 3; light_id++) {
+            for (int tri_id = 0; tri_id < 2; tri_id++) {
+                pmf_sum += light_bvh_pmf(flatten_light_bvh, p, n, light_id, tri_id);
+            }
+        }
+        equal_or_error(__FILE__, __LINE__, Real(1), pmf_sum);
+        // Sampling reproduces the pmf
+        constexpr int num_samples = 100000;
+        Real freq[6] = {0, 0, 0, 0, 0, 0};
+        for (int s = 0; s < num_samples; s++) {
+            auto pmf = Real(0);
+            auto leaf = sample_light_bvh(
+                flatten_light_bvh, p, n, (s + Real(0.5)) / num_samples, pmf);
+            equal_or_error(__FILE__, __LINE__,
+                light_bvh_pmf(flatten_light_bvh, p, n, leaf->light_id, leaf->tri_id), pmf);
+            freq[2 * leaf->light_id + leaf->tri_id] += Real(1) / num_samples;
+        }
+        for (int light_id = 0; light_id < 3; light_id++) {
+            for (int tri_id = 0; tri_id < 2; tri_id++) {
+                equal_or_error(__FILE__, __LINE__,
+                    light_bvh_pmf(flatten_light_bvh, p, n, light_id, tri_id),
+                    freq[2 * light_id + tri_id]);
+            }
+        }
+    }
+    // The origin is behind quad 1, which should never be picked
+    equal_or_error(__FILE__, __LINE__, Real(0),
+        light_bvh_pmf(flatten_light_bvh, shading_pos[0], shading_normal[0], 1, 0));
+    equal_or_error(__FILE__, __LINE__, Real(0),
+        light_bvh_pmf(flatten_light_bvh, shading_pos[0], shading_normal[0], 1, 1));
+}
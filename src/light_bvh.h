@@ -0,0 +1,243 @@
+#pragma once
+
+#include "redner.h"
+#include "vector.h"
+#include "buffer.h"
+#include "aabb.h"
+
+#include <vector>
+
+struct Shape;
+struct AreaLight;
+
+/**
+ * Bounding volume hierarchy over all area light triangles, used for picking
+ * a light triangle proportional to an estimate of its contribution to a
+ * shading point, instead of proportional to its power only.
+ * Each node bounds the positions, the emitting directions and the power of
+ * the triangles below it, following
+ * "Importance Sampling of Many Lights With Adaptive Tree Splitting",
+ * Conty Estevez and Kulla 2018.
+ * The emitting directions of a node are bounded by a cone: the normals are within
+ * theta_o around axis, and each normal emits within theta_e around itself.
+ */
+struct LightBVHNode {
+    AABB3 bounds;
+    Vector3 axis;
+    Real cos_theta_o;
+    Real cos_theta_e;
+    Real power;
+    bool two_sided;
+    LightBVHNode *parent;
+    LightBVHNode *children[2];
+    // -1 for internal nodes
+    int light_id;
+    int tri_id;
+};
+
+struct LightBVH {
+    LightBVH() {}
+    LightBVH(const std::vector<const Shape*> &shapes,
+             const std::vector<const AreaLight*> &area_lights,
+             bool use_gpu);
+
+    Buffer<LightBVHNode> nodes;
+    Buffer<LightBVHNode> leaves;
+    // Offset of each area light in leaf_ids
+    Buffer<int> tri_offsets;
+    // Maps tri_offsets[light_id] + tri_id to the index of the triangle's leaf
+    Buffer<int> leaf_ids;
+};
+
+struct FlattenLightBVH {
+    const LightBVHNode *root;
+    const LightBVHNode *leaves;
+    const int *tri_offsets;
+    const int *leaf_ids;
+};
+
+inline FlattenLightBVH get_flatten_light_bvh(const LightBVH *light_bvh) {
+    if (light_bvh == nullptr || light_bvh->leaves.size() == 0) {
+        return FlattenLightBVH{nullptr, nullptr, nullptr, nullptr};
+    }
+    // With a single leaf there is no internal node
+    auto root = light_bvh->leaves.size() == 1 ?
+        light_bvh->leaves.begin() : light_bvh->nodes.begin();
+    return FlattenLightBVH{root,
+                           light_bvh->leaves.begin(),
+                           light_bvh->tri_offsets.begin(),
+                           light_bvh->leaf_ids.begin()};
+}
+
+DEVICE
+inline bool is_leaf(const LightBVHNode &node) {
+    return node.light_id != -1;
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) given sines and cosines of a & b in [0, pi]
+DEVICE
+inline Real cos_sub_clamped(Real sin_a, Real cos_a, Real sin_b, Real cos_b) {
+    if (cos_a > cos_b) {
+        return 1;
+    }
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+DEVICE
+inline Real sin_sub_clamped(Real sin_a, Real cos_a, Real sin_b, Real cos_b) {
+    if (cos_a > cos_b) {
+        return 0;
+    }
+    return sin_a * cos_b - cos_a * sin_b;
+}
+
+/// Conservative estimate of the contribution of the lights inside node
+/// to shading point p with normal n.
+DEVICE
+inline Real light_importance(const LightBVHNode &node,
+                             const Vector3 &p,
+                             const Vector3 &n) {
+    if (node.power <= 0) {
+        return 0;
+    }
+    auto center = 0.5f * (node.bounds.p_min + node.bounds.p_max);
+    auto dist_sq = distance_squared(p, center);
+    // Squared radius of the bounding sphere of the node
+    auto radius_sq = Real(0.25f) * distance_squared(node.bounds.p_max, node.bounds.p_min);
+    // Don't let the importance blow up when p is close to the node
+    auto clamped_dist_sq = max(max(dist_sq, radius_sq), Real(1e-20));
+    // Direction from the node to p
+    auto wi = dist_sq > 0 ? (p - center) / sqrt(dist_sq) : node.axis;
+    // Half angle of the cone from p containing the bounding sphere of the node
+    auto cos_theta_b = Real(-1);
+    if (dist_sq > radius_sq) {
+        cos_theta_b = sqrt(max(1 - radius_sq / dist_sq, Real(0)));
+    }
+    auto sin_theta_b = sqrt(max(1 - square(cos_theta_b), Real(0)));
+    // Angle between wi and the cone axis, minus the spread of the normals and
+    // the extent of the node: the smallest angle between wi and an emitting normal.
+    auto cos_theta_w = dot(node.axis, wi);
+    if (node.two_sided) {
+        cos_theta_w = fabs(cos_theta_w);
+    }
+    auto sin_theta_w = sqrt(max(1 - square(cos_theta_w), Real(0)));
+    auto sin_theta_o = sqrt(max(1 - square(node.cos_theta_o), Real(0)));
+    auto cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, node.cos_theta_o);
+    auto sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, node.cos_theta_o);
+    auto cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+    if (cos_theta_p <= node.cos_theta_e) {
+        // p is outside of the emission cone
+        return 0;
+    }
+    auto importance = node.power * cos_theta_p / clamped_dist_sq;
+    // Smallest angle between the shading normal and a direction towards the node.
+    // Two-sided materials reflect on both sides, so we bound the absolute cosine.
+    if (length_squared(n) > 0) {
+        auto cos_theta_i = fabs(dot(wi, n));
+        auto sin_theta_i = sqrt(max(1 - square(cos_theta_i), Real(0)));
+        importance *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    }
+    return max(importance, Real(0));
+}
+
+/// Probability of descending into children[0] from node.
+/// Falls back to the power of the children when p can't see either of them,
+/// so that every light with non-zero power can be sampled.
+DEVICE
+inline Real light_bvh_left_prob(const LightBVHNode &node,
+                                const Vector3 &p,
+                                const Vector3 &n) {
+    auto i0 = light_importance(*node.children[0], p, n);
+    auto i1 = light_importance(*node.children[1], p, n);
+    if (i0 + i1 <= 0) {
+        i0 = node.children[0]->power;
+        i1 = node.children[1]->power;
+        if (i0 + i1 <= 0) {
+            return Real(0.5);
+        }
+    }
+    return i0 / (i0 + i1);
+}
+
+/// Stochastically traverse the light tree from p. sample is in [0, 1).
+/// Returns the selected leaf and its probability.
+DEVICE
+inline const LightBVHNode *sample_light_bvh(const FlattenLightBVH &light_bvh,
+                                            const Vector3 &p,
+                                            const Vector3 &n,
+                                            Real sample,
+                                            Real &pmf) {
+    const auto *node = light_bvh.root;
+    pmf = 1;
+    while (!is_leaf(*node)) {
+        auto left_prob = light_bvh_left_prob(*node, p, n);
+        if (sample < left_prob) {
+            // rescale sample to [0, 1)
+            sample = sample / left_prob;
+            pmf *= left_prob;
+            node = node->children[0];
+        } else {
+            sample = (sample - left_prob) / (1 - left_prob);
+            pmf *= (1 - left_prob);
+            node = node->children[1];
+        }
+        // Guard against rounding the rescaled sample up to 1
+        sample = min(sample, Real(1 - 1e-10));
+    }
+    return node;
+}
+
+/// Probability of sample_light_bvh selecting triangle tri_id of area light light_id
+DEVICE
+inline Real light_bvh_pmf(const FlattenLightBVH &light_bvh,
+                          const Vector3 &p,
+                          const Vector3 &n,
+                          int light_id,
+                          int tri_id) {
+    const auto *node =
+        &light_bvh.leaves[light_bvh.leaf_ids[light_bvh.tri_offsets[light_id] + tri_id]];
+    auto pmf = Real(1);
+    while (node != light_bvh.root) {
+        const auto *parent = node->parent;
+        auto left_prob = light_bvh_left_prob(*parent, p, n);
+        pmf *= parent->children[0] == node ? left_prob : 1 - left_prob;
+        node = parent;
+    }
+    return pmf;
+}
+
+/// Smallest cone containing both cones (axis0, cos_theta0) & (axis1, cos_theta1)
+DEVICE
+inline void merge_cones(const Vector3 &axis0, Real cos_theta0,
+                        const Vector3 &axis1, Real cos_theta1,
+                        Vector3 &axis, Real &cos_theta) {
+    auto theta0 = safe_acos(cos_theta0);
+    auto theta1 = safe_acos(cos_theta1);
+    auto theta_d = safe_acos(dot(axis0, axis1));
+    if (min(theta_d + theta1, Real(M_PI)) <= theta0) {
+        axis = axis0;
+        cos_theta = cos_theta0;
+        return;
+    }
+    if (min(theta_d + theta0, Real(M_PI)) <= theta1) {
+        axis = axis1;
+        cos_theta = cos_theta1;
+        return;
+    }
+    auto theta_o = (theta0 + theta_d + theta1) / 2;
+    auto rot_axis = cross(axis0, axis1);
+    if (theta_o >= Real(M_PI) || length_squared(rot_axis) <= 0) {
+        // The whole sphere
+        axis = axis0;
+        cos_theta = -1;
+        return;
+    }
+    // Rotate axis0 towards axis1 by theta_o - theta0 around rot_axis.
+    // rot_axis is orthogonal to axis0 so Rodrigues' formula simplifies.
+    auto theta_r = theta_o - theta0;
+    rot_axis = normalize(rot_axis);
+    axis = normalize(axis0 * cos(theta_r) + cross(rot_axis, axis0) * sin(theta_r));
+    cos_theta = cos(theta_o);
+}
+
+void test_light_bvh();
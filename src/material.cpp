@@ -485,3 +485,91 @@ void test_d_bsdf_pdf() {
         equal_or_error(__FILE__, __LINE__, Real(diff), Real(d_wo[i]));
     }
 }
+
+void test_material_features() {
+    Vector2f uv_scale{1, 1};
+    Vector3f d{0.5, 0.4, 0.3};
+    Texture3 diffuse{{&d[0]}, {-1}, {-1}, -1, &uv_scale[0]};
+    Vector3f s{0, 0, 0};
+    Texture3 specular{{&s[0]}, {-1}, {-1}, -1, &uv_scale[0]};
+    float r = 0.5;
+    Texture1 roughness{{&r}, {-1}, {-1}, -1, &uv_scale[0]};
+    TextureN generic{{}, {}, {}, 0, nullptr};
+    Texture3 normal_map{{}, {}, {}, 0, nullptr};
+    Material m{diffuse,
+               specular,
+               roughness,
+               generic,
+               normal_map,
+               false, // compute_specular_lighting
+               false, // two_sided
+               false}; // use_vertex_color
+    equal_or_error(__FILE__, __LINE__,
+        int(MaterialFeatures::ConstantDiffuse), classify_material(m));
+    // A mipmapped diffuse texture
+    std::vector<float> texels(3 * 4 * 4, 0.5f);
+    Texture3 diffuse_map{{&texels[0]}, {4}, {4}, -1, &uv_scale[0]};
+    Material textured{diffuse_map, specular, roughness, generic, normal_map, false, false, false};
+    equal_or_error(__FILE__, __LINE__,
+        int(MaterialFeatures::Diffuse), classify_material(textured));
+    Material vertex_color{diffuse, specular, roughness, generic, normal_map, false, false, true};
+    equal_or_error(__FILE__, __LINE__,
+        int(MaterialFeatures::ConstantTextures | MaterialFeatures::NoNormalMap |
+            MaterialFeatures::NoSpecularLighting | MaterialFeatures::ZeroSpecular),
+        classify_material(vertex_color));
+
+    // The specialized kernels match the generic ones
+    SurfacePoint p{Vector3{0, 0, 0},
+                   Vector3{0, 1, 0},
+                   Frame(Vector3{0, 1, 0}),
+                   Vector3{1, 0, 0}, // dpdu
+                   Vector2{0.5, 0.5}, // uv
+                   Vector2{0, 0}, Vector2{0, 0}, // du_dxy & dv_dxy
+                   Vector3{0, 0, 0}, Vector3{0, 0, 0}, // dn_dx, dn_dy
+                   Vector3{0, 0, 0}}; // color
+    auto wi = normalize(Vector3{0.5, 1.0, 0.5});
+    auto wo = normalize(Vector3{-0.5, 1.0, -0.3});
+    auto min_roughness = Real(0);
+    equal_or_error(__FILE__, __LINE__,
+        bsdf(m, p, wi, wo, min_roughness),
+        bsdf<MaterialFeatures::ConstantDiffuse>(m, p, wi, wo, min_roughness));
+    equal_or_error(__FILE__, __LINE__,
+        bsdf_pdf(m, p, wi, wo, min_roughness),
+        bsdf_pdf<MaterialFeatures::ConstantDiffuse>(m, p, wi, wo, min_roughness));
+    auto wi_differential = RayDifferential{
+        Vector3{1, 1, 1}, Vector3{1, 1, 1},
+        Vector3{1, 1, 1}, Vector3{1, 1, 1}};
+    auto wo_differential = wi_differential;
+    auto sample = BSDFSample{Vector2{0.3, 0.6}, 0.5};
+    equal_or_error(__FILE__, __LINE__,
+        bsdf_sample(m, p, wi, sample, min_roughness, wi_differential, wo_differential),
+        bsdf_sample<MaterialFeatures::ConstantDiffuse>(
+            m, p, wi, sample, min_roughness, wi_differential, wo_differential));
+
+    Vector3f d_d[2] = {Vector3f{0, 0, 0}, Vector3f{0, 0, 0}};
+    Vector3f d_s[2] = {Vector3f{0, 0, 0}, Vector3f{0, 0, 0}};
+    float d_r[2] = {0, 0};
+    Vector2f d_uv_scale{0, 0};
+    SurfacePoint d_p[2] = {SurfacePoint::zero(), SurfacePoint::zero()};
+    Vector3 d_wi[2] = {Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+    Vector3 d_wo[2] = {Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+    for (int i = 0; i < 2; i++) {
+        DMaterial d_material{Texture3{{&d_d[i][0]}, {-1}, {-1}, -1, &d_uv_scale[0]},
+                             Texture3{{&d_s[i][0]}, {-1}, {-1}, -1, &d_uv_scale[0]},
+                             Texture1{{&d_r[i]}, {-1}, {-1}, -1, &d_uv_scale[0]},
+                             TextureN{{}, {}, {}, 0, nullptr},
+                             Texture3{{}, {}, {}, 0, nullptr}};
+        if (i == 0) {
+            d_bsdf(m, p, wi, wo, min_roughness, Vector3{1, 2, 3},
+                   d_material, d_p[i], d_wi[i], d_wo[i]);
+        } else {
+            d_bsdf<MaterialFeatures::ConstantDiffuse>(m, p, wi, wo, min_roughness,
+                Vector3{1, 2, 3}, d_material, d_p[i], d_wi[i], d_wo[i]);
+        }
+    }
+    equal_or_error(__FILE__, __LINE__, d_d[0], d_d[1]);
+    equal_or_error(__FILE__, __LINE__, d_s[0], d_s[1]);
+    equal_or_error(__FILE__, __LINE__, d_r[0], d_r[1]);
+    equal_or_error(__FILE__, __LINE__, d_wi[0], d_wi[1]);
+    equal_or_error(__FILE__, __LINE__, d_wo[0], d_wo[1]);
+}
@@ -9,8 +9,32 @@
 
 #include <tuple>
 
+/**
+ * Properties of a material the shading kernels can rely on at compile time.
+ * Scene classifies each material (see classify_material), and the kernels
+ * dispatch to the most specialized mask in dispatch_material_features.
+ */
+struct MaterialFeatures {
+    enum : int {
+        Generic = 0,
+        // Diffuse, specular and roughness are constant textures
+        ConstantTextures = 1 << 0,
+        NoNormalMap = 1 << 1,
+        NoVertexColor = 1 << 2,
+        NoSpecularLighting = 1 << 3,
+        // Specular reflectance is a constant zero
+        ZeroSpecular = 1 << 4,
+
+        // The masks we instantiate the shading kernels for
+        Plain = NoNormalMap | NoVertexColor,
+        Diffuse = Plain | NoSpecularLighting | ZeroSpecular,
+        ConstantPlain = ConstantTextures | Plain,
+        ConstantDiffuse = ConstantTextures | Diffuse
+    };
+};
+
 struct Material {
-    Material() {}
+    Material() : features(MaterialFeatures::Generic) {}
 
     Material(Texture3 diffuse_reflectance,
              Texture3 specular_reflectance,
@@ -27,7 +51,8 @@ struct Material {
           normal_map(normal_map),
           compute_specular_lighting(compute_specular_lighting),
           two_sided(two_sided),
-          use_vertex_color(use_vertex_color) {}
+          use_vertex_color(use_vertex_color),
+          features(MaterialFeatures::Generic) {}
 
     inline int get_diffuse_levels() const {
         return diffuse_reflectance.num_levels;
@@ -88,6 +113,8 @@ struct Material {
     bool compute_specular_lighting;
     bool two_sided;
     bool use_vertex_color;
+    // Set by Scene
+    int features;
 };
 
 struct DMaterial {
@@ -106,91 +133,182 @@ struct TBSDFSample {
 
 using BSDFSample = TBSDFSample<Real>;
 
+/// Compute the MaterialFeatures mask of a material.
+/// Reads the texels, call it on the device holding them.
+DEVICE
+inline int classify_material(const Material &material) {
+    auto features = int(MaterialFeatures::Generic);
+    if (is_constant_texture(material.diffuse_reflectance) &&
+            is_constant_texture(material.specular_reflectance) &&
+            is_constant_texture(material.roughness)) {
+        features |= MaterialFeatures::ConstantTextures;
+    }
+    if (material.normal_map.num_levels <= 0) {
+        features |= MaterialFeatures::NoNormalMap;
+    }
+    if (!material.use_vertex_color) {
+        features |= MaterialFeatures::NoVertexColor;
+    }
+    if (!material.compute_specular_lighting) {
+        features |= MaterialFeatures::NoSpecularLighting;
+    }
+    const auto &specular = material.specular_reflectance;
+    if (specular.num_levels > 0 && is_constant_texture(specular) &&
+            specular.texels[0][0] == 0 &&
+            specular.texels[0][1] == 0 && specular.texels[0][2] == 0) {
+        features |= MaterialFeatures::ZeroSpecular;
+    }
+    return features;
+}
+
+/// Call kernel.template shade<Features>(idx) with the most specialized
+/// mask contained in features.
+template <typename Kernel>
+DEVICE
+inline void dispatch_material_features(int features, Kernel &kernel, int idx) {
+    auto contains = [&](int mask) { return (features & mask) == mask; };
+    if (contains(MaterialFeatures::ConstantDiffuse)) {
+        kernel.template shade<MaterialFeatures::ConstantDiffuse>(idx);
+    } else if (contains(MaterialFeatures::Diffuse)) {
+        kernel.template shade<MaterialFeatures::Diffuse>(idx);
+    } else if (contains(MaterialFeatures::ConstantPlain)) {
+        kernel.template shade<MaterialFeatures::ConstantPlain>(idx);
+    } else {
+        kernel.template shade<MaterialFeatures::Generic>(idx);
+    }
+}
+
+template <int Features>
+DEVICE
+inline bool uses_vertex_color(const Material &material) {
+    return (Features & MaterialFeatures::NoVertexColor) == 0 && material.use_vertex_color;
+}
+
+template <int Features>
+DEVICE
+inline bool computes_specular_lighting(const Material &material) {
+    return (Features & MaterialFeatures::NoSpecularLighting) == 0 &&
+        material.compute_specular_lighting;
+}
+
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline Vector3 get_diffuse_reflectance(const Material &material,
                                        const SurfacePoint &shading_point) {
     Vector3 ret;
-    get_texture_value(material.diffuse_reflectance,
-                      shading_point.uv,
-                      shading_point.du_dxy,
-                      shading_point.dv_dxy,
-                      &ret.x);
+    if (Features & MaterialFeatures::ConstantTextures) {
+        get_texture_value_constant(material.diffuse_reflectance, &ret.x);
+    } else {
+        get_texture_value(material.diffuse_reflectance,
+                          shading_point.uv,
+                          shading_point.du_dxy,
+                          shading_point.dv_dxy,
+                          &ret.x);
+    }
     return ret;
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline void d_get_diffuse_reflectance(const Material &material,
                                       const SurfacePoint &shading_point,
                                       const Vector3 &d_output,
                                       Texture3 &d_texture,
                                       SurfacePoint &d_shading_point) {
-    d_get_texture_value(material.diffuse_reflectance,
-                        shading_point.uv,
-                        shading_point.du_dxy,
-                        shading_point.dv_dxy,
-                        &d_output.x,
-                        d_texture,
-                        d_shading_point.uv,
-                        d_shading_point.du_dxy,
-                        d_shading_point.dv_dxy);
+    if (Features & MaterialFeatures::ConstantTextures) {
+        d_get_texture_value_constant(material.diffuse_reflectance, &d_output.x, d_texture);
+    } else {
+        d_get_texture_value(material.diffuse_reflectance,
+                            shading_point.uv,
+                            shading_point.du_dxy,
+                            shading_point.dv_dxy,
+                            &d_output.x,
+                            d_texture,
+                            d_shading_point.uv,
+                            d_shading_point.du_dxy,
+                            d_shading_point.dv_dxy);
+    }
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline Vector3 get_specular_reflectance(const Material &material,
                                         const SurfacePoint &shading_point) {
     Vector3 ret;
-    get_texture_value(material.specular_reflectance,
-                      shading_point.uv,
-                      shading_point.du_dxy,
-                      shading_point.dv_dxy,
-                      &ret.x);
+    if (Features & MaterialFeatures::ZeroSpecular) {
+        ret = Vector3{0, 0, 0};
+    } else if (Features & MaterialFeatures::ConstantTextures) {
+        get_texture_value_constant(material.specular_reflectance, &ret.x);
+    } else {
+        get_texture_value(material.specular_reflectance,
+                          shading_point.uv,
+                          shading_point.du_dxy,
+                          shading_point.dv_dxy,
+                          &ret.x);
+    }
     return ret;
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline void d_get_specular_reflectance(const Material &material,
                                        const SurfacePoint &shading_point,
                                        const Vector3 &d_output,
                                        Texture3 &d_texture,
                                        SurfacePoint &d_shading_point) {
-    d_get_texture_value(material.specular_reflectance,
-                        shading_point.uv,
-                        shading_point.du_dxy,
-                        shading_point.dv_dxy,
-                        &d_output.x,
-                        d_texture,
-                        d_shading_point.uv,
-                        d_shading_point.du_dxy,
-                        d_shading_point.dv_dxy);
+    // A zero specular reflectance is still a constant texture we need the derivatives of
+    if (Features & (MaterialFeatures::ConstantTextures | MaterialFeatures::ZeroSpecular)) {
+        d_get_texture_value_constant(material.specular_reflectance, &d_output.x, d_texture);
+    } else {
+        d_get_texture_value(material.specular_reflectance,
+                            shading_point.uv,
+                            shading_point.du_dxy,
+                            shading_point.dv_dxy,
+                            &d_output.x,
+                            d_texture,
+                            d_shading_point.uv,
+                            d_shading_point.du_dxy,
+                            d_shading_point.dv_dxy);
+    }
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline Real get_roughness(const Material &material,
                           const SurfacePoint &shading_point) {
     Real ret;
-    get_texture_value(material.roughness,
-                      shading_point.uv,
-                      shading_point.du_dxy,
-                      shading_point.dv_dxy,
-                      &ret);
+    if (Features & MaterialFeatures::ConstantTextures) {
+        get_texture_value_constant(material.roughness, &ret);
+    } else {
+        get_texture_value(material.roughness,
+                          shading_point.uv,
+                          shading_point.du_dxy,
+                          shading_point.dv_dxy,
+                          &ret);
+    }
     return ret;
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline void d_get_roughness(const Material &material,
                             const SurfacePoint &shading_point,
                             const Real d_output,
                             Texture1 &d_texture,
                             SurfacePoint &d_shading_point) {
-    d_get_texture_value(material.roughness,
-                        shading_point.uv,
-                        shading_point.du_dxy,
-                        shading_point.dv_dxy,
-                        &d_output,
-                        d_texture,
-                        d_shading_point.uv,
-                        d_shading_point.du_dxy,
-                        d_shading_point.dv_dxy);
+    if (Features & MaterialFeatures::ConstantTextures) {
+        d_get_texture_value_constant(material.roughness, &d_output, d_texture);
+    } else {
+        d_get_texture_value(material.roughness,
+                            shading_point.uv,
+                            shading_point.du_dxy,
+                            shading_point.dv_dxy,
+                            &d_output,
+                            d_texture,
+                            d_shading_point.uv,
+                            d_shading_point.du_dxy,
+                            d_shading_point.dv_dxy);
+    }
 }
 
 DEVICE
@@ -222,9 +340,11 @@ inline void d_get_generic_texture(const Material &material,
 }
 
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline bool has_normal_map(const Material &material) {
-    return material.normal_map.num_levels > 0;
+    return (Features & MaterialFeatures::NoNormalMap) == 0 &&
+        material.normal_map.num_levels > 0;
 }
 
 DEVICE
@@ -350,6 +470,7 @@ inline void d_perturb_shading_frame(const Material &material,
                  d_shading_point);
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline
 Vector3 bsdf(const Material &material,
@@ -365,7 +486,7 @@ Vector3 bsdf(const Material &material,
     // since our edge sampling only detect geometry discontinuities.
     auto shading_frame = shading_point.shading_frame;
     auto geom_n = shading_point.geom_normal;
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         // Perturb shading frame
         shading_frame = perturb_shading_frame(material, shading_point);
     }
@@ -396,16 +517,16 @@ Vector3 bsdf(const Material &material,
         return Vector3{0, 0, 0};
     }
 
-    auto diffuse_reflectance_ = material.use_vertex_color ?
-        shading_point.color : get_diffuse_reflectance(material, shading_point);
-    auto specular_reflectance_ = material.use_vertex_color ?
-        Vector3{0, 0, 0} : get_specular_reflectance(material, shading_point);
+    auto diffuse_reflectance_ = uses_vertex_color<Features>(material) ?
+        shading_point.color : get_diffuse_reflectance<Features>(material, shading_point);
+    auto specular_reflectance_ = uses_vertex_color<Features>(material) ?
+        Vector3{0, 0, 0} : get_specular_reflectance<Features>(material, shading_point);
     auto diffuse_reflectance = max(diffuse_reflectance_, Vector3{0, 0, 0});
     auto specular_reflectance = max(specular_reflectance_, Vector3{0, 0, 0});
-    auto roughness = max(get_roughness(material, shading_point), min_roughness);
+    auto roughness = max(get_roughness<Features>(material, shading_point), min_roughness);
     auto diffuse_contrib = diffuse_reflectance * shading_wo / Real(M_PI);
     auto specular_contrib = Vector3{0, 0, 0};
-    if (material.compute_specular_lighting && !material.use_vertex_color) {
+    if (computes_specular_lighting<Features>(material) && !uses_vertex_color<Features>(material)) {
         // blinn-phong BRDF
         // half-vector
         auto m = normalize(wi + wo);
@@ -448,6 +569,7 @@ Vector3 bsdf(const Material &material,
     return diffuse_contrib + specular_contrib;
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline
 void d_bsdf(const Material &material,
@@ -461,7 +583,7 @@ void d_bsdf(const Material &material,
             Vector3 &d_wi,
             Vector3 &d_wo) {
     auto shading_frame = shading_point.shading_frame;
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         // Perturb shading frame
         shading_frame = perturb_shading_frame(material, shading_point);
     }
@@ -496,8 +618,8 @@ void d_bsdf(const Material &material,
         return;
     }
 
-    auto diffuse_reflectance_ = material.use_vertex_color ?
-        shading_point.color : get_diffuse_reflectance(material, shading_point);
+    auto diffuse_reflectance_ = uses_vertex_color<Features>(material) ?
+        shading_point.color : get_diffuse_reflectance<Features>(material, shading_point);
     auto diffuse_reflectance = max(diffuse_reflectance_, Vector3{0, 0, 0});
     // diffuse_contrib = diffuse_reflectance * shading_wo / Real(M_PI)
     auto d_diffuse_reflectance = d_output * (shading_wo / Real(M_PI));
@@ -510,10 +632,10 @@ void d_bsdf(const Material &material,
     //     diffuse_reflectance_.z >= 0 ? d_diffuse_reflectance.z : Real(0)
     // };
     // HACK (continued): instead we just use the gradients before the max.
-    if (material.use_vertex_color) {
+    if (uses_vertex_color<Features>(material)) {
         d_shading_point.color += d_diffuse_reflectance;
     } else {
-        d_get_diffuse_reflectance(material, shading_point, d_diffuse_reflectance,
+        d_get_diffuse_reflectance<Features>(material, shading_point, d_diffuse_reflectance,
                                   d_material.diffuse_reflectance, d_shading_point);
     }
     auto d_shading_wo = sum(d_output * diffuse_reflectance) / Real(M_PI);
@@ -524,12 +646,12 @@ void d_bsdf(const Material &material,
     d_wo += shading_frame.n * d_shading_wo;
     d_n += wo * d_shading_wo;
 
-    auto specular_reflectance_ = material.use_vertex_color ?
-        Vector3{0, 0, 0} : get_specular_reflectance(material, shading_point);
+    auto specular_reflectance_ = uses_vertex_color<Features>(material) ?
+        Vector3{0, 0, 0} : get_specular_reflectance<Features>(material, shading_point);
     auto specular_reflectance = max(specular_reflectance_, Vector3{0, 0, 0});
-    auto roughness = max(get_roughness(material, shading_point), min_roughness);
+    auto roughness = max(get_roughness<Features>(material, shading_point), min_roughness);
     roughness = max(roughness, Real(1e-6));
-    if (material.compute_specular_lighting && !material.use_vertex_color) {
+    if (computes_specular_lighting<Features>(material) && !uses_vertex_color<Features>(material)) {
         // blinn-phong BRDF
         // half-vector
         auto m = normalize(wi + wo);
@@ -666,12 +788,12 @@ void d_bsdf(const Material &material,
             // };
             // HACK (continued): instead we just use the gradients before the max.
             // specular_reflectance = get_specular_reflectance(material, shading_point)
-            d_get_specular_reflectance(
+            d_get_specular_reflectance<Features>(
                 material, shading_point, d_specular_reflectance,
                 d_material.specular_reflectance, d_shading_point);
             // roughness = get_roughness(material, shading_point.uv)
             if (roughness > min_roughness) {
-                d_get_roughness(material,
+                d_get_roughness<Features>(material,
                                 shading_point,
                                 d_roughness,
                                 d_material.roughness,
@@ -680,7 +802,7 @@ void d_bsdf(const Material &material,
         }
     }
 
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         d_perturb_shading_frame(material,
                                 shading_point,
                                 d_n,
@@ -699,6 +821,7 @@ Vector3 cos_hemisphere(const Vector2 &sample) {
     return Vector3{cos(phi) * tmp, sin(phi) * tmp, sqrt(sample[1])};
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline
 Vector3 bsdf_sample(const Material &material,
@@ -713,7 +836,7 @@ Vector3 bsdf_sample(const Material &material,
         *next_min_roughness = min_roughness;
     }
     auto shading_frame = shading_point.shading_frame;
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         // Perturb shading frame
         shading_frame = perturb_shading_frame(material, shading_point);
     }
@@ -731,10 +854,10 @@ Vector3 bsdf_sample(const Material &material,
         }
     }
 
-    auto diffuse_reflectance_ = material.use_vertex_color ?
-        shading_point.color : get_diffuse_reflectance(material, shading_point);
-    auto specular_reflectance_ = material.use_vertex_color ?
-        Vector3{0, 0, 0} : get_specular_reflectance(material, shading_point);
+    auto diffuse_reflectance_ = uses_vertex_color<Features>(material) ?
+        shading_point.color : get_diffuse_reflectance<Features>(material, shading_point);
+    auto specular_reflectance_ = uses_vertex_color<Features>(material) ?
+        Vector3{0, 0, 0} : get_specular_reflectance<Features>(material, shading_point);
     auto diffuse_reflectance = max(diffuse_reflectance_, Vector3{0, 0, 0});
     auto specular_reflectance = max(specular_reflectance_, Vector3{0, 0, 0});
     auto diffuse_weight = luminance(diffuse_reflectance);
@@ -767,7 +890,7 @@ Vector3 bsdf_sample(const Material &material,
         return dir;
     } else {
         // Blinn-phong
-        auto roughness = max(get_roughness(material, shading_point), min_roughness);
+        auto roughness = max(get_roughness<Features>(material, shading_point), min_roughness);
         roughness = max(roughness, Real(1e-6));
         if (next_min_roughness != nullptr) {
             *next_min_roughness = max(roughness, min_roughness);
@@ -810,6 +933,7 @@ Vector3 bsdf_sample(const Material &material,
     }
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline
 void d_bsdf_sample(const Material &material,
@@ -825,7 +949,7 @@ void d_bsdf_sample(const Material &material,
                    Vector3 &d_wi,
                    RayDifferential &d_wi_differential) {
     auto shading_frame = shading_point.shading_frame;
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         // Perturb shading frame
         shading_frame = perturb_shading_frame(material, shading_point);
     }
@@ -843,10 +967,10 @@ void d_bsdf_sample(const Material &material,
         }
     }
 
-    auto diffuse_reflectance_ = material.use_vertex_color ?
-        shading_point.color : get_diffuse_reflectance(material, shading_point);
-    auto specular_reflectance_ = material.use_vertex_color ?
-        Vector3{0, 0, 0} : get_specular_reflectance(material, shading_point);
+    auto diffuse_reflectance_ = uses_vertex_color<Features>(material) ?
+        shading_point.color : get_diffuse_reflectance<Features>(material, shading_point);
+    auto specular_reflectance_ = uses_vertex_color<Features>(material) ?
+        Vector3{0, 0, 0} : get_specular_reflectance<Features>(material, shading_point);
     auto diffuse_reflectance = max(diffuse_reflectance_, Vector3{0, 0, 0});
     auto specular_reflectance = max(specular_reflectance_, Vector3{0, 0, 0});
     auto diffuse_weight = luminance(diffuse_reflectance);
@@ -893,7 +1017,7 @@ void d_bsdf_sample(const Material &material,
             return;
         }
         // Blinn-phong
-        auto roughness = max(get_roughness(material, shading_point), min_roughness);
+        auto roughness = max(get_roughness<Features>(material, shading_point), min_roughness);
         roughness = max(roughness, Real(1e-6));
         auto phong_exponent = roughness_to_phong(roughness);
         // Sample phi
@@ -1001,7 +1125,7 @@ void d_bsdf_sample(const Material &material,
         auto d_roughness = d_roughness_to_phong(roughness, d_phong_exponent);
         // roughness = get_roughness(material, shading_point)
         if (roughness > min_roughness) {
-            d_get_roughness(material,
+            d_get_roughness<Features>(material,
                             shading_point,
                             d_roughness,
                             d_material.roughness,
@@ -1009,7 +1133,7 @@ void d_bsdf_sample(const Material &material,
         }
     }
 
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         d_perturb_shading_frame(material,
                                 shading_point,
                                 d_shading_frame,
@@ -1020,6 +1144,7 @@ void d_bsdf_sample(const Material &material,
     }
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline Real bsdf_pdf(const Material &material,
                      const SurfacePoint &shading_point,
@@ -1028,7 +1153,7 @@ inline Real bsdf_pdf(const Material &material,
                      const Real min_roughness) {
     auto shading_frame = shading_point.shading_frame;
     auto geom_n = shading_point.geom_normal;
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         // Perturb shading frame
         shading_frame = perturb_shading_frame(material, shading_point);
     }
@@ -1053,10 +1178,10 @@ inline Real bsdf_pdf(const Material &material,
         }
     }
 
-    auto diffuse_reflectance_ = material.use_vertex_color ?
-        shading_point.color : get_diffuse_reflectance(material, shading_point);
-    auto specular_reflectance_ = material.use_vertex_color ?
-        Vector3{0, 0, 0} : get_specular_reflectance(material, shading_point);
+    auto diffuse_reflectance_ = uses_vertex_color<Features>(material) ?
+        shading_point.color : get_diffuse_reflectance<Features>(material, shading_point);
+    auto specular_reflectance_ = uses_vertex_color<Features>(material) ?
+        Vector3{0, 0, 0} : get_specular_reflectance<Features>(material, shading_point);
     auto diffuse_reflectance = max(diffuse_reflectance_, Vector3{0, 0, 0});
     auto specular_reflectance = max(specular_reflectance_, Vector3{0, 0, 0});
     auto diffuse_weight = luminance(diffuse_reflectance);
@@ -1082,7 +1207,7 @@ inline Real bsdf_pdf(const Material &material,
             }
         }
         if (m_local[2] > 0.f && fabs(dot(m, wo)) > 0) {
-            auto roughness = max(get_roughness(material, shading_point), min_roughness);
+            auto roughness = max(get_roughness<Features>(material, shading_point), min_roughness);
             roughness = max(roughness, Real(1e-6));
             auto phong_exponent = roughness_to_phong(roughness);
             auto D = pow(m_local[2], phong_exponent) * (phong_exponent + 2.f) / Real(2 * M_PI);
@@ -1092,6 +1217,7 @@ inline Real bsdf_pdf(const Material &material,
     return diffuse_pdf + specular_pdf;
 }
 
+template <int Features = MaterialFeatures::Generic>
 DEVICE
 inline void d_bsdf_pdf(const Material &material,
                        const SurfacePoint &shading_point,
@@ -1105,7 +1231,7 @@ inline void d_bsdf_pdf(const Material &material,
                        Vector3 &d_wo) {
     auto shading_frame = shading_point.shading_frame;
     auto geom_n = shading_point.geom_normal;
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         // Perturb shading frame
         shading_frame = perturb_shading_frame(material, shading_point);
     }
@@ -1130,10 +1256,10 @@ inline void d_bsdf_pdf(const Material &material,
         }
     }
 
-    auto diffuse_reflectance_ = material.use_vertex_color ?
-        shading_point.color : get_diffuse_reflectance(material, shading_point);
-    auto specular_reflectance_ = material.use_vertex_color ?
-        Vector3{0, 0, 0} : get_specular_reflectance(material, shading_point);
+    auto diffuse_reflectance_ = uses_vertex_color<Features>(material) ?
+        shading_point.color : get_diffuse_reflectance<Features>(material, shading_point);
+    auto specular_reflectance_ = uses_vertex_color<Features>(material) ?
+        Vector3{0, 0, 0} : get_specular_reflectance<Features>(material, shading_point);
     auto diffuse_reflectance = max(diffuse_reflectance_, Vector3{0, 0, 0});
     auto specular_reflectance = max(specular_reflectance_, Vector3{0, 0, 0});
     auto diffuse_weight = luminance(diffuse_reflectance);
@@ -1170,7 +1296,7 @@ inline void d_bsdf_pdf(const Material &material,
             }
         }
         if (m_local[2] > 0.f && fabs(dot(wo, m)) > 0) {
-            auto roughness = max(get_roughness(material, shading_point), min_roughness);
+            auto roughness = max(get_roughness<Features>(material, shading_point), min_roughness);
             roughness = max(roughness, Real(1e-6));
             auto phong_exponent = roughness_to_phong(roughness);
             auto D = pow(m_local[2], phong_exponent) * (phong_exponent + 2.f) / Real(2 * M_PI);
@@ -1214,7 +1340,7 @@ inline void d_bsdf_pdf(const Material &material,
             d_wo += d_wi_wo;
             // roughness = get_roughness(material, shading_point)
             if (roughness > min_roughness) {
-                d_get_roughness(material,
+                d_get_roughness<Features>(material,
                                 shading_point,
                                 d_roughness,
                                 d_material.roughness,
@@ -1223,7 +1349,7 @@ inline void d_bsdf_pdf(const Material &material,
         }
     }
 
-    if (has_normal_map(material)) {
+    if (has_normal_map<Features>(material)) {
         d_perturb_shading_frame(material,
                                 shading_point,
                                 d_n,
@@ -1237,3 +1363,4 @@ inline void d_bsdf_pdf(const Material &material,
 void test_d_bsdf();
 void test_d_bsdf_sample();
 void test_d_bsdf_pdf();
+void test_material_features();
@@ -4,6 +4,14 @@
 #include <condition_variable>
 #include <vector>
 #include <cassert>
+#include <cstdlib>
+#if defined(__linux__)
+#include <fstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 // From https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.cpp
 
@@ -12,6 +20,7 @@ static bool shutdownThreads = false;
 struct ParallelForLoop;
 static ParallelForLoop *workList = nullptr;
 static std::mutex workListMutex;
+static bool pinWorkerThreads = false;
 
 struct ParallelForLoop {
     ParallelForLoop(std::function<void(int)> func1D, int64_t maxIndex, int64_t chunkSize)
@@ -225,6 +234,23 @@ void parallel_for_host(
     }
 }
 
+void parallel_for_host(const std::function<void(int, int)> &func,
+                       const std::vector<int64_t> &counts) {
+    // offsets[i] is the first index of loop i in the merged loop
+    std::vector<int64_t> offsets(counts.size() + 1, 0);
+    for (int i = 0; i < (int)counts.size(); i++) {
+        offsets[i + 1] = offsets[i] + counts[i];
+    }
+    parallel_for_host([&](int index) {
+        // There are only a few loops, a linear search is fine
+        auto loop_id = 0;
+        while (index >= offsets[loop_id + 1]) {
+            loop_id++;
+        }
+        func(loop_id, int(index - offsets[loop_id]));
+    }, offsets.back());
+}
+
 int num_system_cores() {
     // return 1;
     int ret = std::thread::hardware_concurrency();
@@ -234,6 +260,60 @@ int num_system_cores() {
     return ret;
 }
 
+#if defined(__linux__)
+// Group the cores this process may run on by their socket
+static std::vector<std::vector<int>> cores_per_socket() {
+    std::vector<std::vector<int>> sockets;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+        return sockets;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cpus)) {
+            continue;
+        }
+        std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                           "/topology/physical_package_id");
+        auto socket = 0;
+        if (!(file >> socket) || socket < 0) {
+            socket = 0;
+        }
+        if (socket >= (int)sockets.size()) {
+            sockets.resize(socket + 1);
+        }
+        sockets[socket].push_back(cpu);
+    }
+    sockets.erase(std::remove_if(sockets.begin(), sockets.end(),
+        [](const std::vector<int> &cores) { return cores.empty(); }), sockets.end());
+    return sockets;
+}
+#endif
+
+// Split the workers into contiguous groups, one per socket. The main thread
+// is left alone since it belongs to the caller.
+static void pin_to_sockets(std::vector<std::thread> &workers, int nThreads) {
+#if defined(__linux__)
+    auto sockets = cores_per_socket();
+    if (sockets.size() <= 1) {
+        return;
+    }
+    for (int i = 0; i < (int)workers.size(); i++) {
+        const auto &cores = sockets[((i + 1) * sockets.size()) / nThreads];
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (auto cpu : cores) {
+            CPU_SET(cpu, &cpus);
+        }
+        pthread_setaffinity_np(workers[i].native_handle(), sizeof(cpus), &cpus);
+    }
+#endif
+}
+
+void set_pin_worker_threads(bool pin) {
+    pinWorkerThreads = pin;
+}
+
 void parallel_init() {
     assert(threads.size() == 0);
     int nThreads = num_system_cores();
@@ -250,6 +330,9 @@ void parallel_init() {
     for (int i = 0; i < nThreads - 1; ++i) {
         threads.push_back(std::thread(worker_thread_func, i + 1, barrier));
     }
+    if (pinWorkerThreads) {
+        pin_to_sockets(threads, nThreads);
+    }
 
     barrier->Wait();
 }
@@ -271,3 +354,25 @@ void parallel_cleanup() {
     threads.erase(threads.begin(), threads.end());
     shutdownThreads = false;
 }
+
+void *allocate_host(size_t bytes) {
+#if defined(__linux__)
+    const size_t huge_page_size = 2 * 1024 * 1024;
+    if (bytes >= huge_page_size) {
+        auto aligned_bytes = ((bytes + huge_page_size - 1) / huge_page_size) * huge_page_size;
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, huge_page_size, aligned_bytes) == 0) {
+#ifdef MADV_HUGEPAGE
+            madvise(ptr, aligned_bytes, MADV_HUGEPAGE);
+#endif
+            return ptr;
+        }
+    }
+#endif
+    return malloc(bytes);
+}
+
+void free_host(void *ptr) {
+    // posix_memalign memory is released with free() as well
+    free(ptr);
+}
@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <cassert>
 #include <algorithm>
+#include <vector>
 // From https://github.com/mmp/pbrt-v3/blob/master/src/core/parallel.h
 
 class Barrier {
@@ -29,15 +30,33 @@ void parallel_for_host(const std::function<void(int)> &func,
 extern thread_local int ThreadIndex;
 void parallel_for_host(
     std::function<void(Vector2i)> func, const Vector2i count);
+// Run independent loops as one parallel loop: func(loop_id, index) for
+// index < counts[loop_id]. The threads that are done with one loop help with
+// the others instead of waiting for the slowest iterations of each loop.
+void parallel_for_host(const std::function<void(int, int)> &func,
+                       const std::vector<int64_t> &counts);
 int num_system_cores();
 
 void parallel_init();
 void parallel_cleanup();
+// Pin each worker thread to the cores of one socket, so that it doesn't
+// migrate between memory nodes. Takes effect at the next parallel_init().
+void set_pin_worker_threads(bool pin);
+
+// Number of consecutive indices a CPU thread takes from parallel_for
+constexpr int64_t host_work_per_thread = 256;
+
+// Host memory for Buffer. Large allocations are aligned to 2MB and backed by
+// transparent huge pages where the OS supports them. The pages are placed
+// wherever the buffer is first written: parallel_for hands out its chunks
+// dynamically, so there is no thread-to-range mapping to prefault with.
+void *allocate_host(size_t bytes);
+void free_host(void *ptr);
 
 #ifdef __CUDACC__
 template <typename T>
-__global__ void parallel_for_device_kernel(T functor, int count) {
-    auto idx = threadIdx.x + blockIdx.x * blockDim.x;
+__global__ void parallel_for_device_kernel(T functor, int64_t count) {
+    auto idx = int64_t(threadIdx.x) + int64_t(blockIdx.x) * int64_t(blockDim.x);
     if (idx >= count) {
         return;
     }
@@ -56,13 +75,16 @@ inline void parallel_for_device(T functor,
 }
 #endif
 
+// The count and the launch index are 64-bit. Functors still take an int
+// index: one launch covers at most the pixels or edge samples of one bounce,
+// only the offsets into the stacked per-bounce buffers need 64 bits.
 template <typename T>
 inline void parallel_for(T functor,
                          int64_t count,
                          bool use_gpu,
                          int64_t work_per_thread = -1) {
     if (work_per_thread == -1) {
-        work_per_thread = use_gpu ? 64 : 256;
+        work_per_thread = use_gpu ? 64 : host_work_per_thread;
     }
     if (count <= 0) {
         return;
@@ -71,7 +93,7 @@ inline void parallel_for(T functor,
 #ifdef __CUDACC__
         auto block_size = work_per_thread;
         auto block_count = idiv_ceil(count, block_size);
-        parallel_for_device_kernel<T><<<(uint32_t)block_count, (uint32_t)block_size>>>(functor, (int)count);
+        parallel_for_device_kernel<T><<<(uint32_t)block_count, (uint32_t)block_size>>>(functor, count);
 #else
         assert(false);
 #endif
@@ -80,7 +102,7 @@ inline void parallel_for(T functor,
         parallel_for_host([&](int thread_index) {
             auto id_offset = work_per_thread * thread_index;
             auto work_end = std::min(id_offset + work_per_thread, count);
-            for (int work_id = (int)id_offset; work_id < (int)work_end; work_id++) {
+            for (int64_t work_id = id_offset; work_id < work_end; work_id++) {
                 auto idx = work_id;
                 assert(idx < count);
                 functor(idx);
@@ -4,6 +4,12 @@
 
 struct path_contribs_accumulator {
     DEVICE void operator()(int idx) {
+        const auto &shape = scene.shapes[shading_isects[active_pixels[idx]].shape_id];
+        dispatch_material_features(scene.materials[shape.material_id].features, *this, idx);
+    }
+
+    template <int Features>
+    DEVICE void shade(int idx) {
         auto pixel_id = active_pixels[idx];
         const auto &throughput = throughputs[pixel_id];
         const auto &incoming_ray = incoming_rays[pixel_id];
@@ -35,14 +41,13 @@ struct path_contribs_accumulator {
                 if (dist_sq > 1e-20f && light_shape.light_id >= 0) {
                     const auto &light = scene.area_lights[light_shape.light_id];
                     if (light.two_sided || dot(-wo, light_point.shading_frame.n) > 0) {
-                        auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                        auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                         auto geometry_term = fabs(dot(wo, light_point.geom_normal)) / dist_sq;
                         auto light_contrib = light.intensity;
-                        auto light_pmf = scene.light_pmf[light_shape.light_id];
-                        auto light_area = scene.light_areas[light_shape.light_id];
-                        auto pdf_nee = light_pmf / light_area;
+                        auto pdf_nee = light_pdf(
+                            scene, shading_point, light_shape.light_id, light_isect.tri_id);
                         auto pdf_bsdf =
-                            bsdf_pdf(material, shading_point, wi, wo, min_rough) * geometry_term;
+                            bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough) * geometry_term;
                         auto mis_weight = Real(1 / (1 + square((double)pdf_bsdf / (double)pdf_nee)));
                         nee_contrib =
                             (mis_weight * geometry_term / pdf_nee) * bsdf_val * light_contrib;
@@ -55,13 +60,13 @@ struct path_contribs_accumulator {
                 auto light_pmf = scene.light_pmf[envmap_id];
                 auto pdf_nee = envmap_pdf(*scene.envmap, wo) * light_pmf;
                 if (pdf_nee > 0) {
-                    auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                    auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                     // XXX: For now we don't use ray differentials for envmap
                     //      A proper approach might be to use a filter radius based on sampling density?
                     RayDifferential ray_diff{Vector3{0, 0, 0}, Vector3{0, 0, 0},
                                              Vector3{0, 0, 0}, Vector3{0, 0, 0}};
                     auto light_contrib = envmap_eval(*scene.envmap, wo, ray_diff);
-                    auto pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough);
+                    auto pdf_bsdf = bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough);
                     auto mis_weight = Real(1 / (1 + square((double)pdf_bsdf / (double)pdf_nee)));
                     nee_contrib = (mis_weight / pdf_nee) * bsdf_val * light_contrib;
                 }
@@ -75,18 +80,16 @@ struct path_contribs_accumulator {
             auto dir = bsdf_point.position - p;
             auto dist_sq = length_squared(dir);
             auto wo = dir / sqrt(dist_sq);
-            auto pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough);
+            auto pdf_bsdf = bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough);
             if (dist_sq > 1e-20f && pdf_bsdf > 1e-20f) {
-                auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                 if (bsdf_shape.light_id >= 0) {
                     const auto &light = scene.area_lights[bsdf_shape.light_id];
                     if (light.two_sided || dot(-wo, bsdf_point.shading_frame.n) > 0) {
                         auto light_contrib = light.intensity;
-                        auto light_pmf = scene.light_pmf[bsdf_shape.light_id];
-                        auto light_area = scene.light_areas[bsdf_shape.light_id];
-                        auto inv_area = 1 / light_area;
                         auto geometry_term = fabs(dot(wo, bsdf_point.geom_normal)) / dist_sq;
-                        auto pdf_nee = (light_pmf * inv_area) / geometry_term;
+                        auto pdf_nee = light_pdf(scene, shading_point,
+                            bsdf_shape.light_id, bsdf_isect.tri_id) / geometry_term;
                         auto mis_weight = Real(1 / (1 + square((double)pdf_nee / (double)pdf_bsdf)));
                         scatter_contrib = (mis_weight / pdf_bsdf) * bsdf_val * light_contrib;
                     }
@@ -99,14 +102,14 @@ struct path_contribs_accumulator {
         } else if (scene.envmap != nullptr) {
             // Hit environment map
             auto wo = bsdf_ray.dir;
-            auto pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough);
+            auto pdf_bsdf = bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough);
             // wo can be zero when bsdf_sample failed
             if (length_squared(wo) > 0 && pdf_bsdf > 1e-20f) {
                 // XXX: For now we don't use ray differentials for envmap
                 //      A proper approach might be to use a filter radius based on sampling density?
                 RayDifferential ray_diff{Vector3{0, 0, 0}, Vector3{0, 0, 0},
                                          Vector3{0, 0, 0}, Vector3{0, 0, 0}};
-                auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                 auto light_contrib = envmap_eval(*scene.envmap, wo, ray_diff);
                 auto envmap_id = scene.num_lights - 1;
                 auto light_pmf = scene.light_pmf[envmap_id];
@@ -122,7 +125,7 @@ struct path_contribs_accumulator {
         assert(isfinite(nee_contrib));
         assert(isfinite(scatter_contrib));
         if (rendered_image != nullptr) {
-            auto nd = channel_info.num_total_dimensions;
+            auto nd = int64_t(channel_info.num_total_dimensions);
             auto d = channel_info.radiance_dimension;
             rendered_image[nd * pixel_id + d] += float(weight * path_contrib[0]);
             rendered_image[nd * pixel_id + d + 1] += float(weight * path_contrib[1]);
@@ -155,6 +158,12 @@ struct path_contribs_accumulator {
 
 struct d_path_contribs_accumulator {
     DEVICE void operator()(int idx) {
+        const auto &shape = scene.shapes[shading_isects[active_pixels[idx]].shape_id];
+        dispatch_material_features(scene.materials[shape.material_id].features, *this, idx);
+    }
+
+    template <int Features>
+    DEVICE void shade(int idx) {
         auto pixel_id = active_pixels[idx];
         const auto &throughput = throughputs[pixel_id];
         const auto &incoming_ray = incoming_rays[pixel_id];
@@ -178,7 +187,7 @@ struct d_path_contribs_accumulator {
 
         auto &d_material = d_materials[shading_shape.material_id];
 
-        auto nd = channel_info.num_total_dimensions;
+        auto nd = int64_t(channel_info.num_total_dimensions);
         auto d = channel_info.radiance_dimension;
         // rendered_image[nd * pixel_id + d    ] += weight * path_contrib[0];
         // rendered_image[nd * pixel_id + d + 1] += weight * path_contrib[1];
@@ -213,17 +222,15 @@ struct d_path_contribs_accumulator {
                         Vector3 d_light_vertices[3] = {
                             Vector3{0, 0, 0}, Vector3{0, 0, 0}, Vector3{0, 0, 0}};
 
-                        auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                        auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                         auto cos_light = dot(wo, light_point.geom_normal);
                         auto geometry_term = fabs(cos_light) / dist_sq;
                         const auto &light = scene.area_lights[light_shape.light_id];
                         auto light_contrib = light.intensity;
-                        auto light_pmf = scene.light_pmf[light_shape.light_id];
-                        auto light_area = scene.light_areas[light_shape.light_id];
-                        auto inv_area = 1 / light_area;
-                        auto pdf_nee = light_pmf * inv_area;
+                        auto pdf_nee = light_pdf(
+                            scene, shading_point, light_shape.light_id, light_isect.tri_id);
                         auto pdf_bsdf =
-                            bsdf_pdf(material, shading_point, wi, wo, min_rough) * geometry_term;
+                            bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough) * geometry_term;
                         auto mis_weight = Real(1 / (1 + square((double)pdf_bsdf / (double)pdf_nee)));
 
                         auto nee_contrib = (mis_weight * geometry_term / pdf_nee) *
@@ -248,6 +255,7 @@ struct d_path_contribs_accumulator {
                         auto d_light_contrib = weight * d_nee_contrib * geometry_term * bsdf_val;
                         // pdf_nee = light_pmf / light_area
                         //         = light_pmf * tri_pmf / tri_area
+                        // (or light_bvh_pmf / tri_area with the light BVH)
                         auto d_area =
                             -d_pdf_nee * pdf_nee / get_area(light_shape, light_isect.tri_id);
                         d_get_area(light_shape, light_isect.tri_id, d_area, d_light_vertices);
@@ -263,8 +271,8 @@ struct d_path_contribs_accumulator {
                         d_light_point.geom_normal = d_cos_light * wo;
                         // bsdf_val = bsdf(material, shading_point, wi, wo)
                         auto d_wi = Vector3{0, 0, 0};
-                        d_bsdf(material, shading_point, wi, wo, min_rough, d_bsdf_val,
-                               d_material, d_shading_point, d_wi, d_wo);
+                        d_bsdf<Features>(material, shading_point, wi, wo, min_rough, d_bsdf_val,
+                                         d_material, d_shading_point, d_wi, d_wo);
                         // wo = dir / sqrt(dist_sq)
                         auto d_dir = d_wo / sqrt(dist_sq);
                         // sqrt(dist_sq)
@@ -284,12 +292,12 @@ struct d_path_contribs_accumulator {
 
                         // Accumulate derivatives
                         auto light_tri_index = get_indices(light_shape, light_isect.tri_id);
-                        atomic_add(&d_shapes[light_isect.shape_id].vertices[3 * light_tri_index[0]],
-                            d_light_vertices[0]);
-                        atomic_add(&d_shapes[light_isect.shape_id].vertices[3 * light_tri_index[1]],
-                            d_light_vertices[1]);
-                        atomic_add(&d_shapes[light_isect.shape_id].vertices[3 * light_tri_index[2]],
-                            d_light_vertices[2]);
+                        atomic_add_vertex_derivative(light_shape, d_shapes[light_isect.shape_id],
+                            light_tri_index[0], d_light_vertices[0]);
+                        atomic_add_vertex_derivative(light_shape, d_shapes[light_isect.shape_id],
+                            light_tri_index[1], d_light_vertices[1]);
+                        atomic_add_vertex_derivative(light_shape, d_shapes[light_isect.shape_id],
+                            light_tri_index[2], d_light_vertices[2]);
                     }
                 }
             } else if (scene.envmap != nullptr) {
@@ -299,14 +307,14 @@ struct d_path_contribs_accumulator {
                 auto light_pmf = scene.light_pmf[envmap_id];
                 auto pdf_nee = envmap_pdf(*scene.envmap, wo) * light_pmf;
                 if (pdf_nee > 0) {
-                    auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                    auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                     // XXX: For now we don't use ray differentials for next event estimation.
                     //      A proper approach might be to use a filter radius based on sampling density?
                     auto ray_diff = RayDifferential{
                         Vector3{0, 0, 0}, Vector3{0, 0, 0},
                         Vector3{0, 0, 0}, Vector3{0, 0, 0}};
                     auto light_contrib = envmap_eval(*scene.envmap, wo, ray_diff);
-                    auto pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough);
+                    auto pdf_bsdf = bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough);
                     auto mis_weight = Real(1 / (1 + square((double)pdf_bsdf / (double)pdf_nee)));
                     auto nee_contrib = (mis_weight / pdf_nee) * bsdf_val * light_contrib;
 
@@ -328,7 +336,7 @@ struct d_path_contribs_accumulator {
                         *d_envmap, d_wo, d_ray_diff);
                     // bsdf_val = bsdf(material, shading_point, wi, wo, min_rough)
                     auto d_wi = Vector3{0, 0, 0};
-                    d_bsdf(material, shading_point, wi, wo, min_rough, d_bsdf_val,
+                    d_bsdf<Features>(material, shading_point, wi, wo, min_rough, d_bsdf_val,
                         d_material, d_shading_point, d_wi, d_wo);
                     // wi = -incoming_ray.dir
                     d_incoming_ray.dir -= d_wi;
@@ -350,7 +358,7 @@ struct d_path_contribs_accumulator {
             auto dir = bsdf_point.position - p;
             auto dist_sq = length_squared(dir);
             auto wo = dir / sqrt(dist_sq);
-            auto pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough);
+            auto pdf_bsdf = bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough);
             if (pdf_bsdf > 0) {
                 // Initialize bsdf vertex derivatives
                 Vector3 d_bsdf_v_p[3] = {Vector3{0, 0, 0}, Vector3{0, 0, 0}, Vector3{0, 0, 0}};
@@ -358,7 +366,7 @@ struct d_path_contribs_accumulator {
                 Vector2 d_bsdf_v_uv[3] = {Vector2{0, 0}, Vector2{0, 0}, Vector2{0, 0}};
                 Vector3 d_bsdf_v_c[3] = {Vector3{0, 0, 0}, Vector3{0, 0, 0}, Vector3{0, 0, 0}};
 
-                auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                 auto scatter_bsdf = bsdf_val / pdf_bsdf;
 
                 // next_throughput = throughput * scatter_bsdf
@@ -381,10 +389,8 @@ struct d_path_contribs_accumulator {
                         auto geometry_term = fabs(dot(wo, bsdf_point.geom_normal)) / dist_sq;
                         const auto &light = scene.area_lights[bsdf_shape.light_id];
                         auto light_contrib = light.intensity;
-                        auto light_pmf = scene.light_pmf[bsdf_shape.light_id];
-                        auto light_area = scene.light_areas[bsdf_shape.light_id];
-                        auto inv_area = 1 / light_area;
-                        auto pdf_nee = (light_pmf * inv_area) / geometry_term;
+                        auto pdf_nee = light_pdf(scene, shading_point,
+                            bsdf_shape.light_id, bsdf_isect.tri_id) / geometry_term;
                         auto mis_weight = Real(1 / (1 + square((double)pdf_nee / (double)pdf_bsdf)));
                         auto scatter_contrib = (mis_weight / pdf_bsdf) * bsdf_val * light_contrib;
 
@@ -411,8 +417,8 @@ struct d_path_contribs_accumulator {
                 // d_bsdf_pdf(material, shading_point, wi, wo, min_rough, d_pdf_bsdf,
                 //            d_roughness_tex, d_shading_point, d_wi, d_wo);
                 // bsdf_val = bsdf(material, shading_point, wi, wo)
-                d_bsdf(material, shading_point, wi, wo, min_rough, d_bsdf_val,
-                       d_material, d_shading_point, d_wi, d_wo);
+                d_bsdf<Features>(material, shading_point, wi, wo, min_rough, d_bsdf_val,
+                                 d_material, d_shading_point, d_wi, d_wo);
 
                 // wo = dir / sqrt(dist_sq)
                 auto d_dir = d_wo / sqrt(dist_sq);
@@ -478,12 +484,12 @@ struct d_path_contribs_accumulator {
 
                 // Accumulate derivatives
                 auto bsdf_tri_index = get_indices(bsdf_shape, bsdf_isect.tri_id);
-                atomic_add(&d_shapes[bsdf_isect.shape_id].vertices[3 * bsdf_tri_index[0]],
-                    d_bsdf_v_p[0]);
-                atomic_add(&d_shapes[bsdf_isect.shape_id].vertices[3 * bsdf_tri_index[1]],
-                    d_bsdf_v_p[1]);
-                atomic_add(&d_shapes[bsdf_isect.shape_id].vertices[3 * bsdf_tri_index[2]],
-                    d_bsdf_v_p[2]);
+                atomic_add_vertex_derivative(bsdf_shape, d_shapes[bsdf_isect.shape_id],
+                    bsdf_tri_index[0], d_bsdf_v_p[0]);
+                atomic_add_vertex_derivative(bsdf_shape, d_shapes[bsdf_isect.shape_id],
+                    bsdf_tri_index[1], d_bsdf_v_p[1]);
+                atomic_add_vertex_derivative(bsdf_shape, d_shapes[bsdf_isect.shape_id],
+                    bsdf_tri_index[2], d_bsdf_v_p[2]);
                 if (has_uvs(bsdf_shape)) {
                     auto uv_tri_ind = bsdf_tri_index;
                     if (bsdf_shape.uv_indices != nullptr) {
@@ -501,12 +507,12 @@ struct d_path_contribs_accumulator {
                     if (bsdf_shape.normal_indices != nullptr) {
                         normal_tri_ind = get_normal_indices(bsdf_shape, bsdf_isect.tri_id);
                     }
-                    atomic_add(&d_shapes[bsdf_isect.shape_id].normals[3 * normal_tri_ind[0]],
-                        d_bsdf_v_n[0]);
-                    atomic_add(&d_shapes[bsdf_isect.shape_id].normals[3 * normal_tri_ind[1]],
-                        d_bsdf_v_n[1]);
-                    atomic_add(&d_shapes[bsdf_isect.shape_id].normals[3 * normal_tri_ind[2]],
-                        d_bsdf_v_n[2]);
+                    atomic_add_normal_derivative(bsdf_shape, d_shapes[bsdf_isect.shape_id],
+                        normal_tri_ind[0], d_bsdf_v_n[0]);
+                    atomic_add_normal_derivative(bsdf_shape, d_shapes[bsdf_isect.shape_id],
+                        normal_tri_ind[1], d_bsdf_v_n[1]);
+                    atomic_add_normal_derivative(bsdf_shape, d_shapes[bsdf_isect.shape_id],
+                        normal_tri_ind[2], d_bsdf_v_n[2]);
                 }
                 if (has_colors(bsdf_shape)) {
                     atomic_add(&d_shapes[bsdf_isect.shape_id].colors[3 * bsdf_tri_index[0]],
@@ -522,10 +528,10 @@ struct d_path_contribs_accumulator {
             const auto &bsdf_ray = bsdf_rays[pixel_id];
             
             auto wo = bsdf_ray.dir;
-            auto pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough);
+            auto pdf_bsdf = bsdf_pdf<Features>(material, shading_point, wi, wo, min_rough);
             // wo can be zero if bsdf_sample fails
             if (length_squared(wo) > 0 && pdf_bsdf > 0) {
-                auto bsdf_val = bsdf(material, shading_point, wi, wo, min_rough);
+                auto bsdf_val = bsdf<Features>(material, shading_point, wi, wo, min_rough);
                 auto ray_diff = RayDifferential{
                     Vector3{0, 0, 0}, Vector3{0, 0, 0},
                     Vector3{0, 0, 0}, Vector3{0, 0, 0}};
@@ -561,8 +567,8 @@ struct d_path_contribs_accumulator {
                               *d_envmap, d_wo, d_ray_diff);
                 auto d_wi = Vector3{0, 0, 0};
                 // bsdf_val = bsdf(material, shading_point, wi, wo)
-                d_bsdf(material, shading_point, wi, wo, min_rough, d_bsdf_val,
-                       d_material, d_shading_point, d_wi, d_wo);
+                d_bsdf<Features>(material, shading_point, wi, wo, min_rough, d_bsdf_val,
+                                 d_material, d_shading_point, d_wi, d_wo);
 
                 // pdf_bsdf = bsdf_pdf(material, shading_point, wi, wo, min_rough)
                 // d_bsdf_pdf(material, shading_point, wi, wo, min_rough, d_pdf_bsdf,
@@ -19,7 +19,10 @@
 #include "primary_contribution.h"
 #include "bsdf_sample.h"
 #include "path_contribution.h"
+#include "primary_hit_cache.h"
+#include "rasterizer.h"
 
+#include <random>
 #include <thrust/execution_policy.h>
 #include <thrust/fill.h>
 #include <thrust/sort.h>
@@ -35,50 +38,52 @@ void init_paths(BufferView<Vector3> throughputs,
 
 struct PathBuffer {
     PathBuffer(int max_bounces,
-               int num_pixels,
+               int64_t num_pixels,
+               int64_t num_edge_paths,
                bool use_gpu,
                const ChannelInfo &channel_info) :
-            num_pixels(num_pixels) {
+            num_pixels(num_pixels), num_edge_paths(num_edge_paths) {
         assert(max_bounces >= 0);
+        assert(num_edge_paths >= num_pixels);
         // For forward path tracing, we need to allocate memory for
         // all bounces
         // For edge sampling, we need to allocate memory for
-        // 2 * num_pixels paths (and 4 * num_pixels for those
+        // 2 * num_edge_paths paths (and 4 * num_edge_paths for those
         //  shared between two path vertices).
         camera_samples = Buffer<CameraSample>(use_gpu, num_pixels);
         light_samples = Buffer<LightSample>(use_gpu, max_bounces * num_pixels);
-        edge_light_samples = Buffer<LightSample>(use_gpu, 2 * num_pixels);
+        edge_light_samples = Buffer<LightSample>(use_gpu, 2 * num_edge_paths);
         bsdf_samples = Buffer<BSDFSample>(use_gpu, max_bounces * num_pixels);
-        edge_bsdf_samples = Buffer<BSDFSample>(use_gpu, 2 * num_pixels);
+        edge_bsdf_samples = Buffer<BSDFSample>(use_gpu, 2 * num_edge_paths);
         rays = Buffer<Ray>(use_gpu, (max_bounces + 1) * num_pixels);
         nee_rays = Buffer<Ray>(use_gpu, max_bounces * num_pixels);
         primary_ray_differentials = Buffer<RayDifferential>(use_gpu, num_pixels);
         ray_differentials = Buffer<RayDifferential>(use_gpu, (max_bounces + 1) * num_pixels);
         bsdf_ray_differentials = Buffer<RayDifferential>(use_gpu, max_bounces * num_pixels);
-        edge_rays = Buffer<Ray>(use_gpu, 4 * num_pixels);
-        edge_nee_rays = Buffer<Ray>(use_gpu, 2 * num_pixels);
-        edge_ray_differentials = Buffer<RayDifferential>(use_gpu, 2 * num_pixels);
+        edge_rays = Buffer<Ray>(use_gpu, 4 * num_edge_paths);
+        edge_nee_rays = Buffer<Ray>(use_gpu, 2 * num_edge_paths);
+        edge_ray_differentials = Buffer<RayDifferential>(use_gpu, 2 * num_edge_paths);
         primary_active_pixels = Buffer<int>(use_gpu, num_pixels);
         active_pixels = Buffer<int>(use_gpu, (max_bounces + 1) * num_pixels);
-        edge_active_pixels = Buffer<int>(use_gpu, 4 * num_pixels);
+        edge_active_pixels = Buffer<int>(use_gpu, 4 * num_edge_paths);
         shading_isects = Buffer<Intersection>(use_gpu, (max_bounces + 1) * num_pixels);
-        edge_shading_isects = Buffer<Intersection>(use_gpu, 4 * num_pixels);
+        edge_shading_isects = Buffer<Intersection>(use_gpu, 4 * num_edge_paths);
         shading_points = Buffer<SurfacePoint>(use_gpu, (max_bounces + 1) * num_pixels);
-        edge_shading_points = Buffer<SurfacePoint>(use_gpu, 4 * num_pixels);
+        edge_shading_points = Buffer<SurfacePoint>(use_gpu, 4 * num_edge_paths);
         light_isects = Buffer<Intersection>(use_gpu, max_bounces * num_pixels);
-        edge_light_isects = Buffer<Intersection>(use_gpu, 2 * num_pixels);
+        edge_light_isects = Buffer<Intersection>(use_gpu, 2 * num_edge_paths);
         light_points = Buffer<SurfacePoint>(use_gpu, max_bounces * num_pixels);
-        edge_light_points = Buffer<SurfacePoint>(use_gpu, 2 * num_pixels);
+        edge_light_points = Buffer<SurfacePoint>(use_gpu, 2 * num_edge_paths);
         throughputs = Buffer<Vector3>(use_gpu, (max_bounces + 1) * num_pixels);
-        edge_throughputs = Buffer<Vector3>(use_gpu, 4 * num_pixels);
+        edge_throughputs = Buffer<Vector3>(use_gpu, 4 * num_edge_paths);
         channel_multipliers = Buffer<Real>(use_gpu,
-            2 * channel_info.num_total_dimensions * num_pixels);
+            2 * channel_info.num_total_dimensions * num_edge_paths);
         min_roughness = Buffer<Real>(use_gpu, (max_bounces + 1) * num_pixels);
-        edge_min_roughness = Buffer<Real>(use_gpu, 4 * num_pixels);
+        edge_min_roughness = Buffer<Real>(use_gpu, 4 * num_edge_paths);
 
         // OptiX buffers
-        optix_rays = Buffer<OptiXRay>(use_gpu, 2 * num_pixels);
-        optix_hits = Buffer<OptiXHit>(use_gpu, 2 * num_pixels);
+        optix_rays = Buffer<OptiXRay>(use_gpu, 2 * num_edge_paths);
+        optix_hits = Buffer<OptiXHit>(use_gpu, 2 * num_edge_paths);
 
         // Derivatives buffers
         d_next_throughputs = Buffer<Vector3>(use_gpu, num_pixels);
@@ -90,21 +95,25 @@ struct PathBuffer {
         d_ray_differentials = Buffer<RayDifferential>(use_gpu, num_pixels);
         d_points = Buffer<SurfacePoint>(use_gpu, num_pixels);
 
-        primary_edge_samples = Buffer<PrimaryEdgeSample>(use_gpu, num_pixels);
+        primary_edge_samples = Buffer<PrimaryEdgeSample>(use_gpu, num_edge_paths);
         secondary_edge_samples = Buffer<SecondaryEdgeSample>(use_gpu, num_pixels);
-        primary_edge_records = Buffer<PrimaryEdgeRecord>(use_gpu, num_pixels);
+        primary_edge_records = Buffer<PrimaryEdgeRecord>(use_gpu, num_edge_paths);
         secondary_edge_records = Buffer<SecondaryEdgeRecord>(use_gpu, num_pixels);
-        edge_contribs = Buffer<Real>(use_gpu, 2 * num_pixels);
-        edge_surface_points = Buffer<Vector3>(use_gpu, 2 * num_pixels);
+        secondary_edge_pixels = Buffer<int>(use_gpu, num_pixels);
+        edge_contribs = Buffer<Real>(use_gpu, 2 * num_edge_paths);
+        edge_surface_points = Buffer<Vector3>(use_gpu, 2 * num_edge_paths);
 
-        tmp_light_samples = Buffer<LightSample>(use_gpu, num_pixels);
-        tmp_bsdf_samples = Buffer<BSDFSample>(use_gpu, num_pixels);
+        tmp_light_samples = Buffer<LightSample>(use_gpu, num_edge_paths);
+        tmp_bsdf_samples = Buffer<BSDFSample>(use_gpu, num_edge_paths);
 
         generic_texture_buffer = Buffer<Real>(use_gpu,
             channel_info.max_generic_texture_dimension * num_pixels);
     }
 
-    int num_pixels;
+    int64_t num_pixels;
+    // Size of the edge sampling buffers:
+    // the larger of num_pixels and the number of primary edge samples
+    int64_t num_edge_paths;
     Buffer<CameraSample> camera_samples;
     Buffer<LightSample> light_samples, edge_light_samples;
     Buffer<BSDFSample> bsdf_samples, edge_bsdf_samples;
@@ -141,6 +150,8 @@ struct PathBuffer {
     Buffer<SecondaryEdgeSample> secondary_edge_samples;
     Buffer<PrimaryEdgeRecord> primary_edge_records;
     Buffer<SecondaryEdgeRecord> secondary_edge_records;
+    // The active pixels that get a secondary edge sample
+    Buffer<int> secondary_edge_pixels;
     Buffer<Real> edge_contribs;
     Buffer<Vector3> edge_surface_points;
     // For sharing RNG between pixels
@@ -174,6 +185,61 @@ struct get_position {
     Vector3 *p;
 };
 
+// Zero the derivatives of the path vertices, both the current and the next
+// ones, in a single pass
+struct d_path_initializer {
+    DEVICE void operator()(int idx) {
+        auto zero_ray_differential = RayDifferential{
+            Vector3{0, 0, 0}, Vector3{0, 0, 0},
+            Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+        d_throughputs[idx] = Vector3{0, 0, 0};
+        d_rays[idx] = DRay{};
+        d_ray_differentials[idx] = zero_ray_differential;
+        d_points[idx] = SurfacePoint::zero();
+        d_next_throughputs[idx] = Vector3{0, 0, 0};
+        d_next_rays[idx] = DRay{};
+        d_next_ray_differentials[idx] = zero_ray_differential;
+        d_next_points[idx] = SurfacePoint::zero();
+    }
+
+    Vector3 *d_throughputs;
+    DRay *d_rays;
+    RayDifferential *d_ray_differentials;
+    SurfacePoint *d_points;
+    Vector3 *d_next_throughputs;
+    DRay *d_next_rays;
+    RayDifferential *d_next_ray_differentials;
+    SurfacePoint *d_next_points;
+};
+
+// Number of edge samples for a sample pass, see RenderOptions
+int64_t edge_sample_budget(int64_t count, Real ratio, int64_t num_paths) {
+    if (count > 0) {
+        return count;
+    }
+    if (ratio > 0) {
+        return std::max(int64_t(ratio * num_paths + Real(0.5)), int64_t(1));
+    }
+    return num_paths;
+}
+
+// Systematic sampling of num_selected out of the active pixels:
+// with a uniform offset in [0, 1) every active pixel is selected with
+// probability num_selected / num_actives, and the selection is spread
+// over the whole image.
+struct edge_pixel_selector {
+    DEVICE void operator()(int64_t idx) {
+        auto i = int64_t((Real(idx) + offset) * Real(num_actives) / Real(num_selected));
+        selected_pixels[idx] = active_pixels[min(i, num_actives - 1)];
+    }
+
+    const int *active_pixels;
+    int64_t num_actives;
+    int64_t num_selected;
+    Real offset;
+    int *selected_pixels;
+};
+
 void render(const Scene &scene,
             const RenderOptions &options,
             ptr<float> rendered_image,
@@ -201,9 +267,15 @@ void render(const Scene &scene,
     // Some common variables
     const auto &camera = scene.camera;
     auto num_pixels =
-        (camera.viewport_end.x - camera.viewport_beg.x) *
-        (camera.viewport_end.y - camera.viewport_beg.y);
+        int64_t(camera.viewport_end.x - camera.viewport_beg.x) *
+        int64_t(camera.viewport_end.y - camera.viewport_beg.y);
     auto max_bounces = options.max_bounces;
+    // Primary edge samples are not tied to pixels:
+    // their number only changes the weight of each sample.
+    auto num_primary_edge_samples = edge_sample_budget(options.num_primary_edge_samples,
+                                                       options.primary_edge_sample_ratio,
+                                                       num_pixels);
+    auto num_edge_paths = std::max(num_pixels, num_primary_edge_samples);
 
     // A main difference between our path tracer and the usual path
     // tracer is that we need to store all the intermediate states
@@ -211,6 +283,7 @@ void render(const Scene &scene,
     // Therefore we allocate a big buffer here for the storage.
     PathBuffer path_buffer(max_bounces,
                            num_pixels,
+                           num_edge_paths,
                            scene.use_gpu,
                            channel_info);
     auto num_active_pixels = std::vector<int>((max_bounces + 1) * num_pixels, 0);
@@ -219,23 +292,45 @@ void render(const Scene &scene,
         case SamplerType::independent: {
             sampler = std::unique_ptr<Sampler>(new PCGSampler(scene.use_gpu, options.seed, num_pixels));
             edge_sampler = std::unique_ptr<Sampler>(
-                new PCGSampler(scene.use_gpu, options.seed + 131071U, num_pixels));
+                new PCGSampler(scene.use_gpu, options.seed + 131071U, num_edge_paths));
             break;
         } case SamplerType::sobol: {
             sampler = std::unique_ptr<Sampler>(new SobolSampler(scene.use_gpu, options.seed, num_pixels));
             edge_sampler = std::unique_ptr<Sampler>(
-                new SobolSampler(scene.use_gpu, options.seed + 131071U, num_pixels));
+                new SobolSampler(scene.use_gpu, options.seed + 131071U, num_edge_paths));
             break;
         } default: {
             assert(false);
             break;
         }
     }
-    auto optix_rays = path_buffer.optix_rays.view(0, 2 * num_pixels);
-    auto optix_hits = path_buffer.optix_hits.view(0, 2 * num_pixels);
+    auto optix_rays = path_buffer.optix_rays.view(0, 2 * num_edge_paths);
+    auto optix_hits = path_buffer.optix_hits.view(0, 2 * num_edge_paths);
+    // Picks the pixels of the secondary edge samples when their budget
+    // is below one per active pixel
+    std::mt19937_64 edge_pixel_rng(options.seed + 524287U);
 
     ThrustCachedAllocator thrust_alloc(scene.use_gpu, num_pixels * sizeof(int));
 
+    // Look for primary rays & hits from previous calls
+    const PrimaryHitCache::Entry *cached_primary_hits = nullptr;
+    PrimaryHitCache::Entry *new_primary_hits = nullptr;
+    if (options.primary_hit_cache.get() != nullptr) {
+        auto &cache = *options.primary_hit_cache;
+        auto key = make_primary_hit_cache_key(scene, options, cache.geometry_version);
+        cached_primary_hits = cache.find(key);
+        if (cached_primary_hits == nullptr) {
+            new_primary_hits = cache.insert(key);
+        }
+    }
+
+    // The triangle bins do not depend on the samples
+    auto rasterize = options.use_rasterization && can_rasterize_primary(camera);
+    TriangleBins triangle_bins;
+    if (rasterize && cached_primary_hits == nullptr) {
+        bin_triangles(scene, triangle_bins);
+    }
+
     // For each sample
     for (int sample_id = 0; sample_id < options.num_samples; sample_id++) {
         sampler->begin_sample(sample_id);
@@ -257,21 +352,57 @@ void render(const Scene &scene,
         // Initialization
         init_paths(throughputs, min_roughness, scene.use_gpu);
         // Generate primary ray samples
+        // (we always draw the camera samples to keep the sampler state
+        //  in sync, and the backward pass needs them)
         sampler->next_camera_samples(camera_samples, options.sample_pixel_center);
-        sample_primary_rays(camera, camera_samples, rays, primary_differentials, scene.use_gpu);
+        if (cached_primary_hits != nullptr) {
+            load_primary_hits(*cached_primary_hits,
+                              sample_id,
+                              rays,
+                              primary_differentials,
+                              ray_differentials,
+                              shading_isects,
+                              shading_points,
+                              scene.use_gpu);
+        } else {
+            sample_primary_rays(camera, camera_samples, rays, primary_differentials, scene.use_gpu);
+        }
         // Initialize pixel id
         init_active_pixels(rays, primary_active_pixels, scene.use_gpu, thrust_alloc);
         auto num_actives_primary = (int)primary_active_pixels.size();
-        // Intersect with the scene
-        intersect(scene,
-                  primary_active_pixels,
-                  rays,
-                  primary_differentials,
-                  shading_isects,
-                  shading_points,
-                  ray_differentials,
-                  optix_rays,
-                  optix_hits);
+        if (cached_primary_hits == nullptr) {
+            // Intersect with the scene
+            if (rasterize) {
+                rasterize_primary(scene,
+                                  triangle_bins,
+                                  primary_active_pixels,
+                                  rays,
+                                  primary_differentials,
+                                  shading_isects,
+                                  shading_points,
+                                  ray_differentials);
+            } else {
+                intersect(scene,
+                          primary_active_pixels,
+                          rays,
+                          primary_differentials,
+                          shading_isects,
+                          shading_points,
+                          ray_differentials,
+                          optix_rays,
+                          optix_hits);
+            }
+            if (new_primary_hits != nullptr) {
+                store_primary_hits(*new_primary_hits,
+                                   sample_id,
+                                   rays,
+                                   primary_differentials,
+                                   ray_differentials,
+                                   shading_isects,
+                                   shading_points,
+                                   scene.use_gpu);
+            }
+        }
         accumulate_primary_contribs(scene,
                                     primary_active_pixels,
                                     throughputs,
@@ -334,8 +465,7 @@ void render(const Scene &scene,
                                   light_isects,
                                   light_points,
                                   nee_rays);
-            occluded(scene, active_pixels, nee_rays, optix_rays, optix_hits);
-            
+
             // Sample directions based on BRDF
             sampler->next_bsdf_samples(bsdf_samples);
             bsdf_sample(scene,
@@ -349,16 +479,18 @@ void render(const Scene &scene,
                         next_rays,
                         bsdf_ray_differentials,
                         next_min_roughness);
-            // Intersect with the scene
-            intersect(scene,
-                      active_pixels,
-                      next_rays,
-                      bsdf_ray_differentials,
-                      bsdf_isects,
-                      bsdf_points,
-                      next_ray_differentials,
-                      optix_rays,
-                      optix_hits);
+            // Test the light samples for occlusion & intersect the BSDF samples with the scene
+            occluded_and_intersect(scene,
+                                   active_pixels,
+                                   nee_rays,
+                                   active_pixels,
+                                   next_rays,
+                                   bsdf_ray_differentials,
+                                   bsdf_isects,
+                                   bsdf_points,
+                                   next_ray_differentials,
+                                   optix_rays,
+                                   optix_hits);
 
             // Compute path contribution & update throughput
             accumulate_path_contribs(
@@ -383,7 +515,16 @@ void render(const Scene &scene,
  
             // Stream compaction: remove invalid bsdf intersections
             // active_pixels -> next_active_pixels
-            update_active_pixels(active_pixels, bsdf_isects, next_active_pixels, scene.use_gpu); 
+            if (d_rendered_image.get() == nullptr) {
+                // Paths with zero throughput can't contribute to the image anymore.
+                // We keep them when we need derivatives: the throughput can be zero
+                // because of a parameter (e.g. a black albedo) whose derivative isn't.
+                update_active_pixels(active_pixels, bsdf_isects, next_throughputs,
+                                     next_active_pixels, scene.use_gpu);
+            } else {
+                update_active_pixels(active_pixels, bsdf_isects,
+                                     next_active_pixels, scene.use_gpu);
+            }
 
             // Record the number of active pixels for next depth
             num_active_pixels[depth + 1] = next_active_pixels.size();
@@ -393,39 +534,15 @@ void render(const Scene &scene,
             edge_sampler->begin_sample(sample_id);
 
             // Initialize the derivatives for path vertices
-            auto d_throughputs = path_buffer.d_throughputs.view(0, num_pixels);
-            auto d_rays = path_buffer.d_rays.view(0, num_pixels);
-            auto d_ray_differentials = path_buffer.d_ray_differentials.view(0, num_pixels);
-            auto d_points = path_buffer.d_points.view(0, num_pixels);
-            auto d_next_throughputs = path_buffer.d_next_throughputs.view(0, num_pixels);
-            auto d_next_rays = path_buffer.d_next_rays.view(0, num_pixels);
-            auto d_next_ray_differentials =
-                path_buffer.d_next_ray_differentials.view(0, num_pixels);
-            auto d_next_points = path_buffer.d_next_points.view(0, num_pixels);
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_throughputs.begin(), d_throughputs.end(),
-                Vector3{0, 0, 0});
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_rays.begin(), d_rays.end(), DRay{});
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_ray_differentials.begin(), d_ray_differentials.end(),
-                RayDifferential{Vector3{0, 0, 0}, Vector3{0, 0, 0},
-                                Vector3{0, 0, 0}, Vector3{0, 0, 0}});
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_points.begin(), d_points.end(),
-                SurfacePoint::zero());
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_next_throughputs.begin(), d_next_throughputs.end(),
-                Vector3{0, 0, 0});
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_next_rays.begin(), d_next_rays.end(), DRay{});
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_next_ray_differentials.begin(), d_next_ray_differentials.end(),
-                RayDifferential{Vector3{0, 0, 0}, Vector3{0, 0, 0},
-                                Vector3{0, 0, 0}, Vector3{0, 0, 0}});
-            DISPATCH(scene.use_gpu, thrust::fill,
-                d_next_points.begin(), d_next_points.end(),
-                SurfacePoint::zero());
+            parallel_for(d_path_initializer{
+                path_buffer.d_throughputs.begin(),
+                path_buffer.d_rays.begin(),
+                path_buffer.d_ray_differentials.begin(),
+                path_buffer.d_points.begin(),
+                path_buffer.d_next_throughputs.begin(),
+                path_buffer.d_next_rays.begin(),
+                path_buffer.d_next_ray_differentials.begin(),
+                path_buffer.d_next_points.begin()}, num_pixels, scene.use_gpu);
 
             // Traverse the path backward for the derivatives
             for (int depth = max_bounces - 1; depth >= 0 && has_lights(scene); depth--) {
@@ -500,209 +617,235 @@ void render(const Scene &scene,
                 if (scene.use_secondary_edge_sampling) {
                     ////////////////////////////////////////////////////////////////////////////////
                     // Sample edges for secondary visibility
-                    auto num_edge_samples = 2 * num_actives;
-                    auto edge_samples = path_buffer.secondary_edge_samples.view(0, num_actives);
-                    edge_sampler->next_secondary_edge_samples(edge_samples);
-                    auto edge_records = path_buffer.secondary_edge_records.view(0, num_actives);
-                    auto edge_rays = path_buffer.edge_rays.view(0, num_edge_samples);
-                    auto edge_ray_differentials =
-                        path_buffer.edge_ray_differentials.view(0, num_edge_samples);
-                    auto edge_throughputs = path_buffer.edge_throughputs.view(0, num_edge_samples);
-                    auto edge_shading_isects =
-                        path_buffer.edge_shading_isects.view(0, num_edge_samples);
-                    auto edge_shading_points =
-                        path_buffer.edge_shading_points.view(0, num_edge_samples);
-                    auto edge_min_roughness =
-                        path_buffer.edge_min_roughness.view(0, num_edge_samples);
-                    sample_secondary_edges(
-                        scene,
-                        active_pixels,
-                        edge_samples,
-                        incoming_rays,
-                        incoming_ray_differentials,
-                        shading_isects,
-                        shading_points,
-                        nee_rays,
-                        light_isects,
-                        light_points,
-                        throughputs,
-                        min_roughness,
-                        d_rendered_image.get(),
-                        channel_info,
-                        edge_records,
-                        edge_rays,
-                        edge_ray_differentials,
-                        edge_throughputs,
-                        edge_min_roughness);
-
-                    // Now we path trace these edges
-                    auto edge_active_pixels = path_buffer.edge_active_pixels.view(0, num_edge_samples);
-                    init_active_pixels(edge_rays, edge_active_pixels, scene.use_gpu, thrust_alloc);
-                    // Intersect with the scene
-                    intersect(scene,
-                              edge_active_pixels,
-                              edge_rays,
-                              edge_ray_differentials,
-                              edge_shading_isects,
-                              edge_shading_points,
-                              edge_ray_differentials,
-                              optix_rays,
-                              optix_hits);
-                    // Update edge throughputs: take geometry terms and Jacobians into account
-                    update_secondary_edge_weights(scene,
-                                                  active_pixels,
-                                                  shading_points,
-                                                  edge_shading_isects,
-                                                  edge_shading_points,
-                                                  edge_records,
-                                                  edge_throughputs);
-                    // Initialize edge contribution
-                    auto edge_contribs = path_buffer.edge_contribs.view(0, num_edge_samples);
-                    DISPATCH(scene.use_gpu, thrust::fill,
-                        edge_contribs.begin(), edge_contribs.end(), 0);
-                    accumulate_primary_contribs(
-                        scene,
-                        edge_active_pixels,
-                        edge_throughputs,
-                        BufferView<Real>(), // channel multipliers
-                        edge_rays,
-                        edge_ray_differentials,
-                        edge_shading_isects,
-                        edge_shading_points,
-                        Real(1) / options.num_samples,
-                        channel_info,
-                        nullptr,
-                        edge_contribs,
-                        generic_texture_buffer);
-                    // Stream compaction: remove invalid intersections
-                    update_active_pixels(edge_active_pixels,
-                                         edge_shading_isects,
-                                         edge_active_pixels,
-                                         scene.use_gpu);
-                    auto num_active_edge_samples = edge_active_pixels.size();
-                    // Record the hit points for derivatives computation later
-                    auto edge_surface_points =
-                        path_buffer.edge_surface_points.view(0, num_active_edge_samples);
-                    parallel_for(get_position{
-                        edge_active_pixels.begin(),
-                        edge_shading_points.begin(),
-                        edge_surface_points.begin()}, num_active_edge_samples, scene.use_gpu);
-                    for (int edge_depth = depth + 1; edge_depth < max_bounces &&
-                           num_active_edge_samples > 0; edge_depth++) {
-                        // Path tracing loop for secondary edges
-                        auto edge_depth_ = edge_depth - (depth + 1);
-                        auto main_buffer_beg = (edge_depth_ % 2) * (2 * num_pixels);
-                        auto next_buffer_beg = ((edge_depth_ + 1) % 2) * (2 * num_pixels);
-                        const auto active_pixels = path_buffer.edge_active_pixels.view(
-                            main_buffer_beg, num_active_edge_samples);
-                        auto light_samples = path_buffer.edge_light_samples.view(0, num_edge_samples);
-                        auto bsdf_samples = path_buffer.edge_bsdf_samples.view(0, num_edge_samples);
-                        auto tmp_light_samples = path_buffer.tmp_light_samples.view(0, num_actives);
-                        auto tmp_bsdf_samples = path_buffer.tmp_bsdf_samples.view(0, num_actives);
-                        auto shading_isects =
-                            path_buffer.edge_shading_isects.view(main_buffer_beg, num_edge_samples);
-                        auto shading_points =
-                            path_buffer.edge_shading_points.view(main_buffer_beg, num_edge_samples);
-                        auto light_isects = path_buffer.edge_light_isects.view(0, num_edge_samples);
-                        auto light_points = path_buffer.edge_light_points.view(0, num_edge_samples);
-                        auto incoming_rays =
-                            path_buffer.edge_rays.view(main_buffer_beg, num_edge_samples);
-                        auto ray_differentials =
+                    // The budget of this bounce is split into passes of at most
+                    // one sample per active pixel. Below one per pixel, each pass
+                    // samples a random subset of the pixels and reweights it.
+                    auto num_secondary_edge_samples = edge_sample_budget(
+                        options.num_secondary_edge_samples,
+                        options.secondary_edge_sample_ratio,
+                        int64_t(num_actives));
+                    auto num_passes = idiv_ceil(num_secondary_edge_samples, int64_t(num_actives));
+                    auto num_selected = idiv_ceil(num_secondary_edge_samples, num_passes);
+                    auto secondary_edge_weight = Real(num_actives) /
+                        (Real(num_selected) * Real(num_passes) * options.num_samples);
+                    for (int64_t pass = 0; pass < num_passes; pass++) {
+                        auto edge_pixels = active_pixels;
+                        if (num_selected < num_actives) {
+                            auto selected_pixels =
+                                path_buffer.secondary_edge_pixels.view(0, num_selected);
+                            parallel_for(edge_pixel_selector{
+                                active_pixels.begin(),
+                                num_actives,
+                                num_selected,
+                                std::uniform_real_distribution<Real>(0, 1)(edge_pixel_rng),
+                                selected_pixels.begin()}, num_selected, scene.use_gpu);
+                            edge_pixels = selected_pixels;
+                        }
+                        auto num_edge_samples = 2 * num_selected;
+                        auto edge_samples = path_buffer.secondary_edge_samples.view(0, num_selected);
+                        edge_sampler->next_secondary_edge_samples(edge_samples);
+                        auto edge_records = path_buffer.secondary_edge_records.view(0, num_selected);
+                        auto edge_rays = path_buffer.edge_rays.view(0, num_edge_samples);
+                        auto edge_ray_differentials =
                             path_buffer.edge_ray_differentials.view(0, num_edge_samples);
-                        auto nee_rays = path_buffer.edge_nee_rays.view(0, num_edge_samples);
-                        auto next_rays = path_buffer.edge_rays.view(next_buffer_beg, num_edge_samples);
-                        auto bsdf_isects = path_buffer.edge_shading_isects.view(
-                            next_buffer_beg, num_edge_samples);
-                        auto bsdf_points = path_buffer.edge_shading_points.view(
-                            next_buffer_beg, num_edge_samples);
-                        const auto throughputs = path_buffer.edge_throughputs.view(
-                            main_buffer_beg, num_edge_samples);
-                        auto next_throughputs = path_buffer.edge_throughputs.view(
-                            next_buffer_beg, num_edge_samples);
-                        auto next_active_pixels = path_buffer.edge_active_pixels.view(
-                            next_buffer_beg, num_edge_samples);
+                        auto edge_throughputs = path_buffer.edge_throughputs.view(0, num_edge_samples);
+                        auto edge_shading_isects =
+                            path_buffer.edge_shading_isects.view(0, num_edge_samples);
+                        auto edge_shading_points =
+                            path_buffer.edge_shading_points.view(0, num_edge_samples);
                         auto edge_min_roughness =
-                            path_buffer.edge_min_roughness.view(main_buffer_beg, num_edge_samples);
-                        auto edge_next_min_roughness =
-                            path_buffer.edge_min_roughness.view(next_buffer_beg, num_edge_samples);
-
-                        // Sample points on lights
-                        edge_sampler->next_light_samples(tmp_light_samples);
-                        // Copy the samples
-                        parallel_for(copy_interleave<LightSample>{
-                            tmp_light_samples.begin(), light_samples.begin()},
-                            tmp_light_samples.size(), scene.use_gpu);
-                        sample_point_on_light(
-                            scene, active_pixels, shading_points,
-                            light_samples, light_isects, light_points, nee_rays);
-                        occluded(scene, active_pixels, nee_rays, optix_rays, optix_hits);
-
-                        // Sample directions based on BRDF
-                        edge_sampler->next_bsdf_samples(tmp_bsdf_samples);
-                        // Copy the samples
-                        parallel_for(copy_interleave<BSDFSample>{
-                            tmp_bsdf_samples.begin(), bsdf_samples.begin()},
-                            tmp_bsdf_samples.size(), scene.use_gpu);
-                        bsdf_sample(scene,
-                                    active_pixels,
-                                    incoming_rays,
-                                    ray_differentials,
-                                    shading_isects,
-                                    shading_points,
-                                    bsdf_samples,
-                                    edge_min_roughness,
-                                    next_rays,
-                                    ray_differentials,
-                                    edge_next_min_roughness);
-                        // Intersect with the scene
-                        intersect(scene,
-                                  active_pixels,
-                                  next_rays,
-                                  ray_differentials,
-                                  bsdf_isects,
-                                  bsdf_points,
-                                  ray_differentials,
-                                  optix_rays,
-                                  optix_hits);
-
-                        // Compute path contribution & update throughput
-                        accumulate_path_contribs(
+                            path_buffer.edge_min_roughness.view(0, num_edge_samples);
+                        sample_secondary_edges(
                             scene,
-                            active_pixels,
-                            throughputs,
+                            edge_pixels,
+                            edge_samples,
                             incoming_rays,
+                            incoming_ray_differentials,
                             shading_isects,
                             shading_points,
+                            nee_rays,
                             light_isects,
                             light_points,
-                            nee_rays,
-                            bsdf_isects,
-                            bsdf_points,
-                            next_rays,
-                            edge_min_roughness,
-                            Real(1) / options.num_samples,
+                            throughputs,
+                            min_roughness,
+                            d_rendered_image.get(),
+                            channel_info,
+                            edge_records,
+                            edge_rays,
+                            edge_ray_differentials,
+                            edge_throughputs,
+                            edge_min_roughness);
+
+                        // Now we path trace these edges
+                        auto edge_active_pixels = path_buffer.edge_active_pixels.view(0, num_edge_samples);
+                        init_active_pixels(edge_rays, edge_active_pixels, scene.use_gpu, thrust_alloc);
+                        // Intersect with the scene
+                        intersect(scene,
+                                  edge_active_pixels,
+                                  edge_rays,
+                                  edge_ray_differentials,
+                                  edge_shading_isects,
+                                  edge_shading_points,
+                                  edge_ray_differentials,
+                                  optix_rays,
+                                  optix_hits);
+                        // Update edge throughputs: take geometry terms and Jacobians into account
+                        update_secondary_edge_weights(scene,
+                                                      edge_pixels,
+                                                      shading_points,
+                                                      edge_shading_isects,
+                                                      edge_shading_points,
+                                                      edge_records,
+                                                      edge_throughputs);
+                        // Initialize edge contribution
+                        auto edge_contribs = path_buffer.edge_contribs.view(0, num_edge_samples);
+                        DISPATCH(scene.use_gpu, thrust::fill,
+                            edge_contribs.begin(), edge_contribs.end(), 0);
+                        accumulate_primary_contribs(
+                            scene,
+                            edge_active_pixels,
+                            edge_throughputs,
+                            BufferView<Real>(), // channel multipliers
+                            edge_rays,
+                            edge_ray_differentials,
+                            edge_shading_isects,
+                            edge_shading_points,
+                            secondary_edge_weight,
                             channel_info,
-                            next_throughputs,
                             nullptr,
-                            edge_contribs);
+                            edge_contribs,
+                            generic_texture_buffer);
+                        // Stream compaction: remove invalid intersections
+                        update_active_pixels(edge_active_pixels,
+                                             edge_shading_isects,
+                                             edge_active_pixels,
+                                             scene.use_gpu);
+                        auto num_active_edge_samples = edge_active_pixels.size();
+                        // Record the hit points for derivatives computation later
+                        auto edge_surface_points =
+                            path_buffer.edge_surface_points.view(0, num_active_edge_samples);
+                        parallel_for(get_position{
+                            edge_active_pixels.begin(),
+                            edge_shading_points.begin(),
+                            edge_surface_points.begin()}, num_active_edge_samples, scene.use_gpu);
+                        for (int edge_depth = depth + 1; edge_depth < max_bounces &&
+                               num_active_edge_samples > 0; edge_depth++) {
+                            // Path tracing loop for secondary edges
+                            auto edge_depth_ = edge_depth - (depth + 1);
+                            auto main_buffer_beg = (edge_depth_ % 2) * (2 * num_pixels);
+                            auto next_buffer_beg = ((edge_depth_ + 1) % 2) * (2 * num_pixels);
+                            const auto active_pixels = path_buffer.edge_active_pixels.view(
+                                main_buffer_beg, num_active_edge_samples);
+                            auto light_samples = path_buffer.edge_light_samples.view(0, num_edge_samples);
+                            auto bsdf_samples = path_buffer.edge_bsdf_samples.view(0, num_edge_samples);
+                            auto tmp_light_samples = path_buffer.tmp_light_samples.view(0, num_selected);
+                            auto tmp_bsdf_samples = path_buffer.tmp_bsdf_samples.view(0, num_selected);
+                            auto shading_isects =
+                                path_buffer.edge_shading_isects.view(main_buffer_beg, num_edge_samples);
+                            auto shading_points =
+                                path_buffer.edge_shading_points.view(main_buffer_beg, num_edge_samples);
+                            auto light_isects = path_buffer.edge_light_isects.view(0, num_edge_samples);
+                            auto light_points = path_buffer.edge_light_points.view(0, num_edge_samples);
+                            auto incoming_rays =
+                                path_buffer.edge_rays.view(main_buffer_beg, num_edge_samples);
+                            auto ray_differentials =
+                                path_buffer.edge_ray_differentials.view(0, num_edge_samples);
+                            auto nee_rays = path_buffer.edge_nee_rays.view(0, num_edge_samples);
+                            auto next_rays = path_buffer.edge_rays.view(next_buffer_beg, num_edge_samples);
+                            auto bsdf_isects = path_buffer.edge_shading_isects.view(
+                                next_buffer_beg, num_edge_samples);
+                            auto bsdf_points = path_buffer.edge_shading_points.view(
+                                next_buffer_beg, num_edge_samples);
+                            const auto throughputs = path_buffer.edge_throughputs.view(
+                                main_buffer_beg, num_edge_samples);
+                            auto next_throughputs = path_buffer.edge_throughputs.view(
+                                next_buffer_beg, num_edge_samples);
+                            auto next_active_pixels = path_buffer.edge_active_pixels.view(
+                                next_buffer_beg, num_edge_samples);
+                            auto edge_min_roughness =
+                                path_buffer.edge_min_roughness.view(main_buffer_beg, num_edge_samples);
+                            auto edge_next_min_roughness =
+                                path_buffer.edge_min_roughness.view(next_buffer_beg, num_edge_samples);
+
+                            // Sample points on lights
+                            edge_sampler->next_light_samples(tmp_light_samples);
+                            // Copy the samples
+                            parallel_for(copy_interleave<LightSample>{
+                                tmp_light_samples.begin(), light_samples.begin()},
+                                tmp_light_samples.size(), scene.use_gpu);
+                            sample_point_on_light(
+                                scene, active_pixels, shading_points,
+                                light_samples, light_isects, light_points, nee_rays);
+
+                            // Sample directions based on BRDF
+                            edge_sampler->next_bsdf_samples(tmp_bsdf_samples);
+                            // Copy the samples
+                            parallel_for(copy_interleave<BSDFSample>{
+                                tmp_bsdf_samples.begin(), bsdf_samples.begin()},
+                                tmp_bsdf_samples.size(), scene.use_gpu);
+                            bsdf_sample(scene,
+                                        active_pixels,
+                                        incoming_rays,
+                                        ray_differentials,
+                                        shading_isects,
+                                        shading_points,
+                                        bsdf_samples,
+                                        edge_min_roughness,
+                                        next_rays,
+                                        ray_differentials,
+                                        edge_next_min_roughness);
+                            // Test the light samples for occlusion & intersect the BSDF samples with the scene
+                            occluded_and_intersect(scene,
+                                                   active_pixels,
+                                                   nee_rays,
+                                                   active_pixels,
+                                                   next_rays,
+                                                   ray_differentials,
+                                                   bsdf_isects,
+                                                   bsdf_points,
+                                                   ray_differentials,
+                                                   optix_rays,
+                                                   optix_hits);
 
-                        // Stream compaction: remove invalid bsdf intersections
-                        // active_pixels -> next_active_pixels
-                        update_active_pixels(active_pixels, bsdf_isects,
-                                             next_active_pixels, scene.use_gpu);
-                        num_active_edge_samples = next_active_pixels.size();
+                            // Compute path contribution & update throughput
+                            accumulate_path_contribs(
+                                scene,
+                                active_pixels,
+                                throughputs,
+                                incoming_rays,
+                                shading_isects,
+                                shading_points,
+                                light_isects,
+                                light_points,
+                                nee_rays,
+                                bsdf_isects,
+                                bsdf_points,
+                                next_rays,
+                                edge_min_roughness,
+                                secondary_edge_weight,
+                                channel_info,
+                                next_throughputs,
+                                nullptr,
+                                edge_contribs);
+
+                            // Stream compaction: remove invalid bsdf intersections
+                            // active_pixels -> next_active_pixels
+                            update_active_pixels(active_pixels, bsdf_isects,
+                                                 next_active_pixels, scene.use_gpu);
+                            num_active_edge_samples = next_active_pixels.size();
+                        }
+                        // Now the path traced contribution for the edges is stored in edge_contribs
+                        // We'll compute the derivatives w.r.t. three points: two on edges and one on
+                        // the shading point
+                        accumulate_secondary_edge_derivatives(scene,
+                                                              edge_pixels,
+                                                              shading_points,
+                                                              edge_records,
+                                                              edge_surface_points,
+                                                              edge_contribs,
+                                                              d_points,
+                                                              d_scene->shapes.view(0, d_scene->shapes.size()));
                     }
-                    // Now the path traced contribution for the edges is stored in edge_contribs
-                    // We'll compute the derivatives w.r.t. three points: two on edges and one on
-                    // the shading point
-                    accumulate_secondary_edge_derivatives(scene,
-                                                          active_pixels,
-                                                          shading_points,
-                                                          edge_records,
-                                                          edge_surface_points,
-                                                          edge_contribs,
-                                                          d_points,
-                                                          d_scene->shapes.view(0, d_scene->shapes.size()));
                     ////////////////////////////////////////////////////////////////////////////////
                 }
 
@@ -764,19 +907,23 @@ void render(const Scene &scene,
             /////////////////////////////////////////////////////////////////////////////////
             // Sample primary edges for geometric derivatives
             if (scene.use_primary_edge_sampling && scene.edge_sampler.edges.size() > 0) {
-                auto primary_edge_samples = path_buffer.primary_edge_samples.view(0, num_pixels);
-                auto edge_records = path_buffer.primary_edge_records.view(0, num_pixels);
-                auto rays = path_buffer.edge_rays.view(0, 2 * num_pixels);
+                auto primary_edge_samples = path_buffer.primary_edge_samples.view(0, num_primary_edge_samples);
+                auto edge_records = path_buffer.primary_edge_records.view(0, num_primary_edge_samples);
+                auto rays = path_buffer.edge_rays.view(0, 2 * num_primary_edge_samples);
                 auto ray_differentials =
-                    path_buffer.edge_ray_differentials.view(0, 2 * num_pixels);
-                auto throughputs = path_buffer.edge_throughputs.view(0, 2 * num_pixels);
+                    path_buffer.edge_ray_differentials.view(0, 2 * num_primary_edge_samples);
+                auto throughputs = path_buffer.edge_throughputs.view(0, 2 * num_primary_edge_samples);
                 auto channel_multipliers = path_buffer.channel_multipliers.view(
-                    0, 2 * channel_info.num_total_dimensions * num_pixels);
-                auto shading_isects = path_buffer.edge_shading_isects.view(0, 2 * num_pixels);
-                auto shading_points = path_buffer.edge_shading_points.view(0, 2 * num_pixels);
-                auto active_pixels = path_buffer.edge_active_pixels.view(0, 2 * num_pixels);
-                auto edge_contribs = path_buffer.edge_contribs.view(0, 2 * num_pixels);
-                auto edge_min_roughness = path_buffer.edge_min_roughness.view(0, 2 * num_pixels);
+                    0, 2 * channel_info.num_total_dimensions * num_primary_edge_samples);
+                auto shading_isects = path_buffer.edge_shading_isects.view(0, 2 * num_primary_edge_samples);
+                auto shading_points = path_buffer.edge_shading_points.view(0, 2 * num_primary_edge_samples);
+                auto active_pixels = path_buffer.edge_active_pixels.view(0, 2 * num_primary_edge_samples);
+                auto edge_contribs = path_buffer.edge_contribs.view(0, 2 * num_primary_edge_samples);
+                auto edge_min_roughness = path_buffer.edge_min_roughness.view(0, 2 * num_primary_edge_samples);
+                // Each sample estimates the edge integral over the whole screen,
+                // which one sample per pixel turns into per-pixel derivatives
+                auto primary_edge_weight = Real(num_pixels) /
+                    (Real(num_primary_edge_samples) * options.num_samples);
                 // Initialize edge contribution
                 DISPATCH(scene.use_gpu, thrust::fill,
                          edge_contribs.begin(), edge_contribs.end(), 0);
@@ -822,7 +969,7 @@ void render(const Scene &scene,
                                             ray_differentials,
                                             shading_isects,
                                             shading_points,
-                                            Real(1) / options.num_samples,
+                                            primary_edge_weight,
                                             channel_info,
                                             nullptr, // rendered_image
                                             edge_contribs,
@@ -832,40 +979,40 @@ void render(const Scene &scene,
                 auto active_pixels_size = active_pixels.size();
                 for (int depth = 0; depth < max_bounces && active_pixels_size > 0 && has_lights(scene); depth++) {
                     // Buffer views for this path vertex
-                    auto main_buffer_beg = (depth % 2) * (2 * num_pixels);
-                    auto next_buffer_beg = ((depth + 1) % 2) * (2 * num_pixels);
+                    auto main_buffer_beg = (depth % 2) * (2 * num_primary_edge_samples);
+                    auto next_buffer_beg = ((depth + 1) % 2) * (2 * num_primary_edge_samples);
                     const auto active_pixels =
                         path_buffer.edge_active_pixels.view(main_buffer_beg, active_pixels_size);
-                    auto light_samples = path_buffer.edge_light_samples.view(0, 2 * num_pixels);
-                    auto bsdf_samples = path_buffer.edge_bsdf_samples.view(0, 2 * num_pixels);
-                    auto tmp_light_samples = path_buffer.tmp_light_samples.view(0, num_pixels);
-                    auto tmp_bsdf_samples = path_buffer.tmp_bsdf_samples.view(0, num_pixels);
+                    auto light_samples = path_buffer.edge_light_samples.view(0, 2 * num_primary_edge_samples);
+                    auto bsdf_samples = path_buffer.edge_bsdf_samples.view(0, 2 * num_primary_edge_samples);
+                    auto tmp_light_samples = path_buffer.tmp_light_samples.view(0, num_primary_edge_samples);
+                    auto tmp_bsdf_samples = path_buffer.tmp_bsdf_samples.view(0, num_primary_edge_samples);
                     auto shading_isects =
-                        path_buffer.edge_shading_isects.view(main_buffer_beg, 2 * num_pixels);
+                        path_buffer.edge_shading_isects.view(main_buffer_beg, 2 * num_primary_edge_samples);
                     auto shading_points =
-                        path_buffer.edge_shading_points.view(main_buffer_beg, 2 * num_pixels);
-                    auto light_isects = path_buffer.edge_light_isects.view(0, 2 * num_pixels);
-                    auto light_points = path_buffer.edge_light_points.view(0, 2 * num_pixels);
-                    auto nee_rays = path_buffer.edge_nee_rays.view(0, 2 * num_pixels);
+                        path_buffer.edge_shading_points.view(main_buffer_beg, 2 * num_primary_edge_samples);
+                    auto light_isects = path_buffer.edge_light_isects.view(0, 2 * num_primary_edge_samples);
+                    auto light_points = path_buffer.edge_light_points.view(0, 2 * num_primary_edge_samples);
+                    auto nee_rays = path_buffer.edge_nee_rays.view(0, 2 * num_primary_edge_samples);
                     auto incoming_rays =
-                        path_buffer.edge_rays.view(main_buffer_beg, 2 * num_pixels);
+                        path_buffer.edge_rays.view(main_buffer_beg, 2 * num_primary_edge_samples);
                     auto ray_differentials =
-                        path_buffer.edge_ray_differentials.view(0, 2 * num_pixels);
-                    auto next_rays = path_buffer.edge_rays.view(next_buffer_beg, 2 * num_pixels);
+                        path_buffer.edge_ray_differentials.view(0, 2 * num_primary_edge_samples);
+                    auto next_rays = path_buffer.edge_rays.view(next_buffer_beg, 2 * num_primary_edge_samples);
                     auto bsdf_isects = path_buffer.edge_shading_isects.view(
-                        next_buffer_beg, 2 * num_pixels);
+                        next_buffer_beg, 2 * num_primary_edge_samples);
                     auto bsdf_points = path_buffer.edge_shading_points.view(
-                        next_buffer_beg, 2 * num_pixels);
+                        next_buffer_beg, 2 * num_primary_edge_samples);
                     const auto throughputs = path_buffer.edge_throughputs.view(
-                        main_buffer_beg, 2 * num_pixels);
+                        main_buffer_beg, 2 * num_primary_edge_samples);
                     auto next_throughputs = path_buffer.edge_throughputs.view(
-                        next_buffer_beg, 2 * num_pixels);
+                        next_buffer_beg, 2 * num_primary_edge_samples);
                     auto next_active_pixels = path_buffer.edge_active_pixels.view(
-                        next_buffer_beg, 2 * num_pixels);
+                        next_buffer_beg, 2 * num_primary_edge_samples);
                     auto edge_min_roughness =
-                        path_buffer.edge_min_roughness.view(main_buffer_beg, 2 * num_pixels);
+                        path_buffer.edge_min_roughness.view(main_buffer_beg, 2 * num_primary_edge_samples);
                     auto edge_next_min_roughness =
-                        path_buffer.edge_min_roughness.view(next_buffer_beg, 2 * num_pixels);
+                        path_buffer.edge_min_roughness.view(next_buffer_beg, 2 * num_primary_edge_samples);
 
                     // Sample points on lights
                     edge_sampler->next_light_samples(tmp_light_samples);
@@ -876,7 +1023,6 @@ void render(const Scene &scene,
                     sample_point_on_light(
                         scene, active_pixels, shading_points,
                         light_samples, light_isects, light_points, nee_rays);
-                    occluded(scene, active_pixels, nee_rays, optix_rays, optix_hits);
 
                     // Sample directions based on BRDF
                     edge_sampler->next_bsdf_samples(tmp_bsdf_samples);
@@ -895,16 +1041,18 @@ void render(const Scene &scene,
                                 next_rays,
                                 ray_differentials,
                                 edge_next_min_roughness);
-                    // Intersect with the scene
-                    intersect(scene,
-                              active_pixels,
-                              next_rays,
-                              ray_differentials,
-                              bsdf_isects,
-                              bsdf_points,
-                              ray_differentials,
-                              optix_rays,
-                              optix_hits);
+                    // Test the light samples for occlusion & intersect the BSDF samples with the scene
+                    occluded_and_intersect(scene,
+                                           active_pixels,
+                                           nee_rays,
+                                           active_pixels,
+                                           next_rays,
+                                           ray_differentials,
+                                           bsdf_isects,
+                                           bsdf_points,
+                                           ray_differentials,
+                                           optix_rays,
+                                           optix_hits);
                     // Compute path contribution & update throughput
                     accumulate_path_contribs(
                         scene,
@@ -920,7 +1068,7 @@ void render(const Scene &scene,
                         bsdf_points,
                         next_rays,
                         edge_min_roughness,
-                        Real(1) / options.num_samples,
+                        primary_edge_weight,
                         channel_info,
                         next_throughputs,
                         nullptr,
@@ -943,6 +1091,9 @@ void render(const Scene &scene,
             /////////////////////////////////////////////////////////////////////////////////
         }
     }
+    if (new_primary_hits != nullptr) {
+        new_primary_hits->complete = true;
+    }
 
     if (scene.use_gpu) {
         cuda_synchronize();
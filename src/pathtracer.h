@@ -7,6 +7,7 @@
 
 struct Scene;
 struct DScene;
+struct PrimaryHitCache;
 
 enum class SamplerType {
 	independent,
@@ -20,6 +21,20 @@ struct RenderOptions {
     std::vector<Channels> channels;
     SamplerType sampler_type;
     bool sample_pixel_center;
+    // Resolve the primary visibility by rasterizing the triangles instead of
+    // tracing rays (only for perspective & orthographic cameras without distortion)
+    bool use_rasterization;
+    // Optional: reuse primary rays & hits across render() calls
+    // when the camera and the geometry don't change.
+    std::shared_ptr<PrimaryHitCache> primary_hit_cache;
+    // Edge sample budgets of each sample pass. A positive count is absolute,
+    // otherwise a positive ratio is relative to the number of pixels
+    // (primary edges) or of active paths at each bounce (secondary edges).
+    // When neither is set there is one edge sample per pixel/path.
+    int64_t num_primary_edge_samples;
+    Real primary_edge_sample_ratio;
+    int64_t num_secondary_edge_samples;
+    Real secondary_edge_sample_ratio;
 };
 
 void render(const Scene &scene,
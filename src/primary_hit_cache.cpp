@@ -0,0 +1,272 @@
+#include "primary_hit_cache.h"
+#include "scene.h"
+#include "test_utils.h"
+#include "thrust_utils.h"
+
+#include <thrust/copy.h>
+#include <algorithm>
+
+// 64-bit FNV-1a
+struct Hasher {
+    template <typename T>
+    void add(const T &v) {
+        auto bytes = (const unsigned char*)&v;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+};
+
+uint64_t hash_camera(const Camera &camera) {
+    // Hash field by field to avoid hashing padding bytes
+    auto hasher = Hasher{};
+    hasher.add(camera.width);
+    hasher.add(camera.height);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            hasher.add(camera.cam_to_world(i, j));
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            hasher.add(camera.intrinsic_mat_inv(i, j));
+        }
+    }
+    hasher.add(camera.distortion_params.defined);
+    if (camera.distortion_params.defined) {
+        for (int i = 0; i < 6; i++) {
+            hasher.add(camera.distortion_params.k[i]);
+        }
+        hasher.add(camera.distortion_params.p[0]);
+        hasher.add(camera.distortion_params.p[1]);
+        hasher.add(camera.distortion_params.lut_resolution);
+    }
+    hasher.add(camera.clip_near);
+    hasher.add(camera.camera_type);
+    hasher.add(camera.viewport_beg.x);
+    hasher.add(camera.viewport_beg.y);
+    hasher.add(camera.viewport_end.x);
+    hasher.add(camera.viewport_end.y);
+    return hasher.hash;
+}
+
+uint64_t hash_geometry(const Scene &scene) {
+    // Only the layout of the geometry: the contents are covered by
+    // PrimaryHitCache::geometry_version, which pyredner sets to a checksum of
+    // the geometry tensors. The buffer addresses are left out on purpose,
+    // tensors that are re-created with the same contents still hit.
+    // The instance transforms are stored in the shapes, so they are hashed here.
+    auto hasher = Hasher{};
+    hasher.add(scene.shapes.size());
+    for (int i = 0; i < scene.shapes.size(); i++) {
+        const auto &shape = scene.shapes[i];
+        hasher.add(shape.uvs != nullptr);
+        hasher.add(shape.normals != nullptr);
+        hasher.add(shape.uv_indices != nullptr);
+        hasher.add(shape.normal_indices != nullptr);
+        hasher.add(shape.num_vertices);
+        hasher.add(shape.num_triangles);
+        hasher.add(shape.prototype_id);
+        hasher.add(shape.has_transform);
+        if (shape.has_transform) {
+            for (int j = 0; j < 4; j++) {
+                for (int k = 0; k < 4; k++) {
+                    hasher.add(shape.to_world(j, k));
+                }
+            }
+        }
+    }
+    return hasher.hash;
+}
+
+bool PrimaryHitCacheKey::operator==(const PrimaryHitCacheKey &other) const {
+    return same_view(other) &&
+        seed == other.seed &&
+        sampler_type == other.sampler_type &&
+        num_samples == other.num_samples &&
+        sample_pixel_center == other.sample_pixel_center;
+}
+
+bool PrimaryHitCacheKey::same_view(const PrimaryHitCacheKey &other) const {
+    return camera_hash == other.camera_hash &&
+        geometry_hash == other.geometry_hash &&
+        geometry_version == other.geometry_version &&
+        num_pixels == other.num_pixels &&
+        use_gpu == other.use_gpu;
+}
+
+PrimaryHitCacheKey make_primary_hit_cache_key(const Scene &scene,
+                                              const RenderOptions &options,
+                                              uint64_t geometry_version) {
+    const auto &camera = scene.camera;
+    auto num_pixels =
+        (camera.viewport_end.x - camera.viewport_beg.x) *
+        (camera.viewport_end.y - camera.viewport_beg.y);
+    return PrimaryHitCacheKey{hash_camera(camera),
+                              hash_geometry(scene),
+                              geometry_version,
+                              options.seed,
+                              options.sampler_type,
+                              options.num_samples,
+                              options.sample_pixel_center,
+                              num_pixels,
+                              scene.use_gpu};
+}
+
+PrimaryHitCache::Entry::Entry(const PrimaryHitCacheKey &key)
+    : key(key),
+      complete(false),
+      rays(key.use_gpu, (size_t)key.num_samples * key.num_pixels),
+      primary_differentials(key.use_gpu, (size_t)key.num_samples * key.num_pixels),
+      ray_differentials(key.use_gpu, (size_t)key.num_samples * key.num_pixels),
+      isects(key.use_gpu, (size_t)key.num_samples * key.num_pixels),
+      points(key.use_gpu, (size_t)key.num_samples * key.num_pixels) {}
+
+const PrimaryHitCache::Entry *PrimaryHitCache::find(const PrimaryHitCacheKey &key) {
+    // A camera or geometry change invalidates everything we have
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+        [&](const std::unique_ptr<Entry> &entry) {
+            return !entry->key.same_view(key);
+        }), entries.end());
+    for (const auto &entry : entries) {
+        if (entry->complete && entry->key == key) {
+            num_hits++;
+            return entry.get();
+        }
+    }
+    num_misses++;
+    return nullptr;
+}
+
+PrimaryHitCache::Entry *PrimaryHitCache::insert(const PrimaryHitCacheKey &key) {
+    if (max_entries <= 0) {
+        return nullptr;
+    }
+    // Replace incomplete leftovers with the same key
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+        [&](const std::unique_ptr<Entry> &entry) {
+            return entry->key == key;
+        }), entries.end());
+    while ((int)entries.size() >= max_entries) {
+        entries.erase(entries.begin());
+    }
+    entries.emplace_back(new Entry(key));
+    return entries.back().get();
+}
+
+void PrimaryHitCache::clear() {
+    entries.clear();
+}
+
+void load_primary_hits(const PrimaryHitCache::Entry &entry,
+                       int sample_id,
+                       BufferView<Ray> rays,
+                       BufferView<RayDifferential> primary_differentials,
+                       BufferView<RayDifferential> ray_differentials,
+                       BufferView<Intersection> isects,
+                       BufferView<SurfacePoint> points,
+                       bool use_gpu) {
+    auto num_pixels = entry.key.num_pixels;
+    auto offset = (size_t)sample_id * num_pixels;
+    assert(rays.size() == num_pixels);
+    DISPATCH(use_gpu, thrust::copy,
+        entry.rays.begin() + offset,
+        entry.rays.begin() + offset + num_pixels,
+        rays.begin());
+    DISPATCH(use_gpu, thrust::copy,
+        entry.primary_differentials.begin() + offset,
+        entry.primary_differentials.begin() + offset + num_pixels,
+        primary_differentials.begin());
+    DISPATCH(use_gpu, thrust::copy,
+        entry.ray_differentials.begin() + offset,
+        entry.ray_differentials.begin() + offset + num_pixels,
+        ray_differentials.begin());
+    DISPATCH(use_gpu, thrust::copy,
+        entry.isects.begin() + offset,
+        entry.isects.begin() + offset + num_pixels,
+        isects.begin());
+    DISPATCH(use_gpu, thrust::copy,
+        entry.points.begin() + offset,
+        entry.points.begin() + offset + num_pixels,
+        points.begin());
+}
+
+void store_primary_hits(PrimaryHitCache::Entry &entry,
+                        int sample_id,
+                        const BufferView<Ray> &rays,
+                        const BufferView<RayDifferential> &primary_differentials,
+                        const BufferView<RayDifferential> &ray_differentials,
+                        const BufferView<Intersection> &isects,
+                        const BufferView<SurfacePoint> &points,
+                        bool use_gpu) {
+    auto num_pixels = entry.key.num_pixels;
+    auto offset = (size_t)sample_id * num_pixels;
+    assert(rays.size() == num_pixels);
+    DISPATCH(use_gpu, thrust::copy,
+        rays.begin(), rays.end(), entry.rays.begin() + offset);
+    DISPATCH(use_gpu, thrust::copy,
+        primary_differentials.begin(), primary_differentials.end(),
+        entry.primary_differentials.begin() + offset);
+    DISPATCH(use_gpu, thrust::copy,
+        ray_differentials.begin(), ray_differentials.end(),
+        entry.ray_differentials.begin() + offset);
+    DISPATCH(use_gpu, thrust::copy,
+        isects.begin(), isects.end(), entry.isects.begin() + offset);
+    DISPATCH(use_gpu, thrust::copy,
+        points.begin(), points.end(), entry.points.begin() + offset);
+}
+
+void test_primary_hit_cache() {
+    auto key = PrimaryHitCacheKey{1, 2, 0, 3, SamplerType::independent, 2, false, 4, false};
+    auto cache = PrimaryHitCache{};
+    equal_or_error(__FILE__, __LINE__, 1, int(cache.find(key) == nullptr));
+
+    auto entry = cache.insert(key);
+    Buffer<Ray> rays(false, 4);
+    Buffer<RayDifferential> differentials(false, 4);
+    Buffer<Intersection> isects(false, 4);
+    Buffer<SurfacePoint> points(false, 4);
+    for (int sample_id = 0; sample_id < key.num_samples; sample_id++) {
+        for (int i = 0; i < 4; i++) {
+            rays[i] = Ray{Vector3{Real(i), Real(sample_id), Real(0)}, Vector3{0, 0, 1}};
+            differentials[i] = RayDifferential{
+                Vector3{0, 0, 0}, Vector3{0, 0, 0},
+                Vector3{0, 0, 0}, Vector3{0, 0, 0}};
+            isects[i] = Intersection{i, sample_id};
+            points[i] = SurfacePoint::zero();
+        }
+        store_primary_hits(*entry, sample_id,
+                           rays.view(0, 4), differentials.view(0, 4),
+                           differentials.view(0, 4), isects.view(0, 4),
+                           points.view(0, 4), false);
+    }
+    // Incomplete entries are never returned
+    equal_or_error(__FILE__, __LINE__, 1, int(cache.find(key) == nullptr));
+    entry->complete = true;
+    auto found = cache.find(key);
+    equal_or_error(__FILE__, __LINE__, 1, int(found == entry));
+    load_primary_hits(*found, 0,
+                      rays.view(0, 4), differentials.view(0, 4),
+                      differentials.view(0, 4), isects.view(0, 4),
+                      points.view(0, 4), false);
+    for (int i = 0; i < 4; i++) {
+        equal_or_error<Real>(__FILE__, __LINE__, rays[i].org, Vector3{Real(i), Real(0), Real(0)});
+        equal_or_error(__FILE__, __LINE__, i, isects[i].shape_id);
+        equal_or_error(__FILE__, __LINE__, 0, isects[i].tri_id);
+    }
+
+    // A different seed misses but keeps the entry around
+    auto other_seed = key;
+    other_seed.seed = 4;
+    equal_or_error(__FILE__, __LINE__, 1, int(cache.find(other_seed) == nullptr));
+    equal_or_error(__FILE__, __LINE__, 1, (int)cache.num_entries());
+    // A geometry change flushes the cache
+    auto other_geometry = key;
+    other_geometry.geometry_version = 1;
+    equal_or_error(__FILE__, __LINE__, 1, int(cache.find(other_geometry) == nullptr));
+    equal_or_error(__FILE__, __LINE__, 0, (int)cache.num_entries());
+    equal_or_error(__FILE__, __LINE__, 1, cache.num_hits);
+    equal_or_error(__FILE__, __LINE__, 4, cache.num_misses);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "redner.h"
+#include "buffer.h"
+#include "ray.h"
+#include "intersection.h"
+#include "pathtracer.h"
+
+#include <memory>
+#include <vector>
+
+struct Scene;
+
+/// Identifies a sequence of primary rays & hits.
+/// Two renders with equal keys generate bitwise identical primary rays
+/// and therefore identical first intersections.
+struct PrimaryHitCacheKey {
+    uint64_t camera_hash;
+    uint64_t geometry_hash;
+    uint64_t geometry_version;
+    uint64_t seed;
+    SamplerType sampler_type;
+    int num_samples;
+    bool sample_pixel_center;
+    int num_pixels;
+    bool use_gpu;
+
+    bool operator==(const PrimaryHitCacheKey &other) const;
+    bool same_view(const PrimaryHitCacheKey &other) const;
+};
+
+PrimaryHitCacheKey make_primary_hit_cache_key(const Scene &scene,
+                                              const RenderOptions &options,
+                                              uint64_t geometry_version);
+
+/**
+ * Stores primary rays, intersections and surface points for every
+ * (sample, pixel) pair across render() calls. Useful when the camera and
+ * the geometry are fixed over many iterations (e.g. texture or material
+ * optimization): after the first call, render() skips primary ray
+ * generation and the first intersect() entirely.
+ *
+ * The cache only compares the layout of the geometry (counts and which
+ * optional arrays exist), so the caller is expected to change
+ * geometry_version whenever the contents change. pyredner passes a checksum
+ * of the geometry tensors, computed on their device every cached render.
+ * Camera changes are detected automatically.
+ * Memory cost is roughly num_samples * num_pixels * 400 bytes per entry.
+ */
+struct PrimaryHitCache {
+    struct Entry {
+        Entry(const PrimaryHitCacheKey &key);
+
+        PrimaryHitCacheKey key;
+        // Set when all samples have been stored
+        bool complete;
+        Buffer<Ray> rays;
+        Buffer<RayDifferential> primary_differentials;
+        Buffer<RayDifferential> ray_differentials;
+        Buffer<Intersection> isects;
+        Buffer<SurfacePoint> points;
+    };
+
+    PrimaryHitCache(int max_entries = 2)
+        : geometry_version(0), max_entries(max_entries),
+          num_hits(0), num_misses(0) {}
+
+    /// Return the complete entry matching key, or nullptr.
+    /// Entries with a different camera or geometry are dropped.
+    const Entry *find(const PrimaryHitCacheKey &key);
+    /// Allocate a fresh entry for key, evicting the oldest one if needed.
+    Entry *insert(const PrimaryHitCacheKey &key);
+    void clear();
+    size_t num_entries() const { return entries.size(); }
+
+    uint64_t geometry_version;
+    int max_entries;
+    int num_hits;
+    int num_misses;
+    std::vector<std::unique_ptr<Entry>> entries;
+};
+
+/// Copy sample_id's primary rays & hits from the entry into the path buffers
+void load_primary_hits(const PrimaryHitCache::Entry &entry,
+                       int sample_id,
+                       BufferView<Ray> rays,
+                       BufferView<RayDifferential> primary_differentials,
+                       BufferView<RayDifferential> ray_differentials,
+                       BufferView<Intersection> isects,
+                       BufferView<SurfacePoint> points,
+                       bool use_gpu);
+/// Copy sample_id's primary rays & hits from the path buffers into the entry
+void store_primary_hits(PrimaryHitCache::Entry &entry,
+                        int sample_id,
+                        const BufferView<Ray> &rays,
+                        const BufferView<RayDifferential> &primary_differentials,
+                        const BufferView<RayDifferential> &ray_differentials,
+                        const BufferView<Intersection> &isects,
+                        const BufferView<SurfacePoint> &points,
+                        bool use_gpu);
+
+void test_primary_hit_cache();
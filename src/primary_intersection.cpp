@@ -38,9 +38,9 @@ struct d_primary_intersector {
                               d_v_n,
                               d_v_uv,
                               d_v_c);
-            atomic_add(&d_shapes[shape_id].vertices[3 * ind[0]], d_v_p[0]);
-            atomic_add(&d_shapes[shape_id].vertices[3 * ind[1]], d_v_p[1]);
-            atomic_add(&d_shapes[shape_id].vertices[3 * ind[2]], d_v_p[2]);
+            atomic_add_vertex_derivative(shape, d_shapes[shape_id], ind[0], d_v_p[0]);
+            atomic_add_vertex_derivative(shape, d_shapes[shape_id], ind[1], d_v_p[1]);
+            atomic_add_vertex_derivative(shape, d_shapes[shape_id], ind[2], d_v_p[2]);
             if (has_uvs(shape)) {
                 auto uv_ind = ind;
                 if (shape.uv_indices != nullptr) {
@@ -55,9 +55,9 @@ struct d_primary_intersector {
                 if (shape.normal_indices != nullptr) {
                     normal_ind = get_normal_indices(shape, tri_id);
                 }
-                atomic_add(&d_shapes[shape_id].normals[3 * normal_ind[0]], d_v_n[0]);
-                atomic_add(&d_shapes[shape_id].normals[3 * normal_ind[1]], d_v_n[1]);
-                atomic_add(&d_shapes[shape_id].normals[3 * normal_ind[2]], d_v_n[2]);
+                atomic_add_normal_derivative(shape, d_shapes[shape_id], normal_ind[0], d_v_n[0]);
+                atomic_add_normal_derivative(shape, d_shapes[shape_id], normal_ind[1], d_v_n[1]);
+                atomic_add_normal_derivative(shape, d_shapes[shape_id], normal_ind[2], d_v_n[2]);
             }
             if (has_colors(shape)) {
                 atomic_add(&d_shapes[shape_id].colors[3 * ind[0]], d_v_c[0]);
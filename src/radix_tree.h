@@ -0,0 +1,151 @@
+#pragma once
+
+#include "redner.h"
+#include "vector.h"
+#include "buffer.h"
+#include "aabb.h"
+#include "parallel.h"
+
+// Linear BVH construction shared by the edge tree and the light tree.
+
+DEVICE
+inline uint64_t expand_bits_3d(uint64_t x) {
+    // Insert two zero after every bit given a 21-bit integer
+    // https://github.com/leonardo-domingues/atrbvh/blob/master/BVHRT-Core/src/Commons.cuh#L599
+    uint64_t expanded = x;
+    expanded &= 0x1fffff;
+    expanded = (expanded | expanded << 32) & 0x1f00000000ffff;
+    expanded = (expanded | expanded << 16) & 0x1f0000ff0000ff;
+    expanded = (expanded | expanded << 8) & 0x100f00f00f00f00f;
+    expanded = (expanded | expanded << 4) & 0x10c30c30c30c30c3;
+    expanded = (expanded | expanded << 2) & 0x1249249249249249;
+    return expanded;
+}
+
+/// 63-bit Morton code of p, quantized to 21 bits per axis inside bounds
+DEVICE
+inline uint64_t morton_code_3d(const AABB3 &bounds, const Vector3 &p) {
+    auto pp = (p - bounds.p_min) / (bounds.p_max - bounds.p_min);
+    for (int i = 0; i < 3; i++) {
+        if (bounds.p_max[i] - bounds.p_min[i] <= 0.f) {
+            pp[i] = 0.5f;
+        }
+    }
+    auto scale = (1 << 21) - 1;
+    TVector3<uint64_t> pp_i{pp.x * scale, pp.y * scale, pp.z * scale};
+    return (expand_bits_3d(pp_i.x) << 2u) |
+           (expand_bits_3d(pp_i.y) << 1u) |
+           (expand_bits_3d(pp_i.z) << 0u);
+}
+
+/// Karras-style radix tree over sorted Morton codes.
+/// BVHNodeType needs `parent` and `children[2]` pointers.
+/// ids are the primitive ids sorted along with the codes, used to break ties.
+template <typename BVHNodeType>
+struct radix_tree_builder {
+    // https://github.com/henrikdahlberg/GPUPathTracer/blob/master/Source/Core/BVHConstruction.cu#L62
+    DEVICE int longest_common_prefix(int idx0, int idx1) {
+        if (idx0 < 0 || idx0 >= num_primitives || idx1 < 0 || idx1 >= num_primitives) {
+            return -1;
+        }
+        auto mc0 = morton_codes[idx0];
+        auto mc1 = morton_codes[idx1];
+        if (mc0 == mc1) {
+            // Break even when the Morton codes are the same
+            auto id0 = (uint64_t)ids[idx0];
+            auto id1 = (uint64_t)ids[idx1];
+            return clz(mc0 ^ mc1) + clz(id0 ^ id1);
+        }
+        else {
+            return clz(mc0 ^ mc1);
+        }
+    }
+
+    DEVICE void operator()(int idx) {
+        // Mostly adapted from 
+        // https://github.com/henrikdahlberg/GPUPathTracer/blob/master/Source/Core/BVHConstruction.cu#L161
+        // Also see Figure 4 in
+        // https://devblogs.nvidia.com/wp-content/uploads/2012/11/karras2012hpg_paper.pdf
+
+        if (idx >= num_primitives - 1) {
+            if (num_primitives == 1) {
+                // Special case: if there is only one primitive, set it as the root
+                nodes[0] = leaves[0];
+            }
+            return;
+        }
+
+        // Compute upper bound for the length of the range
+        auto d = longest_common_prefix(idx, idx + 1) -
+                 longest_common_prefix(idx, idx - 1) >= 0 ? 1 : -1;
+        auto delta_min = longest_common_prefix(idx, idx - d);
+        auto lmax = 2;
+        while (longest_common_prefix(idx, idx + lmax * d) > delta_min) {
+            lmax *= 2;
+        }
+        // Find the other end using binary search
+        auto l = 0;
+        auto divider = 2;
+        for (int t = lmax / divider; t >= 1;) {
+            if (longest_common_prefix(idx, idx + (l + t) * d) > delta_min) {
+                l += t;
+            }
+            if (t == 1) {
+                break;
+            }
+            divider *= 2;
+            t = lmax / divider;
+        }
+        auto j = idx + l * d;
+        // Find the split position using binary search
+        auto delta_node = longest_common_prefix(idx, j);
+        auto s = 0;
+        divider = 2;
+        for (int t = (l + (divider - 1)) / divider; t >= 1;) {
+            if (longest_common_prefix(idx, idx + (s + t) * d) > delta_node) {
+                s += t;
+            }
+            if (t == 1) {
+                break;
+            }
+            divider *= 2;
+            t = (l + (divider - 1)) / divider;
+        }
+        auto gamma = idx + s * d + min(d, 0);
+        assert(gamma >= 0 && gamma + 1 < num_primitives);
+        auto &node = nodes[idx];
+        if (min(idx, j) == gamma) {
+            node.children[0] = &leaves[gamma];
+            leaves[gamma].parent = &node;
+        } else {
+            node.children[0] = &nodes[gamma];
+            nodes[gamma].parent = &node;
+        }
+        if (max(idx, j) == gamma + 1) {
+            node.children[1] = &leaves[gamma + 1];
+            leaves[gamma + 1].parent = &node;
+        } else {
+            node.children[1] = &nodes[gamma + 1];
+            nodes[gamma + 1].parent = &node;
+        }
+    }
+
+    const uint64_t *morton_codes;
+    const int *ids;
+    const int num_primitives;
+    BVHNodeType *nodes;
+    BVHNodeType *leaves;
+};
+
+template <typename BVHNodeType>
+void build_radix_tree(const BufferView<uint64_t> &morton_codes,
+                      const BufferView<int> &ids,
+                      BufferView<BVHNodeType> nodes,
+                      BufferView<BVHNodeType> leaves,
+                      bool use_gpu) {
+    parallel_for(radix_tree_builder<BVHNodeType>{
+        morton_codes.begin(), ids.begin(),
+            (int)morton_codes.size(), nodes.begin(), leaves.begin()},
+        morton_codes.size(),
+        use_gpu);
+}
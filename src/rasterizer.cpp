@@ -0,0 +1,494 @@
+#include "rasterizer.h"
+#include "scene.h"
+#include "shape.h"
+#include "atomic.h"
+#include "parallel.h"
+#include "test_utils.h"
+#include "thrust_utils.h"
+
+#include <thrust/execution_policy.h>
+#include <thrust/fill.h>
+#include <thrust/copy.h>
+#include <thrust/scan.h>
+#include <thrust/sequence.h>
+#include <thrust/sort.h>
+#include <thrust/gather.h>
+
+/// Pixel-space bounding box of the projection of a triangle.
+/// For the perspective camera we clip the triangle against a plane slightly
+/// in front of the camera first, since the projection of the part behind
+/// it is not bounded. Returns false if nothing is in front of the camera.
+DEVICE
+inline bool project_triangle_bounds(const Camera &camera,
+                                    const Vector3 *vertices,
+                                    Vector2 &p_min,
+                                    Vector2 &p_max) {
+    Vector3 local[3];
+    for (int i = 0; i < 3; i++) {
+        local[i] = xfm_point(camera.world_to_cam, vertices[i]);
+    }
+    // A triangle clipped by a plane has at most 4 vertices
+    Vector3 clipped[4];
+    auto num_clipped = 0;
+    if (camera.camera_type == CameraType::Perspective) {
+        auto near_z = Real(1e-6);
+        for (int i = 0; i < 3; i++) {
+            const auto &a = local[i];
+            const auto &b = local[(i + 1) % 3];
+            if (a.z >= near_z) {
+                clipped[num_clipped++] = a;
+            }
+            if ((a.z >= near_z) != (b.z >= near_z)) {
+                auto t = (near_z - a.z) / (b.z - a.z);
+                clipped[num_clipped++] = a + t * (b - a);
+            }
+        }
+    } else {
+        for (int i = 0; i < 3; i++) {
+            clipped[num_clipped++] = local[i];
+        }
+    }
+    if (num_clipped == 0) {
+        return false;
+    }
+    p_min = Vector2{infinity<Real>(), infinity<Real>()};
+    p_max = Vector2{-infinity<Real>(), -infinity<Real>()};
+    for (int i = 0; i < num_clipped; i++) {
+        auto screen_pos = camera_to_screen(camera, clipped[i]);
+        auto pixel_pos = Vector2{screen_pos.x * camera.width, screen_pos.y * camera.height};
+        p_min = Vector2{min(p_min.x, pixel_pos.x), min(p_min.y, pixel_pos.y)};
+        p_max = Vector2{max(p_max.x, pixel_pos.x), max(p_max.y, pixel_pos.y)};
+    }
+    return true;
+}
+
+/// Range of the viewport tiles a triangle may overlap
+DEVICE
+inline bool triangle_tile_range(const Camera &camera,
+                                const Shape &shape,
+                                int tri_id,
+                                Vector2i &tile_min,
+                                Vector2i &tile_max) {
+    auto ind = get_indices(shape, tri_id);
+    Vector3 vertices[3] = {Vector3{get_vertex(shape, ind[0])},
+                           Vector3{get_vertex(shape, ind[1])},
+                           Vector3{get_vertex(shape, ind[2])}};
+    auto p_min = Vector2{0, 0};
+    auto p_max = Vector2{0, 0};
+    if (!project_triangle_bounds(camera, vertices, p_min, p_max)) {
+        return false;
+    }
+    // Pad by half a pixel for the rounding errors, the primary rays
+    // do the exact test anyway
+    auto x0 = max(floor(p_min.x - Real(0.5)), Real(camera.viewport_beg.x));
+    auto y0 = max(floor(p_min.y - Real(0.5)), Real(camera.viewport_beg.y));
+    auto x1 = min(floor(p_max.x + Real(0.5)), Real(camera.viewport_end.x - 1));
+    auto y1 = min(floor(p_max.y + Real(0.5)), Real(camera.viewport_end.y - 1));
+    // Also rejects NaNs
+    if (!(x0 <= x1 && y0 <= y1)) {
+        return false;
+    }
+    tile_min = Vector2i{(int(x0) - camera.viewport_beg.x) / raster_tile_size,
+                        (int(y0) - camera.viewport_beg.y) / raster_tile_size};
+    tile_max = Vector2i{(int(x1) - camera.viewport_beg.x) / raster_tile_size,
+                        (int(y1) - camera.viewport_beg.y) / raster_tile_size};
+    return true;
+}
+
+/// Lower bound of the view depth dot(p - view_org, view_dir) of the points p
+/// of a triangle. The depth is linear so the minimum is at a vertex.
+DEVICE
+inline Real triangle_min_depth(const Shape &shape,
+                               int tri_id,
+                               const Vector3 &view_org,
+                               const Vector3 &view_dir) {
+    auto ind = get_indices(shape, tri_id);
+    auto min_depth = infinity<Real>();
+    for (int i = 0; i < 3; i++) {
+        auto v = Vector3{get_vertex(shape, ind[i])};
+        min_depth = min(min_depth, dot(v - view_org, view_dir));
+    }
+    // Leave room for the rounding errors of the ray-triangle test
+    return min_depth - Real(1e-3) * (fabs(min_depth) + 1);
+}
+
+struct triangle_binner {
+    DEVICE void operator()(int idx) {
+        // Find the last shape that starts before idx
+        auto lo = 0, hi = num_shapes - 1;
+        while (lo < hi) {
+            auto mid = (lo + hi + 1) / 2;
+            if (shape_offsets[mid] <= idx) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        auto shape_id = lo;
+        auto tri_id = idx - shape_offsets[shape_id];
+        auto tile_min = Vector2i{0, 0};
+        auto tile_max = Vector2i{0, 0};
+        if (!triangle_tile_range(camera, shapes[shape_id], tri_id, tile_min, tile_max)) {
+            return;
+        }
+        auto min_depth = tile_triangles != nullptr ?
+            triangle_min_depth(shapes[shape_id], tri_id, view_org, view_dir) : Real(0);
+        for (int ty = tile_min.y; ty <= tile_max.y; ty++) {
+            for (int tx = tile_min.x; tx <= tile_max.x; tx++) {
+                auto tile_id = ty * num_tiles_x + tx;
+                // Without an output we only count the triangles of each tile
+                auto slot = atomic_increment(&tile_cursors[tile_id]) - 1;
+                if (tile_triangles != nullptr) {
+                    tile_triangles[slot].shape_id = shape_id;
+                    tile_triangles[slot].tri_id = tri_id;
+                    tile_depths[slot] = min_depth;
+                    slot_tiles[slot] = tile_id;
+                }
+            }
+        }
+    }
+
+    const Camera camera;
+    const Shape *shapes;
+    const int *shape_offsets;
+    const int num_shapes;
+    const int num_tiles_x;
+    const Vector3 view_org;
+    const Vector3 view_dir;
+    int *tile_cursors;
+    Intersection *tile_triangles;
+    Real *tile_depths;
+    int *slot_tiles;
+};
+
+void bin_triangles(const Scene &scene, TriangleBins &bins) {
+    const auto &camera = scene.camera;
+    auto use_gpu = scene.use_gpu;
+    bins.num_tiles_x = idiv_ceil(camera.viewport_end.x - camera.viewport_beg.x, raster_tile_size);
+    bins.num_tiles_y = idiv_ceil(camera.viewport_end.y - camera.viewport_beg.y, raster_tile_size);
+    auto num_tiles = bins.num_tiles_x * bins.num_tiles_y;
+    auto num_shapes = (int)scene.shapes.size();
+    // Index the triangles of all shapes together
+    Buffer<int> shape_offsets(use_gpu, num_shapes + 1);
+    shape_offsets[0] = 0;
+    for (int i = 0; i < num_shapes; i++) {
+        shape_offsets[i + 1] = shape_offsets[i] + scene.shapes[i].num_triangles;
+    }
+    auto num_triangles = shape_offsets[num_shapes];
+    bins.view_org = xfm_point(camera.cam_to_world, Vector3{0, 0, 0});
+    bins.view_dir = normalize(xfm_vector(camera.cam_to_world, Vector3{0, 0, 1}));
+    // Count the triangles of each tile, then scan for the offsets
+    bins.tile_offsets = Buffer<int>(use_gpu, num_tiles + 1);
+    DISPATCH(use_gpu, thrust::fill,
+        bins.tile_offsets.begin(), bins.tile_offsets.end(), 0);
+    if (num_triangles > 0) {
+        parallel_for(triangle_binner{
+            camera, scene.shapes.begin(), shape_offsets.begin(), num_shapes,
+            bins.num_tiles_x, bins.view_org, bins.view_dir,
+            bins.tile_offsets.begin(), nullptr, nullptr, nullptr},
+            num_triangles, use_gpu);
+    }
+    DISPATCH(use_gpu, thrust::exclusive_scan,
+        bins.tile_offsets.begin(), bins.tile_offsets.end(), bins.tile_offsets.begin());
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    auto num_entries = bins.tile_offsets[num_tiles];
+    bins.tile_triangles = Buffer<Intersection>(use_gpu, num_entries);
+    bins.tile_depths = Buffer<Real>(use_gpu, num_entries);
+    if (num_entries > 0) {
+        Buffer<int> tile_cursors(use_gpu, num_tiles);
+        DISPATCH(use_gpu, thrust::copy,
+            bins.tile_offsets.begin(), bins.tile_offsets.begin() + num_tiles,
+            tile_cursors.begin());
+        Buffer<Intersection> unsorted_triangles(use_gpu, num_entries);
+        Buffer<Real> unsorted_depths(use_gpu, num_entries);
+        Buffer<int> slot_tiles(use_gpu, num_entries);
+        parallel_for(triangle_binner{
+            camera, scene.shapes.begin(), shape_offsets.begin(), num_shapes,
+            bins.num_tiles_x, bins.view_org, bins.view_dir,
+            tile_cursors.begin(), unsorted_triangles.begin(),
+            unsorted_depths.begin(), slot_tiles.begin()},
+            num_triangles, use_gpu);
+        // Sort the triangles of each tile front to back, so that the primary rays
+        // can stop at the first triangle that starts behind their closest hit.
+        // Sort by depth, then stably by tile.
+        Buffer<int> order(use_gpu, num_entries);
+        DISPATCH(use_gpu, thrust::sequence, order.begin(), order.end());
+        DISPATCH(use_gpu, thrust::copy,
+            unsorted_depths.begin(), unsorted_depths.end(), bins.tile_depths.begin());
+        DISPATCH(use_gpu, thrust::stable_sort_by_key,
+            bins.tile_depths.begin(), bins.tile_depths.end(), order.begin());
+        Buffer<int> sorted_tiles(use_gpu, num_entries);
+        DISPATCH(use_gpu, thrust::gather,
+            order.begin(), order.end(), slot_tiles.begin(), sorted_tiles.begin());
+        DISPATCH(use_gpu, thrust::stable_sort_by_key,
+            sorted_tiles.begin(), sorted_tiles.end(), order.begin());
+        DISPATCH(use_gpu, thrust::gather,
+            order.begin(), order.end(), unsorted_triangles.begin(), bins.tile_triangles.begin());
+        DISPATCH(use_gpu, thrust::gather,
+            order.begin(), order.end(), unsorted_depths.begin(), bins.tile_depths.begin());
+        if (use_gpu) {
+            cuda_synchronize();
+        }
+    }
+}
+
+/// Distance to the triangle along the ray if it is hit
+DEVICE
+inline bool hit_triangle(const Ray &ray,
+                         const Vector3 &v0,
+                         const Vector3 &v1,
+                         const Vector3 &v2,
+                         Real &t) {
+    auto e1 = v1 - v0;
+    auto e2 = v2 - v0;
+    auto pvec = cross(ray.dir, e2);
+    auto divisor = dot(pvec, e1);
+    if (divisor == 0) {
+        return false;
+    }
+    auto inv_divisor = 1 / divisor;
+    auto s = ray.org - v0;
+    auto u = dot(s, pvec) * inv_divisor;
+    if (u < 0 || u > 1) {
+        return false;
+    }
+    auto qvec = cross(s, e1);
+    auto v = dot(ray.dir, qvec) * inv_divisor;
+    if (v < 0 || u + v > 1) {
+        return false;
+    }
+    t = dot(e2, qvec) * inv_divisor;
+    return t >= ray.tmin && t <= ray.tmax;
+}
+
+struct primary_rasterizer {
+    DEVICE void operator()(int idx) {
+        auto pixel_id = active_pixels[idx];
+        auto &ray = rays[pixel_id];
+        auto x = pixel_id % viewport_width;
+        auto y = pixel_id / viewport_width;
+        auto tile_id = (y / raster_tile_size) * num_tiles_x + x / raster_tile_size;
+        auto hit_shape_id = -1;
+        auto hit_tri_id = -1;
+        auto hit_t = ray.tmax;
+        auto hit_depth = infinity<Real>();
+        if (length_squared(ray.dir) > 1e-3f) {
+            for (int i = tile_offsets[tile_id]; i < tile_offsets[tile_id + 1]; i++) {
+                // The triangles are sorted by the lower bounds of their view depths.
+                // Once a bound is behind the closest hit, so is every remaining triangle.
+                // Hits at the same distance still go through the tie breaking below.
+                if (tile_depths[i] > hit_depth) {
+                    break;
+                }
+                auto shape_id = tile_triangles[i].shape_id;
+                auto tri_id = tile_triangles[i].tri_id;
+                const auto &shape = shapes[shape_id];
+                auto ind = get_indices(shape, tri_id);
+                auto t = Real(0);
+                if (!hit_triangle(ray,
+                                  Vector3{get_vertex(shape, ind[0])},
+                                  Vector3{get_vertex(shape, ind[1])},
+                                  Vector3{get_vertex(shape, ind[2])},
+                                  t)) {
+                    continue;
+                }
+                // Triangles with equal bounds are in arbitrary order, so break the ties by the ids
+                if (hit_shape_id == -1 || t < hit_t || (t == hit_t &&
+                        (shape_id < hit_shape_id ||
+                         (shape_id == hit_shape_id && tri_id < hit_tri_id)))) {
+                    hit_shape_id = shape_id;
+                    hit_tri_id = tri_id;
+                    hit_t = t;
+                    hit_depth = dot(ray.org + t * ray.dir - view_org, view_dir);
+                }
+            }
+        }
+        intersections[pixel_id].shape_id = hit_shape_id;
+        intersections[pixel_id].tri_id = hit_tri_id;
+        if (hit_shape_id == -1) {
+            new_ray_differentials[pixel_id] = ray_differentials[pixel_id];
+        } else {
+            points[pixel_id] = intersect_shape(shapes[hit_shape_id],
+                                               hit_tri_id,
+                                               ray,
+                                               ray_differentials[pixel_id],
+                                               new_ray_differentials[pixel_id]);
+            ray.tmax = hit_t;
+        }
+    }
+
+    const Shape *shapes;
+    const int *tile_offsets;
+    const Intersection *tile_triangles;
+    const Real *tile_depths;
+    const Vector3 view_org;
+    const Vector3 view_dir;
+    const int viewport_width;
+    const int num_tiles_x;
+    const int *active_pixels;
+    Ray *rays;
+    const RayDifferential *ray_differentials;
+    Intersection *intersections;
+    SurfacePoint *points;
+    RayDifferential *new_ray_differentials;
+};
+
+void rasterize_primary(const Scene &scene,
+                       const TriangleBins &bins,
+                       const BufferView<int> &active_pixels,
+                       BufferView<Ray> rays,
+                       const BufferView<RayDifferential> &ray_differentials,
+                       BufferView<Intersection> intersections,
+                       BufferView<SurfacePoint> points,
+                       BufferView<RayDifferential> new_ray_differentials) {
+    if (active_pixels.size() == 0) {
+        return;
+    }
+    parallel_for(primary_rasterizer{
+        scene.shapes.begin(),
+        bins.tile_offsets.begin(),
+        bins.tile_triangles.begin(),
+        bins.tile_depths.begin(),
+        bins.view_org,
+        bins.view_dir,
+        scene.camera.viewport_end.x - scene.camera.viewport_beg.x,
+        bins.num_tiles_x,
+        active_pixels.begin(),
+        rays.begin(),
+        ray_differentials.begin(),
+        intersections.begin(),
+        points.begin(),
+        new_ray_differentials.begin()}, active_pixels.size(), scene.use_gpu);
+}
+
+template <CameraType camera_type>
+void test_rasterize_primary(bool use_gpu) {
+    // A ground plane, a triangle partially behind the camera, and a small
+    // triangle in front of the plane
+    Buffer<Vector3f> ground_vertices(use_gpu, 4);
+    ground_vertices[0] = Vector3f{-0.8f, -1.f, 1.f};
+    ground_vertices[1] = Vector3f{ 0.8f, -1.f, 1.f};
+    ground_vertices[2] = Vector3f{ 0.8f,  2.f, 6.f};
+    ground_vertices[3] = Vector3f{-0.8f,  2.f, 6.f};
+    Buffer<Vector3i> ground_indices(use_gpu, 2);
+    ground_indices[0] = Vector3i{0, 1, 2};
+    ground_indices[1] = Vector3i{0, 2, 3};
+    Buffer<Vector3f> object_vertices(use_gpu, 6);
+    object_vertices[0] = Vector3f{-0.3f, 0.1f, -1.f};
+    object_vertices[1] = Vector3f{ 0.2f, 0.4f, 3.f};
+    object_vertices[2] = Vector3f{-0.4f, 0.6f, 3.f};
+    object_vertices[3] = Vector3f{ 0.1f, -0.2f, 2.f};
+    object_vertices[4] = Vector3f{ 0.5f, -0.1f, 2.5f};
+    object_vertices[5] = Vector3f{ 0.2f, 0.3f, 2.2f};
+    Buffer<Vector3i> object_indices(use_gpu, 2);
+    object_indices[0] = Vector3i{0, 1, 2};
+    object_indices[1] = Vector3i{3, 4, 5};
+    auto make_shape = [](Buffer<Vector3f> &vertices, Buffer<Vector3i> &indices) {
+        return Shape{(float*)vertices.data,
+                     (int*)indices.data,
+                     nullptr, // uvs
+                     nullptr, // normal
+                     nullptr, // uv_indices
+                     nullptr, // normal_indices
+                     nullptr, // colors
+                     (int)vertices.size(), // num_vertices
+                     0, // num_uv_vertices
+                     0, // num_normal_vertices
+                     (int)indices.size(), // num_triangles
+                     0,
+                     -1};
+    };
+    auto ground = make_shape(ground_vertices, ground_indices);
+    auto object = make_shape(object_vertices, object_indices);
+    auto pos = Vector3f{0, 0, 0};
+    auto look = Vector3f{0, 0, 1};
+    auto up = Vector3f{0, 1, 0};
+    Matrix3x3f n2c = Matrix3x3f::identity();
+    Matrix3x3f c2n = Matrix3x3f::identity();
+    // Cover two tiles and a partial one horizontally
+    constexpr int width = 40;
+    constexpr int height = 24;
+    Camera camera{width, height,
+        &pos[0],
+        &look[0],
+        &up[0],
+        nullptr, // cam_to_world
+        nullptr, // world_to_cam
+        &n2c.data[0][0],
+        &c2n.data[0][0],
+        nullptr, // distortion_params
+        1e-2f,
+        camera_type,
+        Vector2i{0, 0},
+        Vector2i{width, height}};
+    Scene scene{camera, {&ground, &object}, {}, {}, {}, use_gpu, 0, false, false, false};
+    parallel_init();
+
+    TriangleBins bins;
+    bin_triangles(scene, bins);
+    auto num_pixels = width * height;
+    Buffer<CameraSample> samples(use_gpu, num_pixels);
+    for (int i = 0; i < num_pixels; i++) {
+        samples[i].xy = Vector2{Real(0.25) + Real(0.5) * ((i * 7) % 11) / 11,
+                                Real(0.25) + Real(0.5) * ((i * 5) % 13) / 13};
+    }
+    Buffer<Ray> traced_rays(use_gpu, num_pixels);
+    Buffer<Ray> rasterized_rays(use_gpu, num_pixels);
+    Buffer<RayDifferential> ray_diffs(use_gpu, num_pixels);
+    Buffer<RayDifferential> traced_ray_diffs(use_gpu, num_pixels);
+    Buffer<RayDifferential> rasterized_ray_diffs(use_gpu, num_pixels);
+    sample_primary_rays(camera, samples.view(0, num_pixels),
+        traced_rays.view(0, num_pixels), ray_diffs.view(0, num_pixels), use_gpu);
+    cuda_synchronize();
+    Buffer<int> active_pixels(use_gpu, num_pixels);
+    for (int i = 0; i < num_pixels; i++) {
+        rasterized_rays[i] = traced_rays[i];
+        active_pixels[i] = i;
+    }
+    Buffer<Intersection> traced_isects(use_gpu, num_pixels);
+    Buffer<Intersection> rasterized_isects(use_gpu, num_pixels);
+    Buffer<SurfacePoint> traced_points(use_gpu, num_pixels);
+    Buffer<SurfacePoint> rasterized_points(use_gpu, num_pixels);
+    Buffer<OptiXRay> optix_rays(use_gpu, num_pixels);
+    Buffer<OptiXHit> optix_hits(use_gpu, num_pixels);
+    intersect(scene,
+              active_pixels.view(0, num_pixels),
+              traced_rays.view(0, num_pixels),
+              ray_diffs.view(0, num_pixels),
+              traced_isects.view(0, num_pixels),
+              traced_points.view(0, num_pixels),
+              traced_ray_diffs.view(0, num_pixels),
+              optix_rays.view(0, num_pixels),
+              optix_hits.view(0, num_pixels));
+    rasterize_primary(scene,
+                      bins,
+                      active_pixels.view(0, num_pixels),
+                      rasterized_rays.view(0, num_pixels),
+                      ray_diffs.view(0, num_pixels),
+                      rasterized_isects.view(0, num_pixels),
+                      rasterized_points.view(0, num_pixels),
+                      rasterized_ray_diffs.view(0, num_pixels));
+    cuda_synchronize();
+    auto num_hits = 0;
+    for (int i = 0; i < num_pixels; i++) {
+        equal_or_error(__FILE__, __LINE__, traced_isects[i].shape_id, rasterized_isects[i].shape_id);
+        equal_or_error(__FILE__, __LINE__, traced_isects[i].tri_id, rasterized_isects[i].tri_id);
+        if (traced_isects[i].valid()) {
+            equal_or_error<Real>(__FILE__, __LINE__,
+                traced_points[i].position, rasterized_points[i].position);
+            equal_or_error<Real>(__FILE__, __LINE__,
+                traced_ray_diffs[i].dir_dx, rasterized_ray_diffs[i].dir_dx);
+            num_hits++;
+        }
+    }
+    // Make sure the image has both hits and misses
+    equal_or_error(__FILE__, __LINE__, 1, int(num_hits > 0 && num_hits < num_pixels));
+    parallel_cleanup();
+}
+
+void test_rasterize_primary(bool use_gpu) {
+    test_rasterize_primary<CameraType::Perspective>(use_gpu);
+    test_rasterize_primary<CameraType::Orthographic>(use_gpu);
+}
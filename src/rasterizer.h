@@ -0,0 +1,57 @@
+#pragma once
+
+#include "redner.h"
+#include "buffer.h"
+#include "camera.h"
+#include "intersection.h"
+#include "ray.h"
+
+struct Scene;
+
+/**
+ * Resolve the primary visibility by rasterization instead of ray tracing.
+ * For the linear camera projections (perspective and orthographic without
+ * lens distortion) the primary rays of a pixel only hit triangles whose
+ * projections overlap the pixel. We bin the triangles into square tiles of the
+ * viewport once per render and sort the triangles of each tile front to back
+ * by a lower bound of their depth along the viewing direction. Each primary
+ * ray then tests the triangles of its tile until the bound passes the depth of
+ * its closest hit. The output is the same as intersect(), so the rest of the
+ * pipeline does not need to know how the hits were found.
+ */
+constexpr auto raster_tile_size = 16;
+
+struct TriangleBins {
+    int num_tiles_x = 0;
+    int num_tiles_y = 0;
+    // The triangles overlapping tile i are
+    // tile_triangles[tile_offsets[i]] ... tile_triangles[tile_offsets[i + 1] - 1]
+    Buffer<int> tile_offsets;
+    Buffer<Intersection> tile_triangles;
+    // Lower bounds of dot(p - view_org, view_dir) over the points p of
+    // tile_triangles, ascending within each tile
+    Buffer<Real> tile_depths;
+    Vector3 view_org;
+    Vector3 view_dir;
+};
+
+inline bool can_rasterize_primary(const Camera &camera) {
+    return (camera.camera_type == CameraType::Perspective ||
+            camera.camera_type == CameraType::Orthographic) &&
+           !camera.has_distortion_params();
+}
+
+void bin_triangles(const Scene &scene, TriangleBins &bins);
+
+/// Intersect the primary rays of the active pixels with the triangles binned
+/// in their tiles. Same outputs as intersect().
+void rasterize_primary(const Scene &scene,
+                       const TriangleBins &bins,
+                       const BufferView<int> &active_pixels,
+                       BufferView<Ray> rays,
+                       const BufferView<RayDifferential> &ray_differentials,
+                       BufferView<Intersection> intersections,
+                       BufferView<SurfacePoint> points,
+                       BufferView<RayDifferential> new_ray_differentials);
+
+void test_rasterize_primary(bool use_gpu);
@@ -1,29 +1,123 @@
 #include "redner.h"
 #include "active_pixels.h"
+#include "alias_table.h"
 #include "area_light.h"
 #include "automatic_uv_map.h"
 #include "camera.h"
 #include "camera_distortion.h"
+#include "deferred_shading.h"
 #include "envmap.h"
+#include "light_bvh.h"
 #include "load_serialized.h"
 #include "material.h"
+#include "parallel.h"
 #include "pathtracer.h"
+#include "primary_hit_cache.h"
 #include "ptr.h"
+#include "rasterizer.h"
 #include "scene.h"
 #include "shape.h"
+#include "spherical_harmonics.h"
+#include "validation.h"
 
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include <string>
+#include <stdexcept>
+
 namespace py = pybind11;
 
+// The DLPack tensor layout (https://github.com/dmlc/dlpack), so that
+// pyredner can hand tensors over with their dtype, strides and device
+// instead of a bare address.
+struct DLDevice {
+    int32_t device_type;
+    int32_t device_id;
+};
+struct DLDataType {
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+};
+struct DLTensor {
+    void *data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t *shape;
+    int64_t *strides;
+    uint64_t byte_offset;
+};
+struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void *manager_ctx;
+    void (*deleter)(DLManagedTensor *self);
+};
+enum {
+    kDLInt = 0,
+    kDLFloat = 2
+};
+enum {
+    kDLCPU = 1,
+    kDLCUDA = 2,
+    kDLCUDAHost = 3,
+    kDLCUDAManaged = 13
+};
+
+/// The capsule is only borrowed: the tensor that produced it has to stay
+/// alive as long as redner uses the pointer, as with a raw data_ptr().
+template <typename T>
+ptr<T> ptr_from_dlpack(const py::capsule &capsule, uint8_t type_code) {
+    auto managed = (DLManagedTensor*)PyCapsule_GetPointer(capsule.ptr(), "dltensor");
+    if (managed == nullptr) {
+        PyErr_Clear();
+        throw std::runtime_error("Expected an unconsumed DLPack capsule");
+    }
+    const auto &tensor = managed->dl_tensor;
+    if (tensor.dtype.code != type_code || tensor.dtype.bits != 32 ||
+            tensor.dtype.lanes != 1) {
+        throw std::runtime_error(type_code == kDLFloat ?
+            "Expected a float32 tensor" : "Expected an int32 tensor");
+    }
+    if (tensor.device.device_type != kDLCPU &&
+            tensor.device.device_type != kDLCUDA &&
+            tensor.device.device_type != kDLCUDAHost &&
+            tensor.device.device_type != kDLCUDAManaged) {
+        throw std::runtime_error("Unsupported tensor device type " +
+            std::to_string(tensor.device.device_type));
+    }
+    // Null strides mean compact row-major. Strides of unit dimensions
+    // don't matter.
+    if (tensor.strides != nullptr) {
+        auto expected_stride = int64_t(1);
+        for (int d = tensor.ndim - 1; d >= 0; d--) {
+            if (tensor.shape[d] != 1 && tensor.strides[d] != expected_stride) {
+                throw std::runtime_error("Expected a contiguous tensor");
+            }
+            expected_stride *= tensor.shape[d];
+        }
+    }
+    return ptr<T>((T*)((char*)tensor.data + tensor.byte_offset));
+}
+
+ptr<float> float_ptr_from_dlpack(const py::capsule &capsule) {
+    return ptr_from_dlpack<float>(capsule, kDLFloat);
+}
+
+ptr<int> int_ptr_from_dlpack(const py::capsule &capsule) {
+    return ptr_from_dlpack<int>(capsule, kDLInt);
+}
+
 PYBIND11_MODULE(redner, m) {
     m.doc() = "Redner"; // optional module docstring
 
     py::class_<ptr<float>>(m, "float_ptr")
-        .def(py::init<std::size_t>());
+        .def(py::init<std::size_t>())
+        .def(py::init(&float_ptr_from_dlpack));
     py::class_<ptr<int>>(m, "int_ptr")
-        .def(py::init<std::size_t>());
+        .def(py::init<std::size_t>())
+        .def(py::init(&int_ptr_from_dlpack));
 
     py::enum_<CameraType>(m, "CameraType")
         .value("perspective", CameraType::Perspective)
@@ -45,7 +139,8 @@ PYBIND11_MODULE(redner, m) {
                       float, // clip_near
                       CameraType,
                       Vector2i, // viewport_beg
-                      Vector2i>()) // viewport_end
+                      Vector2i, // viewport_end
+                      int>()) // distortion_lut_resolution
         .def_readonly("use_look_at", &Camera::use_look_at)
         .def("has_distortion_params", &Camera::has_distortion_params);
 
@@ -59,6 +154,20 @@ PYBIND11_MODULE(redner, m) {
                       ptr<float>, // cam_to_ndc
                       ptr<float>>()); // distortion_params
 
+    py::enum_<BuildQuality>(m, "BuildQuality")
+        .value("auto", BuildQuality::Auto)
+        .value("low", BuildQuality::Low)
+        .value("medium", BuildQuality::Medium)
+        .value("high", BuildQuality::High);
+
+    py::class_<SceneBuildOptions>(m, "SceneBuildOptions")
+        .def(py::init<>())
+        .def_readwrite("quality", &SceneBuildOptions::quality)
+        .def_readwrite("expected_num_rays", &SceneBuildOptions::expected_num_rays)
+        .def_readwrite("dynamic", &SceneBuildOptions::dynamic)
+        .def_readwrite("compact", &SceneBuildOptions::compact)
+        .def_readwrite("robust", &SceneBuildOptions::robust);
+
     py::class_<Scene>(m, "Scene")
         .def(py::init<const Camera &,
                       const std::vector<const Shape*> &,
@@ -67,10 +176,24 @@ PYBIND11_MODULE(redner, m) {
                       const std::shared_ptr<const EnvironmentMap> &,
                       bool,
                       int,
+                      bool, // use_primary_edge_sampling
+                      bool, // use_secondary_edge_sampling
+                      bool>()) // use_light_bvh
+        .def(py::init<const Camera &,
+                      const std::vector<const Shape*> &,
+                      const std::vector<const Material*> &,
+                      const std::vector<const AreaLight*> &,
+                      const std::shared_ptr<const EnvironmentMap> &,
                       bool,
-                      bool>())
+                      int,
+                      bool, // use_primary_edge_sampling
+                      bool, // use_secondary_edge_sampling
+                      bool, // use_light_bvh
+                      const SceneBuildOptions &>())
         .def_readonly("max_generic_texture_dimension",
-            &Scene::max_generic_texture_dimension);
+            &Scene::max_generic_texture_dimension)
+        .def_readonly("build_time", &Scene::build_time)
+        .def_readonly("trace_time", &Scene::trace_time);
 
     py::class_<DScene, std::shared_ptr<DScene>>(m, "DScene")
         .def(py::init<const DCamera &,
@@ -99,6 +222,11 @@ PYBIND11_MODULE(redner, m) {
         .def_readonly("num_vertices", &Shape::num_vertices)
         .def_readonly("num_uv_vertices", &Shape::num_uv_vertices)
         .def_readonly("num_normal_vertices", &Shape::num_normal_vertices)
+        .def_readwrite("vertices_padded", &Shape::vertices_padded)
+        .def_readwrite("differentiable", &Shape::differentiable)
+        .def_readonly("prototype_id", &Shape::prototype_id)
+        .def_readonly("has_transform", &Shape::has_transform)
+        .def("set_instance", &Shape::set_instance)
         .def("has_uvs", &Shape::has_uvs)
         .def("has_normals", &Shape::has_normals)
         .def("has_colors", &Shape::has_colors);
@@ -107,7 +235,8 @@ PYBIND11_MODULE(redner, m) {
         .def(py::init<ptr<float>,
                       ptr<float>,
                       ptr<float>,
-                      ptr<float>>());
+                      ptr<float>>())
+        .def("set_instance", &DShape::set_instance);
 
     py::class_<Texture1>(m, "Texture1")
         .def(py::init<const std::vector<ptr<float>> &,
@@ -170,16 +299,37 @@ PYBIND11_MODULE(redner, m) {
         .def(py::init<Texture3,   // values
                       ptr<float>, // env_to_world
                       ptr<float>, // world_to_env
-                      ptr<float>, // sample_cdf_ys
-                      ptr<float>, // sample_cdf_xs
                       Real, // pdf_norm
                       bool>()) // directly_visible
+        .def(py::init<ptr<float>, // sh_coeffs
+                      int, // sh_num_bands
+                      ptr<float>, // env_to_world
+                      ptr<float>, // world_to_env
+                      bool>()) // directly_visible
+        .def_readonly("sh_num_bands", &EnvironmentMap::sh_num_bands)
         .def("get_levels", &EnvironmentMap::get_levels)
         .def("get_size", &EnvironmentMap::get_size);
     py::class_<DEnvironmentMap, std::shared_ptr<DEnvironmentMap>>(m, "DEnvironmentMap")
         .def(py::init<Texture3,       // values
+                      ptr<float>>())  // world_to_env
+        .def(py::init<ptr<float>,     // sh_coeffs
                       ptr<float>>()); // world_to_env
 
+    py::class_<DeferredLights>(m, "DeferredLights")
+        .def(py::init<ptr<float>, // ambient_intensities
+                      int, // num_ambient_lights
+                      ptr<float>, // point_positions
+                      ptr<float>, // point_intensities
+                      int, // num_point_lights
+                      ptr<float>, // directional_directions
+                      ptr<float>, // directional_intensities
+                      int, // num_directional_lights
+                      ptr<float>, // spot_positions
+                      ptr<float>, // spot_directions
+                      ptr<float>, // spot_exponents
+                      ptr<float>, // spot_intensities
+                      int>()); // num_spot_lights
+
     py::enum_<Channels>(m, "channels")
         .value("radiance", Channels::radiance)
         .value("alpha", Channels::alpha)
@@ -213,7 +363,22 @@ PYBIND11_MODULE(redner, m) {
                       bool // sample_pixel_center
                       >())
         .def_readwrite("seed", &RenderOptions::seed)
-        .def_readwrite("num_samples", &RenderOptions::num_samples);
+        .def_readwrite("num_samples", &RenderOptions::num_samples)
+        .def_readwrite("use_rasterization", &RenderOptions::use_rasterization)
+        .def_readwrite("num_primary_edge_samples", &RenderOptions::num_primary_edge_samples)
+        .def_readwrite("primary_edge_sample_ratio", &RenderOptions::primary_edge_sample_ratio)
+        .def_readwrite("num_secondary_edge_samples", &RenderOptions::num_secondary_edge_samples)
+        .def_readwrite("secondary_edge_sample_ratio", &RenderOptions::secondary_edge_sample_ratio)
+        .def_readwrite("primary_hit_cache", &RenderOptions::primary_hit_cache);
+
+    py::class_<PrimaryHitCache, std::shared_ptr<PrimaryHitCache>>(m, "PrimaryHitCache")
+        .def(py::init<int>(), py::arg("max_entries") = 2)
+        .def_readwrite("geometry_version", &PrimaryHitCache::geometry_version)
+        .def_readwrite("max_entries", &PrimaryHitCache::max_entries)
+        .def_readonly("num_hits", &PrimaryHitCache::num_hits)
+        .def_readonly("num_misses", &PrimaryHitCache::num_misses)
+        .def("num_entries", &PrimaryHitCache::num_entries)
+        .def("clear", &PrimaryHitCache::clear);
 
     py::class_<Vector2i>(m, "Vector2i")
         .def(py::init<int, int>())
@@ -255,10 +420,15 @@ PYBIND11_MODULE(redner, m) {
     m.def("copy_texture_atlas", &copy_texture_atlas, "");
 
     m.def("render", &render, "");
+    m.def("set_pin_worker_threads", &set_pin_worker_threads, "");
+    m.def("find_non_finite", &find_non_finite, "");
+    m.def("shade_deferred", &shade_deferred, "");
+    m.def("d_shade_deferred", &d_shade_deferred, "");
 
     /// Tests
     m.def("test_sample_primary_rays", &test_sample_primary_rays, "");
     m.def("test_scene_intersect", &test_scene_intersect, "");
+    m.def("test_rasterize_primary", &test_rasterize_primary, "");
     m.def("test_sample_point_on_light", &test_sample_point_on_light, "");
     m.def("test_active_pixels", &test_active_pixels, "");
     m.def("test_camera_derivatives", &test_camera_derivatives, "");
@@ -266,7 +436,17 @@ PYBIND11_MODULE(redner, m) {
     m.def("test_d_bsdf", &test_d_bsdf, "");
     m.def("test_d_bsdf_sample", &test_d_bsdf_sample, "");
     m.def("test_d_bsdf_pdf", &test_d_bsdf_pdf, "");
+    m.def("test_material_features", &test_material_features, "");
+    m.def("test_channel_sets", &test_channel_sets, "");
+    m.def("test_deferred_shading", &test_deferred_shading, "");
     m.def("test_d_intersect", &test_d_intersect, "");
     m.def("test_d_sample_shape", &test_d_sample_shape, "");
     m.def("test_atomic", &test_atomic, "");
+    m.def("test_primary_hit_cache", &test_primary_hit_cache, "");
+    m.def("test_light_bvh", &test_light_bvh, "");
+    m.def("test_alias_table", &test_alias_table, "");
+    m.def("test_envmap_sample", &test_envmap_sample, "");
+    m.def("test_envmap_sh", &test_envmap_sh, "");
+    m.def("test_spherical_harmonics", &test_spherical_harmonics, "");
+    m.def("test_find_non_finite", &test_find_non_finite, "");
 }
@@ -11,8 +11,12 @@
 #include <thrust/reduce.h>
 #include <thrust/transform_scan.h>
 #include <thrust/binary_search.h>
+#include <thrust/scan.h>
 #include <embree3/rtcore_ray.h>
 #include <algorithm>
+#include <chrono>
+#include <future>
+#include <stdexcept>
 
 struct vector3f_min {
     DEVICE Vector3f operator()(const Vector3f &a, const Vector3f &b) const {
@@ -26,38 +30,169 @@ struct vector3f_max {
     }
 };
 
-struct area_computer {
+struct material_classifier {
     DEVICE void operator()(int idx) {
-        area[idx] = get_area(shape, idx);
+        materials[idx].features = classify_material(materials[idx]);
     }
 
-    Shape shape;
-    Real *area;
+    Material *materials;
 };
 
-Real compute_area_cdf(const Shape &shape, Real *cdf, bool use_gpu) {
-    parallel_for(area_computer{shape, cdf}, shape.num_triangles, use_gpu);
-    // cdf now stores the areas
-    // First ask for the total area
-    #pragma warning(disable : 940 969)
-    auto total_area = DISPATCH(use_gpu, thrust::reduce,
-        cdf, cdf + shape.num_triangles, Real(0), thrust::plus<Real>());
-    #pragma warning(default : 940 969)
-    // In-place prefix sum
-    // XXX: for some reason the program crashes when I use exclusive_scan
-    //thrust::exclusive_scan(dev_ptr, dev_ptr + shape.num_triangles, dev_ptr);
-    DISPATCH(use_gpu, thrust::transform_exclusive_scan,
-             cdf, cdf + shape.num_triangles, cdf,
-             thrust::identity<Real>(), Real(0), thrust::plus<Real>());
-    // Normalize the CDF by total area
-    DISPATCH(use_gpu, thrust::transform,
-             cdf, cdf + shape.num_triangles,
-             thrust::make_constant_iterator(total_area),
-             cdf, thrust::divides<Real>());
-    if (use_gpu) {
-        cuda_synchronize();
+struct light_triangle_area_computer {
+    DEVICE void operator()(int idx) {
+        // Find the light owning this triangle
+        auto light_ptr = thrust::upper_bound(thrust::seq,
+            light_tri_offsets, light_tri_offsets + num_area_lights, idx);
+        auto light_id = (int)(light_ptr - light_tri_offsets - 1);
+        const auto &shape = shapes[area_lights[light_id].shape_id];
+        light_ids[idx] = light_id;
+        areas[idx] = get_area(shape, idx - light_tri_offsets[light_id]);
+    }
+
+    const Shape *shapes;
+    const AreaLight *area_lights;
+    const int *light_tri_offsets;
+    const int num_area_lights;
+    int *light_ids;
+    Real *areas;
+};
+
+struct light_distribution_builder {
+    DEVICE void operator()(int light_id) {
+        const auto &light = area_lights[light_id];
+        auto num_triangles = shapes[light.shape_id].num_triangles;
+        auto offset = light_tri_offsets[light_id];
+        // area_cdfs holds the unnormalized exclusive prefix sum of the areas
+        auto area_sum = num_triangles > 0 ?
+            area_cdfs[offset + num_triangles - 1] + areas[offset + num_triangles - 1] : Real(0);
+        light_areas[light_id] = area_sum;
+        // Power of an area light
+        light_pmf[light_id] = area_sum * luminance(light.intensity) * Real(M_PI);
+        build_alias_table(areas + offset, num_triangles, area_sum,
+                          area_aliases + offset, scratch + offset);
+    }
+
+    const Shape *shapes;
+    const AreaLight *area_lights;
+    const int *light_tri_offsets;
+    const Real *areas;
+    const Real *area_cdfs;
+    Real *light_areas;
+    Real *light_pmf;
+    AliasEntry *area_aliases;
+    int *scratch;
+};
+
+struct area_cdf_normalizer {
+    DEVICE void operator()(int idx) {
+        area_cdfs[idx] /= light_areas[light_ids[idx]];
+    }
+
+    const int *light_ids;
+    const Real *light_areas;
+    Real *area_cdfs;
+};
+
+/// Embree triangle mesh of the shape, before its transform
+inline RTCGeometry new_embree_mesh(RTCDevice device, const Shape &shape) {
+    auto mesh = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    if (shape.vertices_padded) {
+        // Embree reads the vertices in place
+        rtcSetSharedGeometryBuffer(
+            mesh, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+            shape.vertices, 0, 3 * sizeof(float), shape.num_vertices);
+    } else {
+        // Copy the vertices into Embree
+        // (since Embree requires the padding after the last vertex)
+        auto vertices = (Vector4f*)rtcSetNewGeometryBuffer(
+            mesh, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+            sizeof(Vector4f), shape.num_vertices);
+        for (auto i = 0; i < shape.num_vertices; i++) {
+            auto vertex = get_local_vertex(shape, i);
+            vertices[i] = Vector4f{vertex[0], vertex[1], vertex[2], 0.f};
+        }
+    }
+    // The indices need no padding, Embree always reads them in place
+    rtcSetSharedGeometryBuffer(
+        mesh, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+        shape.indices, 0, 3 * sizeof(int), shape.num_triangles);
+    rtcSetGeometryVertexAttributeCount(mesh, 1);
+    rtcCommitGeometry(mesh);
+    return mesh;
+}
+
+/// Attach an instance of prototype_scene placed by the transform of shape
+/// to scene as geometry geom_id.
+inline void attach_embree_instance(RTCDevice device,
+                                   RTCScene scene,
+                                   RTCScene prototype_scene,
+                                   const Shape &shape,
+                                   int geom_id) {
+    auto instance = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+    rtcSetGeometryInstancedScene(instance, prototype_scene);
+    auto xfm = shape.has_transform ? shape.to_world : Matrix4x4f::identity();
+    // The first three rows
+    rtcSetGeometryTransform(instance, 0, RTC_FORMAT_FLOAT3X4_ROW_MAJOR, &xfm.data[0][0]);
+    rtcCommitGeometry(instance);
+    rtcAttachGeometryByID(scene, instance, (unsigned int)geom_id);
+    rtcReleaseGeometry(instance);
+}
+
+/// Adds the lifetime of the timer to seconds
+struct ScopedTimer {
+    ScopedTimer(double &seconds)
+        : seconds(seconds), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
     }
-    return total_area;
+
+    double &seconds;
+    std::chrono::steady_clock::time_point start;
+};
+
+inline RTCBuildQuality embree_build_quality(const SceneBuildOptions &options,
+                                            const std::vector<const Shape*> &shapes) {
+    switch (options.quality) {
+        case BuildQuality::Low: return RTC_BUILD_QUALITY_LOW;
+        case BuildQuality::Medium: return RTC_BUILD_QUALITY_MEDIUM;
+        case BuildQuality::High: return RTC_BUILD_QUALITY_HIGH;
+        default: break;
+    }
+    // A better BVH only pays off its longer build if we trace
+    // many rays per triangle we build the BVH over. The thresholds are
+    // rough guesses, which is why Auto is opt-in and High stays the default.
+    if (options.expected_num_rays <= 0) {
+        return RTC_BUILD_QUALITY_HIGH;
+    }
+    auto num_triangles = int64_t(0);
+    for (const Shape *shape : shapes) {
+        if (shape->prototype_id < 0) {
+            num_triangles += shape->num_triangles;
+        }
+    }
+    auto rays_per_triangle =
+        double(options.expected_num_rays) / double(std::max(num_triangles, int64_t(1)));
+    if (rays_per_triangle < 16) {
+        return RTC_BUILD_QUALITY_LOW;
+    } else if (rays_per_triangle < 256) {
+        return RTC_BUILD_QUALITY_MEDIUM;
+    }
+    return RTC_BUILD_QUALITY_HIGH;
+}
+
+inline RTCSceneFlags embree_scene_flags(const SceneBuildOptions &options) {
+    auto flags = int(RTC_SCENE_FLAG_NONE);
+    if (options.dynamic) {
+        flags |= RTC_SCENE_FLAG_DYNAMIC;
+    }
+    if (options.compact) {
+        flags |= RTC_SCENE_FLAG_COMPACT;
+    }
+    if (options.robust) {
+        flags |= RTC_SCENE_FLAG_ROBUST;
+    }
+    return RTCSceneFlags(flags);
 }
 
 Scene::Scene(const Camera &camera,
@@ -68,13 +203,28 @@ Scene::Scene(const Camera &camera,
              bool use_gpu,
              int gpu_index,
              bool use_primary_edge_sampling,
-             bool use_secondary_edge_sampling)
+             bool use_secondary_edge_sampling,
+             bool use_light_bvh,
+             const SceneBuildOptions &build_options)
         : camera(camera), use_gpu(use_gpu), gpu_index(gpu_index),
           use_primary_edge_sampling(use_primary_edge_sampling),
-          use_secondary_edge_sampling(use_secondary_edge_sampling) {
+          use_secondary_edge_sampling(use_secondary_edge_sampling),
+          use_light_bvh(use_light_bvh) {
 #ifdef __NVCC__
     int old_device_id = -1;
 #endif
+    for (const Shape *shape : shapes) {
+        if (shape->prototype_id >= 0 &&
+                (shape->prototype_id >= (int)shapes.size() ||
+                 shapes[shape->prototype_id]->prototype_id >= 0 ||
+                 shapes[shape->prototype_id]->vertices != shape->vertices ||
+                 shapes[shape->prototype_id]->indices != shape->indices ||
+                 shapes[shape->prototype_id]->num_triangles != shape->num_triangles)) {
+            throw std::runtime_error("Invalid shape instance: the prototype should be "
+                "a shape sharing the buffers of the instance that is not an instance itself");
+        }
+    }
+    std::future<void> embree_build;
     if (use_gpu) {
 #ifdef __NVCC__
         // Initialize the scene in another thread, since optix prime calls cudaSetDeviceFlags
@@ -83,6 +233,7 @@ Scene::Scene(const Camera &camera,
         if (gpu_index != -1) {
             checkCuda(cudaSetDevice(gpu_index));
         }
+        ScopedTimer timer(build_time);
         // Initialize Optix prime scene
         // FIXME: optix context creation calls cudaDeviceSetFlags(), but we already
         // activate CUDA before this. Ideally we want to move context creation to an initialization
@@ -97,6 +248,9 @@ Scene::Scene(const Camera &camera,
         transforms.resize(shapes.size(), Matrix4x4f::identity());
         for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
             const Shape *shape = shapes[shape_id];
+            if (shape->prototype_id >= 0) {
+                continue;
+            }
             optix_models[shape_id] = optix_context->createModel();
             optix_models[shape_id]->setTriangles(
                 shape->num_triangles, RTP_BUFFER_TYPE_CUDA_LINEAR, shape->indices,
@@ -104,9 +258,21 @@ Scene::Scene(const Camera &camera,
             optix_models[shape_id]->update(RTP_MODEL_HINT_ASYNC);
             optix_instances[shape_id] = optix_models[shape_id]->getRTPmodel();
         }
+        // Instances reuse the model of their prototype
+        for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
+            const Shape *shape = shapes[shape_id];
+            if (shape->prototype_id >= 0) {
+                optix_instances[shape_id] = optix_instances[shape->prototype_id];
+            }
+            if (shape->has_transform) {
+                transforms[shape_id] = shape->to_world;
+            }
+        }
 
         for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
-            optix_models[shape_id]->finish();
+            if (shapes[shape_id]->prototype_id < 0) {
+                optix_models[shape_id]->finish();
+            }
         }
 
         optix_scene = optix_context->createModel();
@@ -128,30 +294,72 @@ Scene::Scene(const Camera &camera,
         // Initialize Embree scene
         embree_device = rtcNewDevice(nullptr);
         embree_scene = rtcNewScene(embree_device);
-        rtcSetSceneBuildQuality(embree_scene, RTC_BUILD_QUALITY_HIGH);
-        rtcSetSceneFlags(embree_scene, RTC_SCENE_FLAG_ROBUST);
-        // Copy the scene into Embree (since Embree requires 16 bytes alignment)
-        for (const Shape *shape : shapes) {
-            auto mesh = rtcNewGeometry(embree_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-            auto vertices = (Vector4f*)rtcSetNewGeometryBuffer(
-                mesh, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
-                sizeof(Vector4f), shape->num_vertices);
-            for (auto i = 0; i < shape->num_vertices; i++) {
-                auto vertex = get_vertex(*shape, i);
-                vertices[i] = Vector4f{vertex[0], vertex[1], vertex[2], 0.f};
+        auto build_quality = embree_build_quality(build_options, shapes);
+        auto scene_flags = embree_scene_flags(build_options);
+        rtcSetSceneBuildQuality(embree_scene, build_quality);
+        rtcSetSceneFlags(embree_scene, scene_flags);
+        // Nothing else in the constructor reads the Embree scene, so we build it
+        // in the background (Embree uses its own threads for the BVH build)
+        // while the rest of the scene is set up on the calling thread.
+        // The thread pool is not running while a scene is constructed,
+        // so the CPU parallel_for calls below run serially.
+        // Joined at the end of the constructor.
+        embree_build = std::async(std::launch::async, [this, &shapes, build_quality, scene_flags]() {
+            ScopedTimer timer(build_time);
+            // The shapes with a transform or with instances go into their own
+            // scenes, which are instanced into the top level scene together with
+            // the instances. The other shapes are attached directly.
+            // The geometry ids are the shape ids.
+            embree_prototype_scenes.resize(shapes.size(), nullptr);
+            for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
+                const Shape *shape = shapes[shape_id];
+                auto base_id = shape->prototype_id >= 0 ? shape->prototype_id : shape_id;
+                if ((shape->prototype_id >= 0 || shape->has_transform) &&
+                        embree_prototype_scenes[base_id] == nullptr) {
+                    auto prototype_scene = rtcNewScene(embree_device);
+                    rtcSetSceneBuildQuality(prototype_scene, build_quality);
+                    rtcSetSceneFlags(prototype_scene, scene_flags);
+                    embree_prototype_scenes[base_id] = prototype_scene;
+                }
             }
-            auto triangles = (Vector3i*) rtcSetNewGeometryBuffer(
-                mesh, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
-                sizeof(Vector3i), shape->num_triangles);
-            for (auto i = 0; i < shape->num_triangles; i++) {
-                triangles[i] = get_indices(*shape, i);
+            for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
+                const Shape *shape = shapes[shape_id];
+                if (shape->prototype_id >= 0) {
+                    continue;
+                }
+                auto mesh = new_embree_mesh(embree_device, *shape);
+                auto prototype_scene = embree_prototype_scenes[shape_id];
+                if (prototype_scene != nullptr) {
+                    rtcAttachGeometry(prototype_scene, mesh);
+                    rtcCommitScene(prototype_scene);
+                } else {
+                    rtcAttachGeometryByID(embree_scene, mesh, (unsigned int)shape_id);
+                }
+                rtcReleaseGeometry(mesh);
             }
-            rtcSetGeometryVertexAttributeCount(mesh, 1);
-            rtcCommitGeometry(mesh);
-            rtcAttachGeometry(embree_scene, mesh);
-            rtcReleaseGeometry(mesh);
-        }
-        rtcCommitScene(embree_scene);
+            for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
+                const Shape *shape = shapes[shape_id];
+                auto base_id = shape->prototype_id >= 0 ? shape->prototype_id : shape_id;
+                if (embree_prototype_scenes[base_id] != nullptr) {
+                    attach_embree_instance(embree_device,
+                                           embree_scene,
+                                           embree_prototype_scenes[base_id],
+                                           *shape,
+                                           shape_id);
+                }
+            }
+            rtcCommitScene(embree_scene);
+        });
+    }
+
+    // Bake lens distortion into lookup tables if requested
+    if (camera.has_distortion_params() && camera.distortion_lut_resolution > 0) {
+        auto resolution = camera.distortion_lut_resolution;
+        distortion_lut = Buffer<DistortionLUTEntry>(use_gpu, 2 * resolution * resolution);
+        build_distortion_lut(this->camera.distortion_params,
+                             resolution,
+                             distortion_lut.view(0, distortion_lut.size()),
+                             use_gpu);
     }
 
     // Compute bounding sphere
@@ -164,21 +372,49 @@ Scene::Scene(const Camera &camera,
         -std::numeric_limits<float>::infinity(),
         -std::numeric_limits<float>::infinity(),
         -std::numeric_limits<float>::infinity()};
+    // The bounds of the vertex buffers shared by instances are computed once,
+    // the transformed shapes take the bounds of their transformed local bounds.
+    auto local_min_pos = std::vector<Vector3f>(shapes.size());
+    auto local_max_pos = std::vector<Vector3f>(shapes.size());
+    for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
+        const auto &shape = *shapes[shape_id];
+        if (shape.prototype_id < 0) {
+            const auto *vertices = (const Vector3f *)shape.vertices;
+            local_min_pos[shape_id] = DISPATCH(use_gpu, thrust::reduce,
+                vertices, vertices + shape.num_vertices,
+                Vector3f{std::numeric_limits<float>::infinity(),
+                         std::numeric_limits<float>::infinity(),
+                         std::numeric_limits<float>::infinity()},
+                vector3f_min{});
+            local_max_pos[shape_id] = DISPATCH(use_gpu, thrust::reduce,
+                vertices, vertices + shape.num_vertices,
+                Vector3f{-std::numeric_limits<float>::infinity(),
+                         -std::numeric_limits<float>::infinity(),
+                         -std::numeric_limits<float>::infinity()},
+                vector3f_max{});
+        }
+    }
     for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
         const auto &shape = *shapes[shape_id];
-        const auto *vertices = (const Vector3f *)shape.vertices;
-        auto min_pos = DISPATCH(use_gpu, thrust::reduce,
-            vertices, vertices + shape.num_vertices,
-            Vector3f{std::numeric_limits<float>::infinity(),
-                     std::numeric_limits<float>::infinity(),
-                     std::numeric_limits<float>::infinity()},
-            vector3f_min{});
-        auto max_pos = DISPATCH(use_gpu, thrust::reduce,
-            vertices, vertices + shape.num_vertices,
-            Vector3f{-std::numeric_limits<float>::infinity(),
-                     -std::numeric_limits<float>::infinity(),
-                     -std::numeric_limits<float>::infinity()},
-            vector3f_max{});
+        auto base_id = shape.prototype_id >= 0 ? shape.prototype_id : shape_id;
+        auto min_pos = local_min_pos[base_id];
+        auto max_pos = local_max_pos[base_id];
+        if (shape.has_transform && shape.num_vertices > 0) {
+            auto corner_min = min_pos;
+            auto corner_max = max_pos;
+            min_pos = Vector3f{std::numeric_limits<float>::infinity(),
+                               std::numeric_limits<float>::infinity(),
+                               std::numeric_limits<float>::infinity()};
+            max_pos = -min_pos;
+            for (int corner = 0; corner < 8; corner++) {
+                auto p = xfm_point(shape.to_world, Vector3f{
+                    (corner & 1) ? corner_max.x : corner_min.x,
+                    (corner & 2) ? corner_max.y : corner_min.y,
+                    (corner & 4) ? corner_max.z : corner_min.z});
+                min_pos = vector3f_min{}(min_pos, p);
+                max_pos = vector3f_max{}(max_pos, p);
+            }
+        }
         scene_min_pos = Vector3f{min(min_pos.x, scene_min_pos.x),
                                  min(min_pos.y, scene_min_pos.y),
                                  min(min_pos.y, scene_min_pos.z)};
@@ -194,45 +430,138 @@ Scene::Scene(const Camera &camera,
         bsphere.radius = 0;
     }
 
+    // Flatten the scene into array
+    // TODO: use cudaMemcpyAsync for gpu code path
+    if (shapes.size() > 0) {
+        this->shapes = Buffer<Shape>(use_gpu, shapes.size());
+        for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
+            this->shapes[shape_id] = *shapes[shape_id];
+        }
+    }
+    if (materials.size() > 0) {
+        this->materials = Buffer<Material>(use_gpu, materials.size());
+        for (int material_id = 0; material_id < (int)materials.size(); material_id++) {
+            this->materials[material_id] = *materials[material_id];
+        }
+        // Select the specialized shading kernels. Reads the texels, so run it
+        // where they live.
+        parallel_for(material_classifier{this->materials.begin()},
+            materials.size(), use_gpu);
+    }
+    if (area_lights.size() > 0) {
+        this->area_lights = Buffer<AreaLight>(use_gpu, area_lights.size());
+        for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
+            this->area_lights[light_id] = *area_lights[light_id];
+        }
+    }
+
+    if (envmap.get() != nullptr) {
+        if (use_gpu) {
+#ifdef __NVCC__
+            checkCuda(cudaMallocManaged(&this->envmap, sizeof(EnvironmentMap)));
+#else
+            assert(false);
+#endif
+        } else {
+            this->envmap = new EnvironmentMap;
+        }
+        *(this->envmap) = *envmap;
+        if (envmap->sh_num_bands > 0) {
+            // Importance sample a tabulation of the spherical harmonics,
+            // fine enough for the highest band
+            auto height = max(16, 8 * envmap->sh_num_bands);
+            auto width = 2 * height;
+            tabulate_envmap_sh(*envmap, width, height, envmap_sh_texels, use_gpu);
+            this->envmap->values = Texture3{{envmap_sh_texels.begin()}, {width}, {height}, 3, nullptr};
+        }
+        auto total_weight = build_envmap_alias_tables(
+            *(this->envmap), envmap_alias_ys, envmap_alias_xs, use_gpu);
+        this->envmap->sample_alias_ys = envmap_alias_ys.begin();
+        this->envmap->sample_alias_xs = envmap_alias_xs.begin();
+        if (envmap->sh_num_bands > 0) {
+            // Same normalization as the frontends
+            const auto &values = this->envmap->values;
+            this->envmap->pdf_norm = (values.width[0] * values.height[0]) /
+                (total_weight * 2 * square(Real(M_PI)));
+        }
+    } else {
+        this->envmap = nullptr;
+    }
+
     if (area_lights.size() > 0 || envmap.get() != nullptr) {
-        auto num_lights = (int)area_lights.size();
+        auto num_area_lights = (int)area_lights.size();
+        auto num_lights = num_area_lights;
         if (envmap.get() != nullptr) {
             num_lights++;
         }
-        auto envmap_id = (int)area_lights.size();
+        auto envmap_id = num_area_lights;
         // Build Light CDFs
         light_pmf = Buffer<Real>(use_gpu, num_lights);
-        light_areas = Buffer<Real>(use_gpu, area_lights.size());
-        // For each area light we build a CDF using area of triangles
-        area_cdfs = Buffer<Real*>(use_gpu, area_lights.size());
+        light_areas = Buffer<Real>(use_gpu, num_area_lights);
+        // For each area light we build a CDF and an alias table using area of triangles,
+        // the tables of all lights are stored back to back in the pools
+        area_cdfs = Buffer<Real*>(use_gpu, num_area_lights);
+        area_aliases = Buffer<AliasEntry*>(use_gpu, num_area_lights);
+        Buffer<int> light_tri_offsets(use_gpu, num_area_lights);
         auto total_light_triangles = 0;
-        for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
-            const AreaLight &light = *area_lights[light_id];
-            const Shape &shape = *shapes[light.shape_id];
-            total_light_triangles += shape.num_triangles;
+        for (int light_id = 0; light_id < num_area_lights; light_id++) {
+            light_tri_offsets[light_id] = total_light_triangles;
+            total_light_triangles += shapes[area_lights[light_id]->shape_id]->num_triangles;
         }
         area_cdf_pool = Buffer<Real>(use_gpu, total_light_triangles);
-        auto cur_tri_id = 0;
-        for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
-            const AreaLight &light = *area_lights[light_id];
-            const Shape &shape = *shapes[light.shape_id];
-            area_cdfs[light_id] = area_cdf_pool.begin() + cur_tri_id;
-            cur_tri_id += shape.num_triangles;
+        area_alias_pool = Buffer<AliasEntry>(use_gpu, total_light_triangles);
+        for (int light_id = 0; light_id < num_area_lights; light_id++) {
+            area_cdfs[light_id] = area_cdf_pool.begin() + light_tri_offsets[light_id];
+            area_aliases[light_id] = area_alias_pool.begin() + light_tri_offsets[light_id];
+        }
+        if (num_area_lights > 0) {
+            // Areas of the triangles of all lights in one pass, tagged by light id
+            Buffer<int> light_tri_ids(use_gpu, total_light_triangles);
+            Buffer<Real> light_tri_areas(use_gpu, total_light_triangles);
+            Buffer<int> scratch(use_gpu, total_light_triangles);
+            if (total_light_triangles > 0) {
+                parallel_for(light_triangle_area_computer{
+                    this->shapes.begin(),
+                    this->area_lights.begin(),
+                    light_tri_offsets.begin(),
+                    num_area_lights,
+                    light_tri_ids.begin(),
+                    light_tri_areas.begin()}, total_light_triangles, use_gpu);
+                // Segmented prefix sum of the areas
+                DISPATCH(use_gpu, thrust::exclusive_scan_by_key,
+                         light_tri_ids.begin(), light_tri_ids.end(),
+                         light_tri_areas.begin(), area_cdf_pool.begin());
+            }
+            // Total area & power of each light, and the alias tables
+            parallel_for(light_distribution_builder{
+                this->shapes.begin(),
+                this->area_lights.begin(),
+                light_tri_offsets.begin(),
+                light_tri_areas.begin(),
+                area_cdf_pool.begin(),
+                light_areas.begin(),
+                light_pmf.begin(),
+                area_alias_pool.begin(),
+                scratch.begin()}, num_area_lights, use_gpu);
+            if (total_light_triangles > 0) {
+                // Normalize the CDFs by total area
+                parallel_for(area_cdf_normalizer{
+                    light_tri_ids.begin(),
+                    light_areas.begin(),
+                    area_cdf_pool.begin()}, total_light_triangles, use_gpu);
+            }
+            if (use_gpu) {
+                cuda_synchronize();
+            }
         }
         auto total_importance = Real(0);
-        for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
-            const AreaLight &light = *area_lights[light_id];
-            const Shape &shape = *shapes[light.shape_id];
-            auto area_sum = compute_area_cdf(shape, area_cdfs[light_id], use_gpu);
-            light_areas[light_id] = area_sum;
-            // Power of an area light
-            light_pmf[light_id] = area_sum * luminance(light.intensity) * Real(M_PI);
+        for (int light_id = 0; light_id < num_area_lights; light_id++) {
             total_importance += light_pmf[light_id];
         }
         if (envmap.get() != nullptr) {
             auto surface_area = 4 * Real(M_PI) * square(bsphere.radius);
             if (surface_area > 0) {
-                light_pmf[envmap_id] = surface_area / envmap->pdf_norm;
+                light_pmf[envmap_id] = surface_area / this->envmap->pdf_norm;
                 total_importance += light_pmf[envmap_id];
             } else {
                 light_pmf[envmap_id] = 1;
@@ -250,42 +579,11 @@ Scene::Scene(const Camera &camera,
         for (int i = 1; i < num_lights; i++) {
             light_cdf[i] = light_cdf[i - 1] + light_pmf[i - 1];
         }
-    }
-
-    // Flatten the scene into array
-    // TODO: use cudaMemcpyAsync for gpu code path
-    if (shapes.size() > 0) {
-        this->shapes = Buffer<Shape>(use_gpu, shapes.size());
-        for (int shape_id = 0; shape_id < (int)shapes.size(); shape_id++) {
-            this->shapes[shape_id] = *shapes[shape_id];
-        }
-    }
-    if (materials.size() > 0) {
-        this->materials = Buffer<Material>(use_gpu, materials.size());
-        for (int material_id = 0; material_id < (int)materials.size(); material_id++) {
-            this->materials[material_id] = *materials[material_id];
-        }
-    }
-    if (area_lights.size() > 0) {
-        this->area_lights = Buffer<AreaLight>(use_gpu, area_lights.size());
-        for (int light_id = 0; light_id < (int)area_lights.size(); light_id++) {
-            this->area_lights[light_id] = *area_lights[light_id];
-        }
-    }
 
-    if (envmap.get() != nullptr) {
-        if (use_gpu) {
-#ifdef __NVCC__
-            checkCuda(cudaMallocManaged(&this->envmap, sizeof(EnvironmentMap)));
-#else
-            assert(false);
-#endif
-        } else {
-            this->envmap = new EnvironmentMap;
+        if (use_light_bvh && area_lights.size() > 0) {
+            light_bvh = std::unique_ptr<LightBVH>(
+                new LightBVH(shapes, area_lights, use_gpu));
         }
-        *(this->envmap) = *envmap;
-    } else {
-        this->envmap = nullptr;
     }
 
     max_generic_texture_dimension = 0;
@@ -299,6 +597,11 @@ Scene::Scene(const Camera &camera,
 
     edge_sampler = EdgeSampler(shapes, *this);
 
+    if (embree_build.valid()) {
+        // Rethrows if the build failed
+        embree_build.get();
+    }
+
 #ifdef __NVCC__
     if (old_device_id != -1) {
         checkCuda(cudaSetDevice(old_device_id));
@@ -309,6 +612,11 @@ Scene::Scene(const Camera &camera,
 Scene::~Scene() {
     if (!use_gpu) {
         rtcReleaseScene(embree_scene);
+        for (auto prototype_scene : embree_prototype_scenes) {
+            if (prototype_scene != nullptr) {
+                rtcReleaseScene(prototype_scene);
+            }
+        }
         rtcReleaseDevice(embree_device);
         delete envmap;
     } else {
@@ -418,6 +726,8 @@ FlattenScene get_flatten_scene(const Scene &scene) {
                         scene.light_cdf.data,
                         scene.light_areas.data,
                         scene.area_cdfs.data,
+                        scene.area_aliases.data,
+                        get_flatten_light_bvh(scene.light_bvh.get()),
                         scene.envmap,
                         scene.max_generic_texture_dimension};
 }
@@ -500,6 +810,84 @@ void intersect_shape(const Shape *shapes,
 }
 #endif
 
+/// Embree closest hit query of the ray of pixel_id, see intersect()
+inline void embree_intersect(const Scene &scene,
+                             int pixel_id,
+                             BufferView<Ray> &rays,
+                             const BufferView<RayDifferential> &ray_differentials,
+                             BufferView<Intersection> &intersections,
+                             BufferView<SurfacePoint> &points,
+                             BufferView<RayDifferential> &new_ray_differentials) {
+    Ray &ray = rays[pixel_id];
+    RTCIntersectContext rtc_context;
+    rtcInitIntersectContext(&rtc_context);
+    RTCRayHit rtc_ray_hit;
+    rtc_ray_hit.ray.org_x = (float)ray.org[0];
+    rtc_ray_hit.ray.org_y = (float)ray.org[1];
+    rtc_ray_hit.ray.org_z = (float)ray.org[2];
+    rtc_ray_hit.ray.dir_x = (float)ray.dir[0];
+    rtc_ray_hit.ray.dir_y = (float)ray.dir[1];
+    rtc_ray_hit.ray.dir_z = (float)ray.dir[2];
+    rtc_ray_hit.ray.tnear = (float)ray.tmin;
+    rtc_ray_hit.ray.tfar = (float)ray.tmax;
+    rtc_ray_hit.ray.mask = (unsigned int)(-1);
+    rtc_ray_hit.ray.time = 0.f;
+    rtc_ray_hit.ray.flags = 0;
+    rtc_ray_hit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    rtc_ray_hit.hit.primID = RTC_INVALID_GEOMETRY_ID;
+    rtc_ray_hit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+    // TODO: switch to rtcIntersect16
+    rtcIntersect1(scene.embree_scene, &rtc_context, &rtc_ray_hit);
+    if (rtc_ray_hit.hit.geomID == RTC_INVALID_GEOMETRY_ID ||
+             length_squared(ray.dir) <= 1e-3f) {
+        intersections[pixel_id] = Intersection{-1, -1};
+        new_ray_differentials[pixel_id] = ray_differentials[pixel_id];
+    } else {
+        // Hits of instances report the shape in instID
+        auto shape_id = rtc_ray_hit.hit.instID[0] != RTC_INVALID_GEOMETRY_ID ?
+            (int)rtc_ray_hit.hit.instID[0] : (int)rtc_ray_hit.hit.geomID;
+        auto tri_id = (int)rtc_ray_hit.hit.primID;
+        intersections[pixel_id] =
+            Intersection{shape_id, tri_id};
+        const auto &shape = scene.shapes[shape_id];
+        const auto &ray_differential = ray_differentials[pixel_id];
+        points[pixel_id] =
+            intersect_shape(shape,
+                            tri_id,
+                            ray,
+                            ray_differential,
+                            new_ray_differentials[pixel_id]);
+        ray.tmax = rtc_ray_hit.ray.tfar;
+    }
+}
+
+/// Embree any hit query of the ray of pixel_id, see occluded()
+inline void embree_occluded(const Scene &scene,
+                            int pixel_id,
+                            BufferView<Ray> &rays) {
+    const Ray &ray = rays[pixel_id];
+    RTCIntersectContext rtc_context;
+    rtcInitIntersectContext(&rtc_context);
+    RTCRay rtc_ray;
+    rtc_ray.org_x = (float)ray.org[0];
+    rtc_ray.org_y = (float)ray.org[1];
+    rtc_ray.org_z = (float)ray.org[2];
+    rtc_ray.dir_x = (float)ray.dir[0];
+    rtc_ray.dir_y = (float)ray.dir[1];
+    rtc_ray.dir_z = (float)ray.dir[2];
+    rtc_ray.tnear = (float)ray.tmin;
+    rtc_ray.tfar = (float)ray.tmax;
+    rtc_ray.mask = (unsigned int)(-1);
+    rtc_ray.time = 0.f;
+    rtc_ray.flags = 0;
+    // TODO: switch to rtcOccluded16
+    rtcOccluded1(scene.embree_scene, &rtc_context, &rtc_ray);
+    if (rtc_ray.tfar < 0) {
+        // intersections[pixel_id] = Intersection{-1, -1};
+        rays[pixel_id].tmax = -1;
+    }
+}
+
 void intersect(const Scene &scene,
                const BufferView<int> &active_pixels,
                BufferView<Ray> rays,
@@ -512,6 +900,7 @@ void intersect(const Scene &scene,
     if (active_pixels.size() == 0) {
         return;
     }
+    ScopedTimer timer(scene.trace_time);
     if (scene.use_gpu) {
 #ifdef __NVCC__
         // OptiX prime query
@@ -543,54 +932,15 @@ void intersect(const Scene &scene,
 #endif
     } else {
         // Embree query
-        auto work_per_thread = 256;
+        auto work_per_thread = int64_t(256);
         auto num_threads = idiv_ceil(active_pixels.size(), work_per_thread);
         parallel_for_host([&](int thread_index) {
             auto id_offset = work_per_thread * thread_index;
             auto work_end = std::min(id_offset + work_per_thread,
                                      active_pixels.size());
-            for (int work_id = id_offset; work_id < work_end; work_id++) {
-                auto id = work_id;
-                auto pixel_id = active_pixels[id];
-                Ray &ray = rays[pixel_id];
-                RTCIntersectContext rtc_context;
-                rtcInitIntersectContext(&rtc_context);
-                RTCRayHit rtc_ray_hit;
-                rtc_ray_hit.ray.org_x = (float)ray.org[0];
-                rtc_ray_hit.ray.org_y = (float)ray.org[1];
-                rtc_ray_hit.ray.org_z = (float)ray.org[2];
-                rtc_ray_hit.ray.dir_x = (float)ray.dir[0];
-                rtc_ray_hit.ray.dir_y = (float)ray.dir[1];
-                rtc_ray_hit.ray.dir_z = (float)ray.dir[2];
-                rtc_ray_hit.ray.tnear = (float)ray.tmin;
-                rtc_ray_hit.ray.tfar = (float)ray.tmax;
-                rtc_ray_hit.ray.mask = (unsigned int)(-1);
-                rtc_ray_hit.ray.time = 0.f;
-                rtc_ray_hit.ray.flags = 0;
-                rtc_ray_hit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-                rtc_ray_hit.hit.primID = RTC_INVALID_GEOMETRY_ID;
-                rtc_ray_hit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-                // TODO: switch to rtcIntersect16
-                rtcIntersect1(scene.embree_scene, &rtc_context, &rtc_ray_hit);
-                if (rtc_ray_hit.hit.geomID == RTC_INVALID_GEOMETRY_ID ||
-                         length_squared(ray.dir) <= 1e-3f) {
-                    intersections[pixel_id] = Intersection{-1, -1};
-                    new_ray_differentials[pixel_id] = ray_differentials[pixel_id];
-                } else {
-                    auto shape_id = (int)rtc_ray_hit.hit.geomID;
-                    auto tri_id = (int)rtc_ray_hit.hit.primID;
-                    intersections[pixel_id] =
-                        Intersection{shape_id, tri_id};
-                    const auto &shape = scene.shapes[shape_id];
-                    const auto &ray_differential = ray_differentials[pixel_id];
-                    points[pixel_id] =
-                        intersect_shape(shape,
-                                        tri_id,
-                                        ray,
-                                        ray_differential,
-                                        new_ray_differentials[pixel_id]);
-                    ray.tmax = rtc_ray_hit.ray.tfar;
-                }
+            for (int64_t work_id = id_offset; work_id < work_end; work_id++) {
+                embree_intersect(scene, active_pixels[work_id], rays, ray_differentials,
+                                 intersections, points, new_ray_differentials);
             }
         }, num_threads);
     }
@@ -631,6 +981,7 @@ void occluded(const Scene &scene,
               BufferView<Ray> rays,
               BufferView<OptiXRay> optix_rays,
               BufferView<OptiXHit> optix_hits) {
+    ScopedTimer timer(scene.trace_time);
     if (scene.use_gpu) {
 #ifdef __NVCC__
         // OptiX prime query
@@ -654,58 +1005,97 @@ void occluded(const Scene &scene,
 #endif
     } else {
         // Embree query
-        auto work_per_thread = 256;
+        auto work_per_thread = int64_t(256);
         auto num_threads = idiv_ceil(active_pixels.size(), work_per_thread);
         parallel_for_host([&](int thread_index) {
             auto id_offset = work_per_thread * thread_index;
             auto work_end = std::min(id_offset + work_per_thread,
                                      active_pixels.size());
-            for (int work_id = id_offset; work_id < work_end; work_id++) {
-                auto id = work_id;
-                auto pixel_id = active_pixels[id];
-                const Ray &ray = rays[pixel_id];
-                RTCIntersectContext rtc_context;
-                rtcInitIntersectContext(&rtc_context);
-                RTCRay rtc_ray;
-                rtc_ray.org_x = (float)ray.org[0];
-                rtc_ray.org_y = (float)ray.org[1];
-                rtc_ray.org_z = (float)ray.org[2];
-                rtc_ray.dir_x = (float)ray.dir[0];
-                rtc_ray.dir_y = (float)ray.dir[1];
-                rtc_ray.dir_z = (float)ray.dir[2];
-                rtc_ray.tnear = (float)ray.tmin;
-                rtc_ray.tfar = (float)ray.tmax;
-                rtc_ray.mask = (unsigned int)(-1);
-                rtc_ray.time = 0.f;
-                rtc_ray.flags = 0;
-                // TODO: switch to rtcOccluded16
-                rtcOccluded1(scene.embree_scene, &rtc_context, &rtc_ray);
-                if (rtc_ray.tfar < 0) {
-                    // intersections[pixel_id] = Intersection{-1, -1};
-                    rays[pixel_id].tmax = -1;
+            for (int64_t work_id = id_offset; work_id < work_end; work_id++) {
+                embree_occluded(scene, active_pixels[work_id], rays);
+            }
+        }, num_threads);
+    }
+}
+
+void occluded_and_intersect(const Scene &scene,
+                            const BufferView<int> &shadow_active_pixels,
+                            BufferView<Ray> shadow_rays,
+                            const BufferView<int> &active_pixels,
+                            BufferView<Ray> rays,
+                            const BufferView<RayDifferential> &ray_differentials,
+                            BufferView<Intersection> intersections,
+                            BufferView<SurfacePoint> points,
+                            BufferView<RayDifferential> new_ray_differentials,
+                            BufferView<OptiXRay> optix_rays,
+                            BufferView<OptiXHit> optix_hits) {
+    if (scene.use_gpu) {
+        // The OptiX prime queries share the ray & hit buffers
+        occluded(scene, shadow_active_pixels, shadow_rays, optix_rays, optix_hits);
+        intersect(scene, active_pixels, rays, ray_differentials,
+                  intersections, points, new_ray_differentials,
+                  optix_rays, optix_hits);
+    } else {
+        // Embree query: the chunks of both queries go into the same parallel loop,
+        // so the threads that finish the shadow rays help with the other rays
+        // instead of idling at the end of each query
+        ScopedTimer timer(scene.trace_time);
+        auto work_per_thread = int64_t(256);
+        std::vector<int64_t> num_chunks = {
+            idiv_ceil(shadow_active_pixels.size(), work_per_thread),
+            idiv_ceil(active_pixels.size(), work_per_thread)};
+        parallel_for_host([&](int query, int chunk) {
+            const auto &pixels = query == 0 ? shadow_active_pixels : active_pixels;
+            auto id_offset = work_per_thread * chunk;
+            auto work_end = std::min(id_offset + work_per_thread, pixels.size());
+            for (int64_t work_id = id_offset; work_id < work_end; work_id++) {
+                if (query == 0) {
+                    embree_occluded(scene, pixels[work_id], shadow_rays);
+                } else {
+                    embree_intersect(scene, pixels[work_id], rays, ray_differentials,
+                                     intersections, points, new_ray_differentials);
                 }
             }
-        }, num_threads); 
+        }, num_chunks);
     }
 }
 
 struct light_point_sampler {
     DEVICE void operator()(int idx) {
         auto pixel_id = active_pixels[idx];
-        // Select light source by binary search on light_cdf
+        const auto &shading_point = shading_points[pixel_id];
         auto sample = samples[pixel_id];
-        const Real *light_ptr =
-            thrust::upper_bound(thrust::seq,
-                scene.light_cdf, scene.light_cdf + scene.num_lights,
-                sample.light_sel);
-        auto light_id = clamp((int)(light_ptr - scene.light_cdf - 1),
-                                    0, scene.num_lights - 1);
+        auto light_id = -1;
+        auto tri_id = -1;
+        if (scene.light_bvh.root != nullptr) {
+            // The environment map keeps its share of light_pmf, the rest goes
+            // to the area light triangles picked by traversing the light BVH.
+            if (scene.envmap != nullptr &&
+                    sample.light_sel >= scene.light_cdf[scene.num_lights - 1]) {
+                light_id = scene.num_lights - 1;
+            } else {
+                auto pmf = Real(0);
+                const auto *leaf = sample_light_bvh(scene.light_bvh,
+                    shading_point.position, shading_point.shading_frame.n,
+                    sample.tri_sel, pmf);
+                light_id = leaf->light_id;
+                tri_id = leaf->tri_id;
+            }
+        } else {
+            // Select light source by binary search on light_cdf
+            const Real *light_ptr =
+                thrust::upper_bound(thrust::seq,
+                    scene.light_cdf, scene.light_cdf + scene.num_lights,
+                    sample.light_sel);
+            light_id = clamp((int)(light_ptr - scene.light_cdf - 1),
+                                   0, scene.num_lights - 1);
+        }
         if (scene.envmap != nullptr && light_id == scene.num_lights - 1) {
             // Environment map
             light_isects[pixel_id].shape_id = -1;
             light_isects[pixel_id].tri_id = -1;
             light_points[pixel_id] = SurfacePoint::zero();
-            shadow_rays[pixel_id].org = shading_points[pixel_id].position;
+            shadow_rays[pixel_id].org = shading_point.position;
             shadow_rays[pixel_id].dir = envmap_sample(*(scene.envmap), sample.uv);
             shadow_rays[pixel_id].tmin = 1e-3f;
             shadow_rays[pixel_id].tmax = infinity<Real>();
@@ -713,21 +1103,21 @@ struct light_point_sampler {
             // Area light
             const auto &light = scene.area_lights[light_id];
             const auto &shape = scene.shapes[light.shape_id];
-            // Select triangle by binary search on area_cdfs
-            const Real *area_cdf = scene.area_cdfs[light_id];
-            const Real *tri_ptr = thrust::upper_bound(thrust::seq,
-                    area_cdf, area_cdf + shape.num_triangles, sample.tri_sel);
-            auto tri_id = clamp((int)(tri_ptr - area_cdf - 1), 0, shape.num_triangles - 1);
+            if (tri_id == -1) {
+                // Select triangle proportional to area using the alias table
+                tri_id = sample_alias_table(
+                    scene.area_aliases[light_id], shape.num_triangles, sample.tri_sel);
+            }
             light_isects[pixel_id].shape_id = light.shape_id;
             light_isects[pixel_id].tri_id = tri_id;
             light_points[pixel_id] = sample_shape(shape, tri_id, sample.uv);
-            shadow_rays[pixel_id].org = shading_points[pixel_id].position;
+            shadow_rays[pixel_id].org = shading_point.position;
             shadow_rays[pixel_id].dir = normalize(
-                light_points[pixel_id].position - shading_points[pixel_id].position);
+                light_points[pixel_id].position - shading_point.position);
             // Shadow epislon. Sorry.
             shadow_rays[pixel_id].tmin = 1e-3f;
             shadow_rays[pixel_id].tmax = (1 - 1e-3f) *
-                length(light_points[pixel_id].position - shading_points[pixel_id].position);
+                length(light_points[pixel_id].position - shading_point.position);
         }
     }
 
@@ -759,7 +1149,8 @@ void sample_point_on_light(const Scene &scene,
 }
 
 void test_scene_intersect(bool use_gpu) {
-    Buffer<Vector3f> vertices(use_gpu, 3);
+    // One more vertex than we use, so that Embree can read the vertices in place
+    Buffer<Vector3f> vertices(use_gpu, 4);
     vertices[0] = Vector3f{-1.f, 0.f, 1.f};
     vertices[1] = Vector3f{ 1.f, 0.f, 1.f};
     vertices[2] = Vector3f{ 0.f, 1.f, 1.f};
@@ -793,6 +1184,7 @@ void test_scene_intersect(bool use_gpu) {
                    1, // num_triangles
                    0,
                    -1};
+    triangle.vertices_padded = true;
     auto pos = Vector3f{0, 0, 0};
     auto look = Vector3f{0, 0, 1};
     auto up = Vector3f{0, 1, 0};
@@ -811,7 +1203,7 @@ void test_scene_intersect(bool use_gpu) {
         CameraType::Perspective,
         Vector2i{0, 0},
         Vector2i{1, 1}};
-    Scene scene{camera, {&triangle}, {}, {}, {}, use_gpu, 0, false, false};
+    Scene scene{camera, {&triangle}, {}, {}, {}, use_gpu, 0, false, false, false};
     parallel_init();
 
     Buffer<int> active_pixels(use_gpu, 2);
@@ -844,6 +1236,76 @@ void test_scene_intersect(bool use_gpu) {
     equal_or_error<Real>(__FILE__, __LINE__, ray_diffs[1].org_dy, Vector3{0, 0, 0});
     equal_or_error<Real>(__FILE__, __LINE__, ray_diffs[1].dir_dx, Vector3{0, 0, 0});
     equal_or_error<Real>(__FILE__, __LINE__, ray_diffs[1].dir_dy, Vector3{0, 0, 0});
+
+    // The combined query should give the same results as the separate ones
+    Buffer<Ray> shadow_rays(use_gpu, 2);
+    shadow_rays[0] = ray0;
+    shadow_rays[1] = ray1;
+    rays[0] = ray1;
+    rays[1] = ray0;
+    occluded_and_intersect(scene,
+                           active_pixels.view(0, active_pixels.size()),
+                           shadow_rays.view(0, shadow_rays.size()),
+                           active_pixels.view(0, active_pixels.size()),
+                           rays.view(0, rays.size()),
+                           ray_diffs.view(0, rays.size()),
+                           isects.view(0, rays.size()),
+                           surface_points.view(0, rays.size()),
+                           ray_diffs.view(0, rays.size()),
+                           optix_rays.view(0, rays.size()),
+                           optix_hits.view(0, rays.size()));
+    cuda_synchronize();
+    equal_or_error<Real>(__FILE__, __LINE__, shadow_rays[0].tmax, Real(-1));
+    equal_or_error(__FILE__, __LINE__, int(shadow_rays[1].tmax < 0), 0);
+    equal_or_error(__FILE__, __LINE__, isects[0].shape_id, -1);
+    equal_or_error(__FILE__, __LINE__, isects[0].tri_id, -1);
+    equal_or_error(__FILE__, __LINE__, isects[1].shape_id, 0);
+    equal_or_error(__FILE__, __LINE__, isects[1].tri_id, 0);
+    equal_or_error<Real>(__FILE__, __LINE__, surface_points[1].position, Vector3{0, 0, 1});
+
+    // An instance of the triangle moved 5 units along x
+    Matrix4x4f translation(1, 0, 0, 5,
+                           0, 1, 0, 0,
+                           0, 0, 1, 0,
+                           0, 0, 0, 1);
+    Matrix3x3f identity = Matrix3x3f::identity();
+    Shape instance = triangle;
+    instance.set_instance(0, ptr<float>(&translation.data[0][0]),
+                          ptr<float>(&identity.data[0][0]));
+    Scene instanced_scene{camera, {&triangle, &instance}, {}, {}, {}, use_gpu, 0, false, false, false};
+    rays[0] = Ray{Vector3{5.0, 0.5, 0.0}, Vector3{0.0, 0.0, 1.0}};
+    rays[1] = Ray{Vector3{0.0, 0.5, 0.0}, Vector3{0.0, 0.0, 1.0}};
+    intersect(instanced_scene,
+              active_pixels.view(0, active_pixels.size()),
+              rays.view(0, rays.size()),
+              ray_diffs.view(0, rays.size()),
+              isects.view(0, rays.size()),
+              surface_points.view(0, rays.size()),
+              ray_diffs.view(0, rays.size()),
+              optix_rays.view(0, rays.size()),
+              optix_hits.view(0, rays.size()));
+    cuda_synchronize();
+    equal_or_error(__FILE__, __LINE__, isects[0].shape_id, 1);
+    equal_or_error(__FILE__, __LINE__, isects[0].tri_id, 0);
+    equal_or_error(__FILE__, __LINE__, isects[1].shape_id, 0);
+    equal_or_error(__FILE__, __LINE__, isects[1].tri_id, 0);
+    equal_or_error<Real>(__FILE__, __LINE__, surface_points[0].position, Vector3{5.0, 0.5, 1.0});
+    equal_or_error<Real>(__FILE__, __LINE__, surface_points[1].position, Vector3{0.0, 0.5, 1.0});
+
+    // Instances have to share the buffers of their prototype
+    Buffer<Vector3f> other_vertices(use_gpu, 3);
+    for (int i = 0; i < 3; i++) {
+        other_vertices[i] = vertices[i];
+    }
+    Shape other_instance = instance;
+    other_instance.vertices = (float*)other_vertices.data;
+    auto rejected = false;
+    try {
+        Scene other_scene{camera, {&triangle, &other_instance}, {}, {}, {}, use_gpu, 0, false, false, false};
+    } catch (const std::runtime_error &) {
+        rejected = true;
+    }
+    equal_or_error(__FILE__, __LINE__, int(rejected), 1);
     parallel_cleanup();
 }
 
@@ -867,7 +1329,9 @@ void test_sample_point_on_light(bool use_gpu) {
     Buffer<Vector3i> indices1(use_gpu, 1);
     indices1[0] = Vector3i{0, 1, 2};
     Buffer<LightSample> samples(use_gpu, 3);
-    samples[0] = LightSample{0.25f, 0.5f, Vector2{0.f, 0.f}};
+    // Triangles of a light are selected with the alias table of their areas:
+    // tri_sel in [0, 0.5) picks the first triangle of light0, [0.5, 0.5 + 1/3) the second
+    samples[0] = LightSample{0.25f, 0.25f, Vector2{0.f, 0.f}};
     samples[1] = LightSample{0.25f, 0.75f, Vector2{0.f, 0.f}};
     samples[2] = LightSample{0.5f, 0.5f, Vector2{0.f, 0.f}};
     Shape shape0{(float*)vertices0.data,
@@ -929,7 +1393,7 @@ void test_sample_point_on_light(bool use_gpu) {
         CameraType::Perspective,
         Vector2i{0, 0},
         Vector2i{1, 1}};
-    Scene scene{camera, {&shape0, &shape1}, {}, {&light0, &light1}, {}, use_gpu, 0, false, false};
+    Scene scene{camera, {&shape0, &shape1}, {}, {&light0, &light1}, {}, use_gpu, 0, false, false, false};
     cuda_synchronize();
     // Power of the first light source: 1.5
     // Power of the second light source: 2
@@ -940,6 +1404,10 @@ void test_sample_point_on_light(bool use_gpu) {
     equal_or_error(__FILE__, __LINE__, scene.area_cdfs[0][0], Real(0));
     equal_or_error(__FILE__, __LINE__, scene.area_cdfs[0][1], Real(1.0 / 1.5));
     equal_or_error(__FILE__, __LINE__, scene.area_cdfs[1][0], Real(0));
+    equal_or_error(__FILE__, __LINE__, scene.area_aliases[0][0].prob, Real(1));
+    equal_or_error(__FILE__, __LINE__, scene.area_aliases[0][1].prob, Real(1.0 / 1.5));
+    equal_or_error(__FILE__, __LINE__, scene.area_aliases[0][1].alias, 0);
+    equal_or_error(__FILE__, __LINE__, scene.light_areas[0], Real(1.5));
 
     Buffer<int> active_pixels(use_gpu, samples.size());
     Buffer<SurfacePoint> shading_points(use_gpu, samples.size());
@@ -11,6 +11,8 @@
 #include "material.h"
 #include "envmap.h"
 #include "edge.h"
+#include "light_bvh.h"
+#include "alias_table.h"
 #include <vector>
 #include <memory>
 #include <embree3/rtcore.h>
@@ -18,6 +20,24 @@
   #include <optix_prime/optix_primepp.h>
 #endif
 
+/// Trade-off between the build time and the tracing speed of the Embree BVH
+enum class BuildQuality {
+    Auto, // picked from the expected number of rays per triangle
+    Low,
+    Medium,
+    High
+};
+
+struct SceneBuildOptions {
+    BuildQuality quality = BuildQuality::High;
+    // For BuildQuality::Auto: roughly pixels x samples x bounces
+    int64_t expected_num_rays = 0;
+    // Embree scene flags
+    bool dynamic = false;
+    bool compact = false;
+    bool robust = true;
+};
+
 struct Scene {
     /// XXX should use py::list to avoid copy?
     Scene(const Camera &camera,
@@ -28,7 +48,9 @@ struct Scene {
           bool use_gpu,
           int gpu_index,
           bool use_primary_edge_sampling,
-          bool use_secondary_edge_sampling);
+          bool use_secondary_edge_sampling,
+          bool use_light_bvh,
+          const SceneBuildOptions &build_options = SceneBuildOptions());
     ~Scene();
 
     // Flatten arrays of scene content
@@ -43,10 +65,16 @@ struct Scene {
     int gpu_index;
     bool use_primary_edge_sampling;
     bool use_secondary_edge_sampling;
+    bool use_light_bvh;
 
     // For G-buffer rendering with textures of arbitrary number of channels.
     int max_generic_texture_dimension;
 
+    // Seconds spent building the ray tracing structures, and in the
+    // ray queries (intersect() & occluded()) so far, for profiling
+    double build_time = 0;
+    mutable double trace_time = 0;
+
 #ifdef COMPILE_WITH_CUDA
     // Optix handles
     optix::prime::Context optix_context;
@@ -59,6 +87,12 @@ struct Scene {
     // Embree handles
     RTCDevice embree_device;
     RTCScene embree_scene;
+    // Scenes of the shapes that have a transform or that other shapes are
+    // instances of, instanced into embree_scene (nullptr for the other shapes)
+    std::vector<RTCScene> embree_prototype_scenes;
+
+    // Baked lens distortion, camera.distortion_params points into it
+    Buffer<DistortionLUTEntry> distortion_lut;
 
     // Light sampling
     Buffer<Real> light_pmf;
@@ -66,6 +100,16 @@ struct Scene {
     Buffer<Real> light_areas;
     Buffer<Real*> area_cdfs;
     Buffer<Real> area_cdf_pool;
+    Buffer<AliasEntry*> area_aliases;
+    Buffer<AliasEntry> area_alias_pool;
+    // Shading point dependent selection of area light triangles,
+    // replaces light_cdf & area_cdfs for area lights when set
+    std::unique_ptr<LightBVH> light_bvh;
+    // envmap->sample_alias_ys & sample_alias_xs point into them
+    Buffer<AliasEntry> envmap_alias_ys;
+    Buffer<AliasEntry> envmap_alias_xs;
+    // Tabulated spherical harmonics envmap for importance sampling
+    Buffer<float> envmap_sh_texels;
 
     // For edge sampling
     EdgeSampler edge_sampler;
@@ -85,11 +129,37 @@ struct FlattenScene {
     Real *light_cdf;
     Real *light_areas;
     Real **area_cdfs;
+    AliasEntry **area_aliases;
+    FlattenLightBVH light_bvh;
     EnvironmentMap *envmap;
     // For G-buffer rendering with textures of arbitrary number of channels.
     int max_generic_texture_dimension;
 };
 
+/// Probability density (w.r.t. area) of sample_point_on_light picking a point
+/// on triangle tri_id of area light light_id for shading_point.
+DEVICE
+inline Real light_pdf(const FlattenScene &scene,
+                      const SurfacePoint &shading_point,
+                      int light_id,
+                      int tri_id) {
+    if (scene.light_bvh.root == nullptr) {
+        // pdf = light_pmf * tri_pmf / tri_area = light_pmf / light_area
+        return scene.light_pmf[light_id] / scene.light_areas[light_id];
+    }
+    auto area_light_pmf = Real(1);
+    if (scene.envmap != nullptr) {
+        area_light_pmf -= scene.light_pmf[scene.num_lights - 1];
+    }
+    const auto &shape = scene.shapes[scene.area_lights[light_id].shape_id];
+    return area_light_pmf *
+        light_bvh_pmf(scene.light_bvh,
+                      shading_point.position,
+                      shading_point.shading_frame.n,
+                      light_id,
+                      tri_id) / get_area(shape, tri_id);
+}
+
 // XXX: Again, some unnecessary copy from Python
 struct DScene {
     DScene() {}
@@ -128,6 +198,19 @@ void occluded(const Scene &scene,
               BufferView<Ray> rays,
               BufferView<OptiXRay> optix_rays,
               BufferView<OptiXHit> optix_hits);
+// occluded() on the shadow rays and intersect() on the other rays.
+// The two queries are independent, so on the CPU they run in the same parallel loop.
+void occluded_and_intersect(const Scene &scene,
+                            const BufferView<int> &shadow_active_pixels,
+                            BufferView<Ray> shadow_rays,
+                            const BufferView<int> &active_pixels,
+                            BufferView<Ray> rays,
+                            const BufferView<RayDifferential> &ray_differentials,
+                            BufferView<Intersection> intersections,
+                            BufferView<SurfacePoint> surface_points,
+                            BufferView<RayDifferential> new_ray_differentials,
+                            BufferView<OptiXRay> optix_rays,
+                            BufferView<OptiXHit> optix_hits);
 void sample_point_on_light(const Scene &scene,
                            const BufferView<int> &active_pixels,
                            const BufferView<SurfacePoint> &shading_points,
@@ -5,6 +5,9 @@
 #include "intersection.h"
 #include "buffer.h"
 #include "ptr.h"
+#include "matrix.h"
+#include "transform.h"
+#include "atomic.h"
 
 struct Shape {
     Shape() {}
@@ -47,6 +50,19 @@ struct Shape {
         return colors != nullptr;
     }
 
+    /// to_world and normal_to_world are row-major host arrays (4x4 and 3x3),
+    /// nullptr if the vertices are not transformed.
+    void set_instance(int prototype_id,
+                      ptr<float> to_world,
+                      ptr<float> normal_to_world) {
+        this->prototype_id = prototype_id;
+        this->has_transform = to_world.get() != nullptr;
+        if (has_transform) {
+            this->to_world = Matrix4x4f(to_world.get());
+            this->normal_to_world = Matrix3x3f(normal_to_world.get());
+        }
+    }
+
     float *vertices;
     int *indices;
     float *uvs;
@@ -60,6 +76,25 @@ struct Shape {
     int num_triangles;
     int material_id;
     int light_id;
+    // The vertex array can be read 4 bytes past the last vertex.
+    // Embree loads the vertices 16 bytes at a time, so it can then use
+    // the array in place instead of a padded copy.
+    bool vertices_padded = false;
+    // Instancing: the shape shares the buffers above with shapes[prototype_id]
+    // (-1 if the buffers are its own). The ray tracing structures and the
+    // edges are built once for all the shapes sharing the buffers.
+    int prototype_id = -1;
+    // Whether the vertices are placed by to_world, and the shading normals
+    // by normal_to_world (the inverse transpose of its upper 3x3).
+    // Stored by value so the kernels can read them.
+    bool has_transform = false;
+    Matrix4x4f to_world;
+    Matrix3x3f normal_to_world;
+    // Whether the silhouette of the shape seen from the camera can move,
+    // i.e. whether the shape or the camera has a derivative. The primary
+    // edges of the other shapes are not sampled. Their secondary edges are,
+    // since they can occlude the moving shapes.
+    bool differentiable = true;
 };
 
 struct DShape {
@@ -73,19 +108,38 @@ struct DShape {
           normals(normals.get()),
           colors(colors.get()) {}
 
+    /// Derivatives of the transforms of Shape::set_instance
+    /// (4x4 and 3x3, row-major), nullptr if not needed.
+    void set_instance(ptr<float> to_world, ptr<float> normal_to_world) {
+        this->to_world = to_world.get();
+        this->normal_to_world = normal_to_world.get();
+    }
+
     float *vertices;
     float *uvs;
     float *normals;
     float *colors;
+    float *to_world = nullptr;
+    float *normal_to_world = nullptr;
 };
 
+/// The vertex as stored, before the transform of the shape
 DEVICE
-inline Vector3f get_vertex(const Shape &shape, int index) {
+inline Vector3f get_local_vertex(const Shape &shape, int index) {
     return Vector3f{shape.vertices[3 * index + 0],
                     shape.vertices[3 * index + 1],
                     shape.vertices[3 * index + 2]};
 }
 
+DEVICE
+inline Vector3f get_vertex(const Shape &shape, int index) {
+    auto v = get_local_vertex(shape, index);
+    if (shape.has_transform) {
+        return xfm_point(shape.to_world, v);
+    }
+    return v;
+}
+
 DEVICE
 inline Vector3i get_indices(const Shape &shape, int index) {
     return Vector3i{shape.indices[3 * index + 0],
@@ -124,12 +178,22 @@ inline bool has_shading_normals(const Shape &shape) {
 }
 
 DEVICE
-inline Vector3f get_shading_normal(const Shape &shape, int index) {
+inline Vector3f get_local_shading_normal(const Shape &shape, int index) {
     return Vector3f{shape.normals[3 * index + 0],
                     shape.normals[3 * index + 1],
                     shape.normals[3 * index + 2]};
 }
 
+/// Not normalized under a transform: the interpolated normal is normalized anyway.
+DEVICE
+inline Vector3f get_shading_normal(const Shape &shape, int index) {
+    auto n = get_local_shading_normal(shape, index);
+    if (shape.has_transform) {
+        return shape.normal_to_world * n;
+    }
+    return n;
+}
+
 DEVICE
 inline Vector3 get_normal(const Shape &shape, int tri_index) {
     auto indices = get_indices(shape, tri_index);
@@ -746,5 +810,51 @@ inline void d_intersect_shape(
     d_v_p[2] += d_v2;
 }
 
+/// Accumulates the derivative of get_vertex(shape, index) into the vertex
+/// buffer, and into the transform of the shape if it has one.
+DEVICE
+inline void atomic_add_vertex_derivative(const Shape &shape,
+                                         DShape &d_shape,
+                                         int index,
+                                         const Vector3 &d_v) {
+    if (!shape.has_transform) {
+        atomic_add(&d_shape.vertices[3 * index], d_v);
+        return;
+    }
+    auto d_to_world = Matrix4x4{};
+    auto d_local_v = Vector3{0, 0, 0};
+    d_xfm_point(Matrix4x4(shape.to_world),
+                Vector3{get_local_vertex(shape, index)},
+                d_v, d_to_world, d_local_v);
+    atomic_add(&d_shape.vertices[3 * index], d_local_v);
+    if (d_shape.to_world != nullptr) {
+        atomic_add(d_shape.to_world, d_to_world);
+    }
+}
+
+/// Same as atomic_add_vertex_derivative for get_shading_normal
+DEVICE
+inline void atomic_add_normal_derivative(const Shape &shape,
+                                         DShape &d_shape,
+                                         int index,
+                                         const Vector3 &d_n) {
+    if (!shape.has_transform) {
+        atomic_add(&d_shape.normals[3 * index], d_n);
+        return;
+    }
+    auto n = Vector3{get_local_shading_normal(shape, index)};
+    auto d_normal_to_world = Matrix3x3{};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            d_normal_to_world(i, j) = d_n[i] * n[j];
+        }
+    }
+    // Transpose of normal_to_world
+    atomic_add(&d_shape.normals[3 * index], d_n * Matrix3x3(&shape.normal_to_world.data[0][0]));
+    if (d_shape.normal_to_world != nullptr) {
+        atomic_add(d_shape.normal_to_world, d_normal_to_world);
+    }
+}
+
 void test_d_intersect();
 void test_d_sample_shape();
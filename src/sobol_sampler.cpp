@@ -6,20 +6,21 @@
 
 #include <thrust/fill.h>
 
+// https://gist.github.com/badboy/6267743
+DEVICE
+inline uint64_t hash64shift(uint64_t key) {
+  key = (~key) + (key << 21); // key = (key << 21) - key - 1;
+  key = key ^ (key >> 24);
+  key = (key + (key << 3)) + (key << 8); // key * 265
+  key = key ^ (key >> 14);
+  key = (key + (key << 2)) + (key << 4); // key * 21
+  key = key ^ (key >> 28);
+  key = key + (key << 31);
+  return key;
+}
+
 // Initialize Sobol sampler's scramble parameter for each pixel
 struct sobol_initializer {
-    // https://gist.github.com/badboy/6267743
-    DEVICE uint64_t hash64shift(uint64_t key) {
-      key = (~key) + (key << 21); // key = (key << 21) - key - 1;
-      key = key ^ (key >> 24);
-      key = (key + (key << 3)) + (key << 8); // key * 265
-      key = key ^ (key >> 14);
-      key = (key + (key << 2)) + (key << 4); // key * 21
-      key = key ^ (key >> 28);
-      key = key + (key << 31);
-      return key;
-    }
-
     DEVICE void operator()(int idx) {
         sobol_scramble[idx] = hash64shift((seed << 32) | (uint64_t)idx);
     }
@@ -32,7 +33,7 @@ static const uint64_t *sobol_matrices_cpu = &sobol::matrices_[0];
 static const uint64_t *sobol_matrices_gpu = nullptr;
 
 SobolSampler::SobolSampler(bool use_gpu, uint64_t seed, int num_pixels) :
-        use_gpu(use_gpu), current_sample_id(0), current_dimension(0) {
+        use_gpu(use_gpu), current_sample_id(0), current_dimension(0), current_round(0) {
     sobol_scramble = Buffer<uint64_t>(use_gpu, num_pixels);
     parallel_for(sobol_initializer{seed, sobol_scramble.begin()},
         sobol_scramble.size(), use_gpu);
@@ -78,17 +79,24 @@ inline double sample(const uint64_t *matrices,
 template <int spp, typename T>
 struct sobol_sampler {
     DEVICE void operator()(int idx) {
+        auto scramble = sobol_scramble[idx];
+        if (current_round > 0) {
+            // Rehash the scramble so that the reused dimensions are
+            // decorrelated from the previous rounds
+            scramble = hash64shift(scramble + uint64_t(current_round));
+        }
         for (int i = 0; i < spp; i++) {
             samples[spp * idx + i] =
                 (T)sample(sobol_matrices,
                           current_sample_id,
                           current_dimension + i,
-                          sobol_scramble[idx]);
+                          scramble);
         }
     }
 
     int current_sample_id;
     int current_dimension;
+    int current_round;
     const uint64_t *sobol_matrices;
     const uint64_t *sobol_scramble;
     T *samples;
@@ -97,6 +105,20 @@ struct sobol_sampler {
 void SobolSampler::begin_sample(int sample_id) {
     current_sample_id = sample_id;
     current_dimension = 0;
+    current_round = 0;
+}
+
+int SobolSampler::next_dimensions(int num_dimensions) {
+    // A sample can ask for more dimensions than the table has, e.g. many
+    // secondary edge passes of a deep path. Start over at the first dimension
+    // with a new scramble instead of reading past the table.
+    if (current_dimension + num_dimensions > int(sobol::num_dimensions)) {
+        current_dimension = 0;
+        current_round++;
+    }
+    auto dimension = current_dimension;
+    current_dimension += num_dimensions;
+    return dimension;
 }
 
 void SobolSampler::next_camera_samples(BufferView<TCameraSample<float>> samples, bool sample_pixel_center) {
@@ -104,13 +126,14 @@ void SobolSampler::next_camera_samples(BufferView<TCameraSample<float>> samples,
         DISPATCH(use_gpu, thrust::fill,
             (float*)samples.begin(), (float*)samples.end(), 0.5f);
     } else {
+        auto dimension = next_dimensions(2);
         parallel_for(sobol_sampler<2, float>{
             current_sample_id,
-            current_dimension,
+            dimension,
+            current_round,
             sobol_matrices,
             sobol_scramble.begin(),
             (float*)samples.begin()}, samples.size(), use_gpu);
-        current_dimension += 2;
     }
 }
 
@@ -119,96 +142,105 @@ void SobolSampler::next_camera_samples(BufferView<TCameraSample<double>> samples
         DISPATCH(use_gpu, thrust::fill,
             (double*)samples.begin(), (double*)samples.end(), 0.5);
     } else {
+        auto dimension = next_dimensions(2);
         parallel_for(sobol_sampler<2, double>{
             current_sample_id,
-            current_dimension,
+            dimension,
+            current_round,
             sobol_matrices,
             sobol_scramble.begin(),
             (double*)samples.begin()}, samples.size(), use_gpu);
-        current_dimension += 2;
     }
 }
 
 void SobolSampler::next_light_samples(BufferView<TLightSample<float>> samples) {
+    auto dimension = next_dimensions(4);
     parallel_for(sobol_sampler<4, float>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (float*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 4;
 }
 
 void SobolSampler::next_light_samples(BufferView<TLightSample<double>> samples) {
+    auto dimension = next_dimensions(4);
     parallel_for(sobol_sampler<4, double>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (double*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 4;
 }
 
 void SobolSampler::next_bsdf_samples(BufferView<TBSDFSample<float>> samples) {
+    auto dimension = next_dimensions(3);
     parallel_for(sobol_sampler<3, float>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (float*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 3;
 }
 
 void SobolSampler::next_bsdf_samples(BufferView<TBSDFSample<double>> samples) {
+    auto dimension = next_dimensions(3);
     parallel_for(sobol_sampler<3, double>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (double*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 3;
 }
 
 void SobolSampler::next_primary_edge_samples(
         BufferView<TPrimaryEdgeSample<float>> samples) {
+    auto dimension = next_dimensions(2);
     parallel_for(sobol_sampler<2, float>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (float*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 2;
 }
 
 void SobolSampler::next_primary_edge_samples(
         BufferView<TPrimaryEdgeSample<double>> samples) {
+    auto dimension = next_dimensions(2);
     parallel_for(sobol_sampler<2, double>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (double*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 2;
 }
 
 void SobolSampler::next_secondary_edge_samples(
         BufferView<TSecondaryEdgeSample<float>> samples) {
+    auto dimension = next_dimensions(4);
     parallel_for(sobol_sampler<4, float>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (float*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 4;
 }
 
 void SobolSampler::next_secondary_edge_samples(
         BufferView<TSecondaryEdgeSample<double>> samples) {
+    auto dimension = next_dimensions(4);
     parallel_for(sobol_sampler<4, double>{
         current_sample_id,
-        current_dimension,
+        dimension,
+        current_round,
         sobol_matrices,
         sobol_scramble.begin(),
         (double*)samples.begin()}, samples.size(), use_gpu);
-    current_dimension += 4;
 }
@@ -23,4 +23,10 @@ struct SobolSampler : public Sampler {
     const uint64_t *sobol_matrices;
     int current_sample_id;
     int current_dimension;
+    // Number of times the dimensions of the current sample wrapped around
+    int current_round;
+
+private:
+    // Reserve num_dimensions consecutive dimensions, returns the first one
+    int next_dimensions(int num_dimensions);
 };
@@ -0,0 +1,58 @@
+#include "spherical_harmonics.h"
+#include "test_utils.h"
+
+void test_spherical_harmonics() {
+    auto dir = normalize(Vector3{0.3, -0.5, 0.7});
+    Real basis[max_sh_num_coeffs];
+    Vector3 d_basis[max_sh_num_coeffs];
+    sh_basis(max_sh_num_bands, dir, basis, d_basis);
+    // Closed forms of the first two bands
+    equal_or_error(__FILE__, __LINE__, Real(0.282095), basis[0]);
+    equal_or_error(__FILE__, __LINE__, Real(-0.488603) * dir.x, basis[1]);
+    equal_or_error(__FILE__, __LINE__, Real(0.488603) * dir.y, basis[2]);
+    equal_or_error(__FILE__, __LINE__, Real(0.488603) * dir.z, basis[3]);
+    equal_or_error(__FILE__, __LINE__, Real(0.315392) * (3 * square(dir.y) - 1), basis[6]);
+
+    // Finite difference check of the derivatives
+    auto finite_delta = Real(1e-6);
+    for (int axis = 0; axis < 3; axis++) {
+        auto dir_pos = dir;
+        auto dir_neg = dir;
+        dir_pos[axis] += finite_delta;
+        dir_neg[axis] -= finite_delta;
+        Real basis_pos[max_sh_num_coeffs];
+        Real basis_neg[max_sh_num_coeffs];
+        sh_basis(max_sh_num_bands, dir_pos, basis_pos, nullptr);
+        sh_basis(max_sh_num_bands, dir_neg, basis_neg, nullptr);
+        for (int i = 0; i < max_sh_num_coeffs; i++) {
+            equal_or_error(__FILE__, __LINE__,
+                (basis_pos[i] - basis_neg[i]) / (2 * finite_delta), d_basis[i][axis]);
+        }
+    }
+
+    // Orthonormality
+    constexpr int num_bands = 4;
+    constexpr int num_coeffs = num_bands * num_bands;
+    constexpr int num_theta = 128;
+    constexpr int num_phi = 256;
+    Real gram[num_coeffs][num_coeffs] = {};
+    for (int i = 0; i < num_theta; i++) {
+        auto theta = Real(M_PI) * (i + Real(0.5)) / num_theta;
+        for (int j = 0; j < num_phi; j++) {
+            auto phi = 2 * Real(M_PI) * (j + Real(0.5)) / num_phi;
+            auto d = Vector3{sin(phi) * sin(theta), cos(theta), -cos(phi) * sin(theta)};
+            auto weight = sin(theta) * (Real(M_PI) / num_theta) * (2 * Real(M_PI) / num_phi);
+            sh_basis(num_bands, d, basis, nullptr);
+            for (int k = 0; k < num_coeffs; k++) {
+                for (int l = 0; l < num_coeffs; l++) {
+                    gram[k][l] += weight * basis[k] * basis[l];
+                }
+            }
+        }
+    }
+    for (int k = 0; k < num_coeffs; k++) {
+        for (int l = 0; l < num_coeffs; l++) {
+            equal_or_error(__FILE__, __LINE__, Real(k == l ? 1 : 0), gram[k][l]);
+        }
+    }
+}
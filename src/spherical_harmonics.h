@@ -0,0 +1,83 @@
+#pragma once
+
+#include "redner.h"
+#include "vector.h"
+
+/**
+ * Real spherical harmonics, with the same convention as pyredner.SH:
+ * y is the pole, theta = acos(y), phi = atan2(x, -z), and the coefficient of
+ * band l and order m (-l <= m <= l) is stored at l * l + l + m.
+ */
+constexpr auto max_sh_num_bands = 8;
+constexpr auto max_sh_num_coeffs = max_sh_num_bands * max_sh_num_bands;
+
+DEVICE
+inline Real sh_normalization(int l, int m) {
+    // sqrt((2l + 1) / (4pi) * (l - m)! / (l + m)!)
+    auto ratio = Real(1);
+    for (int k = l - m + 1; k <= l + m; k++) {
+        ratio /= k;
+    }
+    return sqrt((2 * l + 1) * ratio / (4 * Real(M_PI)));
+}
+
+/// Evaluate the basis functions of the first num_bands bands at the unit vector dir.
+/// If d_basis is not nullptr, also outputs the derivatives of each basis function
+/// with respect to dir.
+DEVICE
+inline void sh_basis(int num_bands, const Vector3 &dir, Real *basis, Vector3 *d_basis) {
+    // We use the polynomial form to avoid the singularity at the poles:
+    // sin(theta)^m (cos(m phi) + i sin(m phi)) = (-z + ix)^m = c_m + i s_m
+    Real c[max_sh_num_bands];
+    Real s[max_sh_num_bands];
+    c[0] = 1;
+    s[0] = 0;
+    for (int m = 1; m < num_bands; m++) {
+        c[m] = -dir.z * c[m - 1] - dir.x * s[m - 1];
+        s[m] = -dir.z * s[m - 1] + dir.x * c[m - 1];
+    }
+    // q is the associated Legendre polynomial divided by sin(theta)^m,
+    // following the recurrences of "Spherical Harmonic Lighting: The Gritty Details"
+    auto q_mm = Real(1);
+    for (int m = 0; m < num_bands; m++) {
+        if (m > 0) {
+            q_mm *= -(2 * m - 1);
+        }
+        auto q_l1 = Real(0), dq_l1 = Real(0); // band l - 1
+        auto q_l2 = Real(0), dq_l2 = Real(0); // band l - 2
+        for (int l = m; l < num_bands; l++) {
+            auto q = q_mm;
+            auto dq = Real(0);
+            if (l > m) {
+                q = ((2 * l - 1) * dir.y * q_l1 - (l + m - 1) * q_l2) / (l - m);
+                dq = ((2 * l - 1) * (q_l1 + dir.y * dq_l1) - (l + m - 1) * dq_l2) / (l - m);
+            }
+            q_l2 = q_l1;
+            dq_l2 = dq_l1;
+            q_l1 = q;
+            dq_l1 = dq;
+
+            auto k = sh_normalization(l, m);
+            if (m == 0) {
+                basis[l * l + l] = k * q;
+                if (d_basis != nullptr) {
+                    d_basis[l * l + l] = Vector3{Real(0), k * dq, Real(0)};
+                }
+            } else {
+                k *= sqrt(Real(2));
+                basis[l * l + l + m] = k * q * c[m];
+                basis[l * l + l - m] = k * q * s[m];
+                if (d_basis != nullptr) {
+                    // d(c_m + i s_m)/dx = i m (c_{m-1} + i s_{m-1})
+                    // d(c_m + i s_m)/dz = -m (c_{m-1} + i s_{m-1})
+                    d_basis[l * l + l + m] = k * Vector3{
+                        -q * m * s[m - 1], dq * c[m], -q * m * c[m - 1]};
+                    d_basis[l * l + l - m] = k * Vector3{
+                        q * m * c[m - 1], dq * s[m], -q * m * s[m - 1]};
+                }
+            }
+        }
+    }
+}
+
+void test_spherical_harmonics();
@@ -322,6 +322,12 @@ inline void d_trilinear_interp(const Texture<N> &tex,
     }
 }
 
+template <typename TextureType>
+DEVICE
+inline bool is_constant_texture(const TextureType &tex) {
+    return tex.width[0] <= 0 && tex.height[0] <= 0;
+}
+
 template <int N>
 DEVICE
 inline void get_texture_value_constant(const Texture<N> &tex,
@@ -332,6 +338,18 @@ inline void get_texture_value_constant(const Texture<N> &tex,
     }
 }
 
+template <int N>
+DEVICE
+inline void d_get_texture_value_constant(const Texture<N> &tex,
+                                         const Real *d_output,
+                                         Texture<N> &d_tex) {
+    // output[i] = tex.texels[i]
+    auto channels = N == -1 ? tex.channels : N;
+    for (int i = 0; i < channels; i++) {
+        atomic_add(d_tex.texels[0][i], d_output[i]);
+    }
+}
+
 template <typename TextureType>
 DEVICE
 inline void get_texture_value(const TextureType &tex,
@@ -339,7 +357,7 @@ inline void get_texture_value(const TextureType &tex,
                               const Vector2 &du_dxy_,
                               const Vector2 &dv_dxy_,
                               Real *output) {
-    if (tex.width[0] <= 0 && tex.height[0] <= 0) {
+    if (is_constant_texture(tex)) {
         // Constant texture
         get_texture_value_constant(tex, output);
     } else {
@@ -365,13 +383,9 @@ inline void d_get_texture_value(const Texture<N> &tex,
                                 Vector2 &d_uv_,
                                 Vector2 &d_du_dxy_,
                                 Vector2 &d_dv_dxy_) {
-    if (tex.width[0] <= 0 && tex.height[0] <= 0) {
+    if (is_constant_texture(tex)) {
         // Constant texture
-        // output[i] = tex.texels[i]
-        auto channels = N == -1 ? tex.channels : N;
-        for (int i = 0; i < channels; i++) {
-            atomic_add(d_tex.texels[0][i], d_output[i]);
-        }
+        d_get_texture_value_constant(tex, d_output, d_tex);
     } else {
         // Trilinear interpolation
         auto uv_scale = Vector2f{tex.uv_scale[0], tex.uv_scale[1]};
@@ -0,0 +1,108 @@
+#include "validation.h"
+#include "buffer.h"
+#include "cuda_utils.h"
+#include "parallel.h"
+#include "test_utils.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+// A range of one buffer, scanned by a single thread
+struct ScanChunk {
+    const float *data;
+    int64_t size;
+    int buffer_id;
+};
+
+struct non_finite_finder {
+    DEVICE void operator()(int64_t idx) {
+        const auto &chunk = chunks[idx];
+        for (int64_t i = 0; i < chunk.size; i++) {
+            if (!isfinite(chunk.data[i])) {
+                // All writers store the same value, no atomics needed
+                non_finite[chunk.buffer_id] = 1;
+                return;
+            }
+        }
+    }
+
+    const ScanChunk *chunks;
+    int *non_finite;
+};
+
+std::vector<int> find_non_finite(const std::vector<ptr<float>> &buffers,
+                                 const std::vector<int64_t> &sizes,
+                                 bool use_gpu) {
+    if (buffers.size() != sizes.size()) {
+        throw std::runtime_error("find_non_finite: buffers and sizes have different lengths");
+    }
+    // Large chunks amortize the scheduling on the CPU,
+    // small ones keep the GPU threads busy.
+    auto chunk_size = use_gpu ? int64_t(256) : int64_t(16384);
+    auto host_chunks = std::vector<ScanChunk>();
+    for (int i = 0; i < (int)buffers.size(); i++) {
+        for (int64_t begin = 0; begin < sizes[i]; begin += chunk_size) {
+            host_chunks.push_back(ScanChunk{buffers[i].get() + begin,
+                                            std::min(chunk_size, sizes[i] - begin),
+                                            i});
+        }
+    }
+    if (host_chunks.empty()) {
+        return std::vector<int>();
+    }
+
+    parallel_init();
+    auto chunks = Buffer<ScanChunk>(use_gpu, host_chunks.size());
+    auto non_finite = Buffer<int>(use_gpu, buffers.size());
+    for (int64_t i = 0; i < (int64_t)host_chunks.size(); i++) {
+        chunks[i] = host_chunks[i];
+    }
+    for (int i = 0; i < (int)buffers.size(); i++) {
+        non_finite[i] = 0;
+    }
+    // One chunk per CPU task: there are few chunks, each with a lot of work
+    parallel_for(non_finite_finder{chunks.begin(), non_finite.begin()},
+                 chunks.size(), use_gpu, use_gpu ? 64 : 1);
+    if (use_gpu) {
+        cuda_synchronize();
+    }
+    parallel_cleanup();
+
+    auto result = std::vector<int>();
+    for (int i = 0; i < (int)buffers.size(); i++) {
+        if (non_finite[i] != 0) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+void test_find_non_finite(bool use_gpu) {
+    auto sizes = std::vector<int64_t>{100000, 3, 0, 50000, 1};
+    auto data = std::vector<Buffer<float>>();
+    for (auto size : sizes) {
+        data.emplace_back(use_gpu, size);
+        auto &buffer = data.back();
+        for (int64_t i = 0; i < size; i++) {
+            buffer[i] = float(i % 7) - 3.f;
+        }
+    }
+    // A NaN in the middle of a chunk and an infinity at the very end
+    data[0][70001] = std::numeric_limits<float>::quiet_NaN();
+    data[3][49999] = -std::numeric_limits<float>::infinity();
+    auto buffers = std::vector<ptr<float>>();
+    for (auto &buffer : data) {
+        buffers.push_back(ptr<float>(buffer.begin()));
+    }
+
+    auto result = find_non_finite(buffers, sizes, use_gpu);
+    equal_or_error(__FILE__, __LINE__, 2, (int)result.size());
+    equal_or_error(__FILE__, __LINE__, 0, result[0]);
+    equal_or_error(__FILE__, __LINE__, 3, result[1]);
+
+    data[0][70001] = 0.f;
+    data[3][49999] = 0.f;
+    result = find_non_finite(buffers, sizes, use_gpu);
+    equal_or_error(__FILE__, __LINE__, 0, (int)result.size());
+}
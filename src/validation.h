@@ -0,0 +1,15 @@
+#pragma once
+
+#include "redner.h"
+#include "ptr.h"
+
+#include <vector>
+
+/// Scan all the buffers for NaN and infinity in one parallel pass instead of
+/// one pass per buffer. The buffers must all live on the same device.
+/// Returns the indices of the buffers that contain non-finite values.
+std::vector<int> find_non_finite(const std::vector<ptr<float>> &buffers,
+                                 const std::vector<int64_t> &sizes,
+                                 bool use_gpu);
+
+void test_find_non_finite(bool use_gpu);
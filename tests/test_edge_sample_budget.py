@@ -0,0 +1,81 @@
+import pyredner
+import torch
+
+# The edge sample budgets trade variance for time, they should not change the
+# expected gradients. Compare the default budget against a ratio below one
+# and a count above the number of pixels. A count of hundreds of samples per
+# pixel also runs the Sobol sampler past its table of dimensions.
+
+# Use GPU if available
+pyredner.set_use_gpu(torch.cuda.is_available())
+pyredner.set_print_timing(False)
+
+resolution = (64, 64)
+cam = pyredner.Camera(position = torch.tensor([0.0, 2.0, -5.0]),
+                      look_at = torch.tensor([0.0, 0.0, 0.0]),
+                      up = torch.tensor([0.0, 1.0, 0.0]),
+                      fov = torch.tensor([45.0]),
+                      clip_near = 1e-2,
+                      resolution = resolution)
+
+mat_grey = pyredner.Material(\
+    diffuse_reflectance = torch.tensor([0.5, 0.5, 0.5],
+    device = pyredner.get_device()))
+mat_black = pyredner.Material(\
+    diffuse_reflectance = torch.tensor([0.0, 0.0, 0.0],
+    device = pyredner.get_device()))
+materials = [mat_grey, mat_black]
+
+floor_vertices = torch.tensor([[-2.0,0.0,-2.0],[-2.0,0.0,2.0],[2.0,0.0,-2.0],[2.0,0.0,2.0]],
+    device = pyredner.get_device())
+floor_indices = torch.tensor([[0,1,2], [1,3,2]],
+    device = pyredner.get_device(), dtype = torch.int32)
+shape_floor = pyredner.Shape(floor_vertices, floor_indices, 0)
+blocker_vertices = torch.tensor(\
+    [[-0.5,1.0,-0.5],[-0.5,1.0,0.5],[0.5,1.0,-0.5],[0.5,1.0,0.5]],
+    device = pyredner.get_device())
+blocker_indices = torch.tensor([[0,1,2], [1,3,2]],
+    device = pyredner.get_device(), dtype = torch.int32)
+light_vertices = torch.tensor(\
+    [[-0.1,5,-0.1],[-0.1,5,0.1],[0.1,5,-0.1],[0.1,5,0.1]],
+    device = pyredner.get_device())
+light_indices = torch.tensor([[0,2,1], [1,2,3]],
+    device = pyredner.get_device(), dtype = torch.int32)
+shape_light = pyredner.Shape(light_vertices, light_indices, 1)
+light = pyredner.AreaLight(2, torch.tensor([1000.0, 1000.0, 1000.0]))
+
+render = pyredner.RenderFunction.apply
+def blocker_gradient(primary_edge_samples,
+                     secondary_edge_samples,
+                     num_seeds = 4,
+                     sampler_type = pyredner.sampler_type.independent):
+    # The blocker's silhouette is a primary edge, its shadow a secondary one
+    translation = torch.zeros(3, device = pyredner.get_device(), requires_grad = True)
+    shape_blocker = pyredner.Shape(blocker_vertices + translation, blocker_indices, 0)
+    scene = pyredner.Scene(cam, [shape_floor, shape_blocker, shape_light], materials, [light])
+    for seed in range(num_seeds):
+        args = pyredner.RenderFunction.serialize_scene(\
+            scene = scene,
+            num_samples = 256,
+            max_bounces = 1,
+            sampler_type = sampler_type,
+            primary_edge_samples = primary_edge_samples,
+            secondary_edge_samples = secondary_edge_samples)
+        (render(seed, *args).sum() / num_seeds).backward()
+    return translation.grad
+
+num_pixels = resolution[0] * resolution[1]
+grad_default = blocker_gradient(None, None)
+grad_ratio = blocker_gradient(0.25, 0.25)
+grad_count = blocker_gradient(4 * num_pixels, 4 * num_pixels)
+print('default budget:', grad_default)
+print('ratio 0.25:', grad_ratio)
+# Each secondary edge pass takes 4 Sobol dimensions, 300 passes need 1200
+grad_sobol = blocker_gradient(None, 300 * num_pixels, num_seeds = 1,
+                              sampler_type = pyredner.sampler_type.sobol)
+print('count {}:'.format(4 * num_pixels), grad_count)
+print('sobol count {}:'.format(300 * num_pixels), grad_sobol)
+scale = grad_default.norm().item()
+assert((grad_ratio - grad_default).norm().item() < 0.1 * scale)
+assert((grad_count - grad_default).norm().item() < 0.1 * scale)
+assert((grad_sobol - grad_default).norm().item() < 0.1 * scale)
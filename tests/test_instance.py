@@ -0,0 +1,75 @@
+import pyredner
+import torch
+
+# Check that instances follow their prototype: serialize a scene with an instance,
+# move the prototype, and compare against the same scene without instancing.
+
+# Use GPU if available
+pyredner.set_use_gpu(torch.cuda.is_available())
+pyredner.set_print_timing(False)
+
+cam = pyredner.Camera(position = torch.tensor([0.0, 0.0, -5.0]),
+                      look_at = torch.tensor([0.0, 0.0, 0.0]),
+                      up = torch.tensor([0.0, 1.0, 0.0]),
+                      fov = torch.tensor([45.0]), # in degree
+                      clip_near = 1e-2, # needs to > 0
+                      resolution = (128, 128))
+mat_grey = pyredner.Material(\
+    diffuse_reflectance = torch.tensor([0.5, 0.5, 0.5], device = pyredner.get_device()))
+materials = [mat_grey]
+
+vertices = torch.tensor([[-1.0, -1.0, 0.0], [1.0, -1.0, 0.0], [-1.0, 1.0, 0.0]],
+                        device = pyredner.get_device())
+indices = torch.tensor([[0, 2, 1]], dtype = torch.int32, device = pyredner.get_device())
+prototype = pyredner.Shape(vertices, indices, 0)
+to_world = torch.tensor([[1.0, 0.0, 0.0, 1.5],
+                         [0.0, 1.0, 0.0, 0.5],
+                         [0.0, 0.0, 1.0, 0.0],
+                         [0.0, 0.0, 0.0, 1.0]])
+instance = pyredner.instance_shape(prototype, to_world)
+
+light_vertices = torch.tensor([[-1.0, -1.0, -7.0], [1.0, -1.0, -7.0], [-1.0, 1.0, -7.0], [1.0, 1.0, -7.0]],
+                              device = pyredner.get_device())
+light_indices = torch.tensor([[0, 1, 2], [1, 3, 2]], dtype = torch.int32, device = pyredner.get_device())
+shape_light = pyredner.Shape(light_vertices, light_indices, 0)
+light = pyredner.AreaLight(2, torch.tensor([20.0, 20.0, 20.0]), two_sided = True)
+
+render = pyredner.RenderFunction.apply
+def render_shapes(shapes):
+    scene = pyredner.Scene(cam, shapes + [shape_light], materials, [light])
+    args = pyredner.RenderFunction.serialize_scene(\
+        scene = scene,
+        num_samples = 16,
+        max_bounces = 1)
+    return render(0, *args)
+
+# Serialize once with the original prototype
+render_shapes([prototype, instance])
+
+# Move the prototype, the instance should follow
+translation = torch.tensor([0.0, -0.5, 0.0], device = pyredner.get_device(), requires_grad = True)
+prototype.vertices = vertices + translation
+instanced = render_shapes([prototype, instance])
+
+moved = prototype.vertices.detach()
+reference_shapes = [pyredner.Shape(moved, indices, 0),
+                    pyredner.Shape((moved + torch.tensor([1.5, 0.5, 0.0], device = pyredner.get_device())).contiguous(),
+                                   indices, 0)]
+reference = render_shapes(reference_shapes)
+pyredner.imwrite(instanced.cpu(), 'results/test_instance/instanced.png')
+pyredner.imwrite(reference.cpu(), 'results/test_instance/reference.png')
+# The ray tracers place the instance with the float transform, so a few
+# silhouette pixels can differ
+diff = torch.abs(instanced - reference).mean().item()
+print('mean difference:', diff)
+assert(diff < 1e-3)
+
+# The instance has no vertices of its own: the derivatives go to the
+# prototype and to the transform, and the user shapes are left untouched
+to_world.requires_grad = True
+instanced = render_shapes([prototype, instance])
+instanced.sum().backward()
+print('grad:', translation.grad, to_world.grad)
+assert(translation.grad is not None)
+assert(to_world.grad is not None)
+assert(instance.vertices is vertices)
@@ -0,0 +1,56 @@
+import pyredner
+import torch
+import time
+
+# Compare the primary visibility found by rasterization against ray tracing,
+# and time both. The images must match, the timings depend on the scene.
+
+# Use GPU if available
+pyredner.set_use_gpu(torch.cuda.is_available())
+pyredner.set_print_timing(False)
+
+objects = pyredner.load_obj('scenes/teapot.obj', return_objects = True)
+camera = pyredner.automatic_camera_placement(objects, resolution = (512, 512))
+# Stack copies of the teapot behind each other along the viewing direction,
+# so that most triangles of a tile are occluded
+view_dir = camera.look_at - camera.position
+view_dir = view_dir / view_dir.norm()
+vertices = torch.cat([obj.vertices for obj in objects])
+extent = (vertices.max(0)[0] - vertices.min(0)[0]).norm().item()
+layers = []
+for i in range(16):
+    offset = (view_dir * extent * i).to(pyredner.get_device())
+    for obj in objects:
+        layers.append(pyredner.Object(\
+            vertices = obj.vertices + offset,
+            indices = obj.indices,
+            material = obj.material))
+scene = pyredner.Scene(camera = camera, objects = layers)
+
+channels = [pyredner.channels.position, pyredner.channels.shading_normal]
+def render(use_rasterization):
+    return pyredner.render_g_buffer(scene = scene,
+                                    channels = channels,
+                                    num_samples = (4, 1),
+                                    seed = 0,
+                                    use_rasterization = use_rasterization)
+
+def timed(use_rasterization, num_runs = 5):
+    # Warm up
+    img = render(use_rasterization)
+    if pyredner.get_use_gpu():
+        torch.cuda.synchronize()
+    start = time.time()
+    for _ in range(num_runs):
+        img = render(use_rasterization)
+    if pyredner.get_use_gpu():
+        torch.cuda.synchronize()
+    return img, (time.time() - start) / num_runs
+
+traced, traced_time = timed(False)
+rasterized, rasterized_time = timed(True)
+print('ray traced: {:.2f} ms, rasterized: {:.2f} ms'.format(\
+    traced_time * 1000, rasterized_time * 1000))
+diff = torch.abs(traced - rasterized).max().item()
+print('max difference:', diff)
+assert(diff < 1e-4)
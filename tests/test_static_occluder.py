@@ -0,0 +1,78 @@
+import pyredner
+import torch
+
+# Gradient check for a moving shadow receiver under a static occluder.
+# The occluder's vertices don't require gradients, so its primary edges are
+# not sampled, but its secondary edges still move the shadow on the receiver.
+
+# Use GPU if available
+pyredner.set_use_gpu(torch.cuda.is_available())
+pyredner.set_print_timing(False)
+
+cam = pyredner.Camera(position = torch.tensor([0.0, 2.0, -5.0]),
+                      look_at = torch.tensor([0.0, 0.0, 0.0]),
+                      up = torch.tensor([0.0, 1.0, 0.0]),
+                      fov = torch.tensor([45.0]),
+                      clip_near = 1e-2,
+                      resolution = (64, 64))
+
+mat_grey = pyredner.Material(\
+    diffuse_reflectance = torch.tensor([0.5, 0.5, 0.5],
+    device = pyredner.get_device()))
+mat_black = pyredner.Material(\
+    diffuse_reflectance = torch.tensor([0.0, 0.0, 0.0],
+    device = pyredner.get_device()))
+materials = [mat_grey, mat_black]
+
+floor_vertices = torch.tensor([[-2.0,0.0,-2.0],[-2.0,0.0,2.0],[2.0,0.0,-2.0],[2.0,0.0,2.0]],
+    device = pyredner.get_device())
+floor_indices = torch.tensor([[0,1,2], [1,3,2]],
+    device = pyredner.get_device(), dtype = torch.int32)
+blocker_vertices = torch.tensor(\
+    [[-0.5,3.0,-0.5],[-0.5,3.0,0.5],[0.5,3.0,-0.5],[0.5,3.0,0.5]],
+    device = pyredner.get_device())
+blocker_indices = torch.tensor([[0,1,2], [1,3,2]],
+    device = pyredner.get_device(), dtype = torch.int32)
+light_vertices = torch.tensor(\
+    [[-0.1,5,-0.1],[-0.1,5,0.1],[0.1,5,-0.1],[0.1,5,0.1]],
+    device = pyredner.get_device())
+light_indices = torch.tensor([[0,2,1], [1,2,3]],
+    device = pyredner.get_device(), dtype = torch.int32)
+shape_light = pyredner.Shape(light_vertices, light_indices, 1)
+light = pyredner.AreaLight(2, torch.tensor([1000.0, 1000.0, 1000.0]))
+
+render = pyredner.RenderFunction.apply
+def render_floor(height, blocker_vertices, seed = 0):
+    offset = torch.stack([torch.zeros_like(height), height, torch.zeros_like(height)])
+    shape_floor = pyredner.Shape(floor_vertices + offset, floor_indices, 0)
+    shape_blocker = pyredner.Shape(blocker_vertices, blocker_indices, 0)
+    scene = pyredner.Scene(cam, [shape_floor, shape_blocker, shape_light], materials, [light])
+    args = pyredner.RenderFunction.serialize_scene(\
+        scene = scene,
+        num_samples = 1024,
+        max_bounces = 1)
+    return render(seed, *args)
+
+# Gradient of the total brightness with respect to the floor height
+height = torch.tensor(0.0, device = pyredner.get_device(), requires_grad = True)
+render_floor(height, blocker_vertices).sum().backward()
+grad_static = height.grad.item()
+
+# Same gradient with a differentiable occluder, its primary edges are sampled too
+height_ref = torch.tensor(0.0, device = pyredner.get_device(), requires_grad = True)
+render_floor(height_ref, blocker_vertices.clone().requires_grad_()).sum().backward()
+grad_reference = height_ref.grad.item()
+
+# Central finite differences
+delta = 1e-2
+with torch.no_grad():
+    positive = render_floor(torch.tensor(delta, device = pyredner.get_device()), blocker_vertices, 1)
+    negative = render_floor(torch.tensor(-delta, device = pyredner.get_device()), blocker_vertices, 1)
+grad_finite_difference = ((positive.sum() - negative.sum()) / (2 * delta)).item()
+
+print('static occluder:', grad_static)
+print('differentiable occluder:', grad_reference)
+print('finite difference:', grad_finite_difference)
+scale = abs(grad_finite_difference)
+assert(abs(grad_static - grad_finite_difference) < 0.1 * scale)
+assert(abs(grad_static - grad_reference) < 0.1 * scale)
@@ -4,6 +4,7 @@ import torch
 def unit_tests():
     redner.test_sample_primary_rays(False)
     redner.test_scene_intersect(False)
+    redner.test_rasterize_primary(False)
     redner.test_sample_point_on_light(False)
     redner.test_active_pixels(False)
     redner.test_camera_derivatives()
@@ -11,15 +12,27 @@ def unit_tests():
     redner.test_d_bsdf()
     redner.test_d_bsdf_sample()
     redner.test_d_bsdf_pdf()
+    redner.test_material_features()
+    redner.test_channel_sets()
+    redner.test_deferred_shading()
     redner.test_d_intersect()
     redner.test_d_sample_shape()
     redner.test_atomic()
+    redner.test_primary_hit_cache()
+    redner.test_light_bvh()
+    redner.test_alias_table()
+    redner.test_envmap_sample()
+    redner.test_envmap_sh()
+    redner.test_spherical_harmonics()
+    redner.test_find_non_finite(False)
 
     if torch.cuda.is_available():
         redner.test_sample_primary_rays(True)
         redner.test_scene_intersect(True)
+        redner.test_rasterize_primary(True)
         redner.test_sample_point_on_light(True)
         redner.test_active_pixels(True)
+        redner.test_find_non_finite(True)
 
 unit_tests()
 
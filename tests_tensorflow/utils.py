@@ -99,8 +99,6 @@ def is_same_envmap(a:pyredner.EnvironmentMap, b:pyredner.EnvironmentMap):
     return is_same_texture(a.values, b.values) \
         and is_same_tensor(a.env_to_world, b.env_to_world) \
         and is_same_tensor(a.world_to_env, b.world_to_env) \
-        and is_same_tensor(a.sample_cdf_xs, b.sample_cdf_xs) \
-        and is_same_tensor(a.sample_cdf_ys, b.sample_cdf_ys) \
         and is_same_pdf_norm(a.pdf_norm, b.pdf_norm)
         
 
@@ -275,15 +273,11 @@ def is_same_scene_args(args1:pyredner.SceneArgs, args2:List) -> bool:
         i += 1
         assert is_same_tensor(args1.envmap_world_to_env, args2[i])
         i += 1
-        assert is_same_tensor(args1.envmap_sample_cdf_ys, args2[i])
-        i += 1
-        assert is_same_tensor(args1.envmap_sample_cdf_xs, args2[i])
-        i += 1
         assert is_same_pdf_norm(args1.envmap_pdf_norm, args2[i])
         i += 1
         
     else:
-        i += 7
+        i += 5
 
 
 